@@ -9,11 +9,36 @@
 
 #include "board.h"
 #include <malloc.h>
+#include <math.h>
 
 #define assert(p, text) do { if (!(p)) { printf((text)); } }while(0)
 #define min(a, b) ( ((a) < (b)) ? (a) : (b) )
 #define max(a, b) ( ((a) > (b)) ? (a) : (b) )
 
+// Zobrist keys. Indexed by [color][coord]. Generated once with a fixed seed so that hashes are
+// the same across processes (e.g., the search client and the CNN server).
+#define ZOBRIST_SEED 0x2016
+static uint64_t g_stone_keys[S_WHITE + 1][BOUND_COORD];
+static uint64_t g_ko_keys[S_WHITE + 1][BOUND_COORD];
+static uint64_t g_white_to_move_key;
+
+static void __attribute__ ((constructor)) InitZobristKeys() {
+  uint64_t seed = ZOBRIST_SEED;
+  for (int s = S_BLACK; s <= S_WHITE; ++s) {
+    for (int c = 0; c < BOUND_COORD; ++c) {
+      g_stone_keys[s][c] = fast_random64(&seed);
+      g_ko_keys[s][c] = fast_random64(&seed);
+    }
+  }
+  g_white_to_move_key = fast_random64(&seed);
+}
+
+// Key of the simple ko point, if it is active. Otherwise 0.
+static inline uint64_t ko_key(const Board *board) {
+  if (board->_ko_age == 0 && board->_simple_ko != M_PASS) return g_ko_keys[board->_simple_ko_color][board->_simple_ko];
+  return 0;
+}
+
 // Functions..
 void SetAsBorder(Board* board, int side, int i1, int w, int j1, int h) {
   for (int i = i1; i < i1 + w; i++) {
@@ -43,7 +68,7 @@ void ClearBoard(Board *board) {
   board->_num_groups = 1;
   // The initial ply number is 1.
   board->_ply = 1;
-  // The initial hash is zero.
+  // The initial hash is zero (empty board, black to play, no ko).
 }
 
 BOOL PlaceHandicap(Board *board, int x, int y, Stone player) {
@@ -201,6 +226,7 @@ BOOL IsSelfAtari(const Board *board, const GroupId4 *ids, Coord c, Stone player,
 }
 
 #define MAX_LADDER_SEARCH 1024
+// The board is restored (via Undo) when the function returns, so no board copy is needed for branching.
 int CheckLadderUseSearch(Board *board, Stone victim, int *num_call, int depth) {
   (*num_call) ++;
   Coord c = board->_last_move;
@@ -209,6 +235,8 @@ int CheckLadderUseSearch(Board *board, Stone victim, int *num_call, int depth) {
   unsigned short lib = board->_groups[id].liberties;
   // char buf[30];
   GroupId4 ids;
+  BoardUndo undo;
+  int final_depth = 0;
 
   if (victim == OPPONENT(board->_next_player)) {
     // Capturer to play. He can choose two ways to capture.
@@ -254,8 +282,9 @@ int CheckLadderUseSearch(Board *board, Stone victim, int *num_call, int depth) {
     if (must_block != M_PASS) {
       // It suffices to only play must_block.
       if (TryPlay2(board, must_block, &ids)) {
-        Play(board, &ids);
-        int final_depth = CheckLadderUseSearch(board, victim, num_call, depth + 1);
+        PlayWithUndo(board, &ids, &undo);
+        final_depth = CheckLadderUseSearch(board, victim, num_call, depth + 1);
+        Undo(board, &undo);
         if (final_depth > 0) return final_depth;
       }
     } else {
@@ -265,18 +294,13 @@ int CheckLadderUseSearch(Board *board, Stone victim, int *num_call, int depth) {
       // ShowBoard(board, SHOW_ALL);
 
       // We need to play both. This should seldomly happen.
-      Board b_next;
-      CopyBoard(&b_next, board);
-      if (TryPlay2(&b_next, escape[0], &ids)) {
-        Play(&b_next, &ids);
-        int final_depth = CheckLadderUseSearch(&b_next, victim, num_call, depth + 1);
-        if (final_depth > 0) return final_depth;
-      }
-
-      if (TryPlay2(board, escape[1], &ids)) {
-        Play(board, &ids);
-        int final_depth = CheckLadderUseSearch(board, victim, num_call, depth + 1);
-        if (final_depth > 0) return final_depth;
+      for (int i = 0; i < 2; ++i) {
+        if (TryPlay2(board, escape[i], &ids)) {
+          PlayWithUndo(board, &ids, &undo);
+          final_depth = CheckLadderUseSearch(board, victim, num_call, depth + 1);
+          Undo(board, &undo);
+          if (final_depth > 0) return final_depth;
+        }
       }
     }
   } else {
@@ -298,19 +322,24 @@ int CheckLadderUseSearch(Board *board, Stone victim, int *num_call, int depth) {
       return 0;
     }
     if (TryPlay2(board, flee_loc, &ids)) {
-      Play(board, &ids);
+      PlayWithUndo(board, &ids, &undo);
       unsigned char id = board->_infos[flee_loc].id;
-      if (board->_groups[id].liberties >= 3) return 0;
-      if (board->_groups[id].liberties == 2) {
+      BOOL escaped = FALSE;
+      if (board->_groups[id].liberties >= 3) escaped = TRUE;
+      else if (board->_groups[id].liberties == 2) {
         // Check if the neighboring enemy stone has only one liberty, if so, then it is not a ladder.
         FOR4(flee_loc, _, cc) {
           if (board->_infos[cc].color != OPPONENT(victim)) continue;
           unsigned char id2 = board->_infos[cc].id;
           // If the enemy group is in atari but our group has 2 liberties, then it is not a ladder.
-          if (board->_groups[id2].liberties == 1) return 0;
+          if (board->_groups[id2].liberties == 1) {
+            escaped = TRUE;
+            break;
+          }
         } ENDFOR4
       }
-      int final_depth = CheckLadderUseSearch(board, victim, num_call, depth + 1);
+      if (! escaped) final_depth = CheckLadderUseSearch(board, victim, num_call, depth + 1);
+      Undo(board, &undo);
       if (final_depth > 0) return final_depth;
     }
   }
@@ -391,7 +420,56 @@ int CheckLadder(const Board *board, const GroupId4 *ids, Stone player) {
   return 0;
 }
 
-void RemoveStoneAndAddLiberty(Board *board, Coord c) {
+// Liberty side table operations.
+#define LIB_SET(libs, id, c) ( (libs)->bits[id][(c) >> 6] |= (1ULL << ((c) & 63)) )
+#define LIB_CLEAR(libs, id, c) ( (libs)->bits[id][(c) >> 6] &= ~(1ULL << ((c) & 63)) )
+
+static inline void LibsAddEmptyNeighbors(const Board *board, GroupLibs *libs, unsigned short id, Coord c) {
+  FOR4(c, _, cc) {
+    if (board->_infos[cc].color == S_EMPTY) LIB_SET(libs, id, cc);
+  } ENDFOR4
+}
+
+void GroupLibsInit(GroupLibs *libs, const Board *board) {
+  memset(libs, 0, sizeof(GroupLibs));
+  for (int i = 1; i < board->_num_groups; ++i) {
+    TRAVERSE(board, i, c) {
+      LibsAddEmptyNeighbors(board, libs, i, c);
+    } ENDTRAVERSE
+  }
+}
+
+int GroupLibsCount(const GroupLibs *libs, short id) {
+  int count = 0;
+  for (int i = 0; i < LIB_WORDS; ++i) count += __builtin_popcountll(libs->bits[id][i]);
+  return count;
+}
+
+int GroupLibsGet(const GroupLibs *libs, short id, Coord *m, int max_libs) {
+  int n = 0;
+  for (int i = 0; i < LIB_WORDS && n < max_libs; ++i) {
+    uint64_t w = libs->bits[id][i];
+    while (w != 0 && n < max_libs) {
+      m[n ++] = (i << 6) + __builtin_ctzll(w);
+      // Clear the lowest bit.
+      w &= w - 1;
+    }
+  }
+  return n;
+}
+
+// Save the group entry to the journal before it is changed. Only the first save of each id is kept.
+static inline void SaveGroup(BoardUndo *undo, const Board *board, unsigned short id) {
+  if (undo == NULL) return;
+  for (int i = 0; i < undo->num_groups_changed; ++i) {
+    if (undo->groups[i].id == id) return;
+  }
+  GroupChange *gc = &undo->groups[undo->num_groups_changed ++];
+  gc->id = id;
+  gc->g = board->_groups[id];
+}
+
+void RemoveStoneAndAddLiberty(Board *board, Coord c, BoardUndo *undo, GroupLibs *libs) {
   // First perform an analysis.
   GroupId4 ids;
   StoneLibertyAnalysis(board, board->_next_player, c, &ids);
@@ -400,25 +478,37 @@ void RemoveStoneAndAddLiberty(Board *board, Coord c) {
   for (int i = 0; i < 4; ++i) {
     unsigned short id = ids.ids[i];
     if (id == 0 || id == board->_infos[c].id) continue;
+    SaveGroup(undo, board, id);
     board->_groups[id].liberties ++;
+    if (libs != NULL) LIB_SET(libs, id, c);
   }
 
   // printf("RemoveStoneAndAddLiberty: Remove stone at (%d, %d), belonging to Group %d\n", X(c), Y(c), board->_infos[c].id);
+  board->_hash ^= g_stone_keys[board->_infos[c].color][c];
   board->_infos[c].color = S_EMPTY;
   board->_infos[c].id = 0;
   board->_infos[c].next = 0;
 }
 
 // Group related opreations.
-BOOL EmptyGroup(Board *board, unsigned short group_id) {
+BOOL EmptyGroup(Board *board, unsigned short group_id, BoardUndo *undo, GroupLibs *libs) {
   if (group_id == 0) return FALSE;
+  CaptureRecord *record = NULL;
+  if (undo != NULL) {
+    record = &undo->captures[undo->num_captures ++];
+    record->id = group_id;
+    record->color = board->_groups[group_id].color;
+    record->start = undo->num_captured;
+  }
   Coord c = board->_groups[group_id].start;
   while (c != 0) {
      // printf("Remove stone (%d, %d)\n", X(c), Y(c));
      Coord next = board->_infos[c].next;
-     RemoveStoneAndAddLiberty(board, c);
+     if (undo != NULL) undo->captured[undo->num_captured ++] = c;
+     RemoveStoneAndAddLiberty(board, c, undo, libs);
      c = next;
   }
+  if (record != NULL) record->n = undo->num_captured - record->start;
   // Note this group might be visited again in RemoveAllEmptyGroups, if:
   // There are two empty groups, one with id and the other is the last group.
   // Then when we copy the last group to the former id, we might visit the last group
@@ -447,7 +537,7 @@ void SimpleSort(unsigned char* ids, int n) {
   }
 }
 
-void RemoveAllEmptyGroups(Board *board) {
+void RemoveAllEmptyGroups(Board *board, GroupLibs *libs) {
   // A simple sorting on the empty group id.
   SimpleSort(board->_removed_group_ids, board->_num_group_removed);
 
@@ -459,6 +549,7 @@ void RemoveAllEmptyGroups(Board *board) {
        // Swap with the last entry.
        // Copy the structure.
        memcpy(&board->_groups[id], &board->_groups[last_id], sizeof(Group));
+       if (libs != NULL) memcpy(libs->bits[id], libs->bits[last_id], sizeof(libs->bits[id]));
        TRAVERSE(board, id, c) {
           board->_infos[c].id = id;
        } ENDTRAVERSE
@@ -512,7 +603,8 @@ BOOL EmptyGroupAt(Board *board, Coord c) {
 }
 */
 
-unsigned short CreateNewGroup(Board *board, Coord c, int liberty) {
+unsigned short CreateNewGroup(Board *board, Coord c, int liberty, BoardUndo *undo, GroupLibs *libs) {
+   SaveGroup(undo, board, board->_num_groups);
    unsigned short id = board->_num_groups ++;
    board->_groups[id].color = board->_infos[c].color;
    board->_groups[id].start = c;
@@ -521,16 +613,22 @@ unsigned short CreateNewGroup(Board *board, Coord c, int liberty) {
 
    board->_infos[c].id = id;
    board->_infos[c].next = 0;
+
+   if (libs != NULL) {
+     memset(libs->bits[id], 0, sizeof(libs->bits[id]));
+     LibsAddEmptyNeighbors(board, libs, id, c);
+   }
    return id;
 }
 
 // Merge a single stone into an existing group. In this case, no group deletion/move
 // is needed.
 // Here the liberty is that of the single stone (raw liberty).
-BOOL MergeToGroup(Board *board, Coord c, unsigned short id) {
+BOOL MergeToGroup(Board *board, Coord c, unsigned short id, GroupLibs *libs) {
   // Place the stone.
   board->_infos[c].color = board->_groups[id].color;
   board->_infos[c].last_placed = board->_ply;
+  board->_hash ^= g_stone_keys[board->_infos[c].color][c];
 
   board->_infos[c].id = id;
   // Put the new stone to the beginning of the group.
@@ -552,18 +650,21 @@ BOOL MergeToGroup(Board *board, Coord c, unsigned short id) {
 
 #undef SAME_ID
 
+  if (libs != NULL) LibsAddEmptyNeighbors(board, libs, id, c);
   return TRUE;
 }
 
 // Merge two groups into one.
 // The resulting liberties might not be right and need to be recomputed.
-unsigned short MergeGroups(Board *board, unsigned short id1, unsigned short id2) {
+unsigned short MergeGroups(Board *board, unsigned short id1, unsigned short id2, BoardUndo *undo, GroupLibs *libs) {
   // printf("merge beteween %d and %d", id1, id2);
   // Same id, no merge.
   if (id1 == id2) return id1;
 
   // To save computation power, we want to traverse through the group with small number of stones.
-  if (board->_groups[id2].stones > board->_groups[id1].stones) return MergeGroups(board, id2, id1);
+  if (board->_groups[id2].stones > board->_groups[id1].stones) return MergeGroups(board, id2, id1, undo, libs);
+  SaveGroup(undo, board, id1);
+  SaveGroup(undo, board, id2);
 
   // Merge
   // Find the last stone in id2.
@@ -573,6 +674,14 @@ unsigned short MergeGroups(Board *board, unsigned short id1, unsigned short id2)
     last_c_in_id2 = c;
   } ENDTRAVERSE
 
+  if (undo != NULL) {
+    MergeRecord *record = &undo->merges[undo->num_merges ++];
+    record->id1 = id1;
+    record->id2 = id2;
+    record->start2 = board->_groups[id2].start;
+    record->last = last_c_in_id2;
+  }
+
   // Make connections. Put id2 group in front of id1.
   board->_infos[last_c_in_id2].next = board->_groups[id1].start;
   board->_groups[id1].start = board->_groups[id2].start;
@@ -581,6 +690,10 @@ unsigned short MergeGroups(Board *board, unsigned short id1, unsigned short id2)
   board->_groups[id1].stones += board->_groups[id2].stones;
   // Note that the summed liberties is not right (since multiple groups might share liberties, therefore we need to recompute it).
   board->_groups[id1].liberties = -1;
+  // With the side table, the merged liberties are just the union.
+  if (libs != NULL) {
+    for (int i = 0; i < LIB_WORDS; ++i) libs->bits[id1][i] |= libs->bits[id2][i];
+  }
 
   // Make id2 an empty group.
   board->_groups[id2].start = 0;
@@ -620,6 +733,53 @@ BOOL RecomputeGroupLiberties(Board *board, unsigned short id) {
   return TRUE;
 }
 
+BOOL RebuildGroups(Board *board) {
+  memset(board->_groups, 0, sizeof(board->_groups));
+  board->_num_groups = 1;
+  board->_num_group_removed = 0;
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      Coord c = OFFSETXY(i, j);
+      board->_infos[c].id = 0;
+      board->_infos[c].next = 0;
+    }
+  }
+
+  // Flood fill each group, the stones found but not yet expanded are kept in a stack.
+  Coord stack[MACRO_BOARD_SIZE * MACRO_BOARD_SIZE];
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      Coord c = OFFSETXY(i, j);
+      Stone color = board->_infos[c].color;
+      if (! HAS_STONE(color) || board->_infos[c].id != 0) continue;
+      // Too many groups, the stones cannot come from a real game.
+      if (board->_num_groups >= MAX_GROUP) return FALSE;
+      unsigned short id = CreateNewGroup(board, c, 0, NULL, NULL);
+      int n = 0;
+      stack[n ++] = c;
+      while (n > 0) {
+        Coord cc = stack[-- n];
+        FOR4(cc, _, c4) {
+          Info *info = &board->_infos[c4];
+          if (info->color == color && info->id == 0) {
+            info->id = id;
+            info->next = board->_groups[id].start;
+            board->_groups[id].start = c4;
+            board->_groups[id].stones ++;
+            stack[n ++] = c4;
+          }
+        } ENDFOR4
+      }
+    }
+  }
+  // Liberties are counted once all stones have their ids.
+  for (int id = 1; id < board->_num_groups; ++id) {
+    RecomputeGroupLiberties(board, id);
+    if (board->_groups[id].liberties == 0) return FALSE;
+  }
+  return TRUE;
+}
+
 BOOL TryPlay2(const Board *board, Coord m, GroupId4 *ids) {
   return TryPlay(board, X(m), Y(m), board->_next_player, ids);
 }
@@ -1010,9 +1170,8 @@ BOOL OneGroupLives(const Board *board, Stone player, const Region *r) {
   return FALSE;
 }
 
-#define MOVE_HASH(c, player, ply) ( ((ply) << 24) + ((player) << 16) + (c) )
-
 static inline void update_next_move(Board *board, Coord c, Stone player) {
+  if (board->_next_player != OPPONENT(player)) board->_hash ^= g_white_to_move_key;
   board->_next_player = OPPONENT(player);
 
   board->_last_move4 = board->_last_move3;
@@ -1020,23 +1179,33 @@ static inline void update_next_move(Board *board, Coord c, Stone player) {
   board->_last_move2 = board->_last_move;
   board->_last_move = c;
 
-  // Compute the hash code with c, player and ply.
-  // unsigned long seed = MOVE_HASH(c, player, board->_ply);
-  // board->hash ^= fast_random64(&seed);
-
   board->_ply ++;
 }
 
 static inline void update_undo(Board *board) {
-  Coord c = board->_last_move;
   board->_last_move = board->_last_move2;
   board->_last_move2 = board->_last_move3;
   board->_last_move3 = board->_last_move4;
   board->_next_player = OPPONENT(board->_next_player);
+  board->_hash ^= g_white_to_move_key;
   board->_ply --;
+}
 
-  // unsigned long seed = MOVE_HASH(c, board->_next_player, board->_ply);
-  // board->hash ^= fast_random64(&seed);
+uint64_t GetBoardHash(const Board *board) {
+  return board->_hash;
+}
+
+uint64_t ComputeBoardHash(const Board *board) {
+  uint64_t h = 0;
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      Coord c = OFFSETXY(i, j);
+      Stone s = board->_infos[c].color;
+      if (HAS_STONE(s)) h ^= g_stone_keys[s][c];
+    }
+  }
+  if (board->_next_player == S_WHITE) h ^= g_white_to_move_key;
+  return h ^ ko_key(board);
 }
 
 // Return 0 if there is no ladder, otherwise return the depth of the ladder.
@@ -1081,20 +1250,69 @@ BOOL find_two_liberties(const Board *b, short id, Coord m[2]) {
   return FALSE;
 }
 
-BOOL Play(Board *board, const GroupId4 *ids) {
+static inline void SaveStates(const Board *board, Coord c, BoardUndo *undo) {
+  undo->c = c;
+  undo->info_c = board->_infos[c];
+  undo->num_groups_changed = 0;
+  undo->num_captured = 0;
+  undo->num_captures = 0;
+  undo->num_merges = 0;
+
+  undo->_num_groups = board->_num_groups;
+  undo->_b_cap = board->_b_cap;
+  undo->_w_cap = board->_w_cap;
+  undo->_last_move = board->_last_move;
+  undo->_last_move2 = board->_last_move2;
+  undo->_last_move3 = board->_last_move3;
+  undo->_last_move4 = board->_last_move4;
+  memcpy(undo->_removed_group_ids, board->_removed_group_ids, sizeof(board->_removed_group_ids));
+  undo->_num_group_removed = board->_num_group_removed;
+  undo->_ko_age = board->_ko_age;
+  undo->_simple_ko = board->_simple_ko;
+  undo->_simple_ko_color = board->_simple_ko_color;
+  undo->_next_player = board->_next_player;
+  undo->_ply = board->_ply;
+  undo->_hash = board->_hash;
+}
+
+static inline void RestoreStates(Board *board, const BoardUndo *undo) {
+  board->_num_groups = undo->_num_groups;
+  board->_b_cap = undo->_b_cap;
+  board->_w_cap = undo->_w_cap;
+  board->_last_move = undo->_last_move;
+  board->_last_move2 = undo->_last_move2;
+  board->_last_move3 = undo->_last_move3;
+  board->_last_move4 = undo->_last_move4;
+  memcpy(board->_removed_group_ids, undo->_removed_group_ids, sizeof(board->_removed_group_ids));
+  board->_num_group_removed = undo->_num_group_removed;
+  board->_ko_age = undo->_ko_age;
+  board->_simple_ko = undo->_simple_ko;
+  board->_simple_ko_color = undo->_simple_ko_color;
+  board->_next_player = undo->_next_player;
+  board->_ply = undo->_ply;
+  board->_hash = undo->_hash;
+}
+
+// If undo is not NULL, record all the changes. If libs is not NULL, update the liberty side table.
+static BOOL PlayImpl(Board *board, const GroupId4 *ids, BoardUndo *undo, GroupLibs *libs) {
   assert(board, "Play: Board is nil!");
   assert(ids, "Play: GroupIds4 is nil!");
 
-  board->_num_group_removed = 0;
-
   // Place the stone on the coordinate, and update other structures.
   Coord c = ids->c;
   Stone player = ids->player;
+  if (undo != NULL) SaveStates(board, c, undo);
+
+  board->_num_group_removed = 0;
+
   if (c == M_PASS || c == M_RESIGN) {
     update_next_move(board, c, player);
     return IsGameEnd(board);
   }
 
+  // The old ko (if any) is removed from the hash, the new one is added after the ko check.
+  board->_hash ^= ko_key(board);
+
   short new_id = 0;
   unsigned short liberty = ids->liberty;
   short total_capture = 0;
@@ -1106,23 +1324,25 @@ BOOL Play(Board *board, const GroupId4 *ids) {
     if (ids->ids[i] == 0) continue;
     unsigned short id = ids->ids[i];
     Group* g = &board->_groups[id];
+    SaveGroup(undo, board, id);
 
     Stone s = g->color;
     // The group adjacent to it lose one liberty.
     -- g->liberties;
+    if (libs != NULL) LIB_CLEAR(libs, id, c);
 
     if (s == player) {
         // Self-group.
         if (new_id == 0) {
           // Merge the current stone with the current group.
-          MergeToGroup(board, c, id);
+          MergeToGroup(board, c, id, libs);
           new_id = id;
           // printf("Merge with group %d, preducing id = %d", id, new_id);
         }
         else {
           // int prev_new_id = new_id;
           // Merge two large groups.
-          new_id = MergeGroups(board, new_id, id);
+          new_id = MergeGroups(board, new_id, id, undo, libs);
           merge_two_groups_called = TRUE;
           // printf("Merge with group %d with existing id %d, producing id = %d", id, prev_new_id, new_id);
         }
@@ -1145,19 +1365,23 @@ BOOL Play(Board *board, const GroupId4 *ids) {
           } ENDFOR4
         }
         // Remove stones of the group.
-        EmptyGroup(board, id);
+        EmptyGroup(board, id, undo, libs);
        }
     }
   }
   // if (new_id > 0) RecomputeGroupLiberties(board, new_id);
-  if (merge_two_groups_called) RecomputeGroupLiberties(board, new_id);
+  if (merge_two_groups_called) {
+    if (libs != NULL) board->_groups[new_id].liberties = GroupLibsCount(libs, new_id);
+    else RecomputeGroupLiberties(board, new_id);
+  }
   if (new_id == 0) {
     // It has not merged with other groups, create a new one.
     board->_infos[c].color = player;
     // Place the stone.
     board->_infos[c].last_placed = board->_ply;
+    board->_hash ^= g_stone_keys[player][c];
 
-    new_id = CreateNewGroup(board, c, liberty);
+    new_id = CreateNewGroup(board, c, liberty, undo, libs);
   }
 
   // Check simple ko conditions.
@@ -1170,15 +1394,74 @@ BOOL Play(Board *board, const GroupId4 *ids) {
     board->_ko_age ++;
     // board->_simple_ko = M_PASS;
   }
+  board->_hash ^= ko_key(board);
 
   // We need to run it in the end. After that all group index will be invalid.
-  RemoveAllEmptyGroups(board);
+  RemoveAllEmptyGroups(board, libs);
 
   // Finally add the counter.
   update_next_move(board, c, player);
   return FALSE;
 }
 
+BOOL Play(Board *board, const GroupId4 *ids) {
+  return PlayImpl(board, ids, NULL, NULL);
+}
+
+BOOL PlayWithUndo(Board *board, const GroupId4 *ids, BoardUndo *undo) {
+  return PlayImpl(board, ids, undo, NULL);
+}
+
+BOOL PlayWithLibs(Board *board, const GroupId4 *ids, GroupLibs *libs) {
+  return PlayImpl(board, ids, NULL, libs);
+}
+
+void Undo(Board *board, const BoardUndo *undo) {
+  Coord c = undo->c;
+  if (c != M_PASS && c != M_RESIGN) {
+    // Undo in the reverse order of Play.
+    // 1. Group id compaction in RemoveAllEmptyGroups. The removed ids are sorted in descending order.
+    for (int i = board->_num_group_removed - 1; i >= 0; --i) {
+      unsigned short id = board->_removed_group_ids[i];
+      unsigned short last_id = board->_num_groups ++;
+      // The entry of last_id is untouched after it was copied to id.
+      if (id != last_id) {
+        TRAVERSE(board, id, cc) {
+          board->_infos[cc].id = last_id;
+        } ENDTRAVERSE
+      }
+    }
+
+    // 2. Group merges. Stones of id2 are put in front of id1, so we just need to cut the link.
+    for (int i = undo->num_merges - 1; i >= 0; --i) {
+      const MergeRecord *m = &undo->merges[i];
+      for (Coord cc = m->start2; ; cc = board->_infos[cc].next) {
+        board->_infos[cc].id = m->id2;
+        if (cc == m->last) break;
+      }
+      board->_infos[m->last].next = 0;
+    }
+
+    // 3. Captured stones.
+    for (int i = 0; i < undo->num_captures; ++i) {
+      const CaptureRecord *r = &undo->captures[i];
+      for (int j = 0; j < r->n; ++j) {
+        Info *info = &board->_infos[undo->captured[r->start + j]];
+        info->color = r->color;
+        info->id = r->id;
+        info->next = (j < r->n - 1 ? undo->captured[r->start + j + 1] : 0);
+      }
+    }
+
+    // 4. The stone itself and all changed groups.
+    board->_infos[c] = undo->info_c;
+    for (int i = 0; i < undo->num_groups_changed; ++i) {
+      board->_groups[undo->groups[i].id] = undo->groups[i].g;
+    }
+  }
+  RestoreStates(board, undo);
+}
+
 BOOL UndoPass(Board *board) {
   if (board->_last_move != M_PASS) return FALSE;
   update_undo(board);
@@ -1482,6 +1765,138 @@ BOOL GetDistanceMap(const Board* board, Stone player, float *data) {
   return TRUE;
 }
 
+// ======================== Batched feature extraction ==================================
+#define PLANE_SIZE (MACRO_BOARD_SIZE * MACRO_BOARD_SIZE)
+
+int GetFeatureDim(int feature_type, BOOL userank) {
+  int dim;
+  switch (feature_type) {
+    case FEATURE_COMPLETE: dim = 12; break;
+    case FEATURE_EXTENDED: dim = 16; break;
+    case FEATURE_EXTENDED_WITH_ATTENTION: dim = 17; break;
+    default: return -1;
+  }
+  return userank ? dim + NUM_RANK_PLANES : dim;
+}
+
+// Copy one plane to the output with a dihedral transform.
+// style = 4 * h + 2 * v + t, where h flips y, v flips x and t transposes (in that order).
+static void put_plane(float *dst, const float *src, int style) {
+  if (style == 0) {
+    memcpy(dst, src, PLANE_SIZE * sizeof(float));
+    return;
+  }
+  BOOL h = (style & 4) != 0, v = (style & 2) != 0, t = (style & 1) != 0;
+  for (int x = 0; x < BOARD_SIZE; ++x) {
+    for (int y = 0; y < BOARD_SIZE; ++y) {
+      int x2 = v ? BOARD_SIZE - 1 - x : x;
+      int y2 = h ? BOARD_SIZE - 1 - y : y;
+      dst[t ? EXPORT_OFFSET_XY(y2, x2) : EXPORT_OFFSET_XY(x2, y2)] = src[EXPORT_OFFSET_XY(x, y)];
+    }
+  }
+}
+
+static void fill_plane(float *dst, float v) {
+  for (int i = 0; i < PLANE_SIZE; ++i) dst[i] = v;
+}
+
+static void get_features_one(const Board *board, Stone player, int feature_type, int rank, const Region *attention, int style, float *out) {
+  float tmp[PLANE_SIZE], plane[PLANE_SIZE];
+  float our_dist[PLANE_SIZE], opponent_dist[PLANE_SIZE];
+  Stone opponent = OPPONENT(player);
+  Stone actors[2] = { player, opponent };
+  int idx = 0;
+
+#define PUT(p) put_plane(out + (idx ++) * PLANE_SIZE, (p), style)
+
+  // Liberties.
+  for (int k = 0; k < 2; ++k) {
+    GetLibertyMap(board, actors[k], tmp);
+    for (int i = 0; i < PLANE_SIZE; ++i) plane[i] = (tmp[i] == 1);
+    PUT(plane);
+    for (int i = 0; i < PLANE_SIZE; ++i) plane[i] = (tmp[i] == 2);
+    PUT(plane);
+    for (int i = 0; i < PLANE_SIZE; ++i) plane[i] = (tmp[i] >= 3);
+    PUT(plane);
+  }
+  // Simple ko. Same as board.get_simple_ko in Lua, which (for compatibility with the trained models) returns our stones.
+  GetStones(board, player, tmp);
+  PUT(tmp);
+  // Stones.
+  PUT(tmp);
+  GetStones(board, opponent, tmp);
+  PUT(tmp);
+  GetStones(board, S_EMPTY, tmp);
+  PUT(tmp);
+  // Decayed history.
+  for (int k = 0; k < 2; ++k) {
+    GetHistory(board, actors[k], tmp);
+    for (int i = 0; i < PLANE_SIZE; ++i) tmp[i] = exp((tmp[i] - board->_ply) * 0.1);
+    PUT(tmp);
+  }
+
+  if (feature_type == FEATURE_EXTENDED || feature_type == FEATURE_EXTENDED_WITH_ATTENTION) {
+    // Border.
+    for (int x = 0; x < BOARD_SIZE; ++x) {
+      for (int y = 0; y < BOARD_SIZE; ++y) {
+        plane[EXPORT_OFFSET_XY(x, y)] = (x == 0 || y == 0 || x == BOARD_SIZE - 1 || y == BOARD_SIZE - 1);
+      }
+    }
+    PUT(plane);
+    // Position mask.
+    const float center = (BOARD_SIZE - 1) / 2.0;
+    for (int x = 0; x < BOARD_SIZE; ++x) {
+      for (int y = 0; y < BOARD_SIZE; ++y) {
+        plane[EXPORT_OFFSET_XY(x, y)] = exp(-0.5 * ((x - center) * (x - center) + (y - center) * (y - center)));
+      }
+    }
+    PUT(plane);
+    // Closest color.
+    GetDistanceMap(board, player, our_dist);
+    GetDistanceMap(board, opponent, opponent_dist);
+    for (int i = 0; i < PLANE_SIZE; ++i) plane[i] = (our_dist[i] < opponent_dist[i]);
+    PUT(plane);
+    for (int i = 0; i < PLANE_SIZE; ++i) plane[i] = (opponent_dist[i] < our_dist[i]);
+    PUT(plane);
+  }
+
+  if (feature_type == FEATURE_EXTENDED_WITH_ATTENTION) {
+    if (attention == NULL) fill_plane(plane, 1.0);
+    else {
+      for (int x = 0; x < BOARD_SIZE; ++x) {
+        for (int y = 0; y < BOARD_SIZE; ++y) {
+          plane[EXPORT_OFFSET_XY(x, y)] = IsIn(attention, OFFSETXY(x, y));
+        }
+      }
+    }
+    PUT(plane);
+  }
+
+  // Rank planes are constant so no transform is needed.
+  if (rank > 0) {
+    for (int k = 1; k <= NUM_RANK_PLANES; ++k) {
+      fill_plane(out + (idx ++) * PLANE_SIZE, k == rank ? 1.0 : 0.0);
+    }
+  }
+#undef PUT
+}
+
+BOOL GetFeaturesBatch(const Board **boards, const Stone *players, int n, int feature_type, const int *ranks, const Region *attention, int style, float *data) {
+  int dim = GetFeatureDim(feature_type, ranks != NULL);
+  if (dim < 0 || style < 0 || style >= 8) return FALSE;
+  for (int k = 0; k < n; ++k) {
+    const Board *board = boards[k];
+    Stone player = (players != NULL ? players[k] : board->_next_player);
+    int rank = 0;
+    if (ranks != NULL) {
+      rank = ranks[k];
+      if (rank < 1 || rank > NUM_RANK_PLANES) rank = 1;
+    }
+    get_features_one(board, player, feature_type, rank, attention, style, data + k * dim * PLANE_SIZE);
+  }
+  return TRUE;
+}
+
 void GetAllEmptyLocations(const Board* board, AllMoves *all_moves) {
   all_moves->num_moves = 0;
   all_moves->board = board;
@@ -1493,6 +1908,114 @@ void GetAllEmptyLocations(const Board* board, AllMoves *all_moves) {
   }
 }
 
+// ========================= Companion sets ==========================
+static inline void SetsAddEmpty(BoardSets *sets, Coord c) {
+  sets->empty_idx[c] = sets->num_empties;
+  sets->empties[sets->num_empties ++] = c;
+}
+
+static inline void SetsRemoveEmpty(BoardSets *sets, Coord c) {
+  // Move the last entry to the removed slot.
+  short idx = sets->empty_idx[c];
+  Coord last = sets->empties[-- sets->num_empties];
+  sets->empties[idx] = last;
+  sets->empty_idx[last] = idx;
+}
+
+static inline void SetsUpdateEye(BoardSets *sets, const Board *board, Coord c) {
+  if (board->_infos[c].color == S_OFF_BOARD) return;
+  sets->eye_colors[c] = GetEyeColor(board, c);
+}
+
+void BoardSetsInit(BoardSets *sets, const Board *board) {
+  memset(sets, 0, sizeof(BoardSets));
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      Coord c = OFFSETXY(i, j);
+      // Count for stones as well, since they are updated incrementally and used once the stones are captured.
+      FOR4(c, _, cc) {
+        if (board->_infos[cc].color == S_EMPTY) sets->num_empty_neighbors[c] ++;
+      } ENDFOR4
+      if (HAS_STONE(board->_infos[c].color)) continue;
+      SetsAddEmpty(sets, c);
+      SetsUpdateEye(sets, board, c);
+    }
+  }
+}
+
+BOOL PlayWithSets(Board *board, const GroupId4 *ids, BoardSets *sets) {
+  Coord c = ids->c;
+  if (c == M_PASS || c == M_RESIGN) return Play(board, ids);
+
+  // Locations that are going to change: the move itself and the stones to be captured.
+  Stone player = ids->player;
+  Coord changed[MACRO_BOARD_SIZE * MACRO_BOARD_SIZE];
+  int num_changed = 0;
+  changed[num_changed ++] = c;
+  for (int i = 0; i < 4; ++i) {
+    if (ids->ids[i] == 0 || ids->colors[i] == player || ids->group_liberties[i] != 1) continue;
+    TRAVERSE(board, ids->ids[i], cc) {
+      changed[num_changed ++] = cc;
+    } ENDTRAVERSE
+  }
+
+  BOOL ret = Play(board, ids);
+
+  // The move.
+  SetsRemoveEmpty(sets, c);
+  FOR4(c, _, cc) {
+    sets->num_empty_neighbors[cc] --;
+  } ENDFOR4
+
+  // Captured stones.
+  for (int i = 1; i < num_changed; ++i) {
+    Coord cc = changed[i];
+    SetsAddEmpty(sets, cc);
+    FOR4(cc, _, c4) {
+      sets->num_empty_neighbors[c4] ++;
+    } ENDFOR4
+  }
+
+  // Eye colors depend on the 8 neighbors.
+  for (int i = 0; i < num_changed; ++i) {
+    SetsUpdateEye(sets, board, changed[i]);
+    FOR8(changed[i], _, cc) {
+      SetsUpdateEye(sets, board, cc);
+    } ENDFOR8
+  }
+  return ret;
+}
+
+void FindAllCandidateMovesWithSets(const Board* board, const BoardSets *sets, const Region *r, Stone player, int self_atari_thres, AllMoves *all_moves) {
+  GroupId4 ids;
+  all_moves->board = board;
+  all_moves->num_moves = 0;
+  int self_atari_count = 0;
+  for (int i = 0; i < sets->num_empties; ++i) {
+    Coord c = sets->empties[i];
+    if (r != NULL && ! IsIn(r, c)) continue;
+
+    // Never fill a true eye.
+    if (sets->eye_colors[c] == player) continue;
+
+    // It is illegal to play at ko locations.
+    if (IsSimpleKoViolation(board, c, player)) continue;
+
+    StoneLibertyAnalysis(board, player, c, &ids);
+
+    // It is illegal to play a suicide move.
+    if (sets->num_empty_neighbors[c] == 0 && IsSuicideMove(&ids)) continue;
+
+    // Be careful about self-atari moves.
+    if (IsSelfAtari(board, &ids, c, player, &self_atari_count)) {
+      // For self-atari's with fewer counts, we could tolorate since they are usually important in killing others' group.
+      if (self_atari_count >= self_atari_thres) continue;
+    }
+
+    all_moves->moves[all_moves->num_moves++] = c;
+  }
+}
+
 // Codes used to check the validity of the data structure.
 void VerifyBoard(Board* board) {
   // Groups
@@ -1585,6 +2108,11 @@ void VerifyBoard(Board* board) {
     // Free the memory.
     free(visited);
   }
+  // Check hash.
+  uint64_t hash = ComputeBoardHash(board);
+  if (hash != board->_hash) {
+    printf("[VerifyError]: Actual hash [%" PRIx64 "] != recorded [%" PRIx64 "]\n", hash, board->_hash);
+  }
   printf("-----End verifying-----\n");
 }
 
@@ -1643,9 +2171,18 @@ BOOL IsTrueEye(const Board *board, Coord c, Stone player) {
 }
 
 Stone GetEyeColor(const Board *board, Coord c) {
-  if (IsTrueEye(board, c, S_WHITE)) return S_WHITE;
-  if (IsTrueEye(board, c, S_BLACK)) return S_BLACK;
-  return S_EMPTY;
+  if (board->_infos[c].color != S_EMPTY) return S_EMPTY;
+  // All on-board neighbors have to be of the same color.
+  Stone eye = S_EMPTY;
+  FOR4(c, _, c4) {
+    Stone s = board->_infos[c4].color;
+    if (s == S_OFF_BOARD) continue;
+    if (s == S_EMPTY) return S_EMPTY;
+    if (eye == S_EMPTY) eye = s;
+    else if (eye != s) return S_EMPTY;
+  } ENDFOR4
+  if (eye == S_EMPTY || IsFakeEye(board, c, eye)) return S_EMPTY;
+  return eye;
 }
 
 float GetFastScore(const Board* board, const int rule) {
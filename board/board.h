@@ -63,8 +63,8 @@ typedef struct {
 } GroupId4;
 
 // How many live groups can possibly be there in a game?
-// We use 173 so that sizeof(MBoard) <= 4096. This is important for atomic data transmission using pipe.
-#define MAX_GROUP 173
+// We use 172 so that sizeof(MBoard) <= 4096 (including Board._hash and MBoard.priority). This is important for atomic data transmission using pipe.
+#define MAX_GROUP 172
 /*
 Next step
 1. No PASS handling. need to add.
@@ -121,10 +121,93 @@ typedef struct {
   // The initial ply number is 1.
   short _ply;
 
-  // uint64_t hash for the current board situatons. If we want to enable it, then make MAX_GROUP smaller.
-  // uint64_t hash;
+  // Zobrist hash of the current board situation (stones, next player and the active simple ko point).
+  // It is updated incrementally in Play and UndoPass. Use GetBoardHash to read it.
+  uint64_t _hash;
 } Board;
 
+// Journal of a single Play, filled by PlayWithUndo and consumed by Undo.
+// Only the changed Info cells, Group entries and scalar states are recorded, so that search code can
+// walk down and back up without copying the entire board.
+typedef struct {
+  unsigned char id;
+  Group g;
+} GroupChange;
+
+typedef struct {
+  // Group id before removal, its color and where its stones are stored in BoardUndo.captured.
+  unsigned char id;
+  Stone color;
+  short start;
+  short n;
+} CaptureRecord;
+
+typedef struct {
+  // id2 is merged into id1. last is the last stone of id2 (whose next pointer is changed).
+  unsigned char id1, id2;
+  Coord start2;
+  Coord last;
+} MergeRecord;
+
+typedef struct {
+  // The move played.
+  Coord c;
+  Info info_c;
+
+  // Group entries before the move. Each id appears at most once.
+  GroupChange groups[MAX_GROUP];
+  short num_groups_changed;
+
+  // Captured stones, in the order of their linked lists.
+  Coord captured[MACRO_BOARD_SIZE * MACRO_BOARD_SIZE];
+  short num_captured;
+  CaptureRecord captures[4];
+  unsigned char num_captures;
+
+  MergeRecord merges[4];
+  unsigned char num_merges;
+
+  // Scalar states before the move.
+  short _num_groups;
+  short _b_cap;
+  short _w_cap;
+  Coord _last_move;
+  Coord _last_move2;
+  Coord _last_move3;
+  Coord _last_move4;
+  unsigned char _removed_group_ids[4];
+  unsigned char _num_group_removed;
+  unsigned short _ko_age;
+  Coord _simple_ko;
+  Stone _simple_ko_color;
+  Stone _next_player;
+  short _ply;
+  uint64_t _hash;
+} BoardUndo;
+
+// Liberty side table: for each group id, a bitset over coords (BOUND_COORD bits padded to 64-bit words).
+// It is too large to be put in Board (MBoard has to fit in one pipe write), so the owner of the board keeps it
+// alongside and uses PlayWithLibs to update it incrementally. The liberty count of a group is a popcount.
+#define LIB_WORDS ((BOUND_COORD + 63) / 64)
+typedef struct {
+  uint64_t bits[MAX_GROUP][LIB_WORDS];
+} GroupLibs;
+
+// Companion of a Board that keeps the empty locations and eye colors up to date.
+// Use PlayWithSets to play on the board so that only the neighborhood of changed locations is recomputed.
+// Only the candidate-move fallback of the default policy uses it. There is no per-player legal-move set: legality still
+// comes from the empty-neighbor counts plus the ko check, and GetFastScore / FindAllValidMoves still scan the board.
+typedef struct {
+  // Empty locations, and the index of each empty location in the list (for O(1) removal).
+  Coord empties[MACRO_BOARD_SIZE * MACRO_BOARD_SIZE];
+  short empty_idx[BOUND_COORD];
+  short num_empties;
+  // Number of empty neighbors. An empty location with an empty neighbor is never a suicide move.
+  unsigned char num_empty_neighbors[BOUND_COORD];
+  // GetEyeColor of each location (S_EMPTY if it is not an eye).
+  Stone eye_colors[BOUND_COORD];
+} BoardSets;
+
 // Save all candidate moves.
 typedef struct {
   const Board *board;
@@ -256,14 +339,45 @@ BOOL TryPlay2(const Board *board, Coord m, GroupId4 *ids);
 // Actually play the game. If return TRUE, then the game ended (either by PASS + PASS or by RESIGN)
 BOOL Play(Board *board, const GroupId4 *ids);
 
+// Same as Play, but record the changes into undo so that Undo(board, undo) brings the board back
+// (byte-identical) to the situation before the move. Only one level per BoardUndo, so recursive
+// callers need one BoardUndo per ply.
+BOOL PlayWithUndo(Board *board, const GroupId4 *ids, BoardUndo *undo);
+void Undo(Board *board, const BoardUndo *undo);
+
+// Same as Play, but also update the liberty side table.
+BOOL PlayWithLibs(Board *board, const GroupId4 *ids, GroupLibs *libs);
+// Compute the liberty side table from scratch.
+void GroupLibsInit(GroupLibs *libs, const Board *board);
+// Number of liberties of group id, computed from libs.
+int GroupLibsCount(const GroupLibs *libs, short id);
+// Get up to max_libs liberties of group id in increasing coord order. Return the number of liberties found.
+int GroupLibsGet(const GroupLibs *libs, short id, Coord *m, int max_libs);
+
+// Same as Play, but also update the companion sets.
+BOOL PlayWithSets(Board *board, const GroupId4 *ids, BoardSets *sets);
+// Compute the companion sets from scratch.
+void BoardSetsInit(BoardSets *sets, const Board *board);
+
 // Place handicap stone.
 BOOL PlaceHandicap(Board *board, int x, int y, Stone player);
 
+// Recompute group ids, stone lists and liberties from the stone colors of _infos (e.g., for a board rebuilt from its stones).
+// Other states are not touched. Return FALSE if the stones do not form a legal position (a group without liberty, or
+// more than MAX_GROUP - 1 groups), e.g., for a corrupted message. The board is then left half-built.
+BOOL RebuildGroups(Board *board);
+
 // Undo pass, currently we only support undo at most 2 passes.
 // Return true if last_move_ is pass.
 // After Undo, last_move4 is not usable.
 BOOL UndoPass(Board *board);
 
+// Get the Zobrist hash of the current board situation. O(1).
+// Two boards with the same stones, the same next player and the same active simple ko have the same hash.
+uint64_t GetBoardHash(const Board *board);
+// Recompute the hash from scratch (slow), used for verification.
+uint64_t ComputeBoardHash(const Board *board);
+
 // A region [left, right) * [top, bottom).
 typedef struct {
   int left, top, right, bottom;
@@ -280,6 +394,10 @@ void FindAllCandidateMovesInRegion(const Board* board, const Region *r, Stone pl
 
 // Find all valid moves including self-atari.
 void FindAllValidMoves(const Board* board, Stone player, AllMoves *all_moves);
+
+// Same as FindAllCandidateMovesInRegion, but only visit the empty locations in sets.
+// The moves are the same, but their order can be different.
+void FindAllCandidateMovesWithSets(const Board* board, const BoardSets *sets, const Region *r, Stone player, int self_atari_thres, AllMoves *all_moves);
 void ShowBoardFancy(const Board *board, ShowChoice choice);
 void ShowBoard(const Board *board, ShowChoice choice);
 void DumpBoard(const Board *board);
@@ -372,6 +490,25 @@ BOOL GetSimpleKo(const Board* board, Stone player, float *data);
 BOOL GetHistory(const Board* board, Stone player, float *data);
 BOOL GetDistanceMap(const Board* board, Stone player, float *data);
 
+// Batched feature extraction, same planes as goutils.extract_feature in Lua.
+// complete: our/opponent liberties (1, 2, >=3), our simpleko, our/opponent/empty stones, our/opponent history.
+// extended: complete + border, position_mask, closest_color (2 planes).
+// extended_with_attention: extended + attention.
+#define FEATURE_COMPLETE 0
+#define FEATURE_EXTENDED 1
+#define FEATURE_EXTENDED_WITH_ATTENTION 2
+// Number of rank planes appended if ranks are used.
+#define NUM_RANK_PLANES 9
+
+// Return the number of planes, or -1 if feature_type is invalid.
+int GetFeatureDim(int feature_type, BOOL userank);
+// Write the features of n boards into data, a contiguous n x dim x 19 x 19 buffer (dim = GetFeatureDim(feature_type, ranks != NULL)).
+// players: the player to move for each board. If NULL, use board->_next_player.
+// ranks: rank channel (1-9) for each board. If NULL, no rank planes are added.
+// attention: attention region for extended_with_attention. If NULL, the entire board.
+// style: one of the 8 dihedral transforms (0-7), same as goutils.rotateTransform.
+BOOL GetFeaturesBatch(const Board **boards, const Stone *players, int n, int feature_type, const int *ranks, const Region *attention, int style, float *data);
+
 // Some utility functions.
 char *get_move_str(Coord m, Stone player, char *buf);
 void util_show_move(Coord m, Stone player, char *buf);
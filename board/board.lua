@@ -204,6 +204,11 @@ function board.get_ply(b)
     return b._ply
 end
 
+-- Return the Zobrist hash of the board as uint64_t cdata (use it directly as a table key via tostring).
+function board.get_hash(b)
+    return C.GetBoardHash(b)
+end
+
 function board.is_game_end(b)
     return C.IsGameEnd(b) == common.TRUE
 end
@@ -244,6 +249,42 @@ function board.get_distance_map(b, player)
     return distance_map
 end
 
+local feature_types = {
+    complete = tonumber(symbols.FEATURE_COMPLETE),
+    extended = tonumber(symbols.FEATURE_EXTENDED),
+    extended_with_attention = tonumber(symbols.FEATURE_EXTENDED_WITH_ATTENTION)
+}
+
+function board.get_feature_dim(feature_type, userank)
+    return C.GetFeatureDim(feature_types[feature_type], userank and common.TRUE or common.FALSE)
+end
+
+-- Extract the features of n boards into one n x dim x 19 x 19 FloatTensor.
+-- bs: cdata array of board pointers, players: nil or cdata array of players (default is the next player of each board).
+-- rank_channels: nil (no rank planes) or a table of n rank channels (1-9).
+-- attention: nil (entire board) or {x1, y1, x2, y2} (1-based, inclusive).
+function board.get_features_batch(bs, players, n, feature_type, rank_channels, attention, style, output)
+    local dim = board.get_feature_dim(feature_type, rank_channels ~= nil)
+    assert(dim > 0, "board.get_features_batch: unknown feature_type " .. tostring(feature_type))
+    output = output or torch.FloatTensor()
+    output:resize(n, dim, 19, 19)
+    assert(output:isContiguous())
+
+    local ranks
+    if rank_channels then
+        ranks = ffi.new("int[?]", n)
+        for i = 1, n do ranks[i - 1] = rank_channels[i] end
+    end
+    local region
+    if attention then
+        region = ffi.new("Region")
+        region.left, region.top, region.right, region.bottom = attention[1] - 1, attention[2] - 1, attention[3], attention[4]
+    end
+    local ret = C.GetFeaturesBatch(ffi.cast("const Board **", bs), players, n, feature_types[feature_type], ranks, region, style or 0, output:data())
+    assert(ret == common.TRUE, "board.get_features_batch failed")
+    return output
+end
+
 function board.get_stones_bbox(b)
     local r = ffi.new("Region")
     C.GetBoardBBox(b, r)
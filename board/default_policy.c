@@ -458,6 +458,11 @@ DefPolicyMove RunDefPolicy(void *def_policy, void *context, RandFunc rand_func,
   DefPolicyMoves m;
   m.board = board;
 
+  // Empty locations and eyes are kept up to date along the playout once the fallback is first hit,
+  // so that the later fallbacks do not scan the board. Many playouts never need them.
+  BoardSets sets;
+  BOOL use_sets = FALSE;
+
   if (verbose) {
     printf("Start default policy!\n");
   }
@@ -483,7 +488,11 @@ DefPolicyMove RunDefPolicy(void *def_policy, void *context, RandFunc rand_func,
     if (! sample_res) {
       // Fall back to the normal mode.
       if (verbose) printf("Before find all valid moves..\n");
-      FindAllCandidateMovesInRegion(board, r, board->_next_player, h->params.thres_allow_atari_stone, &all_moves);
+      if (! use_sets) {
+        BoardSetsInit(&sets, board);
+        use_sets = TRUE;
+      }
+      FindAllCandidateMovesWithSets(board, &sets, r, board->_next_player, h->params.thres_allow_atari_stone, &all_moves);
       if (verbose) printf("After find all valid moves..\n");
       if (all_moves.num_moves == 0) {
         // No move to play, just pass.
@@ -509,7 +518,8 @@ DefPolicyMove RunDefPolicy(void *def_policy, void *context, RandFunc rand_func,
     }
 
     // Keep playing (even if the game already end by two pass or a resign), until we see a consecutive two passes.
-    Play(board, &ids);
+    if (use_sets) PlayWithSets(board, &ids, &sets);
+    else Play(board, &ids);
 
     // Check if there is any consecutive two passes.
     if (move.m == M_PASS) {
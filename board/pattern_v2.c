@@ -470,6 +470,8 @@ typedef struct {
   const Handle *h;
   // Internal board.
   Board board;
+  // Liberty bitsets of each group of the internal board, updated along with it.
+  GroupLibs libs;
   // For each valid board location, we have a hash.
   uint64_t hashes[BOUND_COORD];
 
@@ -1106,6 +1108,7 @@ void *PatternV2InitBoardExtra(void *hh, const Board *board) {
   } else {
     CopyBoard(b, board);
   }
+  GroupLibsInit(&be->libs, b);
   // Setup the board extra.
   for (int i = 0; i < BOARD_SIZE; ++i) {
     for (int j = 0; j < BOARD_SIZE; ++j) {
@@ -1231,6 +1234,15 @@ BOOL PatternV2BoardExtraCheck(void *board_extra) {
 
   if (! heap_check(be)) return FALSE;
 
+  // Check the liberty bitsets.
+  for (int i = 1; i < b->_num_groups; ++i) {
+    int lib_count = GroupLibsCount(&be->libs, i);
+    if (lib_count != b->_groups[i].liberties) {
+      fprintf(stderr,"Group %d: liberties from bitset [%d] != recorded [%d]\n", i, lib_count, b->_groups[i].liberties);
+      return FALSE;
+    }
+  }
+
   int move_loc2[BOUND_COORD];
   double total_prob = 0.0;
   double total_prob_d = 0.0;
@@ -1391,7 +1403,7 @@ void PatternV2PlayMove2(void *board_extra, const GroupId4 *ids) {
 
   // Actually play the move.
   PRINT_DEBUG(h, "PlayMove: %s, #empty: %d\n", get_move_str(m, b->_next_player, buf), be->empty_list->n);
-  Play(&be->board, ids);
+  PlayWithLibs(&be->board, ids, &be->libs);
 
   // Recompute the affected ids after we take the move.
   // Note that the ids might change so we need to use BoardIdOld2New in be->board.
@@ -1573,6 +1585,17 @@ void PrintSampleSummary(const SampleSummary *summary) {
         summary->num_counters[4], summary->num_counters[5], summary->max_counter, summary->n_recompute_Z, per_sample * 1e6);
 }
 
+// Same as find_only_liberty/find_two_liberties but using the liberty bitsets (no group traversal).
+static inline BOOL be_find_only_liberty(const BoardExtra *be, short id, Coord *m) {
+  if (! G_HAS_STONE(id) || be->board._groups[id].liberties > 1) return FALSE;
+  return GroupLibsGet(&be->libs, id, m, 1) == 1;
+}
+
+static inline BOOL be_find_two_liberties(const BoardExtra *be, short id, Coord m[2]) {
+  if (be->board._groups[id].liberties != 2) return FALSE;
+  return GroupLibsGet(&be->libs, id, m, 2) == 2;
+}
+
 BOOL add_resp_prior(BoardExtra *board_extra, Coord last) {
   const Handle *h = board_extra->h;
   uint64_t idx = MASK(board_extra->hashes[last]);
@@ -1606,7 +1629,7 @@ BOOL add_global_prior(BoardExtra *board_extra) {
     // Four cases.
     if (lib == 1) {
       Coord m;
-      find_only_liberty(b, i, &m);
+      be_find_only_liberty(board_extra, i, &m);
       if (! TryPlay2(b, m, &ids)) continue;
 
       if (our_group) {
@@ -1621,7 +1644,7 @@ BOOL add_global_prior(BoardExtra *board_extra) {
     } else if (lib == 2) {
       // 2 libs.
       Coord m[2];
-      find_two_liberties(b, i, m);
+      be_find_two_liberties(board_extra, i, m);
       int w_idx = our_group ? offset_global_self_atari : offset_global_atari;
 
       for (int k = 0; k < 2; ++k) {
@@ -1882,7 +1905,7 @@ BOOL add_kill_group_prior(BoardExtra *board_extra, Coord last) {
   const Handle *h = board_extra->h;
   Coord m;
   unsigned short id = b->_infos[last].id;
-  if (! find_only_liberty(b, id, &m)) return FALSE;
+  if (! be_find_only_liberty(board_extra, id, &m)) return FALSE;
 
   GroupId4 ids;
   if (! TryPlay2(b, m, &ids)) return FALSE;
@@ -1913,7 +1936,7 @@ BOOL add_put_group_to_atari(BoardExtra *board_extra) {
 
   // 2 libs.
   Coord ms[2];
-  find_two_liberties(b, id, ms);
+  be_find_two_liberties(board_extra, id, ms);
 
   GroupId4 ids;
   for (int k = 0; k < 2; ++k) {
@@ -1945,7 +1968,7 @@ BOOL add_kill_group_prior2(BoardExtra *board_extra, Coord last2) {
     short id = b->_infos[c].id;
     if (id > 0 && b->_groups[id].color == OPPONENT(b->_next_player) && b->_groups[id].liberties == 1) {
       // Try to kill this group.
-      if (! find_only_liberty(b, id, &m)) error("save_group_prior: this should never fail!");
+      if (! be_find_only_liberty(board_extra, id, &m)) error("save_group_prior: this should never fail!");
       // Check whether this move is valid.
       if (! TryPlay2(b, m, &ids)) continue;
 
@@ -1993,7 +2016,7 @@ BOOL add_save_group_prior(BoardExtra *board_extra, Coord last) {
           if (visitedIds[oppoId]) continue;
           visitedIds[oppoId] = TRUE;
           if (b->_groups[oppoId].liberties == 1) {
-            if (! find_only_liberty(b, oppoId, &m)) error("save_group_prior: this should never fail!");
+            if (! be_find_only_liberty(board_extra, oppoId, &m)) error("save_group_prior: this should never fail!");
             if (! TryPlay2(b, m, &ids)) continue;
             if (! IsSelfAtari(b, &ids, m, ids.player, NULL)) {
               // if (stones >= 5) board_extra->prior_must_move = m;
@@ -2017,7 +2040,7 @@ BOOL add_save_group_prior(BoardExtra *board_extra, Coord last) {
       } ENDFOR4
     }
     // Otherwise, Try to save this group by extending.
-    if (! find_only_liberty(b, id, &m)) error("save_group_prior: this should never fail!");
+    if (! be_find_only_liberty(board_extra, id, &m)) error("save_group_prior: this should never fail!");
 
     // Check whether this move is self-atari.
     if (! TryPlay2(b, m, &ids)) continue;
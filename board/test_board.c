@@ -0,0 +1,76 @@
+//
+// Copyright (c) 2016-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+//
+
+#include "board.h"
+#include "../common/common.h"
+#include <stdio.h>
+#include <string.h>
+
+// Play random games. At each position, PlayWithUndo has to give the same board as Play (with an incremental hash
+// that matches the one computed from scratch), and Undo has to bring the board back byte by byte.
+#define NUM_GAMES 200
+#define MAX_PLY 500
+
+
+static void check_play_undo(const Board *board, Coord m, const GroupId4 *ids) {
+  Board b, b_play;
+  BoardUndo undo;
+  char buf[30];
+
+  CopyBoard(&b, board);
+  CopyBoard(&b_play, board);
+  Play(&b_play, ids);
+  PlayWithUndo(&b, ids, &undo);
+
+  if (! CompareBoard(&b, &b_play) || b._ply != b_play._ply || b._last_move != b_play._last_move || b._simple_ko != b_play._simple_ko) {
+    ShowBoard(board, SHOW_LAST_MOVE);
+    error("PlayWithUndo and Play differ after %s!", get_move_str(m, board->_next_player, buf));
+  }
+  if (GetBoardHash(&b) != GetBoardHash(&b_play) || GetBoardHash(&b) != ComputeBoardHash(&b)) {
+    ShowBoard(board, SHOW_LAST_MOVE);
+    error("Hash mismatch after %s! PlayWithUndo = %lx, Play = %lx, recomputed = %lx", get_move_str(m, board->_next_player, buf),
+        GetBoardHash(&b), GetBoardHash(&b_play), ComputeBoardHash(&b));
+  }
+
+  Undo(&b, &undo);
+  if (memcmp(&b, board, sizeof(Board)) != 0 || GetBoardHash(&b) != GetBoardHash(board)) {
+    ShowBoard(board, SHOW_LAST_MOVE);
+    error("Undo of %s does not restore the board!", get_move_str(m, board->_next_player, buf));
+  }
+}
+
+int main() {
+  unsigned long seed = 1;
+  Board board;
+  AllMoves all_moves;
+  GroupId4 ids;
+  int num_checked = 0, num_captures = 0;
+
+  for (int i = 0; i < NUM_GAMES; ++i) {
+    ClearBoard(&board);
+    while (board._ply < MAX_PLY && ! IsGameEnd(&board)) {
+      FindAllValidMoves(&board, board._next_player, &all_moves);
+      // Pass from time to time, and when there is nothing else to play.
+      Coord m = M_PASS;
+      if (all_moves.num_moves > 0 && fast_random(&seed, 20) > 0) m = all_moves.moves[fast_random(&seed, all_moves.num_moves)];
+      if (! TryPlay2(&board, m, &ids)) continue;
+
+      check_play_undo(&board, m, &ids);
+      num_checked ++;
+
+      short num_cap = board._b_cap + board._w_cap;
+      Play(&board, &ids);
+      if (board._b_cap + board._w_cap > num_cap) num_captures ++;
+    }
+  }
+
+  printf("#games = %d, #moves checked = %d, #moves with captures = %d\n", NUM_GAMES, num_checked, num_captures);
+  printf("All passed\n");
+  return 0;
+}
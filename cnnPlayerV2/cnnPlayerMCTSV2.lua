@@ -30,10 +30,11 @@ local opt = pl.lapp[[
     --max_send_attempts (default 3)          #attempts to send to the server.
     --pipe_path         (default "/data/local/go/") Pipe path
     --tier_name         (default "ai.go-evaluator") Tier name
-    --server_type       (default "local")    We can choose "local" or "cluster". For open source version, for now "cluster" is not usable.
+    --server_type       (default "local")    We can choose "local", "shm" (local with shared memory) or "cluster". For open source version, for now "cluster" is not usable.
     --tree_to_json                           Whether we save the tree to json file for visualization. Note that pipe_path will be used.
     --num_tree_thread   (default 16)         The number of threads used to expand MCTS tree.
     --num_gpu           (default 1)          The number of gpus to use for local play.
+    --gpu_routing       (default "static")   How boards are routed across gpus: "static" (by tree thread), "least_loaded" or "hash" (by position, bounded by load).
     --sigma             (default 0.05)       Sigma used to perturb the win rate in MCTS search.
     --use_sigma_over_n                       use sigma / n (or sqrt(nparent/n)). This makes sigma small for nodes with confident win rate estimation.
     --num_virtual_games (default 0)          Number of virtual games we use.
@@ -61,9 +62,18 @@ local opt = pl.lapp[[
     --final_mixture_ratio            (default 0.5)    The mixture ratio we used.
     --percent_playout_in_expansion   (default 0)      The percent of threads that will run playout when we expand the node. Other threads will block wait.
     --use_old_uct                                     Use old uct
+    --eval_cache_size                (default 16384)  #entries of the CNN evaluation cache keyed by board hash (0 = no cache).
+    --num_reclaimer                  (default 1)      #threads that free pruned subtrees in the background (0 = free inline).
+    --transposition_table_size       (default 0)      #entries of the transposition table. If nonzero, transposed positions share one node.
+    --virtual_loss                   (default 0)      #lost games added per in-flight simulation on an edge (0 = no virtual loss).
+    --bp_coalesce_depth              (default 0)      Backprop into the top levels is accumulated per thread (0 = no coalescing).
+    --bp_flush_interval              (default 16)     #rollouts between two flushes of the coalesced backprop.
+    --num_sim_per_thread             (default 1)      #simulations each tree thread keeps in flight while waiting for CNN (sync mode only).
     --use_async                                       Open async model.
     --cpu_only                                        Whether we only use fast rollout.
     --expand_n_thres                 (default 0)      Statistics collected before expand.
+    --prefetch_n_thres               (default 0)      Visits of a node before its top children are sent to CNN ahead of expansion (sync mode only, 0 = off).
+    --prefetch_topk                  (default 2)      #children of a hot node to prefetch.
     --sample_topn                    (default -1)     If use v2, topn we should sample..
     --rule                           (default cn)     Use JP rule : jp, use CN rule: cn
     --heuristic_tm_total_time        (default 0)      Time for heuristic tm (0 mean you don't use it).
@@ -81,9 +91,10 @@ local function load_params_for_formal_game()
     opt.max_send_attempts = 3 -- (default 3)          #attempts to send to the server.
     opt.pipe_path = "/data/local/go/" --         (default "/data/local/go/") Pipe path
     opt.tier_name = "ai.go-evaluator" --         (default "ai.go-evaluator") Tier name
-    opt.server_type = "local" --       (default "local")                 We can choose "local" or "cluster"
+    opt.server_type = "local" --       (default "local")                 We can choose "local", "shm" or "cluster"
     opt.tree_to_json = false --                           Whether we save the tree to json file for visualization. Note that pipe_path will be used.
     opt.num_tree_thread = 16 --   (default 16)         The number of threads used to expand MCTS tree.
+    opt.gpu_routing = "static"
     opt.num_virtual_games = 5
     opt.acc_prob_thres = 1 --    (default 0.8)        Accumulated probability threshold. We remove the remove if by the time we see it, the accumulated prob is greater than this thres.
     opt.max_num_move = 7 --      (default 20)          Maximum number of moves to consider in each tree node.
@@ -104,10 +115,19 @@ local function load_params_for_formal_game()
     opt.min_ply_to_use_cnn_final_score = 100 -- (default 100)     When to use cnn final score.
     opt.final_mixture_ratio = 0.5 -- (default 0.5)    The mixture ratio we used.
     opt.use_old_uct = false
+    opt.eval_cache_size = 16384
+    opt.num_reclaimer = 1
+    opt.transposition_table_size = 0
+    opt.virtual_loss = 0
+    opt.bp_coalesce_depth = 0
+    opt.bp_flush_interval = 16
+    opt.num_sim_per_thread = 1
     opt.percent_playout_in_expansion = 5
     opt.use_async = false      --                                 Open async model.
     opt.cpu_only = false     --                                   Whether we only use fast rollout.
     opt.expand_n_thres = 0 --              (default 0)      Statistics collected before expand.
+    opt.prefetch_n_thres = 0
+    opt.prefetch_topk = 2
     opt.sample_topn = -1 --                   (default -1)     If use v2, topn we should sample..
     opt.rule = "jp"  --             (default cn)         Use JP rule : jp, use CN rule: cn
     opt.num_playout_per_rollout = 1
@@ -123,9 +143,10 @@ local function set_playout_params_from_opt()
     playoutv2.params.print_search_tree = opt.print_tree and common.TRUE or common.FALSE
     playoutv2.params.pipe_path = opt.pipe_path
     playoutv2.params.tier_name = opt.tier_name
-    playoutv2.params.server_type = opt.server_type == "local" and playoutv2.server_local or playoutv2.server_cluster
+    playoutv2.params.server_type = playoutv2.server_table[opt.server_type] or playoutv2.server_cluster
     playoutv2.params.verbose = opt.verbose
     playoutv2.params.num_gpu = opt.num_gpu
+    playoutv2.params.gpu_routing = playoutv2.route_table[opt.gpu_routing] or playoutv2.route_table.static
     playoutv2.params.dynkomi_factor = opt.dynkomi_factor
     playoutv2.params.cpu_only = opt.cpu_only and common.TRUE or common.FALSE
     playoutv2.params.rule = opt.rule == "jp" and board.japanese_rule or board.chinese_rule
@@ -174,6 +195,8 @@ local function set_playout_params_from_opt()
     playoutv2.tree_params.use_rave = opt.use_rave and common.TRUE or common.FALSE
     playoutv2.tree_params.use_async = opt.use_async and common.TRUE or common.FALSE
     playoutv2.tree_params.expand_n_thres = opt.expand_n_thres
+    playoutv2.tree_params.prefetch_n_thres = opt.prefetch_n_thres
+    playoutv2.tree_params.prefetch_topk = opt.prefetch_topk
     playoutv2.tree_params.num_virtual_games = opt.num_virtual_games
     playoutv2.tree_params.percent_playout_in_expansion = opt.percent_playout_in_expansion
 
@@ -182,6 +205,13 @@ local function set_playout_params_from_opt()
     playoutv2.tree_params.use_old_uct = opt.use_old_uct and common.TRUE or common.FALSE
     playoutv2.tree_params.use_sigma_over_n = opt.use_sigma_over_n and common.TRUE or common.FALSE
     playoutv2.tree_params.num_playout_per_rollout = opt.num_playout_per_rollout
+    playoutv2.tree_params.eval_cache_size = opt.eval_cache_size
+    playoutv2.tree_params.num_reclaimer = opt.num_reclaimer
+    playoutv2.tree_params.transposition_table_size = opt.transposition_table_size
+    playoutv2.tree_params.virtual_loss = opt.virtual_loss
+    playoutv2.tree_params.bp_coalesce_depth = opt.bp_coalesce_depth
+    playoutv2.tree_params.bp_flush_interval = opt.bp_flush_interval
+    playoutv2.tree_params.num_sim_per_thread = opt.num_sim_per_thread
 end
 
 local tr
@@ -13,14 +13,22 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include "comm_pipe.h"
 
 #define PIPE_SIZE 1048576
 
+// Max #messages in one PipeReadV/PipeWriteV call.
+#define PIPE_MAX_IOV 256
+
+// How long to wait for the rest of a partially transferred message before leaving it to the next call.
+#define PIPE_FINISH_MS 10
+
 // Hack here
 #define F_SETPIPE_SZ 1031
 #define F_GETPIPE_SZ 1032
@@ -31,6 +39,8 @@ int PipeInit(const char *name, int create_pipe, Pipe *p) {
     return -1;
   }
   strcpy(p->filename, name);
+  p->partial_size = 0;
+  p->partial_done = 0;
 
   if (create_pipe) {
     mkfifo(name, 0666);
@@ -62,18 +72,129 @@ int PipeInit(const char *name, int create_pipe, Pipe *p) {
   return 0;
 }
 
-int PipeRead(Pipe *p, void *buffer, int size) {
-  if (read(p->fd, buffer, size) == -1) {
-    return -1;
+// Skip the first done bytes of iov. Return #iovecs that are complete.
+static int iov_advance(struct iovec *iov, int n, size_t done) {
+  int i = 0;
+  while (i < n && done >= iov[i].iov_len) {
+    done -= iov[i].iov_len;
+    i ++;
   }
-  return 0;
+  if (i < n) {
+    iov[i].iov_base = (char *)iov[i].iov_base + done;
+    iov[i].iov_len -= done;
+  }
+  return i;
+}
+
+// Part of a message has been transferred, so the rest should follow shortly. Wait for it, but give up (return 0) if
+// the peer makes no progress for PIPE_FINISH_MS.
+static int finish_message(Pipe *p, int for_write, struct iovec *iov) {
+  while (iov->iov_len > 0) {
+    ssize_t r = for_write ? write(p->fd, iov->iov_base, iov->iov_len) : read(p->fd, iov->iov_base, iov->iov_len);
+    if (r > 0) {
+      iov->iov_base = (char *)iov->iov_base + r;
+      iov->iov_len -= r;
+    } else if (r == 0 || ! PipeWait(p, for_write, -1, PIPE_FINISH_MS)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Continue the message kept in p->partial, without waiting. Return 1 if it is complete.
+static int finish_partial(Pipe *p, int for_write) {
+  while (p->partial_done < p->partial_size) {
+    char *buf = p->partial + p->partial_done;
+    size_t len = p->partial_size - p->partial_done;
+    ssize_t r = for_write ? write(p->fd, buf, len) : read(p->fd, buf, len);
+    if (r <= 0) return 0;
+    p->partial_done += r;
+  }
+  return 1;
+}
+
+static int transfer(Pipe *p, int for_write, void **buffers, int size, int n) {
+  struct iovec iov[PIPE_MAX_IOV];
+  if (size > PIPE_MAX_MSG) return 0;
+
+  // A message left over from the last call goes first, so that the stream stays in sync.
+  int k0 = 0;
+  if (p->partial_size > 0) {
+    if (! finish_partial(p, for_write)) return 0;
+    if (! for_write) {
+      memcpy(buffers[0], p->partial, size);
+      k0 = 1;
+    }
+    p->partial_size = 0;
+  }
+
+  n -= k0;
+  if (n > PIPE_MAX_IOV) n = PIPE_MAX_IOV;
+  if (n <= 0) return k0;
+  for (int i = 0; i < n; ++i) {
+    iov[i].iov_base = buffers[k0 + i];
+    iov[i].iov_len = size;
+  }
+  ssize_t r = for_write ? writev(p->fd, iov, n) : readv(p->fd, iov, n);
+  if (r <= 0) return k0;
+
+  int k = iov_advance(iov, n, r);
+  if (k < n && iov[k].iov_len < (size_t)size) {
+    if (finish_message(p, for_write, &iov[k])) {
+      k ++;
+    } else if (for_write) {
+      // The message is committed (its head is in the pipe), keep the rest to be written by the next call.
+      memcpy(p->partial, iov[k].iov_base, iov[k].iov_len);
+      p->partial_size = iov[k].iov_len;
+      p->partial_done = 0;
+      k ++;
+    } else {
+      // Keep what we have got, the next call will read the rest.
+      p->partial_done = size - iov[k].iov_len;
+      memcpy(p->partial, buffers[k0 + k], p->partial_done);
+      p->partial_size = size;
+    }
+  }
+  return k0 + k;
+}
+
+int PipeRead(Pipe *p, void *buffer, int size) {
+  return transfer(p, 0, &buffer, size, 1) == 1 ? 0 : -1;
 }
 
 int PipeWrite(Pipe *p, void *buffer, int size) {
-  if (write(p->fd, buffer, size) == -1) {
-    return -1;
+  return transfer(p, 1, &buffer, size, 1) == 1 ? 0 : -1;
+}
+
+int PipeReadV(Pipe *p, void **buffers, int size, int max_n) {
+  return transfer(p, 0, buffers, size, max_n);
+}
+
+int PipeWriteV(Pipe *p, void **buffers, int size, int n) {
+  return transfer(p, 1, buffers, size, n);
+}
+
+int PipeFlush(Pipe *p) {
+  if (p->partial_size == 0) return 1;
+  if (! finish_partial(p, 1)) return 0;
+  p->partial_size = 0;
+  return 1;
+}
+
+int PipeWait(Pipe *p, int for_write, int extra_fd, int timeout_ms) {
+  struct pollfd fds[2];
+  int n = 1;
+  fds[0].fd = p->fd;
+  fds[0].events = for_write ? POLLOUT : POLLIN;
+  fds[0].revents = 0;
+  if (extra_fd != -1) {
+    fds[1].fd = extra_fd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    n = 2;
   }
-  return 0;
+  if (poll(fds, n, timeout_ms) <= 0) return 0;
+  return (fds[0].revents & fds[0].events) ? 1 : 0;
 }
 
 void PipeClose(Pipe *p) {
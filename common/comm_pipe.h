@@ -13,19 +13,42 @@
 #define PIPE_READ 0
 #define PIPE_WRITE 1
 
+// Max size of a message.
+#define PIPE_MAX_MSG 8192
+
 typedef struct {
   int fd;
   char filename[1000];
   int is_server;
+  // A message that is partially transferred and not finished yet: the bytes still to be written, or the bytes read so far.
+  // It is finished by the next call on the pipe before any other message.
+  char partial[PIPE_MAX_MSG];
+  int partial_size;
+  int partial_done;
 } Pipe;
 
 // Create pipe, if create_pipe == 0, then load the fid from an existing file.
 int PipeInit(const char *filename, int create_pipe, Pipe *p);
 
 // Nonblocking read/write. return -1 if failed, else return 0
+// A message that is partially transferred (e.g., written by PipeWriteV) is waited for shortly. If the peer stalls,
+// the message is kept in the pipe and finished by the next call (a write then counts as done, a read as not done).
 int PipeRead(Pipe *p, void *buffer, int size);
 int PipeWrite(Pipe *p, void *buffer, int size);
 
+// Read up to max_n messages of the same size with one syscall. Return #messages read (0 if there is none).
+int PipeReadV(Pipe *p, void **buffers, int size, int max_n);
+// Write n messages of the same size with one syscall (writev). Return #messages written, which might be fewer than n if the pipe is full.
+// Writes larger than PIPE_BUF are not atomic, so concurrent writers of the same pipe have to be serialized by the caller.
+int PipeWriteV(Pipe *p, void **buffers, int size, int n);
+// Writer side: write the rest of a message kept from a previous call (see above), without waiting.
+// Return 1 if nothing is left, else return 0 (wait until the pipe is writable and call it again).
+int PipeFlush(Pipe *p);
+
+// Block until the pipe is readable (for_write == 0) or writable (for_write == 1), or until extra_fd (if not -1) is readable.
+// Wait at most timeout_ms (-1 means forever). Return 1 if the pipe is ready, else return 0.
+int PipeWait(Pipe *p, int for_write, int extra_fd, int timeout_ms);
+
 void PipeClose(Pipe *p);
 
 #endif
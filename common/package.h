@@ -21,10 +21,18 @@
 #define MAX_CUSTOM_DATA 500
 #define SIG_OK 0
 #define SIG_RESTART 1
-#define SIG_FINISHSOON 2
+// 2 was SIG_FINISHSOON, replaced by credits (SIG_CREDIT).
 #define SIG_NOPKG 3
+// Client to server: boards with a sequence number smaller than MCtrl.seq are cancelled. No ack.
+#define SIG_MINSEQ 4
+// Flow control. Server to client: at most MCtrl.seq boards in flight (0 = no limit).
+// Client to server: ask the server to advertise it.
+#define SIG_CREDIT 5
 #define SIG_ACK 100
 
+// Priority of a board, in [0, PR_HIGHEST]. The local and shm servers evaluate boards with higher priority first.
+#define PR_HIGHEST 100
+
 // Several kind of messages. The first element has to be long
 // Message 1: board
 typedef struct {
@@ -33,6 +41,8 @@ typedef struct {
   uint64_t b;
   // Send time (in microsecond).
   double t_sent;
+  // Priority of the evaluation (see PR_HIGHEST).
+  int priority;
   // Board configuration
   Board board;
 } MBoard;
@@ -57,8 +67,8 @@ typedef struct {
   // Custom data. E.g., feature for the current board.
   char extra[MAX_CUSTOM_DATA];
 
-  // The board hash for the board used.
-  // uint64_t board_hash;
+  // The board hash for the board used (echoed from MBoard.board), used as the key of the evaluation cache.
+  uint64_t board_hash;
 
   // Score if there is any prediction.
   BOOL has_score;
@@ -0,0 +1,243 @@
+//
+// Copyright (c) 2016-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+//
+
+#include <string.h>
+#include "package_codec.h"
+
+// Ages older than this are saturated. Their weight in the history feature (exp(-0.1 * age)) is already negligible.
+#define MAX_AGE 255
+
+#define MOVE_FLAG_ERROR 1
+#define MOVE_FLAG_HAS_SCORE 2
+
+#define PUT(p, v) do { memcpy((p), &(v), sizeof(v)); (p) += sizeof(v); } while(0)
+#define GET(p, v) do { memcpy(&(v), (p), sizeof(v)); (p) += sizeof(v); } while(0)
+
+// Fixed part of the encoded board/move.
+#define BOARD_HEADER_BYTES (2 + 4 * 8 + 4 * sizeof(short) + sizeof(unsigned short) + 5 * sizeof(Coord) + 2 * sizeof(Stone) + 1)
+#define DELTA_BYTES (2 + 5 * 8 + sizeof(Coord) + 1)
+#define PLANE_BYTES ((BOARD_SIZE * BOARD_SIZE * 2 + 7) / 8)
+#define MOVE_HEADER_BYTES (5 + sizeof(unsigned short) + 2 * 8 + 3 * sizeof(double) + 8 + sizeof(float))
+
+int PkgEncodeBoard(const MBoard *mboard, unsigned char *buf) {
+  const Board *board = &mboard->board;
+  unsigned char *p = buf;
+  *p ++ = PKG_CODEC_VERSION;
+  *p ++ = PKG_BOARD_FULL;
+  PUT(p, mboard->seq);
+  PUT(p, mboard->b);
+  PUT(p, mboard->t_sent);
+  PUT(p, board->_hash);
+  PUT(p, board->_ply);
+  PUT(p, board->_b_cap);
+  PUT(p, board->_w_cap);
+  PUT(p, board->_rollout_passes);
+  PUT(p, board->_ko_age);
+  PUT(p, board->_simple_ko);
+  PUT(p, board->_last_move);
+  PUT(p, board->_last_move2);
+  PUT(p, board->_last_move3);
+  PUT(p, board->_last_move4);
+  PUT(p, board->_simple_ko_color);
+  PUT(p, board->_next_player);
+  *p ++ = (unsigned char)mboard->priority;
+
+  // Stone planes, 4 intersections per byte.
+  unsigned char *planes = p;
+  memset(planes, 0, PLANE_BYTES);
+  p += PLANE_BYTES;
+  int k = 0;
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      const Info *info = &board->_infos[OFFSETXY(i, j)];
+      if (HAS_STONE(info->color)) {
+        planes[k >> 2] |= info->color << ((k & 3) * 2);
+        int age = board->_ply - info->last_placed;
+        *p ++ = age < 0 ? 0 : (age > MAX_AGE ? MAX_AGE : age);
+      }
+      k ++;
+    }
+  }
+  return p - buf;
+}
+
+BOOL PkgDecodeBoard(const unsigned char *buf, int size, MBoard *mboard) {
+  if (size < (int)(BOARD_HEADER_BYTES + PLANE_BYTES) || buf[0] != PKG_CODEC_VERSION || buf[1] != PKG_BOARD_FULL) return FALSE;
+  Board *board = &mboard->board;
+  ClearBoard(board);
+
+  const unsigned char *p = buf + 2;
+  GET(p, mboard->seq);
+  GET(p, mboard->b);
+  GET(p, mboard->t_sent);
+  GET(p, board->_hash);
+  GET(p, board->_ply);
+  GET(p, board->_b_cap);
+  GET(p, board->_w_cap);
+  GET(p, board->_rollout_passes);
+  GET(p, board->_ko_age);
+  GET(p, board->_simple_ko);
+  GET(p, board->_last_move);
+  GET(p, board->_last_move2);
+  GET(p, board->_last_move3);
+  GET(p, board->_last_move4);
+  GET(p, board->_simple_ko_color);
+  GET(p, board->_next_player);
+  mboard->priority = *p ++;
+
+  const unsigned char *planes = p;
+  p += PLANE_BYTES;
+  const unsigned char *end = buf + size;
+  int k = 0;
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      Stone color = (planes[k >> 2] >> ((k & 3) * 2)) & 3;
+      k ++;
+      if (! HAS_STONE(color)) continue;
+      if (p >= end) return FALSE;
+      Info *info = &board->_infos[OFFSETXY(i, j)];
+      info->color = color;
+      info->last_placed = board->_ply - *p ++;
+    }
+  }
+  return RebuildGroups(board);
+}
+
+int PkgEncodeBoardDelta(const MBoard *mboard, uint64_t parent_b, Coord m, unsigned char *buf) {
+  unsigned char *p = buf;
+  *p ++ = PKG_CODEC_VERSION;
+  *p ++ = PKG_BOARD_DELTA;
+  PUT(p, mboard->seq);
+  PUT(p, mboard->b);
+  PUT(p, mboard->t_sent);
+  PUT(p, mboard->board._hash);
+  PUT(p, parent_b);
+  PUT(p, m);
+  *p ++ = (unsigned char)mboard->priority;
+  return p - buf;
+}
+
+int PkgBoardKind(const unsigned char *buf, int size, uint64_t *parent_b) {
+  if (size < 2 || buf[0] != PKG_CODEC_VERSION) return -1;
+  if (buf[1] == PKG_BOARD_FULL) return size >= (int)(BOARD_HEADER_BYTES + PLANE_BYTES) ? PKG_BOARD_FULL : -1;
+  if (buf[1] != PKG_BOARD_DELTA || size < (int)DELTA_BYTES) return -1;
+  memcpy(parent_b, buf + 2 + 4 * 8, sizeof(uint64_t));
+  return PKG_BOARD_DELTA;
+}
+
+BOOL PkgDecodeBoardId(const unsigned char *buf, int size, MBoard *mboard) {
+  uint64_t parent_b;
+  if (PkgBoardKind(buf, size, &parent_b) < 0) return FALSE;
+  // Both kinds start with the same fields.
+  const unsigned char *p = buf + 2;
+  GET(p, mboard->seq);
+  GET(p, mboard->b);
+  GET(p, mboard->t_sent);
+  GET(p, mboard->board._hash);
+  return TRUE;
+}
+
+BOOL PkgDecodeBoardDelta(const unsigned char *buf, int size, const Board *parent, MBoard *mboard) {
+  if (size < (int)DELTA_BYTES || buf[0] != PKG_CODEC_VERSION || buf[1] != PKG_BOARD_DELTA) return FALSE;
+  const unsigned char *p = buf + 2;
+  uint64_t hash, parent_b;
+  Coord m;
+  GET(p, mboard->seq);
+  GET(p, mboard->b);
+  GET(p, mboard->t_sent);
+  GET(p, hash);
+  GET(p, parent_b);
+  GET(p, m);
+  mboard->priority = *p ++;
+
+  GroupId4 ids;
+  CopyBoard(&mboard->board, parent);
+  if (! TryPlay2(&mboard->board, m, &ids)) return FALSE;
+  Play(&mboard->board, &ids);
+  return GetBoardHash(&mboard->board) == hash ? TRUE : FALSE;
+}
+
+int PkgEncodeMove(const MMove *mmove, BOOL with_extra, unsigned char *buf) {
+  // Skip the trailing padding (pass with zero confidence) and zeros.
+  int num_moves = NUM_FIRST_MOVES;
+  while (num_moves > 0 && mmove->xs[num_moves - 1] == 0 && mmove->ys[num_moves - 1] == 0 && mmove->probs[num_moves - 1] == 0) num_moves --;
+  unsigned short extra_len = 0;
+  if (with_extra) {
+    extra_len = MAX_CUSTOM_DATA;
+    while (extra_len > 0 && mmove->extra[extra_len - 1] == 0) extra_len --;
+  }
+  int hostname_len = strnlen(mmove->hostname, sizeof(mmove->hostname) - 1);
+
+  unsigned char *p = buf;
+  *p ++ = PKG_CODEC_VERSION;
+  *p ++ = (mmove->error ? MOVE_FLAG_ERROR : 0) | (mmove->has_score ? MOVE_FLAG_HAS_SCORE : 0);
+  *p ++ = mmove->player;
+  *p ++ = num_moves;
+  *p ++ = hostname_len;
+  PUT(p, extra_len);
+  PUT(p, mmove->seq);
+  PUT(p, mmove->b);
+  PUT(p, mmove->t_sent);
+  PUT(p, mmove->t_received);
+  PUT(p, mmove->t_replied);
+  PUT(p, mmove->board_hash);
+  PUT(p, mmove->score);
+
+  memcpy(p, mmove->xs, num_moves);
+  p += num_moves;
+  memcpy(p, mmove->ys, num_moves);
+  p += num_moves;
+  memcpy(p, mmove->types, num_moves);
+  p += num_moves;
+  memcpy(p, mmove->probs, num_moves * sizeof(float));
+  p += num_moves * sizeof(float);
+  memcpy(p, mmove->hostname, hostname_len);
+  p += hostname_len;
+  memcpy(p, mmove->extra, extra_len);
+  p += extra_len;
+  return p - buf;
+}
+
+BOOL PkgDecodeMove(const unsigned char *buf, int size, MMove *mmove) {
+  if (size < (int)MOVE_HEADER_BYTES || buf[0] != PKG_CODEC_VERSION) return FALSE;
+  memset(mmove, 0, sizeof(MMove));
+
+  const unsigned char *p = buf + 1;
+  unsigned char flags = *p ++;
+  mmove->error = (flags & MOVE_FLAG_ERROR) ? TRUE : FALSE;
+  mmove->has_score = (flags & MOVE_FLAG_HAS_SCORE) ? TRUE : FALSE;
+  mmove->player = *p ++;
+  int num_moves = *p ++;
+  int hostname_len = *p ++;
+  unsigned short extra_len;
+  GET(p, extra_len);
+  if (num_moves > NUM_FIRST_MOVES || hostname_len >= (int)sizeof(mmove->hostname) || extra_len > MAX_CUSTOM_DATA) return FALSE;
+  if (size < (int)(MOVE_HEADER_BYTES + num_moves * (3 + sizeof(float)) + hostname_len + extra_len)) return FALSE;
+
+  GET(p, mmove->seq);
+  GET(p, mmove->b);
+  GET(p, mmove->t_sent);
+  GET(p, mmove->t_received);
+  GET(p, mmove->t_replied);
+  GET(p, mmove->board_hash);
+  GET(p, mmove->score);
+
+  memcpy(mmove->xs, p, num_moves);
+  p += num_moves;
+  memcpy(mmove->ys, p, num_moves);
+  p += num_moves;
+  memcpy(mmove->types, p, num_moves);
+  p += num_moves;
+  memcpy(mmove->probs, p, num_moves * sizeof(float));
+  p += num_moves * sizeof(float);
+  memcpy(mmove->hostname, p, hostname_len);
+  p += hostname_len;
+  memcpy(mmove->extra, p, extra_len);
+  return TRUE;
+}
@@ -0,0 +1,60 @@
+//
+// Copyright (c) 2016-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+//
+
+#ifndef _PACKAGE_CODEC_H_
+#define _PACKAGE_CODEC_H_
+
+// Included without the path so that ffi_include (utils.lua) sees the same file as the exchanger headers.
+#include "package.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Compact wire encoding of MBoard/MMove.
+// A board is sent as a small header (seq, b, t_sent, hash, ply, ko, last moves, captures, priority), 2-bit stone planes
+// and one byte of age (ply - last_placed, capped at 255) for each stone. The decoder rebuilds groups and liberties.
+// A board can also be sent as a delta: the id of an earlier request (parent_b, with the same seq) and the move played on it.
+// The receiver replays the move on its copy of the parent board, so it has to keep the recent boards (see cnn_shm_exchanger.c).
+// A move only carries the candidate moves up to the last non-empty one, the hostname, and (if asked) the extra data.
+// Fields are in the native byte order. Bump PKG_CODEC_VERSION whenever the layout changes.
+#define PKG_CODEC_VERSION 3
+
+// Kind of an encoded board.
+#define PKG_BOARD_FULL 0
+#define PKG_BOARD_DELTA 1
+
+// Max #bytes of an encoded board/move.
+#define PKG_MAX_BOARD_BYTES 512
+#define PKG_MAX_MOVE_BYTES 768
+
+// Return #bytes written to buf (at most PKG_MAX_BOARD_BYTES).
+int PkgEncodeBoard(const MBoard *mboard, unsigned char *buf);
+// Return FALSE if the message is truncated, is a delta, has a different version or its stones are not a legal position.
+BOOL PkgDecodeBoard(const unsigned char *buf, int size, MBoard *mboard);
+
+// Encode the board as the move m (not a pass) played on the board of the request parent_b. Return #bytes written to buf.
+int PkgEncodeBoardDelta(const MBoard *mboard, uint64_t parent_b, Coord m, unsigned char *buf);
+// Return the kind of an encoded board, -1 if it is invalid. For a delta, *parent_b is set.
+int PkgBoardKind(const unsigned char *buf, int size, uint64_t *parent_b);
+// Only decode the id of an encoded board (full or delta): seq, b, t_sent and board._hash. Return FALSE if it is invalid.
+BOOL PkgDecodeBoardId(const unsigned char *buf, int size, MBoard *mboard);
+// parent is the board of request parent_b. Return FALSE if the move cannot be played on it, or the result has a different hash.
+BOOL PkgDecodeBoardDelta(const unsigned char *buf, int size, const Board *parent, MBoard *mboard);
+
+// extra is only sent if with_extra is TRUE (e.g., for the online model), otherwise the decoded extra is zero.
+// Return #bytes written to buf (at most PKG_MAX_MOVE_BYTES).
+int PkgEncodeMove(const MMove *mmove, BOOL with_extra, unsigned char *buf);
+BOOL PkgDecodeMove(const unsigned char *buf, int size, MMove *mmove);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,179 @@
+//
+// Copyright (c) 2016-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+//
+
+#include "package_codec.h"
+#include "common.h"
+#include "../board/board.h"
+#include <stdio.h>
+#include <string.h>
+
+// Play random games. At each position, the board has to come back the same from its full encoding, and from its delta
+// on the previous position. Moves are checked with and without the extra data.
+#define NUM_GAMES 100
+#define MAX_PLY 400
+
+// The decoder rebuilds the groups, so their ids and the order of their stones may differ from the original board.
+// Compare what they mean instead: stones, their age (only kept up to 255 moves), and the size and liberties of their groups.
+static BOOL same_position(const Board *b1, const Board *b2) {
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      const Info *info1 = &b1->_infos[OFFSETXY(i, j)], *info2 = &b2->_infos[OFFSETXY(i, j)];
+      if (info1->color != info2->color) return FALSE;
+      if (! HAS_STONE(info1->color)) continue;
+      if (b1->_ply - info1->last_placed < 255 && info1->last_placed != info2->last_placed) return FALSE;
+      const Group *g1 = &b1->_groups[info1->id], *g2 = &b2->_groups[info2->id];
+      if (g1->color != g2->color || g1->stones != g2->stones || g1->liberties != g2->liberties) return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static void check_board(const MBoard *expected, const MBoard *decoded, const char *kind) {
+  const Board *b1 = &expected->board, *b2 = &decoded->board;
+  if (decoded->seq != expected->seq || decoded->b != expected->b || decoded->t_sent != expected->t_sent || decoded->priority != expected->priority) {
+    error("%s: ids differ! seq %ld/%ld, b %lx/%lx", kind, expected->seq, decoded->seq, expected->b, decoded->b);
+  }
+  if (! same_position(b1, b2) || b1->_ply != b2->_ply || b1->_next_player != b2->_next_player || b1->_simple_ko != b2->_simple_ko
+      || b1->_simple_ko_color != b2->_simple_ko_color || b1->_last_move != b2->_last_move || b1->_last_move2 != b2->_last_move2
+      || b1->_ko_age != b2->_ko_age || b1->_b_cap != b2->_b_cap || b1->_w_cap != b2->_w_cap) {
+    ShowBoard(b1, SHOW_LAST_MOVE);
+    ShowBoard(b2, SHOW_LAST_MOVE);
+    error("%s: boards differ at ply %d!", kind, b1->_ply);
+  }
+  if (GetBoardHash(b2) != GetBoardHash(b1) || ComputeBoardHash(b2) != GetBoardHash(b1)) {
+    error("%s: hash mismatch at ply %d! expected = %lx, decoded = %lx", kind, b1->_ply, GetBoardHash(b1), GetBoardHash(b2));
+  }
+}
+
+static void check_full(const MBoard *mboard) {
+  unsigned char buf[PKG_MAX_BOARD_BYTES];
+  uint64_t parent_b = 0;
+  MBoard decoded;
+
+  int size = PkgEncodeBoard(mboard, buf);
+  if (size <= 0 || size > PKG_MAX_BOARD_BYTES) error("Full: bad size %d!", size);
+  if (PkgBoardKind(buf, size, &parent_b) != PKG_BOARD_FULL) error("Full: wrong kind!");
+  if (! PkgDecodeBoard(buf, size, &decoded)) error("Full: cannot decode at ply %d!", mboard->board._ply);
+  check_board(mboard, &decoded, "Full");
+  // Truncated messages are rejected.
+  if (PkgDecodeBoard(buf, size - 1, &decoded)) error("Full: a truncated message is decoded!");
+}
+
+// Stones that cannot come from a game (a black stone in the corner without liberty) are rejected, not decoded.
+static void check_illegal() {
+  unsigned char buf[PKG_MAX_BOARD_BYTES];
+  MBoard mboard, decoded;
+  memset(&mboard, 0, sizeof(mboard));
+  ClearBoard(&mboard.board);
+  mboard.board._infos[OFFSETXY(0, 0)].color = S_BLACK;
+  mboard.board._infos[OFFSETXY(0, 1)].color = S_WHITE;
+  mboard.board._infos[OFFSETXY(1, 0)].color = S_WHITE;
+
+  int size = PkgEncodeBoard(&mboard, buf);
+  if (PkgDecodeBoard(buf, size, &decoded)) error("Illegal: a position with a dead group is decoded!");
+}
+
+static void check_delta(const MBoard *mboard, const Board *parent, uint64_t parent_b, Coord m) {
+  unsigned char buf[PKG_MAX_BOARD_BYTES];
+  uint64_t b = 0;
+  MBoard decoded;
+
+  int size = PkgEncodeBoardDelta(mboard, parent_b, m, buf);
+  if (size <= 0 || size > PKG_MAX_BOARD_BYTES) error("Delta: bad size %d!", size);
+  if (PkgBoardKind(buf, size, &b) != PKG_BOARD_DELTA || b != parent_b) error("Delta: wrong kind or parent!");
+  // A delta is not a full board.
+  if (PkgDecodeBoard(buf, size, &decoded)) error("Delta: decoded as a full board!");
+
+  if (! PkgDecodeBoardId(buf, size, &decoded)) error("Delta: cannot decode the id!");
+  if (decoded.seq != mboard->seq || decoded.b != mboard->b || decoded.board._hash != GetBoardHash(&mboard->board)) error("Delta: wrong id!");
+
+  if (! PkgDecodeBoardDelta(buf, size, parent, &decoded)) error("Delta: cannot decode at ply %d!", mboard->board._ply);
+  check_board(mboard, &decoded, "Delta");
+}
+
+static void check_move(unsigned long *seed, uint64_t *seed64, BOOL with_extra) {
+  unsigned char buf[PKG_MAX_MOVE_BYTES];
+  MMove mmove, decoded;
+  memset(&mmove, 0, sizeof(mmove));
+
+  mmove.seq = fast_random(seed, 1000) + 1;
+  mmove.b = fast_random64(seed64);
+  mmove.t_sent = 1.5;
+  mmove.t_received = 2.25;
+  mmove.t_replied = 3.125;
+  strcpy(mmove.hostname, "localhost");
+  mmove.player = S_BLACK + fast_random(seed, 2);
+  mmove.error = fast_random(seed, 10) == 0;
+  // Leave the tail empty from time to time.
+  int n = fast_random(seed, NUM_FIRST_MOVES + 1);
+  for (int i = 0; i < n; ++i) {
+    mmove.xs[i] = fast_random(seed, BOARD_SIZE) + 1;
+    mmove.ys[i] = fast_random(seed, BOARD_SIZE) + 1;
+    mmove.probs[i] = 1.0 / (i + 2);
+    mmove.types[i] = fast_random(seed, 2) ? MOVE_NORMAL : MOVE_SIMPLE_KO;
+  }
+  for (int i = 0; i < MAX_CUSTOM_DATA; ++i) mmove.extra[i] = (char)fast_random(seed, 256);
+  mmove.board_hash = mmove.b * 31;
+  mmove.has_score = fast_random(seed, 2);
+  mmove.score = mmove.has_score ? 7.5 : 0;
+
+  int size = PkgEncodeMove(&mmove, with_extra, buf);
+  if (size <= 0 || size > PKG_MAX_MOVE_BYTES) error("Move: bad size %d!", size);
+  if (! PkgDecodeMove(buf, size, &decoded)) error("Move: cannot decode!");
+
+  if (! with_extra) memset(mmove.extra, 0, sizeof(mmove.extra));
+  if (memcmp(&mmove, &decoded, sizeof(MMove)) != 0) error("Move: decoded move differs (with_extra = %d, #moves = %d)!", with_extra, n);
+}
+
+int main() {
+  unsigned long seed = 1;
+  uint64_t seed64 = 1;
+  AllMoves all_moves;
+  GroupId4 ids;
+  MBoard mboard, prev;
+  int num_checked = 0;
+
+  memset(&mboard, 0, sizeof(mboard));
+  memset(&prev, 0, sizeof(prev));
+
+  for (int i = 0; i < NUM_GAMES; ++i) {
+    ClearBoard(&mboard.board);
+    mboard.seq = i + 1;
+    BOOL has_prev = FALSE;
+    Coord m_prev = M_PASS;
+
+    while (mboard.board._ply < MAX_PLY && ! IsGameEnd(&mboard.board)) {
+      mboard.b = fast_random64(&seed64);
+      mboard.t_sent = num_checked * 0.5;
+      mboard.priority = fast_random(&seed, 4);
+
+      check_full(&mboard);
+      // Passes cannot be sent as deltas.
+      if (has_prev && m_prev != M_PASS) check_delta(&mboard, &prev.board, prev.b, m_prev);
+      num_checked ++;
+
+      FindAllValidMoves(&mboard.board, mboard.board._next_player, &all_moves);
+      Coord m = M_PASS;
+      if (all_moves.num_moves > 0 && fast_random(&seed, 20) > 0) m = all_moves.moves[fast_random(&seed, all_moves.num_moves)];
+      if (! TryPlay2(&mboard.board, m, &ids)) continue;
+
+      prev = mboard;
+      has_prev = TRUE;
+      m_prev = m;
+      Play(&mboard.board, &ids);
+    }
+  }
+
+  check_illegal();
+  for (int i = 0; i < 1000; ++i) check_move(&seed, &seed64, i % 2 == 0);
+
+  printf("#boards checked = %d\n", num_checked);
+  printf("All passed\n");
+  return 0;
+}
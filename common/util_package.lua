@@ -18,7 +18,6 @@ local symbols, s = utils.ffi_include(paths.concat(common.script_path(), "package
 
 local num_first_move = tonumber(symbols.NUM_FIRST_MOVES)
 local sig_restart = tonumber(symbols.SIG_RESTART)
-local sig_finishsoon = tonumber(symbols.SIG_FINISHSOON)
 local sig_ok = tonumber(symbols.SIG_OK)
 local move_normal = tonumber(symbols.MOVE_NORMAL)
 local move_simple_ko = tonumber(symbols.MOVE_SIMPLE_KO)
@@ -44,6 +43,15 @@ function util_pkg.init(max_batch, feature_type)
     util_pkg.features = { }
     util_pkg.t_received = { }
 
+    -- For batched feature extraction.
+    util_pkg.batch_supported = goutils.is_feature_batch_supported(util_pkg.opt)
+    util_pkg.batch_boards = ffi.new("const Board*[?]", max_batch)
+    util_pkg.batch_ranks = { }
+    for i = 1, max_batch do
+        util_pkg.batch_ranks[i] = '9d'
+    end
+    util_pkg.batch_features = torch.FloatTensor()
+
     local boards = ffi.new("MBoard*[?]", max_batch)
     local moves = ffi.new("MMove*[?]", max_batch)
     local anchor = {}  -- prevent gc
@@ -77,10 +85,9 @@ function util_pkg.get_moves()
     return util_pkg.moves
 end
 
-function util_pkg.extract_board_feature(k)
+local function receive_board(k)
     -- utils.dprint("Start waiting on board")
     local mboard = util_pkg.boards[k - 1]
-    local t_received = common.wallclock()
     local player = mboard.board._next_player
     -- print("GetBoard return, result = " .. ret)
     curr_seq = math.max(tonumber(mboard.seq), curr_seq)
@@ -90,14 +97,48 @@ function util_pkg.extract_board_feature(k)
         board.show(mboard.board, "last_move")
             -- require 'fb.debugger'.enter()
     end
+    util_pkg.t_received[k] = common.wallclock()
+    return mboard, player
+end
+
+local function extract_one(k)
+    local mboard, player = receive_board(k)
     local feature, named_features = goutils.extract_feature(mboard.board, player, util_pkg.opt, '9d') 
     -- Save feature for future use.
     util_pkg.features[k] = named_features 
-    util_pkg.t_received[k] = t_received
-    return feature:cuda()
+    return feature
+end
+
+function util_pkg.extract_board_feature(k)
+    return extract_one(k):cuda()
     -- return tonumber(mboard.seq), tonumber(mboard.b)
 end
 
+-- Extract features of slots block_ids[1..n] into one n x dim x 19 x 19 FloatTensor (reused across calls).
+function util_pkg.extract_board_features_batch(block_ids, n)
+    if not util_pkg.batch_supported then
+        -- Legacy features, extract one by one.
+        local output
+        for j = 1, n do
+            local feature = extract_one(block_ids[j])
+            if output == nil then
+                output = util_pkg.batch_features:resize(n, unpack(feature:size():totable()))
+            end
+            output[j]:copy(feature)
+        end
+        return output
+    end
+
+    for j = 1, n do
+        local k = block_ids[j]
+        local mboard = receive_board(k)
+        -- prepare_move will read the stones from the board directly.
+        util_pkg.features[k] = nil
+        util_pkg.batch_boards[j - 1] = mboard.board
+    end
+    return goutils.extract_feature_batch(util_pkg.batch_boards, nil, n, util_pkg.opt, util_pkg.batch_ranks, nil, 0, util_pkg.batch_features)
+end
+
 function util_pkg.prepare_move(k, sortProb, sortInd, score)
     -- If they are invalid situations, do not send.
     utils.dprint("Start sending move")
@@ -108,7 +149,7 @@ function util_pkg.prepare_move(k, sortProb, sortInd, score)
     local player = mboard.board._next_player
 
     mmove.t_sent = mboard.t_sent
-    -- mmove.board_hash = mboard.board.hash
+    mmove.board_hash = mboard.board._hash
     mmove.t_received = util_pkg.t_received[k] 
     mmove.t_replied = common.wallclock()
     mmove.hostname = hostname
@@ -187,9 +228,14 @@ function util_pkg.prepare_move(k, sortProb, sortInd, score)
     -- Add extra features, for now just the location of stones.
     utils.dprint("Add extra features")
     local f = util_pkg.features[k] 
+    -- Our stones: +1, opponent stones: -1 
+    local sent_feature
     if f ~= nil then
-        -- Our stones: +1, opponent stones: -1 
-        local sent_feature = f["our stones"] - f["opponent stones"]
+        sent_feature = f["our stones"] - f["opponent stones"]
+    else
+        sent_feature = board.get_stones(mboard.board, player) - board.get_stones(mboard.board, board.opponent(player))
+    end
+    if sent_feature ~= nil then
         sent_feature = sent_feature:view(-1)
         for i = 1, common.board_size * common.board_size do
             mmove.extra[i - 1] = sent_feature[i]
@@ -13,7 +13,7 @@ CPP_FLAGS="-O4 -fPIC -std=c++11 -I/usr/include/malloc/ -Wl,-export-dynamic"
 CXX=g++
 
 echo Compiling
-$CXX $CPP_FLAGS -I./common -c common/common.c common/comm.c common/comm_pipe.c 
+$CXX $CPP_FLAGS -I./common -c common/common.c common/comm.c common/comm_pipe.c common/package_codec.c 
 $CXX $CPP_FLAGS -I./common -I./board -c board/board.c board/default_policy.c board/default_policy_common.c board/pattern.c board/pattern_v2.c board/ownermap.c board/sample_pattern_v2.c 
 $CXX $CPP_FLAGS -I./common -I./board -c tsumego/rank_move.c 
 
@@ -23,8 +23,8 @@ $CXX $CPP_FLAGS -fpermissive -I./common -I./board -c pachi_tactics/tactics/1lib.
 echo Create moggy
 $CXX -shared -o libmoggy.so moggy.o board.o board_interface.o 1lib.o 2lib.o ladder.o nakade.o nlib.o selfatari.o pattern.o 
 
-$CXX $CPP_FLAGS -I./common -I./board -I./mctsv2 -c mctsv2/tree.c mctsv2/playout_multithread.c mctsv2/playout_callbacks.c mctsv2/event_count.cpp mctsv2/tree_search.c
-$CXX $CPP_FLAGS -I./common -c ./local_evaluator/cnn_local_exchanger.c
+$CXX $CPP_FLAGS -I./common -I./board -I./mctsv2 -c mctsv2/tree.c mctsv2/playout_multithread.c mctsv2/playout_callbacks.c mctsv2/event_count.cpp mctsv2/tree_search.c mctsv2/eval_cache.c
+$CXX $CPP_FLAGS -I./common -c ./local_evaluator/cnn_local_exchanger.c ./local_evaluator/cnn_shm_exchanger.c
 
 echo Create libboard and libcomm
 $CXX -shared -Wl,-export-dynamic -o libcommon.so common.o
@@ -35,13 +35,18 @@ $CXX -shared -Wl,-export-dynamic -o libpattern_v2.so pattern_v2.o board.o common
 $CXX -shared -Wl,-export-dynamic -o libcomm.so comm.o
 
 echo Create libplayout_multithread.so
-$CXX -shared -o libplayout_multithread.so tree.o playout_multithread.o board.o tree_search.o playout_callbacks.o common.o cnn_local_exchanger.o comm_pipe.o default_policy.o pattern.o pattern_v2.o default_policy_common.o rank_move.o event_count.o moggy.o board_interface.o 1lib.o 2lib.o ladder.o nakade.o nlib.o selfatari.o -lm
+$CXX -shared -o libplayout_multithread.so tree.o playout_multithread.o board.o tree_search.o eval_cache.o playout_callbacks.o common.o cnn_local_exchanger.o cnn_shm_exchanger.o comm_pipe.o package_codec.o default_policy.o pattern.o pattern_v2.o default_policy_common.o rank_move.o event_count.o moggy.o board_interface.o 1lib.o 2lib.o ladder.o nakade.o nlib.o selfatari.o -lm -lrt
 
 echo Create liblocalexchanger.so
-$CXX -shared -o liblocalexchanger.so comm_pipe.o cnn_local_exchanger.o board.o common.o -lm 
+$CXX -shared -o liblocalexchanger.so comm_pipe.o package_codec.o cnn_local_exchanger.o cnn_shm_exchanger.o board.o common.o -lm -lrt
 
 echo Compile all test codes
-$CXX $CPP_FLAGS -lm -pthread mctsv2/test_playout_multithread.c tree.o playout_multithread.o board.o common.o playout_callbacks.o comm_pipe.o event_count.o tree_search.o cnn_local_exchanger.o default_policy.o default_policy_common.o pattern.o pattern_v2.o rank_move.o moggy.o board_interface.o 1lib.o 2lib.o ladder.o nakade.o nlib.o selfatari.o -I./common -I./board -o test_playout_multithread
+$CXX $CPP_FLAGS -lm -pthread mctsv2/test_playout_multithread.c tree.o playout_multithread.o board.o common.o playout_callbacks.o comm_pipe.o package_codec.o event_count.o tree_search.o eval_cache.o cnn_local_exchanger.o cnn_shm_exchanger.o default_policy.o default_policy_common.o pattern.o pattern_v2.o rank_move.o moggy.o board_interface.o 1lib.o 2lib.o ladder.o nakade.o nlib.o selfatari.o -lrt -I./common -I./board -o test_playout_multithread
+$CXX $CPP_FLAGS -lm -pthread mctsv2/test_parked_cancel.c tree.o playout_multithread.o board.o common.o playout_callbacks.o comm_pipe.o package_codec.o event_count.o tree_search.o eval_cache.o cnn_local_exchanger.o cnn_shm_exchanger.o default_policy.o default_policy_common.o pattern.o pattern_v2.o rank_move.o moggy.o board_interface.o 1lib.o 2lib.o ladder.o nakade.o nlib.o selfatari.o -lrt -I./common -I./board -o test_parked_cancel
+$CXX $CPP_FLAGS -pthread mctsv2/test_eval_cache.c eval_cache.o common.o -lm -I./common -I./board -I./mctsv2 -o test_eval_cache
+$CXX $CPP_FLAGS board/test_board.c board.o common.o -lm -I./common -I./board -o test_board
+$CXX $CPP_FLAGS common/test_package_codec.c package_codec.o board.o common.o -lm -I./common -I./board -o test_package_codec
+$CXX $CPP_FLAGS -pthread local_evaluator/test_exchanger.c comm_pipe.o package_codec.o cnn_local_exchanger.o cnn_shm_exchanger.o board.o common.o -lm -lrt -I./common -I./board -o test_exchanger
 
 echo Put all .so file into directory so that lua could load
 DEST_DIR=./libs
@@ -31,6 +31,11 @@ local opt = pl.lapp[[
   --pipe_path (default "./")                 Path for pipe file. Default is in the current directory, i.e., go/mcts
   --codename  (default "darkfores2")         Code name for the model to load.
   --use_local_model                          If true, load the local model. 
+  --shm                                      Use shared memory instead of pipes (the client needs --server_type shm).
+  --credits (default 0)                      Max #boards in flight per client. 0 means twice the batch size.
+  --target_latency (default 2000)            A batch is evaluated at most that long (in microseconds) after its first board is sent, even if it is not full.
+  --batch_size (default 0)                   Batch size. 0 means adaptive: the one with the best throughput within --latency_cap.
+  --latency_cap (default 50000)              Max time (in microseconds) to evaluate a batch, for the adaptive batch size.
 ]]
 
 print("GPU used: " .. opt.gpu)
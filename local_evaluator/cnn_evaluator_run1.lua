@@ -22,14 +22,91 @@ local util_pkg = require 'common.util_package'
 -- local symbols, s = utils.ffi_include(paths.concat(common.lib_path, "local_evaluator/cnn_local_exchanger.h"))
 local script_path = common.script_path()
 local symbols, s = utils.ffi_include(paths.concat(script_path, "cnn_local_exchanger.h"))
+utils.ffi_include(paths.concat(script_path, "cnn_shm_exchanger.h"))
+-- Compact encoding used by the shm transport (PkgEncodeBoard/PkgDecodeBoard, etc. are exported by liblocalexchanger.so).
+utils.ffi_include(paths.concat(script_path, "../common/package_codec.h"))
 local C = ffi.load(paths.concat(script_path, "../libs/liblocalexchanger.so"))
 
-local sig_ok = tonumber(symbols.SIG_OK)
+-- Pick the transport. Both have the same interface.
+local ex_prefix = opt_internal.shm and "ExShm" or "ExLocal"
+local ExInit = C[ex_prefix .. "Init"]
+local ExDestroy = C[ex_prefix .. "Destroy"]
+local ExServerGetBatch = C[ex_prefix .. "ServerGetBatch"]
+local ExServerSendMoves = C[ex_prefix .. "ServerSendMoves"]
+local ExServerSendAckIfNecessary = C[ex_prefix .. "ServerSendAckIfNecessary"]
+local ExServerIsRestarting = C[ex_prefix .. "ServerIsRestarting"]
+local ExServerSetCredits = C[ex_prefix .. "ServerSetCredits"]
+
 local max_batch = opt_internal.async and 128 or 32 
 
--- number of attempt before wait_board gave up and return nil.
--- previously this number is indefinite, i.e., wait until there is a package (which might cause deadlock).
-local num_attempt = 10
+-- Each client may have that many boards in flight, so that a full batch can be queued while the previous one is evaluated.
+local credits = opt_internal.credits > 0 and opt_internal.credits or 2 * max_batch
+
+-- Batch size. Unless it is fixed by --batch_size, the time to evaluate a batch and the number of boards actually in it
+-- are measured online for each size (rounded up to a power of 2), and we pick the size with the most evaluations per second
+-- whose evaluation time is within the latency cap. The next larger size is only tried once the batches of the largest
+-- measured size are (nearly) full, i.e., when the load can fill it. Until then its time is extrapolated linearly.
+local batch_sizes = { }
+local size = 1
+while size < max_batch do
+    table.insert(batch_sizes, size)
+    size = 2 * size
+end
+table.insert(batch_sizes, max_batch)
+local batch_time = { }
+local batch_count = { }
+local latency_cap = opt_internal.latency_cap * 1e-6
+
+local function batch_bucket(n)
+    for _, b in ipairs(batch_sizes) do
+        if b >= n then return b end
+    end
+    return max_batch
+end
+
+local function update_batch_time(n, t)
+    local b = batch_bucket(n)
+    batch_time[b] = batch_time[b] and 0.9 * batch_time[b] + 0.1 * t or t
+    batch_count[b] = batch_count[b] and 0.9 * batch_count[b] + 0.1 * n or n
+end
+
+-- Time to evaluate a batch of size b, extrapolated from the largest smaller size if it is not measured yet (nil if nothing is).
+local function estimate_batch_time(b)
+    if batch_time[b] then return batch_time[b] end
+    local t
+    for _, s in ipairs(batch_sizes) do
+        if s >= b then break end
+        if batch_time[s] then t = batch_time[s] * b / batch_count[s] end
+    end
+    return t
+end
+
+local function pick_batch_size()
+    if opt_internal.batch_size > 0 then return math.min(opt_internal.batch_size, max_batch) end
+    local best, best_rate, largest = nil, 0, nil
+    for i, b in ipairs(batch_sizes) do
+        local t = batch_time[b]
+        if t then
+            largest = i
+            if t <= latency_cap and batch_count[b] / t > best_rate then
+                best, best_rate = b, batch_count[b] / t
+            end
+        end
+    end
+    -- Nothing measured yet, start with the smallest batch.
+    if largest == nil then return batch_sizes[1] end
+    local b, next_b = batch_sizes[largest], batch_sizes[largest + 1]
+    if next_b and batch_count[b] >= 0.9 * b and estimate_batch_time(next_b) <= latency_cap then return next_b end
+    -- If even the smallest is too slow, use it anyway.
+    return best or batch_sizes[1]
+end
+
+-- How long the first board of a batch waits for the rest: at most the target latency, and the batch still has to be
+-- evaluated within the latency cap.
+local function batch_deadline_us(b)
+    local t = estimate_batch_time(b) or 0
+    return math.max(0, math.min(opt_internal.target_latency, math.floor((latency_cap - t) * 1e6)))
+end
 
 cutorch.setDevice(opt_internal.gpu)
 local model_filename = common.codenames[opt_internal.codename].model_name
@@ -44,16 +121,21 @@ local model = torch.load(model_filename)
 print("Loading complete")
 
 -- Server side. 
-local ex = C.ExLocalInit(opt_internal.pipe_path, opt_internal.gpu - 1, common.TRUE) 
+local ex = ExInit(opt_internal.pipe_path, opt_internal.gpu - 1, common.TRUE) 
+ExServerSetCredits(ex, credits)
 print("CNN Exchanger initialized.")
+print(string.format("Credits: %d, target latency: %d us", credits, opt_internal.target_latency))
 print("Size of MBoard: " .. ffi.sizeof('MBoard'))
 print("Size of MMove: " .. ffi.sizeof('MMove'))
+print(string.format("Encoding version: %d, max size of encoded MBoard: %d, MMove: %d", symbols.PKG_CODEC_VERSION, symbols.PKG_MAX_BOARD_BYTES, symbols.PKG_MAX_MOVE_BYTES))
 board.print_info()
 
 -- [board_idx, received time]
 local block_ids = torch.DoubleTensor(max_batch) 
 local sortProb = torch.FloatTensor(max_batch, common.board_size * common.board_size)
 local sortInd = torch.FloatTensor(max_batch, common.board_size * common.board_size)
+-- Replies of one batch, sent back in one call.
+local send_moves = ffi.new("MMove*[?]", max_batch)
 
 util_pkg.init(max_batch, feature_type)
 -- util_pkg.dbg_set()
@@ -77,31 +159,33 @@ while true do
 
     -- Start the cycle.
     -- local start = common.wallclock()
-    for i = 1, max_batch do
+    -- Wait for the first board, then fill the batch until it is full or the deadline is reached.
+    local batch_size = pick_batch_size()
+    local n = ExServerGetBatch(ex, util_pkg.boards, batch_size, batch_deadline_us(batch_size))
+    local batch_start = common.wallclock()
+    for i = 1, n do
         local mboard = util_pkg.boards[i - 1]
-        -- require 'fb.debugger'.enter()
-        local ret = C.ExLocalServerGetBoard(ex, mboard, num_attempt)
-        -- require 'fb.debugger'.enter()
-        if ret == sig_ok and mboard.seq ~= 0 and mboard.b ~= 0 then 
-            local feature = util_pkg.extract_board_feature(i)
-            if feature ~= nil then
-                local nplane, h, w = unpack(feature:size():totable())
-                if all_features == nil then
-                    all_features = torch.CudaTensor(max_batch, nplane, h, w):zero()
-                    probs_cuda = torch.CudaTensor(max_batch, h*w)
-                    sortProb_cuda = torch.CudaTensor(max_batch, h*w)
-                    sortInd_cuda = torch.CudaLongTensor(max_batch, h*w)
-                end
-                num_valid = num_valid + 1
-                all_features[num_valid]:copy(feature)
-                block_ids[num_valid] = i
-            end
+        if mboard.seq ~= 0 and mboard.b ~= 0 then 
+            num_valid = num_valid + 1
+            block_ids[num_valid] = i
+        end
+    end
+    -- Extract the features of all valid boards at once, and send them to GPU in one copy.
+    if num_valid > 0 then
+        local features = util_pkg.extract_board_features_batch(block_ids, num_valid)
+        if all_features == nil then
+            local _, nplane, h, w = unpack(features:size():totable())
+            all_features = torch.CudaTensor(max_batch, nplane, h, w):zero()
+            probs_cuda = torch.CudaTensor(max_batch, h*w)
+            sortProb_cuda = torch.CudaTensor(max_batch, h*w)
+            sortInd_cuda = torch.CudaLongTensor(max_batch, h*w)
         end
+        all_features:sub(1, num_valid):copy(features)
     end
     -- print(string.format("Collect data = %f", common.wallclock() - start))
     -- Now all data are ready, run the model.
-    if C.ExLocalServerIsRestarting(ex) == common.FALSE and all_features ~= nil and num_valid > 0 then 
-        print(string.format("Valid sample = %d / %d", num_valid, max_batch)) 
+    if ExServerIsRestarting(ex) == common.FALSE and all_features ~= nil and num_valid > 0 then 
+        print(string.format("Valid sample = %d / %d", num_valid, batch_size)) 
         util_pkg.dprint("Start evaluation...")
         local start = common.wallclock()
         local output = model:forward(all_features:sub(1, num_valid))
@@ -141,15 +225,17 @@ while true do
         -- sortProb:copy(sortProb_cuda[{{}, {1, num_first_move}}])
         -- sortInd:copy(sortInd_cuda[{{}, {1, num_first_move}}])
         print(string.format("Computation = %f", common.wallclock() - start))
+        -- Features and evaluation, without the time to send the moves back (which depends on the client).
+        update_batch_time(num_valid, common.wallclock() - batch_start)
 
         local start = common.wallclock()
         -- Send them back.
         for k = 1, num_valid do
-            local mmove = util_pkg.prepare_move(block_ids[k], sortProb[k], sortInd[k], score and score[k]) 
-            util_pkg.dprint("Actually send move")
-            C.ExLocalServerSendMove(ex, mmove)
-            util_pkg.dprint("After send move")
+            send_moves[k - 1] = util_pkg.prepare_move(block_ids[k], sortProb[k], sortInd[k], score and score[k]) 
         end
+        util_pkg.dprint("Actually send moves")
+        ExServerSendMoves(ex, send_moves, num_valid)
+        util_pkg.dprint("After send moves")
         print(string.format("Send back = %f", common.wallclock() - start))
 
     end
@@ -157,9 +243,9 @@ while true do
     util_pkg.sparse_gc()
 
     -- Send control message if necessary. 
-    if C.ExLocalServerSendAckIfNecessary(ex) == common.TRUE then
+    if ExServerSendAckIfNecessary(ex) == common.TRUE then
         print("Ack signal sent!")
     end
 end
 
-C.ExLocalDestroy(ex)
+ExDestroy(ex)
@@ -19,9 +19,6 @@
 void *ExClientInit(const char tier_name[100]) { return NULL; }
 void ExClientDestroy(void *) { }
 
-//
-int ExClientSetMaxWaitCount(void *ctx, int n) { return 0; }
-
 // Send board (not blocked)
 BOOL ExClientSendBoard(void *ctx, MBoard *board) { return TRUE; }
 
@@ -31,12 +28,6 @@ BOOL ExClientGetMove(void *ctx, MMove *move) { return TRUE; }
 // Send restart signal (in block mode) once the search is over
 BOOL ExClientSendRestart(void *ctx) { return TRUE; }
 
-BOOL ExClientIncWaitCount(void *ctx, BOOL send_if_needed) { return TRUE; }
-
-BOOL ExClientDecWaitCount(void *ctx) { return TRUE; }
-
-BOOL ExClientSendFinishSoon(void *ctx) { return TRUE; }
-
 // Blocked wait until ack is received.
 BOOL ExClientWaitAck(void *ctx) { return TRUE; }
 
@@ -9,6 +9,10 @@
 
 #include "cnn_local_exchanger.h"
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <limits.h>
 #include "../common/comm_pipe.h"
 #include "../common/common.h"
 #include <pthread.h>
@@ -25,11 +29,16 @@
 #define PIPE_S2C 3
 
 #define PIPE_PREFIX "./pipe"
+
+// A board has to fit in PIPE_BUF to be written atomically (see MAX_GROUP).
+typedef char mboard_fits_in_pipe_buf[sizeof(MBoard) <= PIPE_BUF ? 1 : -1];
+// Max #boards waiting in the priority queue of the server.
 #define QUEUE_SIZE 10000
 
-// Several kind of messages. The first element has to be long
-// Message 1: board
-#define PR_HIGHEST 100
+// Blocked waits time out every so often to check whether the exchanger is done.
+#define WAIT_MS 100
+// Max #messages in one batched call.
+#define MAX_BATCH 256
 
 // Exchanger. Save all the context.
 typedef struct {
@@ -38,23 +47,42 @@ typedef struct {
   BOOL is_server;
   // server parameters.
   // Control flag.
-  //      Bit FINISHSOON: the server should finish the computation soon.
   //      Bit GET_RESTART: we are restarting the thread.
   unsigned char ctrl_flag;
+  // Server side: signaled whenever ctrl_flag is raised, so that a server blocked on a pipe wakes up.
+  int event_fd;
   volatile BOOL done;
   //
   pthread_t ctrl;
+  pthread_t message;
   // Some stats.
   int board_received;
   int move_sent;
-
-  // Client side: wait count. #thread that are waiting on the response.
-  // For each server to connect from, we have a counter (how many threads are waiting for it.)
-  // If the counter reach #threads for this server, send a finishsoon command so that things could move forward.
-  int wait_count;
-  int wait_count_max;
-  // Queue
-  // Queue q;
+  // Boards with seq < min_seq are dropped (see ExLocalClientSetMinSeq). board_cancelled is protected by q_lock.
+  volatile long min_seq;
+  int board_cancelled;
+
+  // Flow control (see SIG_CREDIT). Server side: the advertised credits. Client side: the latest value advertised by the server.
+  volatile int credits;
+  // Client side: ACKs read from the server channel while looking for credits (see ExLocalClientWaitAck).
+  int num_acks;
+  pthread_mutex_t s2c_lock;
+
+  // Server side: the message thread drains the board pipe into a priority queue, a max heap of slots of q_boards
+  // ordered by (priority, arrival order). q_cond is signaled when boards are pushed or ctrl_flag is raised.
+  pthread_mutex_t q_lock;
+  pthread_cond_t q_cond;
+  MBoard *q_boards;
+  uint64_t *q_order;
+  int *q_heap;
+  int q_size;
+  int *q_free;
+  int q_num_free;
+  uint64_t q_next_order;
+  // The message thread is the only reader of the board pipe, except when boards are discarded on restart.
+  // pipe_lock serializes the two, and boards read before a discard (a different generation) are dropped.
+  pthread_mutex_t pipe_lock;
+  int q_generation;
 } Exchanger;
 
 // Message 3: control information
@@ -64,36 +92,177 @@ typedef struct {
   int code;
 } MCtrl;
 
-/*
+// Priority queue. All functions below are called with q_lock held.
+static inline BOOL queue_before(const Exchanger *ex, int i, int j) {
+  int pi = ex->q_boards[i].priority, pj = ex->q_boards[j].priority;
+  return pi > pj || (pi == pj && ex->q_order[i] < ex->q_order[j]);
+}
+
+static void queue_push(Exchanger *ex, int slot) {
+  ex->q_order[slot] = ex->q_next_order ++;
+  int k = ex->q_size ++;
+  while (k > 0 && queue_before(ex, slot, ex->q_heap[(k - 1) / 2])) {
+    ex->q_heap[k] = ex->q_heap[(k - 1) / 2];
+    k = (k - 1) / 2;
+  }
+  ex->q_heap[k] = slot;
+}
+
+// Pop the top slot. The caller puts it back to q_free once the board is copied.
+static int queue_pop(Exchanger *ex) {
+  int top = ex->q_heap[0];
+  int last = ex->q_heap[-- ex->q_size];
+  int k = 0;
+  while (1) {
+    int c = 2 * k + 1;
+    if (c >= ex->q_size) break;
+    if (c + 1 < ex->q_size && queue_before(ex, ex->q_heap[c + 1], ex->q_heap[c])) c ++;
+    if (! queue_before(ex, ex->q_heap[c], last)) break;
+    ex->q_heap[k] = ex->q_heap[c];
+    k = c;
+  }
+  ex->q_heap[k] = last;
+  return top;
+}
+
+// Return all queued boards to the free list. Return #boards dropped.
+static int queue_clear(Exchanger *ex) {
+  int n = ex->q_size;
+  for (int i = 0; i < n; ++i) ex->q_free[ex->q_num_free ++] = ex->q_heap[i];
+  ex->q_size = 0;
+  return n;
+}
+
+static inline BOOL is_cancelled(const Exchanger *ex, const MBoard *mboard) {
+  return mboard->seq < __atomic_load_n(&ex->min_seq, __ATOMIC_RELAXED);
+}
+
+// Take up to max_n boards with the highest priority. Cancelled boards are dropped.
+static int queue_get_boards(Exchanger *ex, MBoard **mboards, int max_n) {
+  pthread_mutex_lock(&ex->q_lock);
+  // The message thread waits for free slots if the queue was full.
+  BOOL was_full = ex->q_num_free == 0;
+  int n = 0;
+  while (n < max_n && ex->q_size > 0) {
+    int slot = queue_pop(ex);
+    if (is_cancelled(ex, &ex->q_boards[slot])) ex->board_cancelled ++;
+    else memcpy(mboards[n ++], &ex->q_boards[slot], sizeof(MBoard));
+    ex->q_free[ex->q_num_free ++] = slot;
+  }
+  if (was_full && n > 0) pthread_cond_broadcast(&ex->q_cond);
+  pthread_mutex_unlock(&ex->q_lock);
+  return n;
+}
+
+static void wait_cond(pthread_cond_t *cond, pthread_mutex_t *lock, int timeout_us) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += (long)timeout_us * 1000;
+  ts.tv_sec += ts.tv_nsec / 1000000000;
+  ts.tv_nsec %= 1000000000;
+  pthread_cond_timedwait(cond, lock, &ts);
+}
+
+// Message thread: read the boards from the pipe and put them into the priority queue.
+// If the queue is full, it stops reading and the boards stay in the pipe.
 void *threaded_message(void *ctx) {
   Exchanger *ex = (Exchanger *)ctx;
-  MBoard mboard;
+  int slots[MAX_BATCH];
+  MBoard *buffers[MAX_BATCH];
   while (! ex->done) {
-    if (PipeRead(&ex->channels[PIPE_BOARD], &mboard, sizeof(MBoard)) == 0) {
-      // Put it to priority queue. if the queue is full, block the threaa.
-      queue_push(&ex->q, &mboard, sizeof(MBoard));
+    // Reserve free slots.
+    pthread_mutex_lock(&ex->q_lock);
+    int n = ex->q_num_free < MAX_BATCH ? ex->q_num_free : MAX_BATCH;
+    for (int i = 0; i < n; ++i) {
+      slots[i] = ex->q_free[-- ex->q_num_free];
+      buffers[i] = &ex->q_boards[slots[i]];
+    }
+    pthread_mutex_unlock(&ex->q_lock);
+
+    int k = 0, generation = 0;
+    if (n > 0) {
+      pthread_mutex_lock(&ex->pipe_lock);
+      generation = ex->q_generation;
+      k = PipeReadV(&ex->channels[PIPE_BOARD], (void **)buffers, sizeof(MBoard), n);
+      pthread_mutex_unlock(&ex->pipe_lock);
+    }
+
+    pthread_mutex_lock(&ex->q_lock);
+    if (generation != ex->q_generation) k = 0;
+    int num_pushed = 0;
+    for (int i = 0; i < k; ++i) {
+      if (is_cancelled(ex, buffers[i])) {
+        ex->board_cancelled ++;
+        ex->q_free[ex->q_num_free ++] = slots[i];
+      } else {
+        queue_push(ex, slots[i]);
+        num_pushed ++;
+      }
+    }
+    if (num_pushed > 0) pthread_cond_broadcast(&ex->q_cond);
+    for (int i = n - 1; i >= k; --i) ex->q_free[ex->q_num_free ++] = slots[i];
+    pthread_mutex_unlock(&ex->q_lock);
+
+    if (n == 0) {
+      // Queue is full. Wait until the evaluator takes some boards.
+      pthread_mutex_lock(&ex->q_lock);
+      if (ex->q_num_free == 0 && ! ex->done) wait_cond(&ex->q_cond, &ex->q_lock, WAIT_MS * 1000);
+      pthread_mutex_unlock(&ex->q_lock);
+    } else if (k == 0) {
+      PipeWait(&ex->channels[PIPE_BOARD], 0, -1, WAIT_MS);
     }
   }
+  return NULL;
 }
-*/
 
 static inline unsigned char get_flag(Exchanger* ex) {
   return __sync_fetch_and_add(&ex->ctrl_flag, 0);
 }
 
+// Block until the channel is ready, or ctrl_flag is raised on the server side (the caller checks the flag again).
+static BOOL wait_channel(Exchanger *ex, int channel, int for_write) {
+  BOOL ready = PipeWait(&ex->channels[channel], for_write, ex->event_fd, WAIT_MS) ? TRUE : FALSE;
+  // Consume the notification, if any.
+  uint64_t v;
+  if (ex->event_fd != -1 && read(ex->event_fd, &v, sizeof(v)) == -1) { }
+  return ready;
+}
+
+// Server side: send the credits to the client. Not blocked, the client asks again on its next connection if it is lost.
+static void advertise_credits(Exchanger *ex) {
+  MCtrl mctrl;
+  memset(&mctrl, 0, sizeof(mctrl));
+  mctrl.code = SIG_CREDIT;
+  mctrl.seq = ex->credits;
+  if (PipeWrite(&ex->channels[PIPE_S2C], &mctrl, sizeof(mctrl)) == -1) printf("Cannot advertise the credits!\n");
+}
+
 // For control thread, we listen to the ctrl channel and change the status of the server.
 void *threaded_ctrl(void *ctx) {
   Exchanger *ex = (Exchanger *)ctx;
   MCtrl mctrl;
   while (! ex->done) {
     if (PipeRead(&ex->channels[PIPE_C2S], &mctrl, sizeof(MCtrl)) == 0) {
-      if (mctrl.code != 0) {
+      if (mctrl.code == SIG_MINSEQ) {
+        // Not a flag. Boards are checked against it when they are queued and taken.
+        __atomic_store_n(&ex->min_seq, mctrl.seq, __ATOMIC_RELAXED);
+      } else if (mctrl.code == SIG_CREDIT) {
+        // A new client asks for the credits.
+        advertise_credits(ex);
+      } else if (mctrl.code != 0) {
         // All the flags will be reset after we call sendAck.
         printf("Get control signal. Code = %d\n", mctrl.code);
         __sync_fetch_and_or(&ex->ctrl_flag, 1 << mctrl.code);
+        // Wake up the server if it is waiting for boards, or blocked on sending moves.
+        pthread_mutex_lock(&ex->q_lock);
+        pthread_cond_broadcast(&ex->q_cond);
+        pthread_mutex_unlock(&ex->q_lock);
+        uint64_t v = 1;
+        if (write(ex->event_fd, &v, sizeof(v)) == -1) printf("Cannot signal the control flag!\n");
       }
+    } else {
+      PipeWait(&ex->channels[PIPE_C2S], 0, -1, WAIT_MS);
     }
-    // Some sleep?
   }
   return NULL;
 }
@@ -120,23 +289,54 @@ void *ExLocalInit(const char *pipe_path, int id, BOOL is_server) {
   }
 
   ex->is_server = is_server;
-  ex->wait_count = 0;
-  ex->wait_count_max = 0;
-  if (! is_server) return ex;
+  ex->credits = 0;
+  ex->num_acks = 0;
+  ex->event_fd = -1;
+  pthread_mutex_init(&ex->s2c_lock, NULL);
+  if (! is_server) {
+    // Ask the server for its credits. Until they arrive, there is no limit.
+    MCtrl mctrl;
+    memset(&mctrl, 0, sizeof(mctrl));
+    mctrl.code = SIG_CREDIT;
+    PipeWrite(&ex->channels[PIPE_C2S], &mctrl, sizeof(mctrl));
+    return ex;
+  }
 
+  ex->event_fd = eventfd(0, EFD_NONBLOCK);
+  if (ex->event_fd == -1) {
+    printf("Cannot create eventfd!\n");
+    for (int i = 0; i < NUM_CHANNELS; ++i) PipeClose(&ex->channels[i]);
+    pthread_mutex_destroy(&ex->s2c_lock);
+    free(ex);
+    return NULL;
+  }
   ex->ctrl_flag = 0;
   ex->done = FALSE;
   ex->move_sent = 0;
   ex->board_received = 0;
+  ex->min_seq = 0;
+  ex->board_cancelled = 0;
   // Initialize queue.
-  // queue_init(&ex->q, QUEUE_SIZE, sizeof(MBoard));
+  pthread_mutex_init(&ex->q_lock, NULL);
+  pthread_cond_init(&ex->q_cond, NULL);
+  pthread_mutex_init(&ex->pipe_lock, NULL);
+  ex->q_boards = (MBoard *)malloc(sizeof(MBoard) * QUEUE_SIZE);
+  ex->q_order = (uint64_t *)malloc(sizeof(uint64_t) * QUEUE_SIZE);
+  ex->q_heap = (int *)malloc(sizeof(int) * QUEUE_SIZE);
+  ex->q_free = (int *)malloc(sizeof(int) * QUEUE_SIZE);
+  // Free slots are taken from the end, so that the low slots (and their pages) are reused first.
+  for (int i = 0; i < QUEUE_SIZE; ++i) ex->q_free[i] = QUEUE_SIZE - 1 - i;
+  ex->q_num_free = QUEUE_SIZE;
+  ex->q_size = 0;
+  ex->q_next_order = 0;
+  ex->q_generation = 0;
 
   // For client, we don't need to do anything.
   // For server, we need to start a few threads.
   //    Message thread: get all board messages and put them into a (priority) queue.
   //    Ctrl thread: check all control messages (ctrl_c2s) and change the status of the exchanger accordingly.
   // Ack knowledge will be sent by the main thread (the main function).
-  // pthread_create(&ex->message, NULL, threaded_message, ex);
+  pthread_create(&ex->message, NULL, threaded_message, ex);
   pthread_create(&ex->ctrl, NULL, threaded_ctrl, ex);
 
   return ex;
@@ -144,23 +344,37 @@ void *ExLocalInit(const char *pipe_path, int id, BOOL is_server) {
 
 void ExLocalDestroy(void *ctx) {
   Exchanger *ex = (Exchanger *)ctx;
-  for (int i = 0; i < NUM_CHANNELS; ++i) {
-    // printf("Closing pipe = %d\n", i);
-    PipeClose(&ex->channels[i]);
-  }
-
   if (ex->is_server) {
     ex->done = TRUE;
-    // Do we need to wait all the threads to terminate?
+    // Wake up the control thread with an empty message, it quits on its next check.
+    MCtrl mctrl;
+    memset(&mctrl, 0, sizeof(mctrl));
+    PipeWrite(&ex->channels[PIPE_C2S], &mctrl, sizeof(mctrl));
     pthread_join(ex->ctrl, NULL);
+    // The message thread quits within WAIT_MS.
+    pthread_join(ex->message, NULL);
+    close(ex->event_fd);
+    pthread_mutex_destroy(&ex->q_lock);
+    pthread_cond_destroy(&ex->q_cond);
+    pthread_mutex_destroy(&ex->pipe_lock);
+    free(ex->q_boards);
+    free(ex->q_order);
+    free(ex->q_heap);
+    free(ex->q_free);
   }
+
+  for (int i = 0; i < NUM_CHANNELS; ++i) {
+    // printf("Closing pipe = %d\n", i);
+    PipeClose(&ex->channels[i]);
+  }
+  pthread_mutex_destroy(&ex->s2c_lock);
   free(ex);
 }
 
 #define ARGP(a) (a), sizeof(*a)
 #define ARG(a)  &(a), sizeof(a)
 
-#define BLOCK(a) while ((a) == -1) { } return TRUE
+#define BLOCK(a, ex, channel) while ((a) == -1) { wait_channel(ex, channel, 1); } return TRUE
 #define RET(a) do { if ((a) == 0) return TRUE; else return FALSE; } while(0)
 #define RETN(a, n) do { int __i = 0; for (__i = 0; __i < (n); ++__i) if ((a) == 0) return TRUE; return FALSE; } while(0)
 
@@ -168,7 +382,8 @@ void ExLocalDestroy(void *ctx) {
 //   1. Block on message with exit value = SIG_OK on newboard.
 //   2. Return immediately with exit value = SIG_RESTART
 //   3. Return immediately with exit value = SIG_HIGH_PR
-// If num_attempt == 0, then try indefinitely, otherwise try num_attempt.
+// If num_attempt == 0, then block until a board or a control signal comes, otherwise try num_attempt times without blocking.
+// Boards come from the priority queue, highest priority first.
 int ExLocalServerGetBoard(void *ctx, MBoard *mboard, int num_attempt) {
   Exchanger *ex = (Exchanger *)ctx;
   int count = 0;
@@ -179,21 +394,60 @@ int ExLocalServerGetBoard(void *ctx, MBoard *mboard, int num_attempt) {
       return SIG_RESTART;
     }
     // Otherwise get the board, if succeed, return.
-    if (PipeRead(&ex->channels[PIPE_BOARD], ARGP(mboard)) == 0) {
+    if (queue_get_boards(ex, &mboard, 1) == 1) {
       ex->board_received ++;
       return SIG_OK;
-    } else if (flag & (1 << SIG_FINISHSOON)) {
-      // If there is no board to read and we want finish soon, return immediately.
-      return SIG_NOPKG;
     }
-    // Do I need to put some sleep here?
+    if (num_attempt == 0) {
+      pthread_mutex_lock(&ex->q_lock);
+      if (ex->q_size == 0 && get_flag(ex) == flag) wait_cond(&ex->q_cond, &ex->q_lock, WAIT_MS * 1000);
+      pthread_mutex_unlock(&ex->q_lock);
+    }
     count ++;
   }
-
-  // queue_pop(&ex->q, board, sizeof(MBoard));
   return SIG_NOPKG;
 }
 
+// Keep taking boards until there are max_n of them, the deadline (wallclock) is passed, or a control signal comes.
+static int queue_get_boards_until(Exchanger *ex, MBoard **mboards, int max_n, double deadline) {
+  int n = 0;
+  while (! ex->done) {
+    n += queue_get_boards(ex, mboards + n, max_n - n);
+    unsigned char flag = get_flag(ex);
+    double left = deadline - wallclock();
+    if (n >= max_n || left <= 0 || flag != 0) break;
+    pthread_mutex_lock(&ex->q_lock);
+    if (ex->q_size == 0 && get_flag(ex) == flag) wait_cond(&ex->q_cond, &ex->q_lock, (int)(left * 1e6) + 1);
+    pthread_mutex_unlock(&ex->q_lock);
+  }
+  return n;
+}
+
+int ExLocalServerGetBatch(void *ctx, MBoard **mboards, int max_n, int deadline_us) {
+  Exchanger *ex = (Exchanger *)ctx;
+  if (max_n <= 0 || ExLocalServerGetBoard(ex, mboards[0], 0) != SIG_OK) return 0;
+  int n = 1;
+  if (deadline_us > 0) {
+    double start = wallclock();
+    if (mboards[0]->t_sent > 0 && mboards[0]->t_sent < start) start = mboards[0]->t_sent;
+    n += queue_get_boards_until(ex, mboards + 1, max_n - 1, start + deadline_us * 1e-6);
+  } else {
+    n += queue_get_boards(ex, mboards + 1, max_n - 1);
+  }
+  ex->board_received += n - 1;
+  return n;
+}
+
+// A move that does not fit in the pipe is cut, and its tail is kept in the Pipe (see PipeWriteV). Block until the tail is
+// written too, otherwise the client would wait for it until the next move is sent, which might never happen.
+static BOOL flush_moves(Exchanger *ex) {
+  while (! PipeFlush(&ex->channels[PIPE_MOVE])) {
+    if (ex->done || (get_flag(ex) & (1 << SIG_RESTART))) return FALSE;
+    wait_channel(ex, PIPE_MOVE, 1);
+  }
+  return TRUE;
+}
+
 // Block send moves, once CNN finish evaluation.
 // If done is set, don't send anything.
 BOOL ExLocalServerSendMove(void *ctx, MMove *move) {
@@ -204,12 +458,29 @@ BOOL ExLocalServerSendMove(void *ctx, MMove *move) {
     if (flag & (1 << SIG_RESTART)) break;
     if (PipeWrite(&ex->channels[PIPE_MOVE], ARGP(move)) == 0) {
       ex->move_sent ++;
-      return TRUE;
+      return flush_moves(ex);
     }
+    // The pipe is full, wait until the client reads.
+    wait_channel(ex, PIPE_MOVE, 1);
   }
   return FALSE;
 }
 
+BOOL ExLocalServerSendMoves(void *ctx, MMove **moves, int n) {
+  Exchanger *ex = (Exchanger *)ctx;
+  int sent = 0;
+  while (sent < n && ! ex->done) {
+    unsigned char flag = get_flag(ex);
+    if (flag & (1 << SIG_RESTART)) break;
+    int k = PipeWriteV(&ex->channels[PIPE_MOVE], (void **)(moves + sent), sizeof(MMove), n - sent);
+    sent += k;
+    ex->move_sent += k;
+    // The pipe is full, wait until the client reads.
+    if (k == 0) wait_channel(ex, PIPE_MOVE, 1);
+  }
+  return sent == n ? flush_moves(ex) : FALSE;
+}
+
 // Send ack for any unusual signal received.
 BOOL ExLocalServerSendAckIfNecessary(void *ctx) {
   Exchanger *ex = (Exchanger *)ctx;
@@ -217,24 +488,28 @@ BOOL ExLocalServerSendAckIfNecessary(void *ctx) {
   unsigned char flag = get_flag(ex);
   // If the flag is not zero before cleanup, we need to send an ack (so that the client know we have received it).
   BOOL clean_flag = FALSE;
-  BOOL send_ack = TRUE;
   if (flag != 0) {
     if (flag & (1 << SIG_RESTART)) {
-      // Clean up the message queues.
+      // Clean up the message queues. The message thread drops any board it has read before this.
       int num_discarded = 0;
       MBoard mboard;
+      pthread_mutex_lock(&ex->pipe_lock);
       while (PipeRead(&ex->channels[PIPE_BOARD], ARG(mboard)) == 0) num_discarded ++;
+      pthread_mutex_lock(&ex->q_lock);
+      ex->q_generation ++;
+      num_discarded += queue_clear(ex);
+      pthread_mutex_unlock(&ex->q_lock);
+      pthread_mutex_unlock(&ex->pipe_lock);
       printf("#Board Discarded = %d\n", num_discarded);
       clean_flag = TRUE;
-    } else if (flag & (1 << SIG_FINISHSOON)) {
-      clean_flag = TRUE;
-      // Do not need to send ack for FINISHSOON (No one is going to receive it).
-      send_ack = FALSE;
     }
   }
 
   if (clean_flag) {
-    printf("Summary: Board received = %d, Move sent = %d\n", ex->board_received, ex->move_sent);
+    pthread_mutex_lock(&ex->q_lock);
+    printf("Summary: Board received = %d, cancelled = %d, Move sent = %d\n", ex->board_received, ex->board_cancelled, ex->move_sent);
+    ex->board_cancelled = 0;
+    pthread_mutex_unlock(&ex->q_lock);
     ex->board_received = 0;
     ex->move_sent = 0;
 
@@ -242,17 +517,17 @@ BOOL ExLocalServerSendAckIfNecessary(void *ctx) {
     __sync_fetch_and_and(&ex->ctrl_flag, 0);
 
     // Send message.
-    if (send_ack) {
-      MCtrl mctrl;
-      mctrl.code = SIG_ACK;
-      while (! ex->done) {
-        if (PipeWrite(&ex->channels[PIPE_S2C], ARG(mctrl)) == 0) {
-          printf("Ack sent with previous flag = %d\n", flag);
-
-          // Sent.
-          return TRUE;
-        }
+    MCtrl mctrl;
+    memset(&mctrl, 0, sizeof(mctrl));
+    mctrl.code = SIG_ACK;
+    while (! ex->done) {
+      if (PipeWrite(&ex->channels[PIPE_S2C], ARG(mctrl)) == 0) {
+        printf("Ack sent with previous flag = %d\n", flag);
+
+        // Sent.
+        return TRUE;
       }
+      wait_channel(ex, PIPE_S2C, 1);
     }
   }
   // Not sent.
@@ -265,15 +540,34 @@ BOOL ExLocalServerIsRestarting(void *ctx) {
   return (flag & (1 << SIG_RESTART)) ? TRUE : FALSE;
 }
 
+void ExLocalServerSetCredits(void *ctx, int credits) {
+  Exchanger *ex = (Exchanger *)ctx;
+  ex->credits = credits;
+  advertise_credits(ex);
+}
+
 // ==================================== Client side ===============================================
-int ExLocalClientSetMaxWaitCount(void *ctx, int n) {
+// Read the messages from the server. Credits are applied, ACKs are counted for ExLocalClientWaitAck.
+static void client_read_s2c(Exchanger *ex) {
+  MCtrl mctrl;
+  pthread_mutex_lock(&ex->s2c_lock);
+  while (PipeRead(&ex->channels[PIPE_S2C], ARG(mctrl)) == 0) {
+    if (mctrl.code == SIG_ACK) {
+      ex->num_acks ++;
+    } else if (mctrl.code == SIG_CREDIT) {
+      ex->credits = (int)mctrl.seq;
+    }
+  }
+  pthread_mutex_unlock(&ex->s2c_lock);
+}
+
+int ExLocalClientGetCredits(void *ctx) {
   Exchanger *ex = (Exchanger *)ctx;
-  int res = ex->wait_count_max;
-  ex->wait_count_max = n;
-  return res;
+  return ex->credits;
 }
 
 // Send board (not blocked)
+// No lock is needed between the tree threads: a board fits in PIPE_BUF, so it is written atomically and never cut.
 BOOL ExLocalClientSendBoard(void *ctx, MBoard *board) {
   Exchanger *ex = (Exchanger *)ctx;
   RET(PipeWrite(&ex->channels[PIPE_BOARD], ARGP(board)));
@@ -285,57 +579,51 @@ BOOL ExLocalClientGetMove(void *ctx, MMove *move) {
   RET(PipeRead(&ex->channels[PIPE_MOVE], ARGP(move)));
 }
 
-// Send restart signal (in block mode) once the search is over
-BOOL ExLocalClientSendRestart(void *ctx) {
+int ExLocalClientGetMoves(void *ctx, MMove *moves, int max_n) {
   Exchanger *ex = (Exchanger *)ctx;
-  MCtrl mctrl;
-  mctrl.code = SIG_RESTART;
-  // Make sure it is sent.
-  BLOCK(PipeWrite(&ex->channels[PIPE_C2S], ARG(mctrl)));
+  void *buffers[MAX_BATCH];
+  if (max_n > MAX_BATCH) max_n = MAX_BATCH;
+  for (int i = 0; i < max_n; ++i) buffers[i] = &moves[i];
+  int n = PipeReadV(&ex->channels[PIPE_MOVE], buffers, sizeof(MMove), max_n);
+  // The move pipe is drained, a good time to check whether the server has changed the credits.
+  if (n < max_n) client_read_s2c(ex);
+  return n;
 }
 
-BOOL ExLocalClientIncWaitCount(void *ctx, BOOL send_if_needed) {
+BOOL ExLocalClientWaitMove(void *ctx, int timeout_ms) {
   Exchanger *ex = (Exchanger *)ctx;
-  int curr = __sync_add_and_fetch(&ex->wait_count, 1);
-  // printf("IncCount! count = %d/%d\n", curr, ex->wait_count_max);
-  if (curr >= ex->wait_count_max && send_if_needed) {
-    // Then we sent the finish soon signal
-    // printf("Sending finishsoon message!\n");
-    ExLocalClientSendFinishSoon(ctx);
-    return TRUE;
-  }
-  return FALSE;
+  return PipeWait(&ex->channels[PIPE_MOVE], 0, -1, timeout_ms) ? TRUE : FALSE;
 }
 
-BOOL ExLocalClientDecWaitCount(void *ctx) {
+BOOL ExLocalClientSetMinSeq(void *ctx, long min_seq) {
   Exchanger *ex = (Exchanger *)ctx;
-  int curr = __sync_add_and_fetch(&ex->wait_count, -1);
-  // printf("DecCount! count = %d/%d\n", curr, ex->wait_count_max);
-  if (curr < 0) {
-    printf("Error!!! In ExLocalClientDecWaitOnCount(), count = %d < 0", curr);
-    return FALSE;
-  }
-  return TRUE;
+  MCtrl mctrl;
+  memset(&mctrl, 0, sizeof(mctrl));
+  mctrl.code = SIG_MINSEQ;
+  mctrl.seq = min_seq;
+  BLOCK(PipeWrite(&ex->channels[PIPE_C2S], ARG(mctrl)), ex, PIPE_C2S);
 }
 
-BOOL ExLocalClientSendFinishSoon(void *ctx) {
+// Send restart signal (in block mode) once the search is over
+BOOL ExLocalClientSendRestart(void *ctx) {
   Exchanger *ex = (Exchanger *)ctx;
   MCtrl mctrl;
-  mctrl.code = SIG_FINISHSOON;
+  mctrl.code = SIG_RESTART;
   // Make sure it is sent.
-  BLOCK(PipeWrite(&ex->channels[PIPE_C2S], ARG(mctrl)));
+  BLOCK(PipeWrite(&ex->channels[PIPE_C2S], ARG(mctrl)), ex, PIPE_C2S);
 }
 
 // Blocked wait until ack is received.
 BOOL ExLocalClientWaitAck(void *ctx) {
   Exchanger *ex = (Exchanger *)ctx;
-  MCtrl mctrl;
-  mctrl.code = SIG_RESTART;
-
   while (1) {
-    if (PipeRead(&ex->channels[PIPE_S2C], ARG(mctrl)) == 0) {
-      if (mctrl.code == SIG_ACK) break;
-    }
+    client_read_s2c(ex);
+    pthread_mutex_lock(&ex->s2c_lock);
+    BOOL acked = ex->num_acks > 0;
+    if (acked) ex->num_acks --;
+    pthread_mutex_unlock(&ex->s2c_lock);
+    if (acked) break;
+    wait_channel(ex, PIPE_S2C, 0);
   }
   return TRUE;
 }
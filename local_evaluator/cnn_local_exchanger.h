@@ -27,37 +27,42 @@ void ExLocalDestroy(void *ctx);
 //   1. Block on message with exit value = SIG_OK on newboard.
 //   2. Return immediately with exit value = SIG_RESTART
 //   3. Return immediately with exit value = SIG_HIGH_PR
-// If num_attempt == 0, then try indefinitely, otherwise try num_attempt.
+// If num_attempt == 0, then block until a board or a control signal comes, otherwise try num_attempt times without blocking.
+// A server thread drains the pipe into a priority queue, so the board with the highest MBoard.priority is returned first.
 int ExLocalServerGetBoard(void *ctx, MBoard *board, int num_attempt);
+// Batched version: block until the first board (or a control signal), then wait for more boards until there are max_n
+// of them or the first one has waited for deadline_us since it was sent (0 = only take the boards already in the queue).
+// The batch size and the deadline are up to the caller (see cnn_evaluator_run1.lua). Return #boards received (0 on control signals).
+int ExLocalServerGetBatch(void *ctx, MBoard **boards, int max_n, int deadline_us);
 // Block send moves, once CNN finish evaluation.
 // If done is set, don't send anything.
 BOOL ExLocalServerSendMove(void *ctx, MMove *move);
+// Batched version, moves are written with writev. Return TRUE if all moves are sent.
+BOOL ExLocalServerSendMoves(void *ctx, MMove **moves, int n);
 // Send ack for any unusual signal received.
 BOOL ExLocalServerSendAckIfNecessary(void *ctx);
 // Check whether the server is restarting.
 BOOL ExLocalServerIsRestarting(void *ctx);
+// Advertise to the client that it may have at most credits boards in flight (0 = no limit).
+void ExLocalServerSetCredits(void *ctx, int credits);
 
 // Client side
-// Set Maximum wait count. Return the previous maximum.
-int ExLocalClientSetMaxWaitCount(void *ctx, int n);
+// Max #boards the client may have in flight, as advertised by the server (0 = no limit, also before the server replies).
+// The caller counts its boards in flight (sent, not replied and not cancelled), and stops sending when it has that many.
+int ExLocalClientGetCredits(void *ctx);
 // Send board (not blocked)
 BOOL ExLocalClientSendBoard(void *ctx, MBoard *board);
 // Receive move (not blocked)
 BOOL ExLocalClientGetMove(void *ctx, MMove *move);
-// Add the wait count. If the count is >= wait_count_max (set by ExLocalClientSetWaitCount) and send_if_needed is true,
-// then send SIG_FINISHSOON.
-// This means that already n threads are waiting on the results, please response soon.
-// Return TRUE if we have sent SIG_FINISHSOON, return FALSE if not.
-BOOL ExLocalClientIncWaitCount(void *ctx, BOOL send_if_needed);
-// Decrease the wait count.
-// Return TRUE if we have done the operation, FALSE if the count is < 0 (this should error).
-BOOL ExLocalClientDecWaitCount(void *ctx);
-
+// Receive up to max_n moves with one read (not blocked). Return #moves received.
+int ExLocalClientGetMoves(void *ctx, MMove *moves, int max_n);
+// Block until a move might be ready to receive, at most timeout_ms. Return FALSE on timeout.
+BOOL ExLocalClientWaitMove(void *ctx, int timeout_ms);
+// Cancel the boards with seq < min_seq (e.g., after the tree is pruned and the sequence number changes).
+// The server drops them before they are evaluated. Unlike restart, there is no ack to wait for.
+BOOL ExLocalClientSetMinSeq(void *ctx, long min_seq);
 // Send restart signal (in block mode) once the search is over
 BOOL ExLocalClientSendRestart(void *ctx);
-// Send finish soon signal. Server will evaluate all current existing
-// board situations and then return. It won't wait for a missing board indefinitely.
-BOOL ExLocalClientSendFinishSoon(void *ctx);
 // Blocked wait until ack is received.
 BOOL ExLocalClientWaitAck(void *ctx);
 
@@ -0,0 +1,799 @@
+//
+// Copyright (c) 2016-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+//
+
+#include "cnn_shm_exchanger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "../common/common.h"
+#include "../common/package_codec.h"
+
+#define SHM_PREFIX "/darkforest"
+#define SHM_MAGIC 0x6466736d6578ULL
+#define CACHE_LINE 64
+
+#define NUM_RINGS 4
+#define RING_BOARD 0
+#define RING_MOVE 1
+#define RING_C2S 2
+#define RING_S2C 3
+
+#define BOARD_RING_SIZE 1024
+#define MOVE_RING_SIZE 1024
+#define CTRL_RING_SIZE 64
+
+// Size of the cache of recent requests (for delta encoding) is 2^REQUEST_CACHE_BITS.
+#define REQUEST_CACHE_BITS 10
+
+// Blocked waits time out every so often to check whether the exchanger is done.
+#define WAIT_MS 100
+// #yields before a wait blocks in the kernel.
+#define WAIT_SPIN 64
+
+// Message 3: control information
+typedef struct {
+  long seq;
+  uint64_t b;
+  int code;
+} MCtrl;
+
+// Bounded lock-free ring (multi-producer/multi-consumer, each cell has a sequence number).
+// Everything lives in the shared region, so there is no pointer in it.
+typedef struct {
+  uint64_t size;
+  uint64_t cell_size;
+  uint64_t offset;
+  char pad0[CACHE_LINE - 3 * sizeof(uint64_t)];
+  volatile uint64_t head;
+  char pad1[CACHE_LINE - sizeof(uint64_t)];
+  volatile uint64_t tail;
+  char pad2[CACHE_LINE - sizeof(uint64_t)];
+  // Wakeup of blocked threads (futex on events, shared between processes).
+  // events is bumped on push/pop whenever someone is waiting, or when the control flag of the server is raised.
+  volatile uint32_t num_waiters;
+  volatile uint32_t events;
+  char pad3[CACHE_LINE - 2 * sizeof(uint32_t)];
+} Ring;
+
+typedef struct {
+  volatile uint64_t seq;
+  // #bytes of data.
+  uint64_t size;
+  char data[0];
+} RingCell;
+
+// Layout of the shared region. The rings' cells follow the header.
+// A board is stored as it is (a cell of sizeof(MBoard) bytes), or as a delta (package_codec.h) of an earlier request.
+// Moves are stored in the compact encoding.
+typedef struct {
+  volatile uint64_t magic;
+  uint64_t total_size;
+  uint32_t codec_version;
+  // Set by the client. Whether the moves carry the extra data.
+  volatile uint32_t move_extra;
+  // Set by the client. Boards with seq < min_seq are dropped by the server.
+  volatile int64_t min_seq;
+  // Set by the server, see ExShmServerSetCredits.
+  volatile int32_t credits;
+  char pad[CACHE_LINE - 3 * sizeof(uint64_t) - 3 * sizeof(uint32_t)];
+  Ring rings[NUM_RINGS];
+} ShmHeader;
+
+// Id of a request.
+typedef struct {
+  uint64_t b;
+  long seq;
+} RequestId;
+
+// Exchanger. Save all the context.
+typedef struct {
+  char name[256];
+  ShmHeader *h;
+  size_t total_size;
+  BOOL is_server;
+
+  // Server side, same as in cnn_local_exchanger.c
+  unsigned char ctrl_flag;
+  volatile BOOL done;
+  pthread_t ctrl;
+  int board_received;
+  int move_sent;
+  int delta_received;
+  int board_cancelled;
+  // Boards that cannot be decoded (e.g., a delta whose parent is gone). They are answered with an error move.
+  int board_dropped;
+
+  // Server side: boards are taken out of the ring (and decoded) in its order, then kept in a priority queue, a max heap
+  // of slots of q_boards ordered by (priority, arrival order), as in cnn_local_exchanger.c. Only the server thread uses it.
+  MBoard *q_boards;
+  uint64_t *q_order;
+  int *q_heap;
+  int q_size;
+  int *q_free;
+  int q_num_free;
+  uint64_t q_next_order;
+
+  // Recent requests, so that a board can be sent as a delta of its parent request (see package_codec.h).
+  // The server keeps their boards, the client keeps a mirror of their ids. Each request takes the slot of its id.
+  // The client threads update the mirror without a lock, so it can be off when two of them push boards of the same slot at
+  // the same time. Then a delta cannot be decoded, the server answers it with an error move, and the board is sent again.
+  RequestId *requests;
+  Board *request_boards;
+} ShmExchanger;
+
+static inline size_t align_up(size_t v) {
+  return (v + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+}
+
+static size_t ring_layout(Ring *r, uint64_t size, size_t elem_size, size_t offset) {
+  r->size = size;
+  r->cell_size = align_up(sizeof(RingCell) + elem_size);
+  r->offset = offset;
+  return offset + r->size * r->cell_size;
+}
+
+static inline RingCell *ring_cell(ShmHeader *h, Ring *r, uint64_t pos) {
+  return (RingCell *)((char *)h + r->offset + (pos & (r->size - 1)) * r->cell_size);
+}
+
+static void ring_init(ShmHeader *h, Ring *r) {
+  for (uint64_t i = 0; i < r->size; ++i) {
+    ring_cell(h, r, i)->seq = i;
+  }
+  r->head = 0;
+  r->tail = 0;
+  r->num_waiters = 0;
+  r->events = 0;
+}
+
+static void futex_wait(volatile uint32_t *addr, uint32_t val, int timeout_us) {
+  struct timespec ts;
+  ts.tv_sec = timeout_us / 1000000;
+  ts.tv_nsec = (timeout_us % 1000000) * 1000L;
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(volatile uint32_t *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Wake up everyone waiting on the ring.
+static inline void ring_kick(Ring *r) {
+  __sync_fetch_and_add(&r->events, 1);
+  futex_wake(&r->events);
+}
+
+// Called after a push/pop. The fence pairs with the one in ring_wait, so that either the waiter sees the change or we see the waiter.
+static inline void ring_notify(Ring *r) {
+  __sync_synchronize();
+  if (__atomic_load_n(&r->num_waiters, __ATOMIC_RELAXED) > 0) ring_kick(r);
+}
+
+static inline uint32_t ring_events(Ring *r) {
+  return __atomic_load_n(&r->events, __ATOMIC_ACQUIRE);
+}
+
+// Whether a pop (for_push == FALSE) or a push (for_push == TRUE) would fail right now.
+static inline BOOL ring_blocked(ShmHeader *h, Ring *r, BOOL for_push) {
+  uint64_t pos = __atomic_load_n(for_push ? &r->tail : &r->head, __ATOMIC_RELAXED);
+  int64_t dif = (int64_t)__atomic_load_n(&ring_cell(h, r, pos)->seq, __ATOMIC_ACQUIRE) - (int64_t)(for_push ? pos : pos + 1);
+  return dif < 0 ? TRUE : FALSE;
+}
+
+// Block until the ring might have an element (for_push == FALSE) or a free cell (for_push == TRUE), or until the ring is kicked.
+// events should be read by ring_events before the caller last checked the ring, so that no wakeup is lost.
+// It first yields a few times without registering as a waiter, so that a busy peer does not pay for a wakeup per message.
+static void ring_wait(ShmHeader *h, Ring *r, BOOL for_push, uint32_t events, int timeout_us) {
+  for (int i = 0; i < WAIT_SPIN; ++i) {
+    if (! ring_blocked(h, r, for_push) || ring_events(r) != events) return;
+    sched_yield();
+  }
+  __sync_fetch_and_add(&r->num_waiters, 1);
+  if (ring_blocked(h, r, for_push)) futex_wait(&r->events, events, timeout_us);
+  __sync_fetch_and_sub(&r->num_waiters, 1);
+}
+
+// Return FALSE if the ring is full.
+static BOOL ring_push(ShmHeader *h, Ring *r, const void *data, size_t size) {
+  uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  RingCell *cell;
+  while (1) {
+    cell = ring_cell(h, r, pos);
+    int64_t dif = (int64_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+    if (dif == 0) {
+      if (__sync_bool_compare_and_swap(&r->tail, pos, pos + 1)) break;
+      pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    } else if (dif < 0) {
+      return FALSE;
+    } else {
+      pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    }
+  }
+  memcpy(cell->data, data, size);
+  cell->size = size;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  ring_notify(r);
+  return TRUE;
+}
+
+// Return #bytes of the element, 0 if the ring is empty. At most max_size bytes are copied.
+static size_t ring_pop(ShmHeader *h, Ring *r, void *data, size_t max_size) {
+  uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  RingCell *cell;
+  while (1) {
+    cell = ring_cell(h, r, pos);
+    int64_t dif = (int64_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (int64_t)(pos + 1);
+    if (dif == 0) {
+      if (__sync_bool_compare_and_swap(&r->head, pos, pos + 1)) break;
+      pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    } else if (dif < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    }
+  }
+  size_t size = cell->size < max_size ? cell->size : max_size;
+  memcpy(data, cell->data, size);
+  __atomic_store_n(&cell->seq, pos + r->size, __ATOMIC_RELEASE);
+  ring_notify(r);
+  return size;
+}
+
+#define PUSH(ex, ring, a) ring_push((ex)->h, &(ex)->h->rings[ring], (a), sizeof(*(a)))
+#define POP(ex, ring, a) ring_pop((ex)->h, &(ex)->h->rings[ring], (a), sizeof(*(a)))
+#define EVENTS(ex, ring) ring_events(&(ex)->h->rings[ring])
+#define WAIT(ex, ring, for_push, events) ring_wait((ex)->h, &(ex)->h->rings[ring], (for_push), (events), WAIT_MS * 1000)
+
+static inline int request_slot(uint64_t b) {
+  return (int)((b * 0x9e3779b97f4a7c15ULL) >> (64 - REQUEST_CACHE_BITS));
+}
+
+static void clear_requests(ShmExchanger *ex) {
+  memset(ex->requests, 0, sizeof(RequestId) << REQUEST_CACHE_BITS);
+}
+
+// Send the board as a delta if the server has the parent request (parent_b with the same seq), otherwise send it as it is.
+// A full board is not encoded: rebuilding its groups on the server costs far more than copying it.
+static BOOL push_board(ShmExchanger *ex, const MBoard *mboard, uint64_t parent_b, Coord m) {
+  RequestId *parent = &ex->requests[request_slot(parent_b)];
+  BOOL res;
+  if (parent_b != 0 && m != M_PASS && m != M_RESIGN && __atomic_load_n(&parent->b, __ATOMIC_RELAXED) == parent_b
+      && __atomic_load_n(&parent->seq, __ATOMIC_RELAXED) == mboard->seq) {
+    unsigned char buf[PKG_MAX_BOARD_BYTES];
+    int size = PkgEncodeBoardDelta(mboard, parent_b, m, buf);
+    res = ring_push(ex->h, &ex->h->rings[RING_BOARD], buf, size);
+  } else {
+    res = ring_push(ex->h, &ex->h->rings[RING_BOARD], mboard, sizeof(MBoard));
+  }
+  if (res) {
+    RequestId *r = &ex->requests[request_slot(mboard->b)];
+    __atomic_store_n(&r->b, mboard->b, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->seq, mboard->seq, __ATOMIC_RELAXED);
+  }
+  return res;
+}
+
+static BOOL push_move(ShmExchanger *ex, const MMove *mmove) {
+  unsigned char buf[PKG_MAX_MOVE_BYTES];
+  int size = PkgEncodeMove(mmove, __atomic_load_n(&ex->h->move_extra, __ATOMIC_RELAXED) ? TRUE : FALSE, buf);
+  return ring_push(ex->h, &ex->h->rings[RING_MOVE], buf, size);
+}
+
+static BOOL pop_move(ShmExchanger *ex, MMove *mmove) {
+  unsigned char buf[PKG_MAX_MOVE_BYTES];
+  size_t size = ring_pop(ex->h, &ex->h->rings[RING_MOVE], buf, sizeof(buf));
+  if (size == 0) return FALSE;
+  if (! PkgDecodeMove(buf, size, mmove)) error("Cannot decode the move (%d bytes)!", (int)size);
+  // The server dropped a board, so our mirror of its requests is not exact. Send full boards until it is rebuilt.
+  if (mmove->error) clear_requests(ex);
+  return TRUE;
+}
+
+static inline unsigned char get_flag(ShmExchanger *ex) {
+  return __sync_fetch_and_add(&ex->ctrl_flag, 0);
+}
+
+// Decode a delta (buf) into mboard. Full boards are popped right into mboard. Keep the board in the cache of requests.
+// Return FALSE if it cannot be decoded.
+static BOOL decode_board(ShmExchanger *ex, const unsigned char *buf, size_t size, MBoard *mboard) {
+  if (buf != NULL) {
+    // The client only sends a delta if it thinks we have the parent.
+    uint64_t parent_b = 0;
+    if (PkgBoardKind(buf, size, &parent_b) != PKG_BOARD_DELTA) return FALSE;
+    int k = request_slot(parent_b);
+    ex->delta_received ++;
+    if (ex->requests[k].b != parent_b || ! PkgDecodeBoardDelta(buf, size, &ex->request_boards[k], mboard) || ex->requests[k].seq != mboard->seq) return FALSE;
+  }
+
+  int k = request_slot(mboard->b);
+  ex->requests[k].b = mboard->b;
+  ex->requests[k].seq = mboard->seq;
+  CopyBoard(&ex->request_boards[k], &mboard->board);
+  return TRUE;
+}
+
+// Answer a board that cannot be decoded with an error move, so that the client sends it again (in full, see pop_move).
+static void drop_board(ShmExchanger *ex, const unsigned char *buf, size_t size) {
+  ex->board_dropped ++;
+  MBoard mboard;
+  if (! PkgDecodeBoardId(buf, size, &mboard)) {
+    printf("Cannot decode the board (%d bytes)!\n", (int)size);
+    return;
+  }
+  if (mboard.seq < (long)__atomic_load_n(&ex->h->min_seq, __ATOMIC_RELAXED)) return;
+
+  MMove mmove;
+  memset(&mmove, 0, sizeof(mmove));
+  mmove.seq = mboard.seq;
+  mmove.b = mboard.b;
+  mmove.t_sent = mboard.t_sent;
+  mmove.t_received = mmove.t_replied = wallclock();
+  mmove.board_hash = mboard.board._hash;
+  mmove.error = TRUE;
+  while (! ex->done && ! (get_flag(ex) & (1 << SIG_RESTART))) {
+    uint32_t events = EVENTS(ex, RING_MOVE);
+    if (push_move(ex, &mmove)) return;
+    WAIT(ex, RING_MOVE, TRUE, events);
+  }
+}
+
+// Pop the next board that is not cancelled (see ExShmClientSetMinSeq).
+static BOOL pop_board(ShmExchanger *ex, MBoard *mboard) {
+  while (1) {
+    size_t size = ring_pop(ex->h, &ex->h->rings[RING_BOARD], mboard, sizeof(MBoard));
+    if (size == 0) return FALSE;
+    // Anything shorter than a board is a delta. Move it out of the way first.
+    unsigned char buf[PKG_MAX_BOARD_BYTES];
+    const unsigned char *delta = NULL;
+    if (size != sizeof(MBoard)) {
+      memcpy(buf, mboard, size < sizeof(buf) ? size : sizeof(buf));
+      delta = buf;
+    }
+    // Cancelled boards are still decoded and cached, so that the cache follows the ring order.
+    if (! decode_board(ex, delta, size, mboard)) {
+      drop_board(ex, delta, size);
+      continue;
+    }
+    if (mboard->seq >= (long)__atomic_load_n(&ex->h->min_seq, __ATOMIC_RELAXED)) return TRUE;
+    ex->board_cancelled ++;
+  }
+}
+
+// Priority queue, same as in cnn_local_exchanger.c.
+static inline BOOL queue_before(const ShmExchanger *ex, int i, int j) {
+  int pi = ex->q_boards[i].priority, pj = ex->q_boards[j].priority;
+  return pi > pj || (pi == pj && ex->q_order[i] < ex->q_order[j]);
+}
+
+static void queue_push(ShmExchanger *ex, int slot) {
+  ex->q_order[slot] = ex->q_next_order ++;
+  int k = ex->q_size ++;
+  while (k > 0 && queue_before(ex, slot, ex->q_heap[(k - 1) / 2])) {
+    ex->q_heap[k] = ex->q_heap[(k - 1) / 2];
+    k = (k - 1) / 2;
+  }
+  ex->q_heap[k] = slot;
+}
+
+// Pop the top slot. The caller puts it back to q_free once the board is copied.
+static int queue_pop(ShmExchanger *ex) {
+  int top = ex->q_heap[0];
+  int last = ex->q_heap[-- ex->q_size];
+  int k = 0;
+  while (1) {
+    int c = 2 * k + 1;
+    if (c >= ex->q_size) break;
+    if (c + 1 < ex->q_size && queue_before(ex, ex->q_heap[c + 1], ex->q_heap[c])) c ++;
+    if (! queue_before(ex, ex->q_heap[c], last)) break;
+    ex->q_heap[k] = ex->q_heap[c];
+    k = c;
+  }
+  ex->q_heap[k] = last;
+  return top;
+}
+
+// Return all queued boards to the free list. Return #boards dropped.
+static int queue_clear(ShmExchanger *ex) {
+  int n = ex->q_size;
+  for (int i = 0; i < n; ++i) ex->q_free[ex->q_num_free ++] = ex->q_heap[i];
+  ex->q_size = 0;
+  return n;
+}
+
+// Take up to max_n boards, the ones with the highest priority first. Boards cancelled while they were queued are dropped.
+static int take_boards(ShmExchanger *ex, MBoard **mboards, int max_n) {
+  int n = 0;
+  // Nothing is queued and all the boards of the ring fit, so their order does not matter. Skip the queue.
+  if (ex->q_size == 0) {
+    Ring *r = &ex->h->rings[RING_BOARD];
+    int num = (int)(__atomic_load_n(&r->tail, __ATOMIC_RELAXED) - __atomic_load_n(&r->head, __ATOMIC_RELAXED));
+    if (num <= max_n) {
+      while (n < num && pop_board(ex, mboards[n])) n ++;
+      return n;
+    }
+  }
+  // Move the boards of the ring into the queue, then take the top ones.
+  while (ex->q_num_free > 0) {
+    int slot = ex->q_free[ex->q_num_free - 1];
+    if (! pop_board(ex, &ex->q_boards[slot])) break;
+    ex->q_num_free --;
+    queue_push(ex, slot);
+  }
+  while (n < max_n && ex->q_size > 0) {
+    int slot = queue_pop(ex);
+    ex->q_free[ex->q_num_free ++] = slot;
+    if (ex->q_boards[slot].seq < (long)__atomic_load_n(&ex->h->min_seq, __ATOMIC_RELAXED)) {
+      ex->board_cancelled ++;
+      continue;
+    }
+    memcpy(mboards[n ++], &ex->q_boards[slot], sizeof(MBoard));
+  }
+  return n;
+}
+
+// For control thread, we listen to the ctrl ring and change the status of the server.
+static void *threaded_ctrl(void *ctx) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  MCtrl mctrl;
+  while (! ex->done) {
+    uint32_t events = EVENTS(ex, RING_C2S);
+    if (POP(ex, RING_C2S, &mctrl)) {
+      if (mctrl.code != 0) {
+        // All the flags will be reset after we call sendAck.
+        printf("Get control signal. Code = %d\n", mctrl.code);
+        __sync_fetch_and_or(&ex->ctrl_flag, 1 << mctrl.code);
+        // Wake up the server if it is waiting for boards or for room to send moves.
+        ring_kick(&ex->h->rings[RING_BOARD]);
+        ring_kick(&ex->h->rings[RING_MOVE]);
+      }
+    } else {
+      WAIT(ex, RING_C2S, FALSE, events);
+    }
+  }
+  return NULL;
+}
+
+void *ExShmInit(const char *pipe_path, int id, BOOL is_server) {
+  ShmExchanger *ex = (ShmExchanger *)malloc(sizeof(ShmExchanger));
+  memset(ex, 0, sizeof(ShmExchanger));
+
+  // Shared memory names cannot contain '/', so we flatten the path.
+  if (strlen(pipe_path) + 32 >= sizeof(ex->name)) {
+    printf("Input path %s is too long!\n", pipe_path);
+    free(ex);
+    return NULL;
+  }
+  sprintf(ex->name, "%s-%s-%d", SHM_PREFIX, pipe_path, id);
+  for (char *p = ex->name + 1; *p != 0; ++p) {
+    if (*p == '/') *p = '_';
+  }
+
+  // Compute the layout.
+  ShmHeader layout;
+  size_t offset = align_up(sizeof(ShmHeader));
+  offset = ring_layout(&layout.rings[RING_BOARD], BOARD_RING_SIZE, sizeof(MBoard), offset);
+  offset = ring_layout(&layout.rings[RING_MOVE], MOVE_RING_SIZE, PKG_MAX_MOVE_BYTES, offset);
+  offset = ring_layout(&layout.rings[RING_C2S], CTRL_RING_SIZE, sizeof(MCtrl), offset);
+  offset = ring_layout(&layout.rings[RING_S2C], CTRL_RING_SIZE, sizeof(MCtrl), offset);
+  ex->total_size = offset;
+
+  int fd;
+  if (is_server) {
+    // We need to remove the region first.
+    shm_unlink(ex->name);
+    fd = shm_open(ex->name, O_RDWR | O_CREAT, 0666);
+    if (fd == -1 || ftruncate(fd, ex->total_size) == -1) {
+      printf("Cannot create shared memory %s (server) !\n", ex->name);
+      if (fd != -1) close(fd);
+      free(ex);
+      return NULL;
+    }
+  } else {
+    fd = shm_open(ex->name, O_RDWR, 0666);
+    if (fd == -1) {
+      printf("Cannot open shared memory %s (client) !\n", ex->name);
+      free(ex);
+      return NULL;
+    }
+  }
+
+  ex->h = (ShmHeader *)mmap(NULL, ex->total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ex->h == MAP_FAILED) {
+    printf("Cannot map shared memory %s!\n", ex->name);
+    free(ex);
+    return NULL;
+  }
+
+  ex->is_server = is_server;
+  ex->requests = (RequestId *)calloc(1 << REQUEST_CACHE_BITS, sizeof(RequestId));
+
+  if (! is_server) {
+    if (__atomic_load_n(&ex->h->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || ex->h->total_size != ex->total_size || ex->h->codec_version != PKG_CODEC_VERSION) {
+      printf("Shared memory %s is not initialized by a compatible server!\n", ex->name);
+      munmap(ex->h, ex->total_size);
+      free(ex->requests);
+      free(ex);
+      return NULL;
+    }
+    return ex;
+  }
+
+  // Initialize the region. The magic number is set last so that clients only see a ready region.
+  ex->h->total_size = ex->total_size;
+  ex->h->codec_version = PKG_CODEC_VERSION;
+  ex->h->move_extra = 0;
+  ex->h->min_seq = 0;
+  ex->h->credits = 0;
+  for (int i = 0; i < NUM_RINGS; ++i) {
+    ex->h->rings[i] = layout.rings[i];
+    ring_init(ex->h, &ex->h->rings[i]);
+  }
+  __atomic_store_n(&ex->h->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+  ex->ctrl_flag = 0;
+  ex->done = FALSE;
+  ex->move_sent = 0;
+  ex->board_received = 0;
+  ex->delta_received = 0;
+  ex->board_cancelled = 0;
+  ex->board_dropped = 0;
+  ex->request_boards = (Board *)malloc(sizeof(Board) << REQUEST_CACHE_BITS);
+
+  // The queue can take a full ring.
+  ex->q_boards = (MBoard *)malloc(sizeof(MBoard) * BOARD_RING_SIZE);
+  ex->q_order = (uint64_t *)malloc(sizeof(uint64_t) * BOARD_RING_SIZE);
+  ex->q_heap = (int *)malloc(sizeof(int) * BOARD_RING_SIZE);
+  ex->q_free = (int *)malloc(sizeof(int) * BOARD_RING_SIZE);
+  for (int i = 0; i < BOARD_RING_SIZE; ++i) ex->q_free[i] = i;
+  ex->q_num_free = BOARD_RING_SIZE;
+  ex->q_size = 0;
+  ex->q_next_order = 0;
+  pthread_create(&ex->ctrl, NULL, threaded_ctrl, ex);
+
+  return ex;
+}
+
+void ExShmDestroy(void *ctx) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  if (ex->is_server) {
+    ex->done = TRUE;
+    ring_kick(&ex->h->rings[RING_C2S]);
+    pthread_join(ex->ctrl, NULL);
+    shm_unlink(ex->name);
+  }
+  munmap(ex->h, ex->total_size);
+  free(ex->requests);
+  free(ex->request_boards);
+  free(ex->q_boards);
+  free(ex->q_order);
+  free(ex->q_heap);
+  free(ex->q_free);
+  free(ex);
+}
+
+// Take up to max_n boards into mboards (*n of them). See ExShmServerGetBoard for num_attempt and the return value.
+static int get_boards(ShmExchanger *ex, MBoard **mboards, int max_n, int num_attempt, int *n) {
+  int count = 0;
+  *n = 0;
+  while (! ex->done && (num_attempt == 0 || count < num_attempt)) {
+    uint32_t events = EVENTS(ex, RING_BOARD);
+    // Check flag.
+    unsigned char flag = get_flag(ex);
+    if (flag & (1 << SIG_RESTART)) {
+      return SIG_RESTART;
+    }
+    // Otherwise get the boards, if succeed, return.
+    *n = take_boards(ex, mboards, max_n);
+    if (*n > 0) {
+      ex->board_received += *n;
+      return SIG_OK;
+    }
+    if (num_attempt == 0) WAIT(ex, RING_BOARD, FALSE, events);
+    count ++;
+  }
+  return SIG_NOPKG;
+}
+
+int ExShmServerGetBoard(void *ctx, MBoard *mboard, int num_attempt) {
+  int n;
+  return get_boards((ShmExchanger *)ctx, &mboard, 1, num_attempt, &n);
+}
+
+// Keep taking boards until there are max_n of them, the deadline (wallclock) is passed, or a control signal comes.
+static int take_boards_until(ShmExchanger *ex, MBoard **mboards, int max_n, double deadline) {
+  int n = 0;
+  while (! ex->done) {
+    uint32_t events = EVENTS(ex, RING_BOARD);
+    n += take_boards(ex, mboards + n, max_n - n);
+    double left = deadline - wallclock();
+    if (n >= max_n || left <= 0 || get_flag(ex) != 0) break;
+    ring_wait(ex->h, &ex->h->rings[RING_BOARD], FALSE, events, (int)(left * 1e6) + 1);
+  }
+  return n;
+}
+
+int ExShmServerGetBatch(void *ctx, MBoard **mboards, int max_n, int deadline_us) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  int n;
+  if (max_n <= 0 || get_boards(ex, mboards, max_n, 0, &n) != SIG_OK) return 0;
+  if (n < max_n && deadline_us > 0) {
+    double start = wallclock();
+    if (mboards[0]->t_sent > 0 && mboards[0]->t_sent < start) start = mboards[0]->t_sent;
+    int m = take_boards_until(ex, mboards + n, max_n - n, start + deadline_us * 1e-6);
+    ex->board_received += m;
+    n += m;
+  }
+  return n;
+}
+
+BOOL ExShmServerSendMove(void *ctx, MMove *move) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  if (move->seq == 0) return FALSE;
+  while (! ex->done) {
+    uint32_t events = EVENTS(ex, RING_MOVE);
+    unsigned char flag = get_flag(ex);
+    if (flag & (1 << SIG_RESTART)) break;
+    if (push_move(ex, move)) {
+      ex->move_sent ++;
+      return TRUE;
+    }
+    // The ring is full, wait until the client reads.
+    WAIT(ex, RING_MOVE, TRUE, events);
+  }
+  return FALSE;
+}
+
+BOOL ExShmServerSendMoves(void *ctx, MMove **moves, int n) {
+  for (int i = 0; i < n; ++i) {
+    if (! ExShmServerSendMove(ctx, moves[i])) return FALSE;
+  }
+  return TRUE;
+}
+
+BOOL ExShmServerSendAckIfNecessary(void *ctx) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  unsigned char flag = get_flag(ex);
+  BOOL clean_flag = FALSE;
+  if (flag != 0) {
+    if (flag & (1 << SIG_RESTART)) {
+      // Clean up the queue and the board ring.
+      int num_discarded = queue_clear(ex);
+      MBoard mboard;
+      while (ring_pop(ex->h, &ex->h->rings[RING_BOARD], &mboard, sizeof(mboard)) > 0) num_discarded ++;
+      printf("#Board Discarded = %d\n", num_discarded);
+      // The client clears its mirror too.
+      clear_requests(ex);
+      clean_flag = TRUE;
+    }
+  }
+
+  if (clean_flag) {
+    printf("Summary: Board received = %d (delta = %d), cancelled = %d, dropped = %d, Move sent = %d\n", ex->board_received, ex->delta_received, ex->board_cancelled, ex->board_dropped, ex->move_sent);
+    ex->board_received = 0;
+    ex->delta_received = 0;
+    ex->board_cancelled = 0;
+    ex->board_dropped = 0;
+    ex->move_sent = 0;
+
+    __sync_fetch_and_and(&ex->ctrl_flag, 0);
+
+    MCtrl mctrl;
+    memset(&mctrl, 0, sizeof(mctrl));
+    mctrl.code = SIG_ACK;
+    while (! ex->done) {
+      uint32_t events = EVENTS(ex, RING_S2C);
+      if (PUSH(ex, RING_S2C, &mctrl)) {
+        printf("Ack sent with previous flag = %d\n", flag);
+        return TRUE;
+      }
+      WAIT(ex, RING_S2C, TRUE, events);
+    }
+  }
+  return FALSE;
+}
+
+BOOL ExShmServerIsRestarting(void *ctx) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  unsigned char flag = get_flag(ex);
+  return (flag & (1 << SIG_RESTART)) ? TRUE : FALSE;
+}
+
+void ExShmServerSetCredits(void *ctx, int credits) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  __atomic_store_n(&ex->h->credits, credits, __ATOMIC_RELAXED);
+}
+
+// ==================================== Client side ===============================================
+int ExShmClientGetCredits(void *ctx) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  return __atomic_load_n(&ex->h->credits, __ATOMIC_RELAXED);
+}
+
+void ExShmClientSetMoveExtra(void *ctx, BOOL move_extra) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  __atomic_store_n(&ex->h->move_extra, move_extra ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+void ExShmClientSetMinSeq(void *ctx, long seq) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  __atomic_store_n(&ex->h->min_seq, seq, __ATOMIC_RELAXED);
+}
+
+BOOL ExShmClientSendBoard(void *ctx, MBoard *board) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  return push_board(ex, board, 0, M_PASS);
+}
+
+BOOL ExShmClientSendBoardDelta(void *ctx, MBoard *board, uint64_t parent_b, Coord m) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  return push_board(ex, board, parent_b, m);
+}
+
+BOOL ExShmClientGetMove(void *ctx, MMove *move) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  return pop_move(ex, move);
+}
+
+int ExShmClientGetMoves(void *ctx, MMove *moves, int max_n) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  int n = 0;
+  while (n < max_n && pop_move(ex, &moves[n])) n ++;
+  return n;
+}
+
+BOOL ExShmClientWaitMove(void *ctx, int timeout_ms) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  Ring *r = &ex->h->rings[RING_MOVE];
+  ring_wait(ex->h, r, FALSE, ring_events(r), timeout_ms * 1000);
+  return ring_blocked(ex->h, r, FALSE) ? FALSE : TRUE;
+}
+
+static BOOL send_ctrl(ShmExchanger *ex, int code) {
+  MCtrl mctrl;
+  memset(&mctrl, 0, sizeof(mctrl));
+  mctrl.code = code;
+  // Make sure it is sent.
+  while (1) {
+    uint32_t events = EVENTS(ex, RING_C2S);
+    if (PUSH(ex, RING_C2S, &mctrl)) break;
+    WAIT(ex, RING_C2S, TRUE, events);
+  }
+  return TRUE;
+}
+
+BOOL ExShmClientSendRestart(void *ctx) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  // The server drops its cache of requests on restart.
+  clear_requests(ex);
+  return send_ctrl(ex, SIG_RESTART);
+}
+
+BOOL ExShmClientWaitAck(void *ctx) {
+  ShmExchanger *ex = (ShmExchanger *)ctx;
+  MCtrl mctrl;
+  while (1) {
+    uint32_t events = EVENTS(ex, RING_S2C);
+    if (POP(ex, RING_S2C, &mctrl)) {
+      if (mctrl.code == SIG_ACK) break;
+    } else {
+      WAIT(ex, RING_S2C, FALSE, events);
+    }
+  }
+  return TRUE;
+}
@@ -0,0 +1,74 @@
+//
+// Copyright (c) 2016-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+//
+
+#ifndef _CNN_SHM_EXCHANGER_H_
+#define _CNN_SHM_EXCHANGER_H_
+
+#include "../common/package.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Shared memory version of the local exchanger (see cnn_local_exchanger.h), with the same semantics (including the
+// priorities of the boards).
+// Boards, moves and control messages go through lock-free rings in a POSIX shared memory region.
+// A board is copied into the ring as it is, or as a delta of its parent request if the server still has it.
+// Moves are stored in the compact encoding of package_codec.h. A side only makes a syscall when it has to block
+// (the ring is empty or full for a while), and the other side then has to wake it up.
+
+// Init exchanger.
+//    pipe_path: the path of the pipe. It is only used to name the shared memory region.
+//    id: the id of the exchanger.
+//    is_server: whether this is a server. The server has to be started first.
+void *ExShmInit(const char *pipe_path, int id, BOOL is_server);
+void ExShmDestroy(void *ctx);
+
+// Server side, see ExLocalServerGetBoard. Blocked waits yield a few times, then sleep on a futex.
+// The server moves the boards of the ring into a priority queue when it asks for one, so it has to call these from one thread.
+int ExShmServerGetBoard(void *ctx, MBoard *board, int num_attempt);
+int ExShmServerGetBatch(void *ctx, MBoard **boards, int max_n, int deadline_us);
+// Block send moves, once CNN finish evaluation.
+BOOL ExShmServerSendMove(void *ctx, MMove *move);
+BOOL ExShmServerSendMoves(void *ctx, MMove **moves, int n);
+// Send ack for any unusual signal received.
+BOOL ExShmServerSendAckIfNecessary(void *ctx);
+// Check whether the server is restarting.
+BOOL ExShmServerIsRestarting(void *ctx);
+// See ExLocalServerSetCredits. The value is kept in the shared region, so the client sees it right away.
+void ExShmServerSetCredits(void *ctx, int credits);
+
+// Client side
+// See ExLocalClientGetCredits.
+int ExShmClientGetCredits(void *ctx);
+// Whether the server should send MMove.extra (only used by the online model). Off by default.
+void ExShmClientSetMoveExtra(void *ctx, BOOL move_extra);
+// Cancel the boards with seq < min_seq, see ExLocalClientSetMinSeq.
+void ExShmClientSetMinSeq(void *ctx, long min_seq);
+// Send board (not blocked)
+BOOL ExShmClientSendBoard(void *ctx, MBoard *board);
+// Send board that is the move m played on the board of an earlier request parent_b (not blocked).
+// It is sent as a delta if the server still has the parent with the same seq, otherwise in full.
+BOOL ExShmClientSendBoardDelta(void *ctx, MBoard *board, uint64_t parent_b, Coord m);
+// Receive move (not blocked)
+BOOL ExShmClientGetMove(void *ctx, MMove *move);
+int ExShmClientGetMoves(void *ctx, MMove *moves, int max_n);
+// Block until a move might be ready to receive, at most timeout_ms. Return FALSE on timeout.
+BOOL ExShmClientWaitMove(void *ctx, int timeout_ms);
+
+// Send restart signal (in block mode) once the search is over
+BOOL ExShmClientSendRestart(void *ctx);
+// Blocked wait until ack is received.
+BOOL ExShmClientWaitAck(void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
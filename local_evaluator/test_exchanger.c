@@ -0,0 +1,215 @@
+//
+// Copyright (c) 2016-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+//
+
+// Throughput/latency benchmark of the pipe exchanger vs the shared memory exchanger.
+// A server thread echoes every board back as a move, while several client threads keep
+// a bounded number of boards in flight (like tree threads waiting on the CNN).
+// Idle threads block (or yield, for the senders) so that the numbers are meaningful on machines with few cores.
+// Usage: test_exchanger [pipe_path] [num_boards] [num_threads] [max_inflight]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "cnn_local_exchanger.h"
+#include "cnn_shm_exchanger.h"
+
+typedef struct {
+  const char *name;
+  void *(*init)(const char *, int, BOOL);
+  void (*destroy)(void *);
+  int (*server_get_batch)(void *, MBoard **, int, int);
+  BOOL (*server_send_moves)(void *, MMove **, int);
+  BOOL (*client_send_board)(void *, MBoard *);
+  int (*client_get_moves)(void *, MMove *, int);
+  BOOL (*client_wait_move)(void *, int);
+} Transport;
+
+static const Transport transports[] = {
+  { "pipe", ExLocalInit, ExLocalDestroy, ExLocalServerGetBatch, ExLocalServerSendMoves, ExLocalClientSendBoard, ExLocalClientGetMoves, ExLocalClientWaitMove },
+  { "shm", ExShmInit, ExShmDestroy, ExShmServerGetBatch, ExShmServerSendMoves, ExShmClientSendBoard, ExShmClientGetMoves, ExShmClientWaitMove },
+};
+
+typedef struct {
+  const Transport *t;
+  void *server, *client;
+  int num_boards, num_threads, max_inflight;
+  int inflight;
+  int num_sent;
+  // Stats on the receiver side.
+  int num_received;
+  double total_latency, max_latency;
+} Bench;
+
+// Max #messages per batched call, same as the evaluator.
+#define BATCH 32
+
+static void *threaded_server(void *ctx) {
+  Bench *b = (Bench *)ctx;
+  MBoard mboards[BATCH], *pboards[BATCH];
+  MMove mmoves[BATCH], *pmoves[BATCH];
+  memset(mmoves, 0, sizeof(mmoves));
+  for (int i = 0; i < BATCH; ++i) {
+    pboards[i] = &mboards[i];
+    pmoves[i] = &mmoves[i];
+  }
+  // Every board is served exactly once, so the server stops after the last one.
+  int num_served = 0;
+  while (num_served < b->num_boards) {
+    int n = b->t->server_get_batch(b->server, pboards, BATCH, 0);
+    if (n == 0) continue;
+    num_served += n;
+    for (int i = 0; i < n; ++i) {
+      mmoves[i].seq = mboards[i].seq;
+      mmoves[i].b = mboards[i].b;
+      mmoves[i].t_sent = mboards[i].t_sent;
+    }
+    b->t->server_send_moves(b->server, pmoves, n);
+  }
+  return NULL;
+}
+
+static void *threaded_sender(void *ctx) {
+  Bench *b = (Bench *)ctx;
+  MBoard mboard;
+  memset(&mboard, 0, sizeof(mboard));
+  ClearBoard(&mboard.board);
+  while (1) {
+    int seq = __sync_add_and_fetch(&b->num_sent, 1);
+    if (seq > b->num_boards) break;
+    // Wait until we have room.
+    while (__sync_fetch_and_add(&b->inflight, 0) >= b->max_inflight) sched_yield();
+    __sync_fetch_and_add(&b->inflight, 1);
+    mboard.seq = seq;
+    mboard.b = seq;
+    mboard.t_sent = wallclock();
+    while (! b->t->client_send_board(b->client, &mboard)) sched_yield();
+  }
+  return NULL;
+}
+
+static void *threaded_receiver(void *ctx) {
+  Bench *b = (Bench *)ctx;
+  MMove mmoves[BATCH];
+  while (b->num_received < b->num_boards) {
+    int n = b->t->client_get_moves(b->client, mmoves, BATCH);
+    if (n == 0) {
+      b->t->client_wait_move(b->client, 10);
+      continue;
+    }
+    double now = wallclock();
+    for (int i = 0; i < n; ++i) {
+      double latency = now - mmoves[i].t_sent;
+      b->total_latency += latency;
+      if (latency > b->max_latency) b->max_latency = latency;
+    }
+    b->num_received += n;
+    __sync_fetch_and_add(&b->inflight, -n);
+  }
+  return NULL;
+}
+
+static void run(const Transport *t, const char *pipe_path, int num_boards, int num_threads, int max_inflight) {
+  Bench b;
+  memset(&b, 0, sizeof(b));
+  b.t = t;
+  b.num_boards = num_boards;
+  b.num_threads = num_threads;
+  b.max_inflight = max_inflight;
+
+  b.server = t->init(pipe_path, 0, TRUE);
+  b.client = t->init(pipe_path, 0, FALSE);
+  if (b.server == NULL || b.client == NULL) {
+    printf("[%s] Cannot initialize the exchanger at %s\n", t->name, pipe_path);
+    return;
+  }
+
+  pthread_t server, receiver;
+  pthread_t *senders = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
+  double start = wallclock();
+  pthread_create(&server, NULL, threaded_server, &b);
+  pthread_create(&receiver, NULL, threaded_receiver, &b);
+  for (int i = 0; i < num_threads; ++i) pthread_create(&senders[i], NULL, threaded_sender, &b);
+
+  for (int i = 0; i < num_threads; ++i) pthread_join(senders[i], NULL);
+  pthread_join(receiver, NULL);
+  double elapsed = wallclock() - start;
+  pthread_join(server, NULL);
+
+  printf("[%s] #boards = %d, #threads = %d, inflight = %d, time = %.3lf s, throughput = %.0lf boards/s, latency avg = %.1lf us, max = %.1lf us\n",
+      t->name, num_boards, num_threads, max_inflight, elapsed, num_boards / elapsed,
+      b.total_latency / num_boards * 1e6, b.max_latency * 1e6);
+
+  free(senders);
+  t->destroy(b.client);
+  t->destroy(b.server);
+}
+
+// Boards already waiting on the server side come out by priority, and in the order they were sent for the same priority.
+// The order is only checked between batches: the boards of a batch are evaluated together.
+static void check_priority(const Transport *t, const char *pipe_path) {
+  const int n = 64, batch = 16;
+  void *server = t->init(pipe_path, 0, TRUE);
+  void *client = t->init(pipe_path, 0, FALSE);
+  if (server == NULL || client == NULL) error("[%s] Cannot initialize the exchanger at %s", t->name, pipe_path);
+
+  MBoard mboard;
+  memset(&mboard, 0, sizeof(mboard));
+  ClearBoard(&mboard.board);
+  mboard.seq = 1;
+  for (int i = 0; i < n; ++i) {
+    mboard.b = i + 1;
+    mboard.priority = (i * 7) % 5;
+    if (! t->client_send_board(client, &mboard)) error("[%s] Cannot send board %d", t->name, i);
+  }
+  // Let the pipe server drain the pipe.
+  usleep(100000);
+
+  MBoard *mboards = (MBoard *)malloc(sizeof(MBoard) * n);
+  MBoard *pboards[n];
+  for (int i = 0; i < n; ++i) pboards[i] = &mboards[i];
+  for (int k = 0; k < n; k += batch) {
+    int num = t->server_get_batch(server, pboards + k, batch, 0);
+    if (num != batch) error("[%s] Only got %d boards out of %d", t->name, num, batch);
+  }
+  for (int i = 0; i < n; ++i) {
+    for (int j = (i / batch + 1) * batch; j < n; ++j) {
+      if (mboards[j].priority > mboards[i].priority || (mboards[j].priority == mboards[i].priority && mboards[j].b < mboards[i].b)) {
+        error("[%s] b = %lu (priority = %d) comes after b = %lu (priority = %d)", t->name,
+            mboards[j].b, mboards[j].priority, mboards[i].b, mboards[i].priority);
+      }
+    }
+  }
+  printf("[%s] Priority order passed\n", t->name);
+
+  free(mboards);
+  t->destroy(client);
+  t->destroy(server);
+}
+
+int main(int argc, char *argv[]) {
+  char pipe_path[200];
+  int num_boards = 100000;
+  int num_threads = 16;
+  int max_inflight = 128;
+
+  strcpy(pipe_path, "/tmp");
+  if (argc >= 2) sscanf(argv[1], "%s", pipe_path);
+  if (argc >= 3) sscanf(argv[2], "%d", &num_boards);
+  if (argc >= 4) sscanf(argv[3], "%d", &num_threads);
+  if (argc >= 5) sscanf(argv[4], "%d", &max_inflight);
+
+  for (int i = 0; i < (int)(sizeof(transports) / sizeof(transports[0])); ++i) {
+    check_priority(&transports[i], pipe_path);
+    run(&transports[i], pipe_path, num_boards, num_threads, max_inflight);
+  }
+  return 0;
+}
@@ -0,0 +1,205 @@
+//
+// Copyright (c) 2016-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "eval_cache.h"
+
+// Set-associative table. Each set is protected by one of the striped locks.
+#define EC_WAYS 4
+#define EC_NUM_LOCKS 64
+
+#define EC_EMPTY 0
+#define EC_PENDING 1
+#define EC_READY 2
+
+typedef struct {
+  uint64_t key;
+  int state;
+  // For pending entry.
+  long seq;
+  void *owner;
+  int num_waiters;
+  void *waiters[EC_MAX_WAITERS];
+  // For LRU.
+  unsigned int stamp;
+  MMove mmove;
+} EvalEntry;
+
+typedef struct {
+  int num_sets;
+  EvalEntry *entries;
+  pthread_mutex_t locks[EC_NUM_LOCKS];
+  unsigned int clock;
+
+  // Stats.
+  int num_hit, num_miss, num_waiting, num_store;
+} EvalCache;
+
+void *EvalCacheInit(int size) {
+  EvalCache *c = (EvalCache *)malloc(sizeof(EvalCache));
+  memset(c, 0, sizeof(EvalCache));
+  c->num_sets = (size + EC_WAYS - 1) / EC_WAYS;
+  if (c->num_sets < 1) c->num_sets = 1;
+  c->entries = (EvalEntry *)calloc(c->num_sets * EC_WAYS, sizeof(EvalEntry));
+  if (c->entries == NULL) error("EvalCacheInit: cannot allocate %d entries!", size);
+  for (int i = 0; i < EC_NUM_LOCKS; ++i) {
+    pthread_mutex_init(&c->locks[i], NULL);
+  }
+  return c;
+}
+
+void EvalCacheFree(void *ctx) {
+  if (ctx == NULL) return;
+  EvalCache *c = (EvalCache *)ctx;
+  for (int i = 0; i < EC_NUM_LOCKS; ++i) {
+    pthread_mutex_destroy(&c->locks[i]);
+  }
+  free(c->entries);
+  free(c);
+}
+
+static inline int get_set(const EvalCache *c, uint64_t key) {
+  // The low bits of Zobrist hash are already well mixed.
+  return (int)(key % c->num_sets);
+}
+
+static EvalEntry *find(EvalCache *c, int set, uint64_t key) {
+  EvalEntry *e = &c->entries[set * EC_WAYS];
+  for (int i = 0; i < EC_WAYS; ++i) {
+    if (e[i].state != EC_EMPTY && e[i].key == key) return &e[i];
+  }
+  return NULL;
+}
+
+// Pick an entry to overwrite. Never evict a pending entry with the current seq (someone is waiting on it).
+static EvalEntry *pick_victim(EvalCache *c, int set, long seq) {
+  EvalEntry *e = &c->entries[set * EC_WAYS];
+  EvalEntry *victim = NULL;
+  for (int i = 0; i < EC_WAYS; ++i) {
+    if (e[i].state == EC_EMPTY) return &e[i];
+    if (e[i].state == EC_PENDING && e[i].seq == seq) continue;
+    if (victim == NULL || e[i].stamp < victim->stamp) victim = &e[i];
+  }
+  return victim;
+}
+
+static void set_pending(EvalEntry *e, uint64_t key, long seq, void *requester) {
+  e->key = key;
+  e->state = EC_PENDING;
+  e->seq = seq;
+  e->owner = requester;
+  e->num_waiters = 0;
+}
+
+int EvalCacheLookup(void *ctx, uint64_t key, long seq, void *requester, MMove *mmove) {
+  EvalCache *c = (EvalCache *)ctx;
+  int set = get_set(c, key);
+  pthread_mutex_t *lock = &c->locks[set % EC_NUM_LOCKS];
+  int res = EC_MISS;
+
+  pthread_mutex_lock(lock);
+  EvalEntry *e = find(c, set, key);
+  if (e != NULL && e->state == EC_READY) {
+    e->stamp = __sync_add_and_fetch(&c->clock, 1);
+    memcpy(mmove, &e->mmove, sizeof(MMove));
+    __sync_fetch_and_add(&c->num_hit, 1);
+    res = EC_HIT;
+  } else if (e != NULL && e->seq == seq && e->owner == requester) {
+    // The owner is resending (e.g., the previous send failed), keep the waiters.
+    __sync_fetch_and_add(&c->num_miss, 1);
+  } else if (e != NULL && e->seq == seq) {
+    // Pending with the same seq, wait on it if there is room.
+    if (e->num_waiters < EC_MAX_WAITERS) {
+      e->waiters[e->num_waiters ++] = requester;
+      __sync_fetch_and_add(&c->num_waiting, 1);
+      res = EC_WAITING;
+    } else {
+      __sync_fetch_and_add(&c->num_miss, 1);
+    }
+  } else {
+    // Not found, or a stale pending request. We own the request now.
+    if (e == NULL) e = pick_victim(c, set, seq);
+    if (e != NULL) set_pending(e, key, seq, requester);
+    __sync_fetch_and_add(&c->num_miss, 1);
+  }
+  pthread_mutex_unlock(lock);
+  return res;
+}
+
+BOOL EvalCacheReserve(void *ctx, uint64_t key, long seq, void *requester) {
+  EvalCache *c = (EvalCache *)ctx;
+  int set = get_set(c, key);
+  pthread_mutex_t *lock = &c->locks[set % EC_NUM_LOCKS];
+  BOOL reserved = FALSE;
+
+  pthread_mutex_lock(lock);
+  EvalEntry *e = find(c, set, key);
+  if (e == NULL || (e->state == EC_PENDING && e->seq != seq)) {
+    if (e == NULL) e = pick_victim(c, set, seq);
+    if (e != NULL) {
+      set_pending(e, key, seq, requester);
+      reserved = TRUE;
+    }
+  }
+  pthread_mutex_unlock(lock);
+  return reserved;
+}
+
+int EvalCacheCancel(void *ctx, uint64_t key, void *requester, void **waiters) {
+  EvalCache *c = (EvalCache *)ctx;
+  int set = get_set(c, key);
+  pthread_mutex_t *lock = &c->locks[set % EC_NUM_LOCKS];
+  int num_waiters = 0;
+
+  pthread_mutex_lock(lock);
+  EvalEntry *e = find(c, set, key);
+  if (e != NULL && e->state == EC_PENDING && e->owner == requester) {
+    num_waiters = e->num_waiters;
+    memcpy(waiters, e->waiters, num_waiters * sizeof(void *));
+    e->state = EC_EMPTY;
+  }
+  pthread_mutex_unlock(lock);
+  return num_waiters;
+}
+
+int EvalCacheStore(void *ctx, uint64_t key, const MMove *mmove, void **waiters) {
+  EvalCache *c = (EvalCache *)ctx;
+  int set = get_set(c, key);
+  pthread_mutex_t *lock = &c->locks[set % EC_NUM_LOCKS];
+  int num_waiters = 0;
+
+  pthread_mutex_lock(lock);
+  EvalEntry *e = find(c, set, key);
+  if (e != NULL && e->state == EC_PENDING) {
+    num_waiters = e->num_waiters;
+    memcpy(waiters, e->waiters, num_waiters * sizeof(void *));
+  }
+  if (e == NULL) e = pick_victim(c, set, mmove->seq);
+  if (e != NULL) {
+    e->key = key;
+    e->state = EC_READY;
+    e->owner = NULL;
+    e->num_waiters = 0;
+    e->stamp = __sync_add_and_fetch(&c->clock, 1);
+    memcpy(&e->mmove, mmove, sizeof(MMove));
+    __sync_fetch_and_add(&c->num_store, 1);
+  }
+  pthread_mutex_unlock(lock);
+  return num_waiters;
+}
+
+void EvalCachePrintStats(void *ctx) {
+  EvalCache *c = (EvalCache *)ctx;
+  int total = c->num_hit + c->num_miss + c->num_waiting;
+  fprintf(stderr,"EvalCache: #entries = %d, lookup = %d, hit = %d, coalesced = %d, miss = %d, stored = %d, hit rate = %.2f%%\n",
+      c->num_sets * EC_WAYS, total, c->num_hit, c->num_waiting, c->num_miss, c->num_store,
+      total > 0 ? 100.0 * (c->num_hit + c->num_waiting) / total : 0.0);
+}
@@ -0,0 +1,59 @@
+//
+// Copyright (c) 2016-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+//
+
+#ifndef _EVAL_CACHE_H_
+#define _EVAL_CACHE_H_
+
+#include "../common/package.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bounded concurrent cache of CNN evaluations, keyed by the board hash (GetBoardHash).
+// Note that the hash does not cover the move history, so two transposed positions share the evaluation
+// even if the history planes of the features are slightly different.
+//
+// Each entry is either pending (one request is in flight) or ready (the reply is cached).
+// Requests for a pending position are coalesced: the later requester is registered as a waiter
+// and receives the reply of the first one.
+
+// Return values of EvalCacheLookup.
+// Not found (or the caller already owns the request), the caller should send the board.
+// Once the reply arrives, call EvalCacheStore. If the request is given up, call EvalCacheCancel.
+#define EC_MISS 0
+// Found, the cached reply is copied.
+#define EC_HIT 1
+// The same position is being evaluated, the caller is registered as a waiter.
+#define EC_WAITING 2
+
+// Max #waiters for one pending position. More requesters will get EC_MISS.
+#define EC_MAX_WAITERS 8
+
+// size: #entries.
+void *EvalCacheInit(int size);
+void EvalCacheFree(void *ctx);
+
+// requester is an opaque pointer returned to whoever stores the reply. Pending entries with a different seq are stale and taken over.
+int EvalCacheLookup(void *ctx, uint64_t key, long seq, void *requester, MMove *mmove);
+// Take ownership of a position for a speculative request, without waiting on it or reading the reply.
+// Return FALSE if the position is already cached or pending with the same seq (nothing to send).
+BOOL EvalCacheReserve(void *ctx, uint64_t key, long seq, void *requester);
+// Remove the pending entry owned by requester, and return its waiters (at most EC_MAX_WAITERS).
+int EvalCacheCancel(void *ctx, uint64_t key, void *requester, void **waiters);
+// Store the reply, and return the waiters of the same position (at most EC_MAX_WAITERS).
+int EvalCacheStore(void *ctx, uint64_t key, const MMove *mmove, void **waiters);
+
+void EvalCachePrintStats(void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
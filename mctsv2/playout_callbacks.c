@@ -22,85 +22,261 @@ static float sigmoid(float x) {
 
 // ========================= All callback functions =======================================
 //
-static inline float add_uct_prior(ThreadInfo *info, float confidence, int n, int n_parent) {
-  // For win rate, we need to put some DCNN prior. The prior will diminish when n is large, but remain strong when n is small.
-  // float online_prior = 1.0 - bl->data.opp_preds[i];
-  /*
-     float winning_rate_with_prior = (s->params.decision_mixture_ratio * confidence + s->params.online_prior_mixture_ratio * online_prior) / n + winning_rate;
-  // Put some noise to make things diverse a bit
-  float this_score = winning_rate_with_prior + C * sqrt(log_n_parent/ n) + 2 * thread_randf(info) * info->s->params.sigma;
-  */
+// ========================= UCT selection kernel =========================================
+// For child i with n = #visits + 1, the score is
+//   win_rate + (decision_mixture_ratio * confidence + noise) * factor, factor = sqrt(n_parent) / n (or 1 / n with use_old_uct)
+// where win_rate (from the current player's perspective) is blended with the RAVE win rate if RAVE is open, and the noise
+// is not scaled by factor unless use_sigma_over_n. The terms that only depend on the parent are computed once per node (UCTParams),
+// and all children are scored at once over the arrays in Stats.
+// With virtual loss, each in-flight simulation of a child adds virtual_loss lost games to its n.
+#if defined(__AVX__)
+#include <immintrin.h>
+#define UCT_WIDTH 8
+typedef __m256 VFloat;
+#define V_SET1 _mm256_set1_ps
+#define V_LOAD _mm256_loadu_ps
+#define V_LOAD_INT(p) _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(p)))
+#define V_STORE _mm256_storeu_ps
+#define V_ADD _mm256_add_ps
+#define V_MUL _mm256_mul_ps
+#define V_DIV _mm256_div_ps
+#define V_MAX _mm256_max_ps
+#define V_LT(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define V_EQ(a, b) _mm256_cmp_ps(a, b, _CMP_EQ_OQ)
+#define V_SELECT(mask, a, b) _mm256_blendv_ps(b, a, mask)
+#define V_MOVEMASK _mm256_movemask_ps
+#define V_INDICES(base) _mm256_setr_ps(base, base + 1, base + 2, base + 3, base + 4, base + 5, base + 6, base + 7)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define UCT_WIDTH 4
+typedef __m128 VFloat;
+#define V_SET1 _mm_set1_ps
+#define V_LOAD _mm_loadu_ps
+#define V_LOAD_INT(p) _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(p)))
+#define V_STORE _mm_storeu_ps
+#define V_ADD _mm_add_ps
+#define V_MUL _mm_mul_ps
+#define V_DIV _mm_div_ps
+#define V_MAX _mm_max_ps
+#define V_LT _mm_cmplt_ps
+#define V_EQ _mm_cmpeq_ps
+#define V_SELECT(mask, a, b) _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b))
+#define V_MOVEMASK _mm_movemask_ps
+#define V_INDICES(base) _mm_setr_ps(base, base + 1, base + 2, base + 3)
+#endif
+
+typedef struct {
+  // win_rate = flip_a + flip_s * black_win_rate.
+  float flip_a, flip_s;
+  // RAVE weight, 0 if RAVE is not open.
+  float beta;
+  // #lost games per in-flight simulation.
+  float vloss;
+  // prior = (prior_coeff * confidence + noise * noise_over_n) / n + noise * noise_const.
+  float prior_coeff;
+  float noise_over_n, noise_const;
+} UCTParams;
+
+static void uct_init_params(const TreeHandle *s, Stone player, unsigned int n_parent, UCTParams *u) {
+  float factor = s->params.use_old_uct ? 1.0 : sqrt(n_parent);
+  u->flip_a = (player == S_WHITE ? 1.0 : 0.0);
+  u->flip_s = (player == S_WHITE ? -1.0 : 1.0);
+  const float rave_k = 100;
+  u->beta = s->params.use_rave ? sqrt(rave_k / (n_parent + rave_k)) : 0.0;
+  u->vloss = s->params.virtual_loss;
+  u->prior_coeff = s->params.decision_mixture_ratio * factor;
+  u->noise_over_n = s->params.use_sigma_over_n ? factor : 0.0;
+  u->noise_const = s->params.use_sigma_over_n ? 0.0 : 1.0;
+}
 
-  TreeHandle *s = info->s;
-  float factor = s->params.use_old_uct ? 1.0 / n : sqrt(n_parent) / n;
+// Unpack the stats of the first n children into float arrays. Each word is read once, so visits and wins are consistent.
+#ifdef UCT_WIDTH
+// SSE2 version, 4 words at a time (n is a multiple of 4). The 32-bit halves of the words are split into two vectors:
+//   total = hi >> (STAT_WIN_BITS - 32), black_win = (hi & mask) * 2^(32 - FRAC) + (lo >> FRAC) + (lo & frac_mask) / 2^FRAC
+// so that every conversion to float is from a non-negative int32. A 16-byte load reads each 8-byte word atomically on x86.
+static inline void unpack_stats(const Stats *stats, int n, float *totals, float *black_wins) {
+  const __m128i hi_mask = _mm_set1_epi32((1 << (STAT_WIN_BITS - 32)) - 1), frac_mask = _mm_set1_epi32((1 << STAT_WIN_FRAC_BITS) - 1);
+  const __m128 hi_scale = _mm_set1_ps((float)(1ULL << (32 - STAT_WIN_FRAC_BITS))), frac_scale = _mm_set1_ps(1.0 / (1 << STAT_WIN_FRAC_BITS));
+  for (int i = 0; i < n; i += 4) {
+    __m128 a = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)&stats->packed[i]));
+    __m128 b = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)&stats->packed[i + 2]));
+    __m128i lo = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i hi = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    _mm_storeu_ps(&totals[i], _mm_cvtepi32_ps(_mm_srli_epi32(hi, STAT_WIN_BITS - 32)));
+    __m128 win = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(hi, hi_mask)), hi_scale);
+    win = _mm_add_ps(win, _mm_cvtepi32_ps(_mm_srli_epi32(lo, STAT_WIN_FRAC_BITS)));
+    win = _mm_add_ps(win, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(lo, frac_mask)), frac_scale));
+    _mm_storeu_ps(&black_wins[i], win);
+  }
+}
+#else
+static inline void unpack_stats(const Stats *stats, int n, float *totals, float *black_wins) {
+  for (int i = 0; i < n; ++i) {
+    uint64_t v = __atomic_load_n(&stats->packed[i], __ATOMIC_RELAXED);
+    totals[i] = stat_total(v);
+    black_wins[i] = stat_black_win(v);
+  }
+}
+#endif
+
+// Compute the scores of the first n children, return the index of the best one (the first one if there is a tie).
+// rave and inflights can be NULL. All arrays have BLOCK_SIZE entries, so the SIMD version can read past n.
+static int uct_select(const UCTParams *u, int n, const Stats *stats, const Stats *rave, const int *inflights,
+    const float *confidences, const float *noises, float *scores) {
+  float totals[BLOCK_SIZE] __attribute__((aligned(32))), black_wins[BLOCK_SIZE] __attribute__((aligned(32)));
+  float rave_totals[BLOCK_SIZE] __attribute__((aligned(32))), rave_black_wins[BLOCK_SIZE] __attribute__((aligned(32)));
+#ifdef UCT_WIDTH
+  int n_padded = (n + UCT_WIDTH - 1) / UCT_WIDTH * UCT_WIDTH;
+  unpack_stats(stats, n_padded, totals, black_wins);
+  if (rave != NULL) unpack_stats(rave, n_padded, rave_totals, rave_black_wins);
+
+  const VFloat half = V_SET1(0.5), one = V_SET1(1.0);
+  const VFloat flip_a = V_SET1(u->flip_a), flip_s = V_SET1(u->flip_s);
+  const VFloat beta = V_SET1(u->beta), one_minus_beta = V_SET1(1.0 - u->beta);
+  const VFloat prior_coeff = V_SET1(u->prior_coeff), noise_over_n = V_SET1(u->noise_over_n), noise_const = V_SET1(u->noise_const);
+  const VFloat vloss = V_SET1(u->vloss);
+  const VFloat vn = V_SET1((float)n), lowest = V_SET1(-INFINITY);
+  VFloat best = lowest;
+
+  for (int i = 0; i < n; i += UCT_WIDTH) {
+    VFloat total = V_ADD(V_LOAD(&totals[i]), one);
+    VFloat black_win = V_ADD(V_LOAD(&black_wins[i]), half);
+    if (inflights != NULL) {
+      // Virtual losses are losses for the current player (wins for black if white is to move).
+      VFloat loss = V_MUL(V_LOAD_INT(&inflights[i]), vloss);
+      total = V_ADD(total, loss);
+      black_win = V_ADD(black_win, V_MUL(loss, flip_a));
+    }
+    VFloat inv_n = V_DIV(one, total);
+    VFloat win_rate = V_MUL(black_win, inv_n);
+    if (rave != NULL) {
+      VFloat rave_win_rate = V_DIV(V_ADD(V_LOAD(&rave_black_wins[i]), half), V_ADD(V_LOAD(&rave_totals[i]), one));
+      win_rate = V_ADD(V_MUL(win_rate, one_minus_beta), V_MUL(rave_win_rate, beta));
+    }
+    VFloat noise = V_LOAD(&noises[i]);
+    VFloat prior = V_ADD(V_MUL(V_ADD(V_MUL(prior_coeff, V_LOAD(&confidences[i])), V_MUL(noise, noise_over_n)), inv_n), V_MUL(noise, noise_const));
+    VFloat score = V_ADD(V_ADD(flip_a, V_MUL(flip_s, win_rate)), prior);
+    // Lanes beyond n never win.
+    score = V_SELECT(V_LT(V_INDICES((float)i), vn), score, lowest);
+    V_STORE(&scores[i], score);
+    best = V_MAX(best, score);
+  }
 
-  // winning_rate_with_prior += (s->params.decision_mixture_ratio * bl->cnn_data.confidences[i] + s->params.online_prior_mixture_ratio * online_prior) / n;
-  float prior = s->params.decision_mixture_ratio * confidence * factor;
+  float lanes[UCT_WIDTH];
+  V_STORE(lanes, best);
+  float best_score = lanes[0];
+  for (int k = 1; k < UCT_WIDTH; ++k) {
+    if (lanes[k] > best_score) best_score = lanes[k];
+  }
+  best = V_SET1(best_score);
+  for (int i = 0; i < n; i += UCT_WIDTH) {
+    int mask = V_MOVEMASK(V_EQ(V_LOAD(&scores[i]), best));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  return 0;
+#else
+  unpack_stats(stats, n, totals, black_wins);
+  if (rave != NULL) unpack_stats(rave, n, rave_totals, rave_black_wins);
+
+  int best = 0;
+  for (int i = 0; i < n; ++i) {
+    float total = totals[i] + 1;
+    float black_win = black_wins[i] + 0.5;
+    if (inflights != NULL) {
+      float loss = inflights[i] * u->vloss;
+      total += loss;
+      black_win += loss * u->flip_a;
+    }
+    float inv_n = 1.0 / total;
+    float win_rate = black_win * inv_n;
+    if (rave != NULL) {
+      float rave_win_rate = (rave_black_wins[i] + 0.5) / (rave_totals[i] + 1);
+      win_rate = win_rate * (1 - u->beta) + rave_win_rate * u->beta;
+    }
+    float prior = (u->prior_coeff * confidences[i] + noises[i] * u->noise_over_n) * inv_n + noises[i] * u->noise_const;
+    scores[i] = u->flip_a + u->flip_s * win_rate + prior;
+    if (scores[i] > scores[best]) best = i;
+  }
+  return best;
+#endif
+}
 
-  // Put some noise to make things diverse a bit
-  if (s->params.num_virtual_games == 0) {
-    float noise = 2 * thread_randf(info) * s->params.sigma;
-    if (s->params.use_sigma_over_n) prior += noise * factor;
-    else prior += noise;
+// #visits of the edge that leads to bl.
+// In transposition mode, bl->parent might not be where we come from, so we use the path of this rollout instead.
+static inline int get_parent_total(const ThreadInfo *info, const TreeBlock *bl) {
+  if (USE_TRANSPOSITION(info->s)) {
+    int k = info->path_len - 1;
+    return stat_total(info->path[k]->data.stats.packed[info->path_offsets[k]]);
   }
-  return prior;
+  return stat_total(bl->parent->data.stats.packed[bl->parent_offset]);
 }
 
-// =================================== Policy
-BOOL cnn_policy(ThreadInfo *info, TreeBlock *bl, const Board *board, BlockOffset *offset, TreeBlock **child_chosen) {
+// Pick the child with the highest noisy UCT score given the priors. Shared by cnn_policy and async_policy.
+static BOOL uct_policy(ThreadInfo *info, TreeBlock *bl, const Board *board, const float *confidences, BlockOffset *offset, TreeBlock **child_chosen) {
   TreeHandle *s = info->s;
-
-  if (bl->terminal_status != S_EMPTY) return FALSE;
   char buf[30];
 
-  const float C = 1.4142;
-  // Find the node with highest noisy winrate score
-  float best_score = -1.0;
-
   Stone player = board->_next_player;
+  int n = bl->n;
+  if (n == 0) return FALSE;
 
-  for (int i = 0; i < bl->n; ++i) {
-    float black_win = ((float)bl->data.stats[i].black_win) + 0.5;
-    unsigned int n = bl->data.stats[i].total + 1;
-    unsigned int n_parent = bl->parent->data.stats[bl->parent_offset].total + 1;
-
-    float log_n_parent = log2((float)n_parent);
-    float winning_rate = ((float)black_win) / n;
-    if (player == S_WHITE) winning_rate = 1 - winning_rate;
-
-    // If there is rave open, add rave heuristic.
-    if (s->params.use_rave) {
-      float rave_winning_rate = ((float)bl->data.rave_stats[i].black_win + 0.5) / (bl->data.rave_stats[i].total + 1);
-      if (player == S_WHITE) rave_winning_rate = 1 - rave_winning_rate;
-
-      const float rave_k = 100;
-      const float beta = sqrt(rave_k / (n_parent + rave_k));
-      const float combined_winning_rate = winning_rate * (1 - beta) + rave_winning_rate * beta;
-      PRINT_DEBUG("[%d]: %s, win_rate = %f, rave_win_rate = %f, beta = %f, combined_win_rate = %f, n_parent = %d\n",
-        i, get_move_str(bl->data.moves[i], player, buf), winning_rate, rave_winning_rate, beta, combined_winning_rate, n_parent);
+  UCTParams u;
+  unsigned int n_parent = get_parent_total(info, bl) + 1;
+  uct_init_params(s, player, n_parent, &u);
 
-      winning_rate = combined_winning_rate;
+  // Put some noise to make things diverse a bit
+  float noises[BLOCK_SIZE] __attribute__((aligned(32)));
+  memset(noises, 0, sizeof(noises));
+  if (s->params.num_virtual_games == 0) {
+    for (int i = 0; i < n; ++i) {
+      noises[i] = 2 * thread_randf(info) * s->params.sigma;
     }
+  }
 
-    float this_score = winning_rate + add_uct_prior(info, bl->cnn_data.confidences[i], n, n_parent);
+  float scores[BLOCK_SIZE] __attribute__((aligned(32)));
+  int best = uct_select(&u, n, &bl->data.stats, s->params.use_rave ? bl->data.rave_stats : NULL,
+      USE_VIRTUAL_LOSS(s) ? bl->data.inflights : NULL, confidences, noises, scores);
 
-    // For win rate, we need to put some DCNN prior. The prior will diminish when n is large, but remain strong when n is small.
-    // float winning_rate_with_prior = (s->params.decision_mixture_ratio * bl->cnn_data.confidences[i] + s->params.online_prior_mixture_ratio * online_prior) / n + winning_rate;
-    PRINT_DEBUG("[%d]: %s, score = %f, n = %d, n_parent = %d, winning_rate = %f, cnn = %f, score = %f\n",
-        i, get_move_str(bl->data.moves[i], player, buf), this_score, n, n_parent, winning_rate, bl->cnn_data.confidences[i], this_score);
-    //
-    if (this_score > best_score) {
-      best_score = this_score;
-      *offset = i;
-      *child_chosen = bl->children[i].child;
+  if (s->params.verbose >= V_DEBUG) {
+    for (int i = 0; i < n; ++i) {
+      PRINT_DEBUG("[%d]: %s, score = %f, n = %d, n_parent = %d, conf = %f, beta = %f\n",
+          i, get_move_str(bl->data.moves[i], player, buf), scores[i], stat_total(bl->data.stats.packed[i]) + 1, n_parent, confidences[i], u.beta);
     }
   }
-  PRINT_DEBUG("Best score = %f, best index = %d, best move = %s\n", best_score, *offset, get_move_str(bl->data.moves[*offset], player, buf));
-  if (best_score < 0) {
+
+  PRINT_DEBUG("Best score = %f, best index = %d, best move = %s\n", scores[best], best, get_move_str(bl->data.moves[best], player, buf));
+  if (scores[best] < 0) {
     // No node is selected.
     return FALSE;
   }
+  *offset = best;
+  *child_chosen = bl->children[best].child;
+  return TRUE;
+}
+
+void add_virtual_loss(ThreadInfo *info, TreeBlock *bl, BlockOffset offset) {
+  if (info->vloss_len > MAX_PATH_LEN) error("Virtual loss path is too long! len = %d", info->vloss_len);
+  __sync_fetch_and_add(&bl->data.inflights[offset], 1);
+  info->vloss_path[info->vloss_len] = bl;
+  info->vloss_offsets[info->vloss_len] = offset;
+  info->vloss_len ++;
+}
+
+void revert_virtual_loss(ThreadInfo *info) {
+  for (int i = 0; i < info->vloss_len; ++i) {
+    __sync_fetch_and_add(&info->vloss_path[i]->data.inflights[info->vloss_offsets[i]], -1);
+  }
+  info->vloss_len = 0;
+}
+
+// =================================== Policy
+static void prefetch_children(ThreadInfo *info, TreeBlock *bl, const Board *board);
+
+BOOL cnn_policy(ThreadInfo *info, TreeBlock *bl, const Board *board, BlockOffset *offset, TreeBlock **child_chosen) {
+  if (bl->terminal_status != S_EMPTY) return FALSE;
+  if (! uct_policy(info, bl, board, bl->cnn_data.confidences, offset, child_chosen)) return FALSE;
   info->use_cnn ++;
+  if (info->s->params.prefetch_n_thres > 0) prefetch_children(info, bl, board);
   return TRUE;
 }
 
@@ -169,38 +345,9 @@ BOOL async_policy(ThreadInfo *info, TreeBlock *bl, const Board *board, BlockOffs
 
   if (bl->terminal_status != S_EMPTY) return FALSE;
   BOOL use_cnn_policy = cnn_data_get_evaluated_bit(&bl->cnn_data, BIT_CNN_RECEIVED);
-  char buf[30];
-
-  const float C = 1.4142;
-  // Find the node with highest noisy winrate score
-  float best_score = -1.0;
-  Stone player = board->_next_player;
 
   PRINT_DEBUG("Async_policy. b = %lx, use_cnn_policy = %s, n = %d\n", (uint64_t)bl, STR_BOOL(use_cnn_policy), bl->n);
-  for (int i = 0; i < bl->n; ++i) {
-    float black_win = ((float)bl->data.stats[i].black_win) + 0.5;
-    unsigned int n = bl->data.stats[i].total + 1;
-    unsigned int n_parent = bl->parent->data.stats[bl->parent_offset].total + 1;
-
-    float log_n_parent = log2((float)n_parent);
-    float winning_rate = ((float)black_win) / n;
-    if (player == S_WHITE) winning_rate = 1 - winning_rate;
-
-    float confidence = use_cnn_policy ? bl->cnn_data.confidences[i] : bl->cnn_data.fast_confidences[i];
-    float this_score = winning_rate + add_uct_prior(info, confidence, n, n_parent);
-
-    PRINT_DEBUG("[%d]: %s, score = %f, n = %d, n_parent = %d, winning_rate = %f, conf = %f, winning_rate+prior = %f\n",
-        i, get_move_str(bl->data.moves[i], player, buf), this_score, n, n_parent, winning_rate, confidence, this_score);
-    //
-    // float this_score = winning_rate + bl->cnn_data.confidences[i] + thread_randf(info) * sigma;
-    // float this_score = winning_rate + thread_randf(info);
-    if (this_score > best_score) {
-      best_score = this_score;
-      *offset = i;
-      *child_chosen = bl->children[i].child;
-    }
-  }
-  PRINT_DEBUG("Best score = %f, best index = %d, best move = %s\n", best_score, *offset, get_move_str(bl->data.moves[*offset], player, buf));
+  BOOL selected = uct_policy(info, bl, board, use_cnn_policy ? bl->cnn_data.confidences : bl->cnn_data.fast_confidences, offset, child_chosen);
 
   if (! s->common_params->cpu_only) {
     if (use_cnn_policy) {
@@ -210,17 +357,30 @@ BOOL async_policy(ThreadInfo *info, TreeBlock *bl, const Board *board, BlockOffs
     }
   }
   info->use_async ++;
-
-  if (best_score < 0) {
-    // No node is selected.
-    return FALSE;
-  }
-
-  return TRUE;
+  return selected;
 }
 
 // Leaf expansion.
 // ============================= Expansion Related ==================================
+// Priority of the evaluation of b (see PR_HIGHEST). Boards that tree threads block on (sync mode) come first,
+// then the nodes closer to the root and with more visits on their edge.
+// Note that a new leaf is sent before it is pushed to info->path, so in transposition mode its #visits is unknown (taken as 0).
+static int cnn_priority(const ThreadInfo *info, const TreeBlock *b, const Board *board) {
+  const TreeHandle *s = info->s;
+  if (b->parent == NULL || b->parent == s->p.root) return PR_HIGHEST;
+  int pr = s->params.use_async ? 0 : PR_HIGHEST / 2;
+  int visits = 0;
+  if (! USE_TRANSPOSITION(s)) {
+    visits = stat_total(b->parent->data.stats.packed[b->parent_offset]);
+  } else if (info->path_len > 0 && info->path[info->path_len - 1]->children[info->path_offsets[info->path_len - 1]].child == b) {
+    visits = get_parent_total(info, b);
+  }
+  // log2 of #visits.
+  pr += 32 - __builtin_clz(visits + 1);
+  pr -= board->_ply - s->board._ply;
+  return pr < 0 ? 0 : (pr > PR_HIGHEST ? PR_HIGHEST : pr);
+}
+
 static BOOL send_to_cnn(ThreadInfo *info, TreeBlock *b, const Board *board) {
   // Send the current player to CNN for evaluation.
   // Check if someone else has sent it.
@@ -240,10 +400,35 @@ static BOOL send_to_cnn(ThreadInfo *info, TreeBlock *b, const Board *board) {
   // If the sequence number is out-of-date, we just clear it.
   if (b->cnn_data.seq != s->seq) cnn_data_clear_evaluated_bit(&b->cnn_data, BIT_CNN_SENT);
 
+  // Check the evaluation cache first.
+  uint64_t hash = GetBoardHash(board);
+  if (s->eval_cache != NULL) {
+    MMove mmove;
+    int res = EvalCacheLookup(s->eval_cache, hash, s->seq, b, &mmove);
+    if (res != EC_MISS) {
+      b->cnn_data.seq = s->seq;
+      cnn_data_set_evaluated_bit(&b->cnn_data, BIT_CNN_SENT);
+      if (res == EC_HIT) {
+        // Use the cached evaluation as if it is returned now.
+        mmove.b = (uint64_t) b;
+        mmove.seq = s->seq;
+        fill_block_with_cnn_move(s, b, &mmove, &info->seed);
+        __sync_fetch_and_add(&s->dcnn_count, 1);
+        info->cnn_cache_hit ++;
+      } else {
+        // Someone else is evaluating the same position, the move receiver will fill this block once the reply arrives.
+        info->cnn_cache_waiting ++;
+      }
+      cnn_data_clear_evaluated_bit(&b->cnn_data, BIT_CNN_TRY_SEND);
+      return TRUE;
+    }
+  }
+
   // Send the message.
   MBoard mboard;
   mboard.b = (uint64_t) b;
   mboard.seq = s->seq;
+  mboard.priority = cnn_priority(info, b, board);
   CopyBoard(&mboard.board, board);
 
 /*  ShowBoard(&mboard.board, SHOW_LAST_MOVE);
@@ -256,7 +441,15 @@ static BOOL send_to_cnn(ThreadInfo *info, TreeBlock *b, const Board *board) {
   b->cnn_data.seq = s->seq;
   cnn_data_set_evaluated_bit(&b->cnn_data, BIT_CNN_SENT);
 
-  if (s->callbacks.callback_send_board(s->callbacks.context, info->ex_id, &mboard)) {
+  BOOL sent;
+  if (s->callbacks.callback_send_board_delta != NULL && b->parent != NULL && ! USE_TRANSPOSITION(s)) {
+    // Without transposition, the board is the board of the parent plus the last move. The parent was sent with its address as id.
+    sent = s->callbacks.callback_send_board_delta(s->callbacks.context, info->ex_id, &mboard, (uint64_t) b->parent, board->_last_move);
+  } else {
+    sent = s->callbacks.callback_send_board(s->callbacks.context, info->ex_id, &mboard);
+  }
+
+  if (sent) {
     // Note that in asynchronized version, Ideally, setting BIT_CNN_SENT and ExLocalClientSendBoard should be in the critical region.
     // Otherwise the board might get sent twice. But it should not harm too much.
     // Save the sent sequence.
@@ -265,6 +458,15 @@ static BOOL send_to_cnn(ThreadInfo *info, TreeBlock *b, const Board *board) {
     cnn_data_clear_evaluated_bit(&b->cnn_data, BIT_CNN_TRY_SEND);
     return TRUE;
   } else {
+    // In async mode, we might never resend it, so release the blocks waiting on it and let them send by themselves.
+    // In sync mode, we will keep resending until it succeeds.
+    if (s->eval_cache != NULL && s->params.use_async) {
+      void *waiters[EC_MAX_WAITERS];
+      int num_waiters = EvalCacheCancel(s->eval_cache, hash, b, waiters);
+      for (int i = 0; i < num_waiters; ++i) {
+        cnn_data_clear_evaluated_bit(&((TreeBlock *)waiters[i])->cnn_data, BIT_CNN_SENT);
+      }
+    }
     cnn_data_clear_evaluated_bit(&b->cnn_data, BIT_CNN_SENT);
     // Release the token so that other thread can resend.
     cnn_data_clear_evaluated_bit(&b->cnn_data, BIT_CNN_TRY_SEND);
@@ -281,6 +483,56 @@ static void fill_block_with_fast_rollout(const TreeHandle *s, const Board *board
   PatternV2DestroyBoardExtra(be);
 }
 
+// Send the top unexpanded children of a hot node bl (sync mode) to CNN at the lowest priority, so that the GPU evaluates them
+// between the batches that tree threads are blocked on. There is no block for a child yet, so the reply is parked in the
+// evaluation cache (see receive_one_move), and the later expansion of the child is a cache hit, or waits on the request in flight.
+static void prefetch_children(ThreadInfo *info, TreeBlock *bl, const Board *board) {
+  TreeHandle *s = info->s;
+  if (s->eval_cache == NULL || s->common_params->cpu_only) return;
+  if (get_parent_total(info, bl) < s->params.prefetch_n_thres) return;
+  // Only the first thread that sees bl hot does it.
+  if (__sync_lock_test_and_set(&bl->prefetched, 1)) return;
+
+  BOOL picked[BLOCK_SIZE];
+  memset(picked, 0, sizeof(picked));
+  for (int k = 0; k < s->params.prefetch_topk; ++k) {
+    // Pick the unexpanded child with the highest prior.
+    int best = -1;
+    for (int i = 0; i < bl->n; ++i) {
+      if (picked[i] || bl->children[i].child != NULL) continue;
+      if (best < 0 || bl->cnn_data.confidences[i] > bl->cnn_data.confidences[best]) best = i;
+    }
+    if (best < 0) break;
+    picked[best] = TRUE;
+
+    MBoard mboard;
+    GroupId4 ids;
+    CopyBoard(&mboard.board, board);
+    if (! TryPlay2(&mboard.board, bl->data.moves[best], &ids)) continue;
+    Play(&mboard.board, &ids);
+
+    uint64_t hash = GetBoardHash(&mboard.board);
+    if (! EvalCacheReserve(s->eval_cache, hash, s->seq, (void *)PREFETCH_ID(s))) continue;
+
+    mboard.b = PREFETCH_ID(s);
+    mboard.seq = s->seq;
+    mboard.priority = 0;
+    if (s->callbacks.callback_send_board(s->callbacks.context, info->ex_id, &mboard)) {
+      info->cnn_prefetch_sent ++;
+      continue;
+    }
+
+    // Give it up, and hand the blocks that started waiting on it in the meantime back to their threads. A thread blocked on
+    // its block wakes up and sends the board itself (see dcnn_leaf_expansion). A parked leaf is sent again by its thread
+    // the next time it resumes its simulations (see resume_simulations).
+    void *waiters[EC_MAX_WAITERS];
+    int num_waiters = EvalCacheCancel(s->eval_cache, hash, (void *)PREFETCH_ID(s), waiters);
+    for (int i = 0; i < num_waiters; ++i) {
+      cnn_data_cancel_sent(&((TreeBlock *)waiters[i])->cnn_data);
+    }
+  }
+}
+
 BOOL dcnn_leaf_expansion(ThreadInfo *info, const Board *board, TreeBlock *b) {
   const TreeHandle *s = info->s;
 
@@ -299,18 +551,30 @@ BOOL dcnn_leaf_expansion(ThreadInfo *info, const Board *board, TreeBlock *b) {
     // send_to_cnn(info, b, board);
     // If we are in asynchronized mode and the number of attempts exceed the threshold, we leave the loop.
   } else {
-    // If it is synchronized, then we need to keep sending until it is done.
-    for (int i = 0; ;++i) {
-      // If we send stuff successfully, we leave the loop.
-      if (send_to_cnn(info, b, board)) {
-        // Wait until cnn moves is returned.
-        PRINT_DEBUG("Wait until CNN moves are returned..\n");
-        cnn_data_wait_until_evaluated_bit(&b->cnn_data, BIT_CNN_RECEIVED);
-        PRINT_DEBUG("CNN moves are returned..\n");
-        return TRUE;
-      }
-      PRINT_DEBUG("Send failed, resend...\n");
+    dcnn_leaf_send(info, board, b);
+    // Wait until cnn moves is returned. If the request is given up (see receive_one_move), send it again.
+    PRINT_DEBUG("Wait until CNN moves are returned..\n");
+    while (! TEST_BIT(cnn_data_wait_until_received_or_cancelled(&b->cnn_data), BIT_CNN_RECEIVED)) {
+      dcnn_leaf_send(info, board, b);
     }
+    PRINT_DEBUG("CNN moves are returned..\n");
+    return TRUE;
+  }
+  return FALSE;
+}
+
+// How long a tree thread waits for a credit before it tries to send again.
+#define SEND_WAIT_MS 10
+
+BOOL dcnn_leaf_send(ThreadInfo *info, const Board *board, TreeBlock *b) {
+  const TreeHandle *s = info->s;
+  // If it is synchronized, then we need to keep sending until it is done.
+  for (int i = 0; ;++i) {
+    // If we send stuff successfully, we leave the loop.
+    if (send_to_cnn(info, b, board)) return TRUE;
+    PRINT_DEBUG("Send failed, resend...\n");
+    // Most likely the credits are used up, wait until some come back instead of spinning.
+    if (s->callbacks.callback_wait_send != NULL) s->callbacks.callback_wait_send(s->callbacks.context, info->ex_id, SEND_WAIT_MS);
   }
   return FALSE;
 }
@@ -424,7 +688,9 @@ static void update_online_model(ThreadInfo *info, Stone player, TreeBlock *b) {
   for (;b != p->root; b = b->parent, player = OPPONENT(player)) {
     TreeBlock * parent = b->parent;
     BlockOffset parent_offset = b->parent_offset;
-    const Stat* stat = &b->parent->data.stats[parent_offset];
+    uint64_t stat = b->parent->data.stats.packed[parent_offset];
+    float black_win = stat_black_win(stat);
+    int total = stat_total(stat);
 
     if (b->extra == NULL) continue;
 
@@ -455,12 +721,12 @@ static void update_online_model(ThreadInfo *info, Stone player, TreeBlock *b) {
     } else {
       // Normal mode.
       // Get actual win rate.
-      float win_rate = ((float)stat->black_win) / stat->total;
+      float win_rate = black_win / total;
       if (player == S_WHITE) win_rate = 1 - win_rate;
 
-      update_model = stat->total > 30;
+      update_model = total > 30;
       target = win_rate;
-      weight = min(stat->total, 1000);
+      weight = min(total, 1000);
     }
 
     // One must make sure that if update_model is TRUE, target must be meaningful.
@@ -536,6 +802,32 @@ float threaded_compute_score(ThreadInfo *info, const Board *board) {
 }
 
 // =============================================== Back propagation.
+void flush_bp_deltas(ThreadInfo *info) {
+  for (int i = 0; i < info->num_bp_deltas; ++i) {
+    __sync_fetch_and_add(info->bp_deltas[i].loc, info->bp_deltas[i].delta);
+  }
+  info->num_bp_deltas = 0;
+  info->num_bp_pending = 0;
+}
+
+// Add delta to the stat word at loc, which belongs to an edge at the given depth.
+static inline void bp_add(ThreadInfo *info, uint64_t *loc, uint64_t delta, int depth) {
+  if (depth >= info->s->params.bp_coalesce_depth) {
+    __sync_fetch_and_add(loc, delta);
+    return;
+  }
+  for (int i = 0; i < info->num_bp_deltas; ++i) {
+    if (info->bp_deltas[i].loc == loc) {
+      info->bp_deltas[i].delta += delta;
+      return;
+    }
+  }
+  if (info->num_bp_deltas == MAX_BP_DELTAS) flush_bp_deltas(info);
+  info->bp_deltas[info->num_bp_deltas].loc = loc;
+  info->bp_deltas[info->num_bp_deltas].delta = delta;
+  info->num_bp_deltas ++;
+}
+
 void threaded_run_bp(ThreadInfo *info, float black_moku, Stone next_player, int end_ply, BOOL board_on_child, BlockOffset child_offset, TreeBlock *b) {
   TreeHandle *s = info->s;
   TreePool *p = &s->p;
@@ -561,24 +853,31 @@ void threaded_run_bp(ThreadInfo *info, float black_moku, Stone next_player, int
   TreeBlock *curr;
   BlockOffset curr_offset;
 
+  // In transposition mode, walk up along the path of this rollout instead of the parent pointers.
+  // Either way, path[k] is the edge above the current one, so the current edge is at depth k + 1.
+  BOOL use_path = USE_TRANSPOSITION(s);
+  int k = info->path_len - 1;
+
   if (board_on_child) {
     curr = b;
     curr_offset = child_offset;
   } else {
-    curr = b->parent;
-    curr_offset = b->parent_offset;
+    if (use_path) {
+      curr = info->path[k];
+      curr_offset = info->path_offsets[k];
+    } else {
+      curr = b->parent;
+      curr_offset = b->parent_offset;
+    }
+    k --;
   }
 
+  // Visits and wins are packed, so one atomic add updates both.
+  const uint64_t delta = STAT_PACK(1, black_count);
+
   // Backprop from b.
   while (curr != NULL) {
-    Stat* stat = &curr->data.stats[curr_offset];
-
-    // Add total first, otherwise the winning rate might go over 1.
-    __sync_add_and_fetch(&stat->total, 1);
-    inc_atomic_float(&stat->black_win, black_count);
-    // stat->total += 1;
-    // stat->black_win += black_count;
-    // __sync_add_and_fetch(&stat->black_win, black_count);
+    bp_add(info, &curr->data.stats.packed[curr_offset], delta, k + 1);
 
     // Then update rave, if rave mode is open
     if (s->params.use_rave) {
@@ -589,19 +888,27 @@ void threaded_run_bp(ThreadInfo *info, float black_moku, Stone next_player, int
       for (int i = 0; i < curr->n; ++i) {
         Coord m = curr->data.moves[i];
         if (rave_moves[m]) {
-          Stat *rave_stat = &curr->data.rave_stats[i];
-          __sync_add_and_fetch(&rave_stat->total, 1);
-          inc_atomic_float(&rave_stat->black_win, black_count);
-          // __sync_add_and_fetch(&rave_stat->black_win, black_count);
+          bp_add(info, &curr->data.rave_stats->packed[i], delta, k + 1);
         }
       }
     }
 
-    curr_offset = curr->parent_offset;
-    curr = curr->parent;
+    if (use_path) {
+      curr = k >= 0 ? info->path[k] : NULL;
+      curr_offset = k >= 0 ? info->path_offsets[k] : 0;
+    } else {
+      curr_offset = curr->parent_offset;
+      curr = curr->parent;
+    }
+    k --;
   }
 
-  if (s->params.use_online_model) {
+  // The real result is in, so remove our virtual loss.
+  revert_virtual_loss(info);
+
+  if (info->num_bp_deltas > 0 && ++ info->num_bp_pending >= s->params.bp_flush_interval) flush_bp_deltas(info);
+
+  if (s->params.use_online_model && ! use_path) {
     // Update the online model.
     Stone player = (board_on_child ? OPPONENT(next_player) : next_player);
     update_online_model(info, player, b);
@@ -620,7 +927,7 @@ static void update_pn(ThreadInfo *info, BOOL board_on_child, Stone player, TreeB
     printf("==========Error===========\n");
     ShowBoard(board, SHOW_ALL);
     printf("player from outside = %s, player in the block = %s, board_on_child = %s\n", STR_STONE(player), STR_STONE(bl->player), STR_BOOL(board_on_child));
-    tree_simple_visitor_cnn(stdout, bl, 0);
+    tree_simple_visitor_cnn(stdout, bl->parent, bl->parent_offset, bl, 0);
     error("UpdatePN: current player is different from bl->player\n");
   }
   */
@@ -677,7 +984,7 @@ static void update_pn(ThreadInfo *info, BOOL board_on_child, Stone player, TreeB
   __atomic_store_n(&pn->w, w, __ATOMIC_RELAXED);
   __atomic_store_n(&pn->b, b, __ATOMIC_RELAXED);
 
-  __sync_fetch_and_add(&parent->data.stats[bl->parent_offset].total, 1);
+  __sync_fetch_and_add(&parent->data.stats.packed[bl->parent_offset], STAT_PACK(1, 0));
 }
 
 void threaded_run_tsumego_bp(ThreadInfo *info, float black_moku, Stone next_player, int end_ply, BOOL board_on_child, BlockOffset child_offset, TreeBlock *b) {
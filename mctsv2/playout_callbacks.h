@@ -17,9 +17,18 @@ BOOL cnn_policy(ThreadInfo *info, TreeBlock *bl, const Board *board, BlockOffset
 void threaded_run_bp(ThreadInfo *info, float black_moku, Stone next_player, int end_ply, BOOL board_on_child, BlockOffset child_offset, TreeBlock *b);
 float threaded_compute_score(ThreadInfo *info, const Board *board);
 BOOL dcnn_leaf_expansion(ThreadInfo *info, const Board *board, TreeBlock *b);
+// Sync mode: send the leaf to CNN (keep trying until it succeeds) without waiting for the reply.
+BOOL dcnn_leaf_send(ThreadInfo *info, const Board *board, TreeBlock *b);
 
 BOOL async_policy(ThreadInfo *info, TreeBlock *bl, const Board *board, BlockOffset *offset, TreeBlock **child_chosen);
 
+// Virtual loss on the edge picked by the policy, reverted in threaded_run_bp.
+void add_virtual_loss(ThreadInfo *info, TreeBlock *bl, BlockOffset offset);
+void revert_virtual_loss(ThreadInfo *info);
+
+// Apply the coalesced backprop updates of this thread to the tree.
+void flush_bp_deltas(ThreadInfo *info);
+
 // Def policy using fast rollout.
 DefPolicyMove fast_rollout_def_policy(void *def_policy, void *context, RandFunc rand_func, Board* board, const Region *r, int max_depth, BOOL verbose);
 
@@ -9,7 +9,10 @@
 
 #include "playout_multithread.h"
 #include "tree_search.h"
+#include <pthread.h>
+#include <time.h>
 #include "../local_evaluator/cnn_local_exchanger.h"
+#include "../local_evaluator/cnn_shm_exchanger.h"
 #include "../local_evaluator/cnn_exchanger.h"
 
 // ======================== Utilities functions =================================
@@ -43,6 +46,15 @@ typedef struct SearchHandle {
   // CNN Servers to connect from. The number of servers should be the
   // same as the number of gpus.
   void **ex;
+  // For each server, #boards sent and not replied yet. Only boards with seq >= route_seq are counted,
+  // since the older ones are dropped by the servers (see client_set_min_seq).
+  // It is also the #credits in use: no board is sent to a server that has as many pending boards as it advertises.
+  int *num_pending;
+  long route_seq;
+  // Tree threads blocked in client_wait_send, woken up when moves come back (see client_receive_moves).
+  pthread_mutex_t credit_lock;
+  pthread_cond_t credit_cond;
+  int num_credit_waiters;
 
   // Previous moves.
   Move prev_moves[MAX_MOVE];
@@ -59,6 +71,14 @@ static void client_init(SearchHandle *s) {
         error("No CNN connection\n");
       }
     }
+  } else if (s->params.server_type == SERVER_SHM) {
+    for (int i = 0; i < s->params.num_gpu; ++i) {
+      s->ex[i] = ExShmInit(s->params.pipe_path, i, FALSE);
+      if (s->ex[i] == NULL) {
+        error("No CNN connection\n");
+      }
+      ExShmClientSetMoveExtra(s->ex[i], s->tree_params.use_online_model);
+    }
   } else {
     s->ex[0] = ExClientInit(s->params.tier_name);
     if (s->ex[0] == NULL) {
@@ -74,21 +94,136 @@ static void client_destroy(SearchHandle *s) {
     for (int i = 0; i < s->params.num_gpu; ++i) {
       ExLocalDestroy(s->ex[i]);
     }
+  } else if (s->params.server_type == SERVER_SHM) {
+    for (int i = 0; i < s->params.num_gpu; ++i) {
+      ExShmDestroy(s->ex[i]);
+    }
   } else {
     ExClientDestroy(s->ex[0]);
   }
 }
 
+// With ROUTE_HASH, how many more pending boards the GPU of the hash may have than the least loaded one.
+#define ROUTE_HASH_SLACK 16
+
+// Credits advertised by server i (0 = no limit).
+static int client_credits(const SearchHandle *s, int i) {
+  if (s->params.server_type == SERVER_LOCAL) return ExLocalClientGetCredits(s->ex[i]);
+  return ExShmClientGetCredits(s->ex[i]);
+}
+
+// Take a credit of server i, return FALSE if all of them are in use. It is returned when the move comes back,
+// or right away with release_credit if the board cannot be sent.
+static BOOL take_credit(SearchHandle *s, int i) {
+  int credits = client_credits(s, i);
+  int pending = __atomic_load_n(&s->num_pending[i], __ATOMIC_RELAXED);
+  do {
+    if (credits > 0 && pending >= credits) return FALSE;
+  } while (! __atomic_compare_exchange_n(&s->num_pending[i], &pending, pending + 1, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return TRUE;
+}
+
+static inline void release_credit(SearchHandle *s, int i) {
+  __sync_fetch_and_add(&s->num_pending[i], -1);
+}
+
+// Whether server i has a free credit.
+static inline BOOL has_credit(const SearchHandle *s, int i) {
+  int credits = client_credits(s, i);
+  return credits == 0 || __atomic_load_n(&s->num_pending[i], __ATOMIC_RELAXED) < credits;
+}
+
+// Wake up the tree threads waiting for a credit.
+static void notify_credit(SearchHandle *s) {
+  if (__atomic_load_n(&s->num_credit_waiters, __ATOMIC_SEQ_CST) == 0) return;
+  pthread_mutex_lock(&s->credit_lock);
+  pthread_cond_broadcast(&s->credit_cond);
+  pthread_mutex_unlock(&s->credit_lock);
+}
+
+// Pick the server for the board. i is the server of the tree thread.
+// In every mode, a server without free credits is skipped. If no server has any, return i (take_credit then fails).
+static int route_board(const SearchHandle *s, int i, const MBoard *mboard) {
+  if (s->params.num_gpu <= 1) return i;
+  if (s->params.gpu_routing == ROUTE_STATIC && has_credit(s, i)) return i;
+  int best = -1, best_pending = 0;
+  for (int j = 0; j < s->params.num_gpu; ++j) {
+    if (! has_credit(s, j)) continue;
+    int pending = __atomic_load_n(&s->num_pending[j], __ATOMIC_RELAXED);
+    if (best < 0 || pending < best_pending) {
+      best = j;
+      best_pending = pending;
+    }
+  }
+  if (best < 0) return i;
+  if (s->params.gpu_routing == ROUTE_HASH) {
+    int h = GetBoardHash(&mboard->board) % s->params.num_gpu;
+    int pending = __atomic_load_n(&s->num_pending[h], __ATOMIC_RELAXED);
+    if (pending <= best_pending + ROUTE_HASH_SLACK && has_credit(s, h)) return h;
+  }
+  return best;
+}
+
 // Abstraction for sending the board / receiving the move.
 static BOOL client_send_board(void *ctx, int i, MBoard *mboard) {
   SearchHandle *s = (SearchHandle *)ctx;
   mboard->t_sent = wallclock();
-  if (s->params.server_type == SERVER_LOCAL) {
-    return ExLocalClientSendBoard(s->ex[i], mboard);
-  } else {
+  if (s->params.server_type == SERVER_CLUSTER) {
     ExClientSendBoard(s->ex[0], mboard);
     return TRUE;
   }
+  i = route_board(s, i, mboard);
+  if (! take_credit(s, i)) return FALSE;
+  BOOL sent;
+  if (s->params.server_type == SERVER_LOCAL) {
+    sent = ExLocalClientSendBoard(s->ex[i], mboard);
+  } else {
+    sent = ExShmClientSendBoard(s->ex[i], mboard);
+  }
+  if (! sent) release_credit(s, i);
+  return sent;
+}
+
+// Note that if the board is routed to another server than its parent, the delta falls back to a full board.
+static BOOL client_send_board_delta(void *ctx, int i, MBoard *mboard, uint64_t parent_b, Coord m) {
+  SearchHandle *s = (SearchHandle *)ctx;
+  mboard->t_sent = wallclock();
+  i = route_board(s, i, mboard);
+  if (! take_credit(s, i)) return FALSE;
+  BOOL sent = ExShmClientSendBoardDelta(s->ex[i], mboard, parent_b, m);
+  if (! sent) release_credit(s, i);
+  return sent;
+}
+
+// A send failed. If all the credits are in use, wait until a move comes back (or timeout_ms), otherwise the exchanger
+// is full and we back off for SEND_BACKOFF_MS.
+#define SEND_BACKOFF_MS 1
+static void client_wait_send(void *ctx, int i, int timeout_ms) {
+  SearchHandle *s = (SearchHandle *)ctx;
+  if (s->params.server_type == SERVER_CLUSTER) return;
+  pthread_mutex_lock(&s->credit_lock);
+  __sync_fetch_and_add(&s->num_credit_waiters, 1);
+  BOOL full = TRUE;
+  for (int j = 0; j < s->params.num_gpu && full; ++j) {
+    if (has_credit(s, j)) full = FALSE;
+  }
+  if (! full && timeout_ms > SEND_BACKOFF_MS) timeout_ms = SEND_BACKOFF_MS;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += (long)timeout_ms * 1000000;
+  ts.tv_sec += ts.tv_nsec / 1000000000;
+  ts.tv_nsec %= 1000000000;
+  pthread_cond_timedwait(&s->credit_cond, &s->credit_lock, &ts);
+  __sync_fetch_and_add(&s->num_credit_waiters, -1);
+  pthread_mutex_unlock(&s->credit_lock);
+}
+
+static void reset_pending(SearchHandle *s, long route_seq) {
+  __atomic_store_n(&s->route_seq, route_seq, __ATOMIC_RELEASE);
+  for (int i = 0; i < s->params.num_gpu; ++i) {
+    __atomic_store_n(&s->num_pending[i], 0, __ATOMIC_RELAXED);
+  }
+  notify_credit(s);
 }
 
 static void client_send_restart(void *ctx) {
@@ -105,18 +240,67 @@ static void client_send_restart(void *ctx) {
       // Wait until the server has finish restarting.
       ExLocalClientWaitAck(s->ex[i]);
     }
+  } else if (s->params.server_type == SERVER_SHM) {
+    PRINT_INFO("Send Restart message to server...\n");
+    for (int i = 0; i < s->params.num_gpu; ++i) {
+      ExShmClientSendRestart(s->ex[i]);
+    }
+
+    PRINT_INFO("Waiting for ACK from server...\n");
+    for (int i = 0; i < s->params.num_gpu; ++i) {
+      ExShmClientWaitAck(s->ex[i]);
+    }
   }
+  // The servers have dropped everything.
+  if (s->params.server_type != SERVER_CLUSTER) reset_pending(s, s->route_seq);
 }
 
-// Return FALSE if the receiver did not get anything.
-static BOOL client_receive_move(void *ctx, int i, MMove *mmove) {
+// Return #moves received, 0 if the receiver did not get anything.
+static int client_receive_moves(void *ctx, int i, MMove *mmoves, int max_n) {
   SearchHandle *s = (SearchHandle *)ctx;
-  // Block read since we are in a different thread.
+  int n;
   if (s->params.server_type == SERVER_LOCAL) {
-    return ExLocalClientGetMove(s->ex[i], mmove);
+    n = ExLocalClientGetMoves(s->ex[i], mmoves, max_n);
+  } else if (s->params.server_type == SERVER_SHM) {
+    n = ExShmClientGetMoves(s->ex[i], mmoves, max_n);
   } else {
-    return ExClientGetMove(s->ex[0], mmove);
+    // Block read since we are in a different thread.
+    return ExClientGetMove(s->ex[0], mmoves) ? 1 : 0;
   }
+
+  long route_seq = __atomic_load_n(&s->route_seq, __ATOMIC_ACQUIRE);
+  int num_replied = 0;
+  for (int j = 0; j < n; ++j) {
+    if (mmoves[j].seq >= route_seq) num_replied ++;
+  }
+  if (num_replied > 0) {
+    __sync_fetch_and_add(&s->num_pending[i], -num_replied);
+    notify_credit(s);
+  }
+  return n;
+}
+
+static BOOL client_wait_move(void *ctx, int i, int timeout_ms) {
+  SearchHandle *s = (SearchHandle *)ctx;
+  if (s->params.server_type == SERVER_LOCAL) {
+    return ExLocalClientWaitMove(s->ex[i], timeout_ms);
+  } else if (s->params.server_type == SERVER_SHM) {
+    return ExShmClientWaitMove(s->ex[i], timeout_ms);
+  }
+  return FALSE;
+}
+
+static void client_set_min_seq(void *ctx, long min_seq) {
+  SearchHandle *s = (SearchHandle *)ctx;
+  if (s->params.server_type == SERVER_CLUSTER) return;
+  for (int i = 0; i < s->params.num_gpu; ++i) {
+    if (s->params.server_type == SERVER_LOCAL) {
+      ExLocalClientSetMinSeq(s->ex[i], min_seq);
+    } else {
+      ExShmClientSetMinSeq(s->ex[i], min_seq);
+    }
+  }
+  reset_pending(s, min_seq);
 }
 
 static int client_discard_moves(void *ctx, int i) {
@@ -125,6 +309,8 @@ static int client_discard_moves(void *ctx, int i) {
   int num_discarded = 0;
   if (s->params.server_type == SERVER_LOCAL) {
     while (ExLocalClientGetMove(s->ex[i], &mmove)) num_discarded ++;
+  } else if (s->params.server_type == SERVER_SHM) {
+    while (ExShmClientGetMove(s->ex[i], &mmove)) num_discarded ++;
   }
   return num_discarded;
 }
@@ -140,6 +326,7 @@ void ts_v2_init_params(SearchParamsV2 *params) {
   params->komi = 6.5;
   params->dynkomi_factor = 0.0;
   params->num_gpu = 4;
+  params->gpu_routing = ROUTE_STATIC;
   params->print_search_tree = FALSE;
   params->cpu_only = FALSE;
   params->rule = RULE_CHINESE;
@@ -160,12 +347,15 @@ void ts_v2_print_params(void *ctx) {
   fprintf(stderr," ------------ Parameters for Search -----------------\n");
   if (params->server_type == SERVER_LOCAL) {
     fprintf(stderr,"Local Pipe path: %s\n", params->pipe_path);
+  } else if (params->server_type == SERVER_SHM) {
+    fprintf(stderr,"Local shared memory path: %s\n", params->pipe_path);
   } else {
     fprintf(stderr,"Server: %s\n", params->tier_name);
   }
   fprintf(stderr,"Verbose: %d\n", params->verbose);
   fprintf(stderr,"PrintSearchTree: %s\n", STR_BOOL(params->print_search_tree));
   fprintf(stderr,"#GPU: %d\n", params->num_gpu);
+  fprintf(stderr,"GPU routing: %s\n", params->gpu_routing == ROUTE_LEAST_LOADED ? "least_loaded" : (params->gpu_routing == ROUTE_HASH ? "hash" : "static"));
   fprintf(stderr,"#Use CPU rollout only: %s\n", STR_BOOL(params->cpu_only));
   fprintf(stderr,"Komi: %.1f\n", params->komi);
   fprintf(stderr,"dynkomi_factor: %.2f\n", params->dynkomi_factor);
@@ -220,9 +410,14 @@ void* ts_v2_init(const SearchParamsV2 *params, const TreeParams *tree_params, co
   ExCallbacks cbs;
   cbs.context = s;
   cbs.callback_send_board = client_send_board;
-  cbs.callback_receive_move = client_receive_move;
+  // Only the shared memory exchanger keeps the recent boards for delta encoding.
+  cbs.callback_send_board_delta = params->server_type == SERVER_SHM ? client_send_board_delta : NULL;
+  cbs.callback_receive_moves = client_receive_moves;
+  cbs.callback_wait_move = client_wait_move;
+  cbs.callback_wait_send = client_wait_send;
   cbs.callback_receiver_discard_move = client_discard_moves;
   cbs.callback_receiver_restart = client_send_restart;
+  cbs.callback_set_min_seq = client_set_min_seq;
 
   // initialize the queue for previous moves.
   s->num_prev_moves = 0;
@@ -232,6 +427,11 @@ void* ts_v2_init(const SearchParamsV2 *params, const TreeParams *tree_params, co
   // For global server, we need to set num_gpu to 1.
   if (! params->cpu_only) {
     s->ex = (void **)malloc(sizeof(void *) * s->params.num_gpu);
+    s->num_pending = (int *)calloc(s->params.num_gpu, sizeof(int));
+    s->route_seq = 0;
+    pthread_mutex_init(&s->credit_lock, NULL);
+    pthread_cond_init(&s->credit_cond, NULL);
+    s->num_credit_waiters = 0;
     client_init(s);
   }
 
@@ -296,6 +496,11 @@ BOOL ts_v2_set_params(void *ctx, const SearchParamsV2 *new_params, const TreePar
     for (int i = 0; i < s->num_trees; ++i) {
       tree_search_set_params(s->trees[i], new_tree_params);
     }
+    if (s->params.server_type == SERVER_SHM && ! s->params.cpu_only) {
+      for (int i = 0; i < s->params.num_gpu; ++i) {
+        ExShmClientSetMoveExtra(s->ex[i], s->tree_params.use_online_model);
+      }
+    }
   }
 
   ts_v2_thread_on(ctx);
@@ -341,7 +546,7 @@ void ts_v2_free(void *ctx) {
 
   if (! s->params.cpu_only) {
     // Stop all receiving process...
-    if (s->params.server_type != SERVER_LOCAL) {
+    if (s->params.server_type == SERVER_CLUSTER) {
       ExClientStopReceivers(s->ex[0]);
     }
 
@@ -356,6 +561,9 @@ void ts_v2_free(void *ctx) {
   if (! s->params.cpu_only) {
     // Free the sender/receiver. Their sizes are equal to the number of gpus we have.
     free(s->ex);
+    free(s->num_pending);
+    pthread_mutex_destroy(&s->credit_lock);
+    pthread_cond_destroy(&s->credit_cond);
   }
 }
 
@@ -41,6 +41,18 @@ playout.dead_black = 8 + common.black
 
 playout.server_local = tonumber(symbols.SERVER_LOCAL)
 playout.server_cluster = tonumber(symbols.SERVER_CLUSTER)
+playout.server_shm = tonumber(symbols.SERVER_SHM)
+playout.server_table = {
+    ['local'] = playout.server_local,
+    cluster = playout.server_cluster,
+    shm = playout.server_shm
+}
+
+playout.route_table = {
+    static = tonumber(symbols.ROUTE_STATIC),
+    least_loaded = tonumber(symbols.ROUTE_LEAST_LOADED),
+    hash = tonumber(symbols.ROUTE_HASH)
+}
 
 playout.dp_simple = tonumber(symbols.DP_SIMPLE)
 playout.dp_pachi = tonumber(symbols.DP_PACHI)
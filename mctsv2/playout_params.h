@@ -22,6 +22,16 @@
 
 #define SERVER_LOCAL 0
 #define SERVER_CLUSTER 1
+// Same as SERVER_LOCAL, but exchange boards/moves through shared memory instead of pipes.
+#define SERVER_SHM 2
+
+// Routing of boards across the GPUs (local servers only).
+// Each tree thread always sends to the same GPU.
+#define ROUTE_STATIC 0
+// Send to the GPU with the fewest boards in flight.
+#define ROUTE_LEAST_LOADED 1
+// Send to the GPU picked by the board hash, so that the same position lands on the same GPU, unless it is much busier than the least loaded one.
+#define ROUTE_HASH 2
 
 #define THREAD_NEW_BLOCKED 0
 #define THREAD_ALREADY_BLOCKED 1
@@ -45,7 +55,7 @@ typedef struct {
   char pipe_path[200];
   char tier_name[200];
 
-  // Whether we use local server or global server, could be SERVER_LOCAL or SERVER_CLUSTER
+  // Whether we use local server or global server, could be SERVER_LOCAL, SERVER_SHM or SERVER_CLUSTER
   int server_type;
 
   // Go rule, rule = RULE_CHINESE (default) or RULE_JAPANESE
@@ -64,6 +74,9 @@ typedef struct {
   // #gpu we used.
   int num_gpu;
 
+  // How boards are routed across the GPUs, ROUTE_STATIC (default), ROUTE_LEAST_LOADED or ROUTE_HASH.
+  int gpu_routing;
+
   // Only use cpu-based rollout.
   BOOL cpu_only;
 
@@ -100,6 +113,11 @@ typedef struct {
   // Expand leaf only if total >= expand_n_thres.
   int expand_n_thres;
 
+  // Sync mode only (needs the evaluation cache): once a node has prefetch_n_thres visits, send its top prefetch_topk
+  // unexpanded children (by prior) to CNN at the lowest priority, ahead of their expansion. 0 means disabled.
+  int prefetch_n_thres;
+  int prefetch_topk;
+
   int verbose;
 
   // #move receivers.
@@ -205,6 +223,33 @@ typedef struct {
 
   // Whether we use PUCT and previous UCT
   BOOL use_old_uct;
+
+  // #entries of the CNN evaluation cache (keyed by board hash). 0 means no cache.
+  // It only takes effect when the tree is initialized.
+  int eval_cache_size;
+
+  // #threads that free pruned subtrees in the background. 0 means the tree is freed inline when pruning.
+  // It only takes effect when the tree is initialized.
+  int num_reclaimer;
+
+  // #entries of the transposition table. If it is nonzero, positions reached by different move orders share the same node (the tree becomes a DAG).
+  // Not supported in life and death mode or with online model. It only takes effect when the tree is initialized.
+  int transposition_table_size;
+
+  // Virtual loss. Each simulation that is still descending through an edge counts as virtual_loss lost games for the player
+  // who picks it, so that the other tree threads are pushed to different paths. 0 means no virtual loss (not used in life and death mode).
+  float virtual_loss;
+
+  // Backprop into the edges of the top bp_coalesce_depth levels (the edge above the root block is level 0) is accumulated per thread
+  // and flushed every bp_flush_interval rollouts (and whenever the threads are blocked), so that threads do not keep bouncing
+  // the cache lines near the root. 0 means every update goes directly to the tree.
+  int bp_coalesce_depth;
+  int bp_flush_interval;
+
+  // #simulations each tree thread keeps in flight in sync mode. Once a simulation creates a new leaf, the thread sends it to CNN,
+  // runs the playout, parks the simulation and starts the next one; the leaf is linked and the result backpropagated when the reply arrives.
+  // The thread only blocks when all of them are waiting. 1 means the thread waits for each reply (not used in async or life and death mode).
+  int num_sim_per_thread;
 } TreeParams;
 
 #endif
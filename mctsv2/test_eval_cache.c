@@ -0,0 +1,141 @@
+//
+// Copyright (c) 2016-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+//
+
+#include "eval_cache.h"
+#include "../common/common.h"
+#include <stdio.h>
+#include <string.h>
+
+// Requesters are opaque pointers for the cache.
+static int A, B, C;
+#define REQ_A ((void *)&A)
+#define REQ_B ((void *)&B)
+#define REQ_C ((void *)&C)
+
+#define CHECK(cond) do { if (! (cond)) error("%s:%d: check failed: %s", __FILE__, __LINE__, #cond); } while(0)
+
+static void make_move(MMove *mmove, uint64_t key, long seq, float prob) {
+  memset(mmove, 0, sizeof(MMove));
+  mmove->seq = seq;
+  mmove->board_hash = key;
+  mmove->xs[0] = 3;
+  mmove->ys[0] = 4;
+  mmove->probs[0] = prob;
+}
+
+// One requester owns the request, the next one waits on it, and both are served by the stored reply.
+static void test_miss_wait_hit(void *c) {
+  MMove mmove, reply;
+  void *waiters[EC_MAX_WAITERS];
+  const uint64_t key = 0x1234;
+
+  CHECK(EvalCacheLookup(c, key, 1, REQ_A, &mmove) == EC_MISS);
+  CHECK(EvalCacheLookup(c, key, 1, REQ_B, &mmove) == EC_WAITING);
+  // The owner resends, the waiters are kept.
+  CHECK(EvalCacheLookup(c, key, 1, REQ_A, &mmove) == EC_MISS);
+
+  make_move(&reply, key, 1, 0.5);
+  CHECK(EvalCacheStore(c, key, &reply, waiters) == 1);
+  CHECK(waiters[0] == REQ_B);
+
+  memset(&mmove, 0, sizeof(mmove));
+  CHECK(EvalCacheLookup(c, key, 1, REQ_C, &mmove) == EC_HIT);
+  CHECK(mmove.xs[0] == 3 && mmove.ys[0] == 4 && mmove.probs[0] == 0.5);
+  // The reply stays valid for the next search.
+  CHECK(EvalCacheLookup(c, key, 2, REQ_C, &mmove) == EC_HIT);
+  printf("MISS/WAITING/HIT passed\n");
+}
+
+// A cancelled request hands its waiters back, and the next lookup owns the position.
+static void test_cancel(void *c) {
+  MMove mmove;
+  void *waiters[EC_MAX_WAITERS];
+  const uint64_t key = 0x5678;
+
+  CHECK(EvalCacheLookup(c, key, 1, REQ_A, &mmove) == EC_MISS);
+  CHECK(EvalCacheLookup(c, key, 1, REQ_B, &mmove) == EC_WAITING);
+  CHECK(EvalCacheLookup(c, key, 1, REQ_C, &mmove) == EC_WAITING);
+
+  // Only the owner can cancel.
+  CHECK(EvalCacheCancel(c, key, REQ_B, waiters) == 0);
+  CHECK(EvalCacheCancel(c, key, REQ_A, waiters) == 2);
+  CHECK(waiters[0] == REQ_B && waiters[1] == REQ_C);
+  CHECK(EvalCacheCancel(c, key, REQ_A, waiters) == 0);
+
+  CHECK(EvalCacheLookup(c, key, 1, REQ_B, &mmove) == EC_MISS);
+  CHECK(EvalCacheLookup(c, key, 1, REQ_A, &mmove) == EC_WAITING);
+  printf("Cancel passed\n");
+}
+
+// A pending request of an older seq is taken over, and requesters beyond EC_MAX_WAITERS send by themselves.
+static void test_stale_and_full(void *c) {
+  MMove mmove;
+  int others[EC_MAX_WAITERS + 1];
+  const uint64_t key = 0x9abc;
+
+  CHECK(EvalCacheLookup(c, key, 1, REQ_A, &mmove) == EC_MISS);
+  CHECK(EvalCacheLookup(c, key, 2, REQ_B, &mmove) == EC_MISS);
+  for (int i = 0; i < EC_MAX_WAITERS; ++i) {
+    CHECK(EvalCacheLookup(c, key, 2, (void *)&others[i], &mmove) == EC_WAITING);
+  }
+  CHECK(EvalCacheLookup(c, key, 2, (void *)&others[EC_MAX_WAITERS], &mmove) == EC_MISS);
+  printf("Stale seq and full waiters passed\n");
+}
+
+// A reserved position is pending (others wait on it), and cannot be reserved twice.
+static void test_reserve(void *c) {
+  MMove mmove, reply;
+  void *waiters[EC_MAX_WAITERS];
+  const uint64_t key = 0xdef0;
+
+  CHECK(EvalCacheReserve(c, key, 1, REQ_A));
+  CHECK(! EvalCacheReserve(c, key, 1, REQ_B));
+  CHECK(EvalCacheLookup(c, key, 1, REQ_B, &mmove) == EC_WAITING);
+
+  make_move(&reply, key, 1, 0.25);
+  CHECK(EvalCacheStore(c, key, &reply, waiters) == 1);
+  CHECK(! EvalCacheReserve(c, key, 1, REQ_C));
+  printf("Reserve passed\n");
+}
+
+// A pending request of the current seq is never evicted, even if the set is full.
+static void test_no_evict_pending() {
+  MMove mmove;
+  // A single set.
+  void *c = EvalCacheInit(4);
+  int owners[5];
+
+  for (int i = 0; i < 4; ++i) {
+    CHECK(EvalCacheLookup(c, 100 + i, 1, (void *)&owners[i], &mmove) == EC_MISS);
+  }
+  CHECK(EvalCacheLookup(c, 200, 1, (void *)&owners[4], &mmove) == EC_MISS);
+  for (int i = 0; i < 4; ++i) {
+    CHECK(EvalCacheLookup(c, 100 + i, 1, REQ_A, &mmove) == EC_WAITING);
+  }
+  // With a new seq, they can be replaced.
+  CHECK(EvalCacheLookup(c, 200, 2, (void *)&owners[4], &mmove) == EC_MISS);
+  CHECK(EvalCacheLookup(c, 200, 2, REQ_A, &mmove) == EC_WAITING);
+
+  EvalCacheFree(c);
+  printf("No eviction of pending entries passed\n");
+}
+
+int main() {
+  void *c = EvalCacheInit(1024);
+  test_miss_wait_hit(c);
+  test_cancel(c);
+  test_stale_and_full(c);
+  test_reserve(c);
+  EvalCachePrintStats(c);
+  EvalCacheFree(c);
+
+  test_no_evict_pending();
+  printf("All passed\n");
+  return 0;
+}
@@ -0,0 +1,137 @@
+//
+// Copyright (c) 2016-present, Facebook, Inc.
+// All rights reserved.
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+//
+
+#include "playout_multithread.h"
+#include "tree_search.h"
+#include "../local_evaluator/cnn_local_exchanger.h"
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+// Run the search with parked simulations against an in-process fake evaluator, which answers one board out of
+// ERROR_EVERY with an error move. The requests of the parked leaves are then given up, and the tree threads have to send
+// them again. If they do not, the search never finishes, and the alarm fails the test.
+#define ERROR_EVERY 3
+#define TIMEOUT_SEC 120
+
+static volatile BOOL done = FALSE;
+static int num_served = 0, num_errors = 0;
+
+static void *fake_evaluator(void *ctx) {
+  MBoard mboard;
+  MMove mmove;
+  GroupId4 ids;
+  unsigned long seed = 1;
+
+  while (! done) {
+    if (ExLocalServerGetBoard(ctx, &mboard, 10) == SIG_OK && mboard.seq != 0 && mboard.b != 0) {
+      memset(&mmove, 0, sizeof(mmove));
+      mmove.seq = mboard.seq;
+      mmove.b = mboard.b;
+      mmove.player = mboard.board._next_player;
+      mmove.board_hash = GetBoardHash(&mboard.board);
+
+      if (num_served ++ % ERROR_EVERY == 0) {
+        mmove.error = TRUE;
+        num_errors ++;
+      } else {
+        // Some legal moves, starting from a random location.
+        int k = 0;
+        int start = fast_random(&seed, BOARD_SIZE * BOARD_SIZE);
+        for (int i = 0; i < BOARD_SIZE * BOARD_SIZE && k < NUM_FIRST_MOVES; ++i) {
+          int j = (start + i * 7) % (BOARD_SIZE * BOARD_SIZE);
+          int x = j / BOARD_SIZE, y = j % BOARD_SIZE;
+          if (! TryPlay(&mboard.board, x, y, mboard.board._next_player, &ids)) continue;
+          mmove.xs[k] = x + 1;
+          mmove.ys[k] = y + 1;
+          mmove.probs[k] = 1.0 / (k + 2);
+          mmove.types[k] = MOVE_NORMAL;
+          k ++;
+        }
+      }
+      ExLocalServerSendMove(ctx, &mmove);
+    }
+    ExLocalServerSendAckIfNecessary(ctx);
+  }
+  return NULL;
+}
+
+void on_timeout(int sig) {
+  fprintf(stderr,"Timeout! The tree threads are stuck on the given-up requests. #served = %d, #errors = %d\n", num_served, num_errors);
+  _exit(1);
+}
+
+int main() {
+  const int K = 300, R = 3;
+
+  char pipe_path[100];
+  strcpy(pipe_path, "/tmp/test_parked_cancel.XXXXXX");
+  if (! mkdtemp(pipe_path)) error("Could not create temporary directory");
+  strcat(pipe_path, "/");
+
+  void *server = ExLocalInit(pipe_path, 0, TRUE);
+  pthread_t evaluator;
+  pthread_create(&evaluator, NULL, fake_evaluator, server);
+
+  SearchParamsV2 search_params;
+  TreeParams tree_params;
+  ts_v2_init_params(&search_params);
+  tree_search_init_params(&tree_params);
+
+  search_params.verbose = V_INFO;
+  search_params.server_type = SERVER_LOCAL;
+  search_params.num_gpu = 1;
+  search_params.cpu_only = FALSE;
+  strcpy(search_params.pipe_path, pipe_path);
+
+  tree_params.verbose = V_INFO;
+  tree_params.use_async = FALSE;
+  tree_params.num_sim_per_thread = 4;
+  tree_params.expand_n_thres = 0;
+  tree_params.num_rollout = K;
+  tree_params.num_rollout_per_move = K;
+  tree_params.num_dcnn_per_move = K;
+  tree_params.num_receiver = 1;
+  tree_params.num_tree_thread = 4;
+  tree_params.sigma = 0.05;
+  tree_params.decision_mixture_ratio = 5.0;
+  tree_params.rcv_max_num_move = 20;
+  tree_params.rcv_acc_percent_thres = 80;
+  tree_params.use_pondering = FALSE;
+  tree_params.default_policy_choice = DP_SIMPLE;
+
+  signal(SIGALRM, on_timeout);
+  alarm(TIMEOUT_SEC);
+
+  Board board;
+  ClearBoard(&board);
+  GroupId4 ids;
+  AllMoves move_seq;
+
+  void *tree_handle = ts_v2_init(&search_params, &tree_params, &board);
+  ts_v2_search_start(tree_handle);
+  for (int i = 0; i < R; ++i) {
+    Move m = ts_v2_pick_best(tree_handle, &move_seq, NULL);
+    ts_v2_prune_ours(tree_handle, m.m);
+    if (! TryPlay(&board, m.x, m.y, board._next_player, &ids)) error("The move given by the search should never fail!");
+    Play(&board, &ids);
+  }
+  ts_v2_search_stop(tree_handle);
+  ts_v2_free(tree_handle);
+  alarm(0);
+
+  done = TRUE;
+  pthread_join(evaluator, NULL);
+  ExLocalDestroy(server);
+
+  printf("#served = %d, #errors = %d\n", num_served, num_errors);
+  if (num_errors == 0) error("No request was given up, nothing is tested!");
+  printf("All passed\n");
+  return 0;
+}
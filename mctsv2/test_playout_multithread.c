@@ -54,6 +54,11 @@ int main(int argc, char *argv[]) {
     search_params.server_type = SERVER_LOCAL;
     search_params.num_gpu = num_gpu;
     strcpy(search_params.pipe_path, "/data/local/go/");
+  } else if (! strcmp(server_type, "shm")) {
+    printf("Use local server with shared memory\n");
+    search_params.server_type = SERVER_SHM;
+    search_params.num_gpu = num_gpu;
+    strcpy(search_params.pipe_path, "/data/local/go/");
   } else {
     printf("Use cluster server = %s\n", server_type);
     search_params.server_type = SERVER_CLUSTER;
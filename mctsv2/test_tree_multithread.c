@@ -77,14 +77,9 @@ void* thread_random_expansion(void *ctx) {
     while (b != p->root) {
       TreeBlock * parent = b->parent;
       BlockOffset parent_offset = b->parent_offset;
-      Stat* stat = &b->parent->data.stats[parent_offset];
 
       // Add total first, otherwise the winning rate might go over 1.
-      // stat->total += 1;
-      // stat->black_win += black_count;
-      __sync_fetch_and_add(&stat->total, 1);
-      inc_atomic_float(&stat->black_win, (float)black_count);
-      // __sync_fetch_and_add(&stat->black_win, black_count);
+      __sync_fetch_and_add(&b->parent->data.stats.packed[parent_offset], STAT_PACK(1, black_count));
 
       b = parent;
     }
@@ -14,14 +14,276 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <sys/mman.h>
+
+// ====================== Arena ======================
+// Free blocks are linked through their parent pointer.
+#define NEXT_FREE(bl) ((bl)->parent)
+
+// Each thread sticks to one of the TP_NUM_CACHES free lists.
+static int g_next_cache = 0;
+static __thread int tls_cache_idx = -1;
+
+static inline int get_cache_idx() {
+  if (tls_cache_idx < 0) tls_cache_idx = __sync_fetch_and_add(&g_next_cache, 1) % TP_NUM_CACHES;
+  return tls_cache_idx;
+}
+
+static void *map_chunk(size_t bytes) {
+  void *chunk = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED) error("Failed to allocate a chunk of %lu bytes for tree blocks!\n", bytes);
+#ifdef MADV_HUGEPAGE
+  madvise(chunk, bytes, MADV_HUGEPAGE);
+#endif
+  return chunk;
+}
+
+// Bytes of each side array per block.
+static const size_t side_bytes[TP_NUM_SIDES] = {
+  sizeof(Stats),
+  sizeof(float) * BLOCK_SIZE,
+  sizeof(float) * BLOCK_SIZE,
+  (sizeof(ProveNumber) + sizeof(char)) * BLOCK_SIZE,
+  sizeof(int) * BLOCK_SIZE,
+};
+
+static inline char *get_side(const TreePool *p, int k, unsigned int id) {
+  unsigned int idx = id - 1;
+  return p->side_chunks[k][idx >> TP_CHUNK_BITS] + (idx & (TP_CHUNK_SIZE - 1)) * side_bytes[k];
+}
+
+// Point the block to its side arrays. The pointers stay valid for the life of the pool.
+static void attach_sides(const TreePool *p, TreeBlock *bl) {
+  if (p->side_mask & BIT(TP_SIDE_RAVE)) bl->data.rave_stats = (Stats *)get_side(p, TP_SIDE_RAVE, bl->id);
+  if (p->side_mask & BIT(TP_SIDE_ONLINE)) bl->data.opp_preds = (float *)get_side(p, TP_SIDE_ONLINE, bl->id);
+  if (p->side_mask & BIT(TP_SIDE_FAST)) bl->cnn_data.fast_confidences = (float *)get_side(p, TP_SIDE_FAST, bl->id);
+  if (p->side_mask & BIT(TP_SIDE_LD)) {
+    bl->cnn_data.ps = (ProveNumber *)get_side(p, TP_SIDE_LD, bl->id);
+    bl->cnn_data.types = (char *)(bl->cnn_data.ps + BLOCK_SIZE);
+  }
+  if (p->side_mask & BIT(TP_SIDE_VLOSS)) bl->data.inflights = (int *)get_side(p, TP_SIDE_VLOSS, bl->id);
+}
+
+static void clear_sides(const TreePool *p, TreeBlock *bl) {
+  for (int k = 0; k < TP_NUM_SIDES; ++k) {
+    if (p->side_mask & BIT(k)) memset(get_side(p, k, bl->id), 0, side_bytes[k]);
+  }
+}
+
+static void pool_new_chunk(TreePool *p) {
+  if (p->num_chunks >= TP_MAX_CHUNKS) error("Tree arena is full! #chunks = %d\n", p->num_chunks);
+  for (int k = 0; k < TP_NUM_SIDES; ++k) {
+    if (p->side_mask & BIT(k)) p->side_chunks[k][p->num_chunks] = (char *)map_chunk(side_bytes[k] * TP_CHUNK_SIZE);
+  }
+  p->chunks[p->num_chunks ++] = (TreeBlock *)map_chunk(sizeof(TreeBlock) * TP_CHUNK_SIZE);
+}
+
+// Move up to TP_CACHE_BATCH blocks into the cache, first from the global free list, then from the arena.
+static void pool_refill_cache(TreePool *p, TreeBlockCache *c) {
+  pthread_mutex_lock(&p->lock);
+  while (c->n < TP_CACHE_BATCH && p->free_list != TP_NULL) {
+    TreeBlock *bl = p->free_list;
+    p->free_list = NEXT_FREE(bl);
+    p->num_free --;
+    NEXT_FREE(bl) = c->head;
+    c->head = bl;
+    c->n ++;
+  }
+  while (c->n < TP_CACHE_BATCH) {
+    if (p->num_carved == p->num_chunks * TP_CHUNK_SIZE) pool_new_chunk(p);
+    int idx = p->num_carved ++;
+    TreeBlock *bl = &p->chunks[idx >> TP_CHUNK_BITS][idx & (TP_CHUNK_SIZE - 1)];
+    bl->id = idx + 1;
+    attach_sides(p, bl);
+    NEXT_FREE(bl) = c->head;
+    c->head = bl;
+    c->n ++;
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+static TreeBlock *pool_alloc_block(TreePool *p) {
+  TreeBlockCache *c = &p->caches[get_cache_idx()];
+  pthread_mutex_lock(&c->lock);
+  if (c->head == TP_NULL) pool_refill_cache(p, c);
+  TreeBlock *bl = c->head;
+  c->head = NEXT_FREE(bl);
+  c->n --;
+  pthread_mutex_unlock(&c->lock);
+  return bl;
+}
+
+// A chain of freed blocks, returned to the global free list in one go.
+typedef struct {
+  TreeBlock *head, *tail;
+  int n;
+} FreeChain;
+
+static void pool_release_chain(TreePool *p, FreeChain *chain) {
+  if (chain->n == 0) return;
+  pthread_mutex_lock(&p->lock);
+  NEXT_FREE(chain->tail) = p->free_list;
+  p->free_list = chain->head;
+  p->num_free += chain->n;
+  pthread_mutex_unlock(&p->lock);
+  __sync_fetch_and_add(&p->freed, chain->n);
+  __sync_fetch_and_add(&p->allocated, -chain->n);
+}
+
+TreeBlock *tree_simple_get_block(const TreePool *p, unsigned int id) {
+  if (id == 0) return TP_NULL;
+  unsigned int idx = id - 1;
+  return &p->chunks[idx >> TP_CHUNK_BITS][idx & (TP_CHUNK_SIZE - 1)];
+}
+
+size_t tree_simple_pool_bytes(const TreePool *p) {
+  size_t bytes_per_block = sizeof(TreeBlock);
+  for (int k = 0; k < TP_NUM_SIDES; ++k) {
+    if (p->side_mask & BIT(k)) bytes_per_block += side_bytes[k];
+  }
+  return (size_t)p->num_chunks * TP_CHUNK_SIZE * bytes_per_block;
+}
+
+void tree_simple_pool_enable_sides(TreePool *p, int mask) {
+  int new_mask = mask & ~p->side_mask;
+  if (new_mask == 0) return;
+  pthread_mutex_lock(&p->lock);
+  for (int k = 0; k < TP_NUM_SIDES; ++k) {
+    if (! (new_mask & BIT(k))) continue;
+    p->side_chunks[k] = (char **)malloc(sizeof(char *) * TP_MAX_CHUNKS);
+    if (p->side_chunks[k] == NULL) error("Failed to malloc the side chunk table!\n");
+    for (int i = 0; i < p->num_chunks; ++i) {
+      p->side_chunks[k][i] = (char *)map_chunk(side_bytes[k] * TP_CHUNK_SIZE);
+    }
+  }
+  p->side_mask |= new_mask;
+  // Blocks that are already carved (in use or free) get their new side arrays (which are zero).
+  for (int idx = 0; idx < p->num_carved; ++idx) {
+    attach_sides(p, &p->chunks[idx >> TP_CHUNK_BITS][idx & (TP_CHUNK_SIZE - 1)]);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+// ====================== Transposition table ======================
+// Set-associative table from board hash to block. Each set is protected by one of the striped locks.
+// The table does not own the blocks: a block removes itself when it is freed, and an entry might be overwritten
+// (then the position is just not shared any more).
+// Blocks are stored by id (0 = empty), so that a set takes 48 bytes instead of 64.
+#define TT_WAYS 4
+#define TT_NUM_LOCKS 64
+
+typedef struct {
+  uint64_t keys[TT_WAYS];
+  unsigned int ids[TT_WAYS];
+} TransSet;
+
+typedef struct {
+  const TreePool *p;
+  int num_sets;
+  TransSet *sets;
+  pthread_mutex_t locks[TT_NUM_LOCKS];
+} TransTable;
+
+static TransTable *tt_init(const TreePool *p, int size) {
+  TransTable *t = (TransTable *)malloc(sizeof(TransTable));
+  t->p = p;
+  t->num_sets = (size + TT_WAYS - 1) / TT_WAYS;
+  if (t->num_sets < 1) t->num_sets = 1;
+  t->sets = (TransSet *)calloc(t->num_sets, sizeof(TransSet));
+  if (t->sets == NULL) error("Failed to allocate the transposition table with %d entries!\n", size);
+  for (int i = 0; i < TT_NUM_LOCKS; ++i) {
+    pthread_mutex_init(&t->locks[i], NULL);
+  }
+  return t;
+}
+
+static void tt_free(TransTable *t) {
+  for (int i = 0; i < TT_NUM_LOCKS; ++i) {
+    pthread_mutex_destroy(&t->locks[i]);
+  }
+  free(t->sets);
+  free(t);
+}
+
+// Find the block and add one parent link to it. Return TP_NULL if not found, or the block is being freed.
+static TreeBlock *tt_acquire(TransTable *t, uint64_t key) {
+  int set = (int)(key % t->num_sets);
+  TransSet *e = &t->sets[set];
+  TreeBlock *res = TP_NULL;
+  pthread_mutex_lock(&t->locks[set % TT_NUM_LOCKS]);
+  for (int i = 0; i < TT_WAYS; ++i) {
+    if (e->ids[i] == 0 || e->keys[i] != key) continue;
+    TreeBlock *bl = tree_simple_get_block(t->p, e->ids[i]);
+    int num_parents = __atomic_load_n(&bl->num_parents, __ATOMIC_ACQUIRE);
+    while (num_parents > 0) {
+      if (__sync_bool_compare_and_swap(&bl->num_parents, num_parents, num_parents + 1)) {
+        res = bl;
+        break;
+      }
+      num_parents = __atomic_load_n(&bl->num_parents, __ATOMIC_ACQUIRE);
+    }
+    break;
+  }
+  pthread_mutex_unlock(&t->locks[set % TT_NUM_LOCKS]);
+  return res;
+}
+
+static void tt_insert(TransTable *t, uint64_t key, TreeBlock *bl) {
+  int set = (int)(key % t->num_sets);
+  TransSet *e = &t->sets[set];
+  int way = -1;
+  pthread_mutex_lock(&t->locks[set % TT_NUM_LOCKS]);
+  for (int i = 0; i < TT_WAYS; ++i) {
+    if (e->ids[i] == 0 || e->keys[i] == key) {
+      way = i;
+      break;
+    }
+  }
+  // Overwrite one way (chosen by the higher bits of the hash) if the set is full.
+  if (way < 0) way = (key >> 32) % TT_WAYS;
+  e->keys[way] = key;
+  e->ids[way] = bl->id;
+  bl->board_hash = key;
+  pthread_mutex_unlock(&t->locks[set % TT_NUM_LOCKS]);
+}
+
+static void tt_remove(TransTable *t, uint64_t key, TreeBlock *bl) {
+  int set = (int)(key % t->num_sets);
+  TransSet *e = &t->sets[set];
+  pthread_mutex_lock(&t->locks[set % TT_NUM_LOCKS]);
+  for (int i = 0; i < TT_WAYS; ++i) {
+    if (e->ids[i] == bl->id && e->keys[i] == key) {
+      e->ids[i] = 0;
+      e->keys[i] = 0;
+    }
+  }
+  pthread_mutex_unlock(&t->locks[set % TT_NUM_LOCKS]);
+}
+
+void tree_simple_pool_enable_transposition(TreePool *p, int size) {
+  if (p->trans_table != NULL || size <= 0) return;
+  p->trans_table = tt_init(p, size);
+}
 
 // Initialize tree pool
 void tree_simple_pool_init(TreePool *p) {
-  p->root = (TreeBlock *)malloc(sizeof(TreeBlock));
-  if (p->root == NULL) {
-    error("Failed to malloc root!\n");
+  memset(p, 0, sizeof(TreePool));
+  p->chunks = (TreeBlock **)malloc(sizeof(TreeBlock *) * TP_MAX_CHUNKS);
+  if (p->chunks == NULL) {
+    error("Failed to malloc the chunk table!\n");
   }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_mutex_init(&p->reclaim_lock, NULL);
+  pthread_cond_init(&p->reclaim_cond, NULL);
+  for (int i = 0; i < TP_NUM_CACHES; ++i) {
+    pthread_mutex_init(&p->caches[i].lock, NULL);
+  }
+
+  p->root = pool_alloc_block(p);
+  unsigned int id = p->root->id;
   memset(p->root, 0, sizeof(TreeBlock));
+  p->root->id = id;
+  attach_sides(p, p->root);
   // Root always have one child.
   p->root->n = 1;
 
@@ -88,26 +350,57 @@ unsigned char cnn_data_wait_until_evaluated_bit(CNNData* data,
   return v;
 }
 
+void cnn_data_cancel_sent(CNNData* data) {
+  cnn_data_clear_evaluated_bit(data, BIT_CNN_SENT);
+  event_count_broadcast(&data->event_counts[BIT_CNN_RECEIVED]);
+}
+
+unsigned char cnn_data_wait_until_received_or_cancelled(CNNData* data) {
+  EventCount* ev = &data->event_counts[BIT_CNN_RECEIVED];
+  for (;;) {
+    EventCountKey ek = event_count_prepare(ev);
+    unsigned char v = __atomic_load_n(&data->evaluated, __ATOMIC_ACQUIRE);
+    if (TEST_BIT(v, BIT_CNN_RECEIVED) || !TEST_BIT(v, BIT_CNN_SENT)) {
+      event_count_cancel(ev);
+      return v;
+    }
+    event_count_wait(ev, ek);
+  }
+}
+
 unsigned char cnn_data_load_evaluated(CNNData* data) {
   return __atomic_load_n(&data->evaluated, __ATOMIC_ACQUIRE);
 }
 
-static void tree_simple_alloc_assign_info(TreeBlock* bl, TreeBlock *parent, BlockOffset parent_offset) {
+static void tree_simple_alloc_assign_info(const TreePool *p, TreeBlock* bl, TreeBlock *parent, BlockOffset parent_offset) {
+  // The id is the slot in the arena and is kept, so are the side arrays.
+  unsigned int id = bl->id;
   memset((void *)bl, TP_NULL, sizeof(TreeBlock));
+  bl->id = id;
+  attach_sides(p, bl);
+  clear_sides(p, bl);
   bl->parent = parent;
   bl->parent_offset = parent_offset;
+  bl->num_parents = 1;
   // Number of nodes will be assigned when CNN moves arrives. bl->n = num_nodes;
   for (unsigned i = 0; i < BIT_CNN_NUM_BITS; ++i) {
     event_count_init(&bl->cnn_data.event_counts[i]);
   }
 }
 
-TreeBlock *tree_simple_g_alloc(TreePool *p, void *context, void *context2, FuncSimpleInitBlocks func_init, TreeBlock *parent, BlockOffset parent_offset) {
-  TreeBlock *bl = (TreeBlock *)malloc(sizeof(TreeBlock));
-  tree_simple_alloc_assign_info(bl, parent, parent_offset);
+// Now parent should connect the head of the children.
+// Note that parent->expansion should already be set (parent->expansion is used as a simple mutex).
+static void link_child(TreeBlock *parent, BlockOffset parent_offset, TreeBlock *bl) {
+  SET_BIT(parent->expansion, parent_offset);
+  __sync_bool_compare_and_swap(&parent->children[parent_offset].child, 0, bl);
+  event_count_broadcast(&parent->children[parent_offset].event_count);
+}
+
+static TreeBlock *alloc_and_init(TreePool *p, void *context, void *context2, FuncSimpleInitBlocks func_init, TreeBlock *parent, BlockOffset parent_offset) {
+  TreeBlock *bl = pool_alloc_block(p);
+  tree_simple_alloc_assign_info(p, bl, parent, parent_offset);
 
-  // Set the id of the tree.
-  bl->id = __sync_fetch_and_add(&p->ever_allocated, 1);
+  __sync_fetch_and_add(&p->ever_allocated, 1);
   __sync_fetch_and_add(&p->allocated, 1);
 
   // Initialize function if there is any.
@@ -118,84 +411,271 @@ TreeBlock *tree_simple_g_alloc(TreePool *p, void *context, void *context2, FuncS
   if (func_init != NULL) {
     func_init(p, bl, context, context2);
   }
+  return bl;
+}
 
-  // Now parent should connect the head of the children.
-  // Note that parent->expansion should already be set (parent->expansion is used as a simple mutex).
-  SET_BIT(parent->expansion, parent_offset);
-  __sync_bool_compare_and_swap(&parent->children[parent_offset].child, 0, bl);
-  event_count_broadcast(&parent->children[parent_offset].event_count);
+TreeBlock *tree_simple_g_alloc(TreePool *p, void *context, void *context2, FuncSimpleInitBlocks func_init, TreeBlock *parent, BlockOffset parent_offset) {
+  TreeBlock *bl = alloc_and_init(p, context, context2, func_init, parent, parent_offset);
+  link_child(parent, parent_offset, bl);
+  return bl;
+}
+
+TreeBlock *tree_simple_g_alloc_shared(TreePool *p, uint64_t board_hash, void *context, void *context2, FuncSimpleInitBlocks func_init,
+    TreeBlock *parent, BlockOffset parent_offset, BOOL *shared) {
+  TransTable *t = (TransTable *)p->trans_table;
+  *shared = FALSE;
+  if (t == NULL || board_hash == 0) return tree_simple_g_alloc(p, context, context2, func_init, parent, parent_offset);
+
+  TreeBlock *bl = tt_acquire(t, board_hash);
+  if (bl != TP_NULL) {
+    // The block in the table is always initialized.
+    link_child(parent, parent_offset, bl);
+    *shared = TRUE;
+    return bl;
+  }
+
+  bl = tree_simple_g_alloc(p, context, context2, func_init, parent, parent_offset);
+  tt_insert(t, board_hash, bl);
+  return bl;
+}
+
+TreeBlock *tree_simple_g_alloc_deferred(TreePool *p, uint64_t board_hash, void *context, void *context2, FuncSimpleInitBlocks func_init,
+    TreeBlock *parent, BlockOffset parent_offset, BOOL *shared) {
+  TransTable *t = (TransTable *)p->trans_table;
+  *shared = FALSE;
+  if (t != NULL && board_hash != 0) {
+    TreeBlock *bl = tt_acquire(t, board_hash);
+    if (bl != TP_NULL) {
+      link_child(parent, parent_offset, bl);
+      *shared = TRUE;
+      return bl;
+    }
+  }
+
+  TreeBlock *bl = alloc_and_init(p, context, context2, func_init, parent, parent_offset);
+  // Registered in the table by tree_simple_g_link.
+  if (t != NULL) bl->board_hash = board_hash;
   return bl;
 }
 
-static void recursive_free(TreePool *p, TreeBlock *r) {
+void tree_simple_g_link(TreePool *p, TreeBlock *bl) {
+  TransTable *t = (TransTable *)p->trans_table;
+  if (t != NULL && bl->board_hash != 0) tt_insert(t, bl->board_hash, bl);
+  link_child(bl->parent, bl->parent_offset, bl);
+}
+
+static void release_block(TreePool *p, TreeBlock *r, FreeChain *chain);
+
+// Collect the subtree into chain. The blocks are returned to the pool by pool_release_chain.
+static void recursive_free(TreePool *p, TreeBlock *r, FreeChain *chain) {
     // Open multithread to recursively free the tree.
     // For now just single thread
     if (r == TP_NULL) return;
     for (int i = 0; i < r->n; ++i) {
-        if (r->children[i].child != TP_NULL) {
-            recursive_free(p, r->children[i].child);
+        TreeBlock *c = r->children[i].child;
+        if (c != TP_NULL) {
+            r->children[i].child = TP_NULL;
+            event_count_destroy(&r->children[i].event_count);
+            release_block(p, c, chain);
         }
     }
-    if (r->parent != TP_NULL) {
-      RESET_BIT(r->parent->expansion, r->parent_offset);
-      r->parent->children[r->parent_offset].child = TP_NULL;
-      event_count_destroy(&r->parent->children[r->parent_offset].event_count);
+    r->expansion = 0;
+    if (r->board_hash != 0 && p->trans_table != NULL) {
+      tt_remove((TransTable *)p->trans_table, r->board_hash, r);
     }
     for (int j = 0; j < BIT_CNN_NUM_BITS; ++j) {
       event_count_destroy(&r->cnn_data.event_counts[j]);
     }
     if (r->extra) free(r->extra);
-    free(r);
-    p->allocated --;
+
+    NEXT_FREE(r) = chain->head;
+    chain->head = r;
+    if (chain->tail == TP_NULL) chain->tail = r;
+    chain->n ++;
     return;
 }
 
+// Drop one parent link of r, and free r once no parent links to it.
+static void release_block(TreePool *p, TreeBlock *r, FreeChain *chain) {
+    if (__sync_sub_and_fetch(&r->num_parents, 1) > 0) return;
+    recursive_free(p, r, chain);
+}
+
+// Free a list of detached subtrees (linked through their parent pointers).
+static void free_subtrees(TreePool *p, TreeBlock *list) {
+  FreeChain chain = { TP_NULL, TP_NULL, 0 };
+  while (list != TP_NULL) {
+    TreeBlock *r = list;
+    list = r->parent;
+    r->parent = TP_NULL;
+    release_block(p, r, &chain);
+  }
+  pool_release_chain(p, &chain);
+}
+
+static void *threaded_reclaimer(void *ctx) {
+  TreePool *p = (TreePool *)ctx;
+  pthread_mutex_lock(&p->reclaim_lock);
+  while (1) {
+    while (p->reclaim_list == TP_NULL && ! p->reclaimer_done) {
+      pthread_cond_wait(&p->reclaim_cond, &p->reclaim_lock);
+    }
+    if (p->reclaim_list == TP_NULL) break;
+
+    // Take one subtree, so that several reclaimers can work in parallel.
+    TreeBlock *r = p->reclaim_list;
+    p->reclaim_list = r->parent;
+    pthread_mutex_unlock(&p->reclaim_lock);
+
+    r->parent = TP_NULL;
+    free_subtrees(p, r);
+
+    pthread_mutex_lock(&p->reclaim_lock);
+    p->num_reclaim_pending --;
+  }
+  pthread_mutex_unlock(&p->reclaim_lock);
+  return NULL;
+}
+
+void tree_simple_pool_start_reclaimers(TreePool *p, int num_reclaimer) {
+  if (p->num_reclaimer > 0 || num_reclaimer <= 0) return;
+  p->reclaimers = (pthread_t *)malloc(sizeof(pthread_t) * num_reclaimer);
+  p->reclaimer_done = FALSE;
+  p->num_reclaimer = num_reclaimer;
+  for (int i = 0; i < num_reclaimer; ++i) {
+    pthread_create(&p->reclaimers[i], NULL, threaded_reclaimer, p);
+  }
+}
+
+static void pool_stop_reclaimers(TreePool *p) {
+  if (p->num_reclaimer == 0) return;
+  pthread_mutex_lock(&p->reclaim_lock);
+  p->reclaimer_done = TRUE;
+  pthread_cond_broadcast(&p->reclaim_cond);
+  pthread_mutex_unlock(&p->reclaim_lock);
+  // Reclaimers drain the list before they quit.
+  for (int i = 0; i < p->num_reclaimer; ++i) {
+    pthread_join(p->reclaimers[i], NULL);
+  }
+  free(p->reclaimers);
+  p->reclaimers = NULL;
+  p->num_reclaimer = 0;
+}
+
+// Hand the detached subtrees to the reclaimers, or free them now if there is none.
+static void pool_reclaim(TreePool *p, TreeBlock *list, TreeBlock *tail, int n) {
+  if (list == TP_NULL) return;
+  if (p->num_reclaimer == 0) {
+    free_subtrees(p, list);
+    return;
+  }
+  pthread_mutex_lock(&p->reclaim_lock);
+  tail->parent = p->reclaim_list;
+  p->reclaim_list = list;
+  p->num_reclaim_pending += n;
+  pthread_cond_broadcast(&p->reclaim_cond);
+  pthread_mutex_unlock(&p->reclaim_lock);
+}
+
 // Free the children of p->root, except for the child exception.
 // Connect the parent of bl with the exception child. If except == TP_NULL, remove all children.
-// Then we starts a few threads to free the tree (also free bl).
+// The rest of the tree (including p->root's old child) is detached and handed to the reclaimers.
 void tree_simple_free_except(TreePool *p, TreeBlock *except) {
   TreeBlock *r = p->root->children[0].child;
   if (r == TP_NULL) {
-    memset(&p->root->data.stats[0], 0, sizeof(Stat));
+    p->root->data.stats.packed[0] = 0;
     return;
   }
 
-  // Free the nodes.
+  // Detach the nodes. Each discarded child becomes one job for the reclaimers, and r itself is freed without children
+  // (unless r is kept, then only its children are freed).
+  TreeBlock *list = TP_NULL, *tail = TP_NULL;
+  int n = 0;
+  if (r != except) {
+    r->parent = TP_NULL;
+    list = tail = r;
+    n ++;
+  }
   for (int i = 0; i < r->n; ++i) {
-      if (r->children[i].child != except) {
-        recursive_free(p, r->children[i].child);
-      }
+    TreeBlock *c = r->children[i].child;
+    r->children[i].child = TP_NULL;
+    if (c == TP_NULL || c == except) continue;
+    c->parent = list;
+    if (tail == TP_NULL) tail = c;
+    list = c;
+    n ++;
   }
+  r->expansion = 0;
 
   // Reconnect. Note this is run in single thread, so order does not matter.
   p->root->children[0].child = except;
   if (except != TP_NULL) {
-    float black_win = 0.0;
-    int total = 0;
-    // In this case, we need to recompute the stats.
+    // In this case, we need to recompute the stats. The packed words add up field by field.
+    uint64_t sum = 0;
     for (int i = 0; i < except->n; ++i) {
-      black_win += except->data.stats[i].black_win;
-      total += except->data.stats[i].total;
+      sum += except->data.stats.packed[i];
     }
-    p->root->data.stats[0].black_win = black_win;
-    p->root->data.stats[0].total = total;
+    p->root->data.stats.packed[0] = sum;
 
     except->parent = p->root;
     except->parent_offset = 0;
   } else {
     // Empty the child and reset the statistics.
     RESET_BIT(p->root->expansion, 0);
-    memset(&p->root->data.stats[0], 0, sizeof(Stat));
+    p->root->data.stats.packed[0] = 0;
   }
+
+  pool_reclaim(p, list, tail, n);
+}
+
+void tree_simple_pool_disable_transposition(TreePool *p) {
+  if (p->trans_table == NULL) return;
+  // The reclaimers remove the freed blocks from the table, so let them finish first.
+  int num_reclaimer = p->num_reclaimer;
+  pool_stop_reclaimers(p);
+  tt_free((TransTable *)p->trans_table);
+  p->trans_table = NULL;
+  tree_simple_pool_start_reclaimers(p, num_reclaimer);
 }
 
 // Free the tree_pool
 void tree_simple_pool_free(TreePool* p) {
-    recursive_free(p, p->root);
+    pool_stop_reclaimers(p);
+
+    FreeChain chain = { TP_NULL, TP_NULL, 0 };
+    recursive_free(p, p->root, &chain);
+    if (p->trans_table != NULL) {
+      tt_free((TransTable *)p->trans_table);
+      p->trans_table = NULL;
+    }
+
+    // Release the whole arena at once.
+    for (int i = 0; i < p->num_chunks; ++i) {
+      munmap(p->chunks[i], sizeof(TreeBlock) * TP_CHUNK_SIZE);
+      for (int k = 0; k < TP_NUM_SIDES; ++k) {
+        if (p->side_chunks[k] != NULL) munmap(p->side_chunks[k][i], side_bytes[k] * TP_CHUNK_SIZE);
+      }
+    }
+    for (int k = 0; k < TP_NUM_SIDES; ++k) {
+      free(p->side_chunks[k]);
+      p->side_chunks[k] = NULL;
+    }
+    p->side_mask = 0;
+    free(p->chunks);
+    p->chunks = NULL;
+    p->num_chunks = 0;
+    p->root = TP_NULL;
+    for (int i = 0; i < TP_NUM_CACHES; ++i) {
+      pthread_mutex_destroy(&p->caches[i].lock);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_mutex_destroy(&p->reclaim_lock);
+    pthread_cond_destroy(&p->reclaim_cond);
 }
 
 // Debug code to detect any inconsistency.
-static void tree_simple_check_one_block(const TreeBlock *root, const TreeBlock *bl) {
+// In transposition mode, the parent pointer and the statistics of a shared block are not checked.
+static void tree_simple_check_one_block(const TreeBlock *root, const TreeBlock *bl, BOOL check_parent) {
   if (bl == TP_NULL) return;
   // printf("Checking: ");
   // tree_simple_show_block(p, b);
@@ -209,6 +689,7 @@ static void tree_simple_check_one_block(const TreeBlock *root, const TreeBlock *
     tree_simple_show_block(bl);
     error("Block [%u] has nonzero expansion outside its size %d. Expansion = %u\n", ID(bl), bl->n, bl->expansion);
   }
+  if (! check_parent) return;
   // Check the connection between its parents node and itself.
   if (bl->parent == TP_NULL) {
     if (bl != root) {
@@ -226,16 +707,16 @@ static void tree_simple_check_one_block(const TreeBlock *root, const TreeBlock *
     }
 
     // Check the statistics, except if the parent is root.
-    float total_black_win = 0;
-    int total = 0;
+    uint64_t sum = 0;
     for (int i = 0; i < bl->n; ++i) {
-      // printf("Child %d: black_win = %.2f, total = %d\n", bl->data.stats[i].black_win, bl->data.stats[i].total);
-      total_black_win += bl->data.stats[i].black_win;
-      total += bl->data.stats[i].total;
+      sum += bl->data.stats.packed[i];
     }
+    int total = stat_total(sum);
+    float total_black_win = stat_black_win(sum);
 
-    int recorded_total = bl->parent->data.stats[bl->parent_offset].total;
-    float recorded_black_win =  bl->parent->data.stats[bl->parent_offset].black_win;
+    uint64_t recorded = bl->parent->data.stats.packed[bl->parent_offset];
+    int recorded_total = stat_total(recorded);
+    float recorded_black_win = stat_black_win(recorded);
     if (total != recorded_total) {
       error("Block %x [%u]: The computed total [%d] is different from recorded total [%d]!", (uint64_t)bl, ID(bl), total, recorded_total);
     }
@@ -245,14 +726,14 @@ static void tree_simple_check_one_block(const TreeBlock *root, const TreeBlock *
   }
 }
 
-static void tree_simple_pool_recursive_tree_check(const TreeBlock *root, const TreeBlock *bl) {
+static void tree_simple_pool_recursive_tree_check(const TreeBlock *root, const TreeBlock *bl, BOOL check_parent) {
     if (bl == TP_NULL) return;
     // Check this block.
-    tree_simple_check_one_block(root, bl);
+    tree_simple_check_one_block(root, bl, check_parent);
 
     // Do it recursively.
     for (int i = 0; i < bl->n; ++i) {
-        tree_simple_check_one_block(root, bl->children[i].child);
+        tree_simple_check_one_block(root, bl->children[i].child, check_parent);
     }
 }
 
@@ -263,7 +744,7 @@ void tree_simple_pool_check(const TreePool *p) {
     return;
   }
 
-  tree_simple_pool_recursive_tree_check(p->root, p->root);
+  tree_simple_pool_recursive_tree_check(p->root, p->root, p->trans_table == NULL);
   printf("DEBUG: All tree check complete!\n");
 }
 
@@ -275,32 +756,34 @@ const char *tree_simple_get_status_str(unsigned char evaluated) {
   return "unknown";
 }
 
-void tree_simple_visitor_cnn(void *context, const TreeBlock *bl, int depth) {
+void tree_simple_visitor_cnn(void *context, const TreeBlock *parent, BlockOffset parent_offset, const TreeBlock *bl, int depth) {
   FILE *fp = (FILE *)context;
-  BlockOffset i = bl->parent_offset;
+  BlockOffset i = parent_offset;
 
-  const TreeBlock *parent = bl->parent;
-  const Stat *s = &parent->data.stats[i];
+  float black_win = stat_black_win(parent->data.stats.packed[i]);
+  int total = stat_total(parent->data.stats.packed[i]);
   const CNNData *cnn = &parent->cnn_data;
 
   char *spaces = (char *)malloc(depth + 1);
   memset(spaces, ' ', depth);
   spaces[depth] = 0;
 
-  float win_ratio = ((float)s->black_win) / s->total;
+  float win_ratio = black_win / total;
   char buf[30];
 
   // Only show black win ratio.
-  fprintf(fp, "%s\"name\": \"%.1f/%.3f/%d\", \n", spaces, win_ratio * 100, s->black_win, s->total);
+  fprintf(fp, "%s\"name\": \"%.1f/%.3f/%d\", \n", spaces, win_ratio * 100, black_win, total);
   fprintf(fp, "%s\"status\": \"%s\", \n", spaces, tree_simple_get_status_str(bl->cnn_data.evaluated));
   fprintf(fp, "%s\"confidence\": %f, \n", spaces, cnn->confidences[i]);
-  fprintf(fp, "%s\"fast_confidence\": %f, \n", spaces, cnn->fast_confidences[i]);
-  fprintf(fp, "%s\"opp_pred\": %f, \n", spaces, parent->data.opp_preds[i]);
+  // Side arrays that are not allocated in this mode are shown as 0.
+  fprintf(fp, "%s\"fast_confidence\": %f, \n", spaces, cnn->fast_confidences ? cnn->fast_confidences[i] : 0.0);
+  fprintf(fp, "%s\"opp_pred\": %f, \n", spaces, parent->data.opp_preds ? parent->data.opp_preds[i] : 0.0);
   fprintf(fp, "%s\"terminal\": \"%s\", \n", spaces, STR_STONE(bl->terminal_status));
   fprintf(fp, "%s\"b_ptr\": \"%lx\",\n", spaces, (uint64_t)bl);
   fprintf(fp, "%s\"seq\": %ld,\n", spaces, bl->cnn_data.seq);
   fprintf(fp, "%s\"n\": %d,\n", spaces, bl->n);
-  fprintf(fp, "%s\"b/w/n\": \"%d/%d/%d\",\n", spaces, parent->cnn_data.ps[i].b, parent->cnn_data.ps[i].w, s->total);
+  fprintf(fp, "%s\"b/w/n\": \"%d/%d/%d\",\n", spaces,
+      cnn->ps ? cnn->ps[i].b : 0, cnn->ps ? cnn->ps[i].w : 0, total);
   fprintf(fp, "%s\"move_x\": %d,\n", spaces, X(parent->data.moves[i]));
   fprintf(fp, "%s\"move_y\": %d,\n", spaces, Y(parent->data.moves[i]));
   fprintf(fp, "%s\"move_str\": \"%s\",\n", spaces, get_move_str(parent->data.moves[i], S_EMPTY, buf));
@@ -309,7 +792,7 @@ void tree_simple_visitor_cnn(void *context, const TreeBlock *bl, int depth) {
 }
 
 // Recursively print stuff
-void tree_simple_print_out_impl(FILE* fp, const TreeBlock *bl, int depth, FuncSimpleTreeVisitor visitor) {
+void tree_simple_print_out_impl(FILE* fp, const TreeBlock *parent, BlockOffset parent_offset, const TreeBlock *bl, int depth, FuncSimpleTreeVisitor visitor) {
   if (bl == TP_NULL) return;
 
   char *spaces = (char *)malloc(depth + 1);
@@ -318,7 +801,7 @@ void tree_simple_print_out_impl(FILE* fp, const TreeBlock *bl, int depth, FuncSi
 
   // Visit the current node.
   fprintf(fp, "%s{\n", spaces);
-  visitor(fp, bl, depth);
+  visitor(fp, parent, parent_offset, bl, depth);
 
   int index = 0;
   for (int i = 0; i < bl->n; ++i) {
@@ -328,7 +811,7 @@ void tree_simple_print_out_impl(FILE* fp, const TreeBlock *bl, int depth, FuncSi
     } else {
       fprintf(fp, ",\n%s\"children\": [\n", spaces);
     }
-    tree_simple_print_out_impl(fp, bl->children[i].child, depth + 2, visitor);
+    tree_simple_print_out_impl(fp, bl, i, bl->children[i].child, depth + 2, visitor);
     index ++;
   }
   if (index > 0) fprintf(fp, "\n%s]", spaces);
@@ -338,7 +821,7 @@ void tree_simple_print_out_impl(FILE* fp, const TreeBlock *bl, int depth, FuncSi
 }
 
 void tree_simple_print_out(void *fp, const TreePool *p, FuncSimpleTreeVisitor visitor) {
-  tree_simple_print_out_impl((FILE *)fp, p->root->children[0].child, 0,
+  tree_simple_print_out_impl((FILE *)fp, p->root, 0, p->root->children[0].child, 0,
                              visitor);
 }
 
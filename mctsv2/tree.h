@@ -13,16 +13,11 @@
 // Simple tree. (No sibiling pointers)
 #include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
 #include "../common/common.h"
 #include "../common/comm_constant.h"
 #include "event_count.h"
 
-// Statistics at each tree node.
-typedef struct {
-  float black_win;
-  int total;
-} Stat;
-
 #define MAX_PROVE_NUM 0x7fffffff
 #define INIT_PROVE_NUM 100000
 
@@ -45,15 +40,39 @@ typedef unsigned long BlockBits;
 #define SET_BIT(e, k) e |= BIT(k)
 #define RESET_BIT(e, k) e &= ~BIT(k)
 
+// Statistics of the children of a tree node, one 64-bit word per child: #visits in the high bits, and #black wins in fixed point
+// (STAT_WIN_FRAC_BITS fractional bits) in the low STAT_WIN_BITS bits. A backprop is then a single atomic add, and a reader always
+// sees visits and wins that are consistent with each other.
+#define STAT_WIN_BITS 36
+#define STAT_WIN_FRAC_BITS 8
+typedef struct {
+  uint64_t packed[BLOCK_SIZE];
+} Stats;
+
+// The word to add for total visits and black_win wins.
+#define STAT_PACK(total, black_win) (((uint64_t)(total) << STAT_WIN_BITS) + (uint64_t)((black_win) * (1 << STAT_WIN_FRAC_BITS) + 0.5))
+
+static inline int stat_total(uint64_t v) {
+  return (int)(v >> STAT_WIN_BITS);
+}
+
+static inline float stat_black_win(uint64_t v) {
+  return (float)(v & ((1ULL << STAT_WIN_BITS) - 1)) / (1 << STAT_WIN_FRAC_BITS);
+}
+
 // ==== Game specific data =======
 typedef struct {
    // Game specific data
   unsigned char player;
   Coord moves[BLOCK_SIZE];
-  Stat stats[BLOCK_SIZE];
-  Stat rave_stats[BLOCK_SIZE];
-  // win rate online prediction from opponent perspective.
-  float opp_preds[BLOCK_SIZE];
+  Stats stats;
+  // The following fields point to side arrays (BLOCK_SIZE entries each) and are NULL unless the mode needs them (see TP_SIDE_*).
+  // Used by RAVE.
+  Stats *rave_stats;
+  // win rate online prediction from opponent perspective. Used by the online model.
+  float *opp_preds;
+  // #simulations that are descending through each child (atomic). Used for virtual loss.
+  int *inflights;
 } GameData;
 
 #define BIT_CNN_TRY_SEND 0
@@ -71,14 +90,15 @@ typedef struct {
   // The sent/received sequence number from CNN server.
   long seq;
   // Deepnet confidences.
-  // Type of moves. Some moves might not come from CNN (e.g., tactical moves).
-  // See ../common/package.h for definition of move types.
-  char types[BLOCK_SIZE];
-  // confidences given in fast rollout.
-  float fast_confidences[BLOCK_SIZE];
   float confidences[BLOCK_SIZE];
+  // The following fields point to side arrays, see GameData.
+  // Type of moves. Some moves might not come from CNN (e.g., tactical moves). Used in life and death mode.
+  // See ../common/package.h for definition of move types.
+  char *types;
+  // confidences given in fast rollout. Used in async mode.
+  float *fast_confidences;
   // prove, disprove numbers, used for tsumego search.
-  ProveNumber ps[BLOCK_SIZE];
+  ProveNumber *ps;
   EventCount event_counts[BIT_CNN_NUM_BITS];
 } CNNData;
 
@@ -89,6 +109,11 @@ BOOL cnn_data_fetch_set_evaluated_bit(CNNData* data, unsigned char bit);
 
 unsigned char cnn_data_wait_until_evaluated_bit(CNNData* data,
                                                 unsigned char bit);
+// The request in flight is given up (e.g., the server could not evaluate it): clear BIT_CNN_SENT and wake up the threads
+// in cnn_data_wait_until_received_or_cancelled, so that they send it again.
+void cnn_data_cancel_sent(CNNData* data);
+// Wait until BIT_CNN_RECEIVED is set or BIT_CNN_SENT is cleared. Return the bits.
+unsigned char cnn_data_wait_until_received_or_cancelled(CNNData* data);
 unsigned char cnn_data_load_evaluated(CNNData* data);
 
 struct TreeBlock_;
@@ -102,7 +127,7 @@ typedef struct TreeBlock_ {
   // Parent node.
   struct TreeBlock_ *parent;
 
-  // Now the block needs an id (starting from 1)
+  // Now the block needs an id (starting from 1), which is also its slot in the arena (see TreePool).
   unsigned int id;
 
   // The block offset for the parent.
@@ -115,9 +140,14 @@ typedef struct TreeBlock_ {
   // Usually the node is a terminal node when n = 0 (no move is valid), but in life and death problem, a node might be
   // terminal when the opponent builds two eyes, or failed to build two eyes, etc.
   Stone terminal_status;
+  // Whether the top unexpanded children of this node have been sent for speculative evaluation (see TreeParams.prefetch_n_thres).
+  unsigned char prefetched;
 
-  // The board hash for this node.
-  // uint64_t board_hash;
+  // The board hash for this node (mixed with the ply), only set in transposition mode. 0 means it is not shared.
+  uint64_t board_hash;
+  // #parents that link to this node. It is more than 1 only in transposition mode, and the node is freed when it drops to 0.
+  // Note that in transposition mode, parent/parent_offset is the first parent and might be stale once that parent is freed.
+  int num_parents;
 
   // Many children
   ChildInfo children[BLOCK_SIZE];
@@ -145,12 +175,67 @@ typedef TreeBlock * TreeBlockPtr;
 // For simple tree, we allocate/delete the memory on the fly.
 #define TP_NULL 0
 
+// Blocks are carved from large chunks (a slab arena) and recycled through free lists, instead of malloc/free per block.
+// Each block keeps its slot in the arena for life, so bl->id is a 32-bit handle: tree_simple_get_block(p, id) == bl.
+#define TP_CHUNK_BITS 10
+#define TP_CHUNK_SIZE (1 << TP_CHUNK_BITS)
+#define TP_MAX_CHUNKS 65536
+// #Free lists that threads allocate from, and how many blocks they take from the global free list each time.
+// They are striped caches, each behind its own mutex: a thread sticks to one, and several threads might share it.
+#define TP_NUM_CACHES 16
+#define TP_CACHE_BATCH 64
+
+typedef struct {
+  pthread_mutex_t lock;
+  TreeBlock *head;
+  int n;
+} TreeBlockCache;
+
+// Optional side arrays of a block. They are kept out of TreeBlock so that the hot part of a node (moves, stats, priors, children)
+// stays compact, and are only allocated for the modes that need them.
+#define TP_SIDE_RAVE   0   // data.rave_stats (use_rave)
+#define TP_SIDE_ONLINE 1   // data.opp_preds (use_online_model)
+#define TP_SIDE_FAST   2   // cnn_data.fast_confidences (use_async)
+#define TP_SIDE_LD     3   // cnn_data.ps and cnn_data.types (life_and_death_mode)
+#define TP_SIDE_VLOSS  4   // data.inflights (virtual_loss > 0)
+#define TP_NUM_SIDES   5
+
 typedef struct {
   // All things starts from 1. 0 is reserved for null pointer.
   // blocks[TP_ROOT] is always the root for the main tree (so that root can collect the overall statistics)
-  // blocks[TP_FREE_START + i] is always the root for the i-th freed tree. We keep a set of free trees to make allocation parallelable.
   TreeBlock *root;
 
+  // Arena. chunks[i] holds the blocks with id [i * TP_CHUNK_SIZE + 1, (i + 1) * TP_CHUNK_SIZE].
+  TreeBlock **chunks;
+  int num_chunks;
+  // #blocks carved from the arena so far.
+  int num_carved;
+
+  // Global free list, refilled by frees in bulk. Protected by lock (also protects carving).
+  pthread_mutex_t lock;
+  TreeBlock *free_list;
+  int num_free;
+
+  // Striped free lists to make allocation parallelable (see TP_NUM_CACHES).
+  TreeBlockCache caches[TP_NUM_CACHES];
+
+  // Side arrays, parallel to the arena. side_chunks[k] is NULL if side k is not enabled (bit k of side_mask),
+  // otherwise side_chunks[k][i] holds the side data of the blocks in chunks[i].
+  int side_mask;
+  char **side_chunks[TP_NUM_SIDES];
+
+  // Pruned subtrees waiting to be freed by the reclaimer threads (linked through their parent pointers).
+  pthread_mutex_t reclaim_lock;
+  pthread_cond_t reclaim_cond;
+  TreeBlock *reclaim_list;
+  int num_reclaim_pending;
+  int num_reclaimer;
+  pthread_t *reclaimers;
+  BOOL reclaimer_done;
+
+  // Transposition table (board hash -> block), NULL if transposition is not used.
+  void *trans_table;
+
   // Some statistics.
   int64_t ever_allocated;
   int allocated;
@@ -164,6 +249,15 @@ void tree_simple_pool_init(TreePool *p);
 #define FIRST_NONLEAF(bl) (((bl)->expansion == 0) ? BLOCK_SIZE : __builtin_ctzl((bl)->expansion))
 #define ID(bl) ((bl) == TP_NULL ? 0 : (bl)->id)
 
+// Enable the side arrays in mask (e.g., BIT(TP_SIDE_RAVE) | BIT(TP_SIDE_LD)) for all blocks. Side arrays are never disabled.
+// Not thread-safe: call it when no thread is working on the tree.
+void tree_simple_pool_enable_sides(TreePool *p, int mask);
+
+// Get the block from its id (32-bit handle). Return TP_NULL if id = 0.
+TreeBlock *tree_simple_get_block(const TreePool *p, unsigned int id);
+// Bytes reserved by the arena.
+size_t tree_simple_pool_bytes(const TreePool *p);
+
 // Display the content of the block.
 void tree_simple_show_block(const TreeBlock *bl);
 
@@ -171,7 +265,28 @@ void tree_simple_show_block(const TreeBlock *bl);
 typedef void (* FuncSimpleInitBlocks)(TreePool *p, TreeBlock *bl, void *context, void *context2);
 TreeBlock *tree_simple_g_alloc(TreePool *p, void *context, void *context2, FuncSimpleInitBlocks func_init, TreeBlock *parent, BlockOffset parent_offset);
 
+// Transposition mode: positions reached by different move orders share one block, so the tree becomes a DAG.
+// size: #entries of the table.
+void tree_simple_pool_enable_transposition(TreePool *p, int size);
+// Drop the table. Only call it once the tree has been freed by tree_simple_free_except(p, TP_NULL), with no search thread running.
+void tree_simple_pool_disable_transposition(TreePool *p);
+// Same as tree_simple_g_alloc, but first look up the block by board hash. If found, link it to the parent and set *shared = TRUE,
+// otherwise allocate a new block and register it in the table once it is initialized.
+TreeBlock *tree_simple_g_alloc_shared(TreePool *p, uint64_t board_hash, void *context, void *context2, FuncSimpleInitBlocks func_init,
+    TreeBlock *parent, BlockOffset parent_offset, BOOL *shared);
+
+// Same as tree_simple_g_alloc_shared, but a new block is neither linked to the parent nor registered in the table,
+// so that its initialization can complete later (e.g., the CNN reply is still on its way). Call tree_simple_g_link once it is ready.
+// Until then, other threads see the child as being expanded. A shared block is linked right away.
+TreeBlock *tree_simple_g_alloc_deferred(TreePool *p, uint64_t board_hash, void *context, void *context2, FuncSimpleInitBlocks func_init,
+    TreeBlock *parent, BlockOffset parent_offset, BOOL *shared);
+void tree_simple_g_link(TreePool *p, TreeBlock *bl);
+
+// Start num_reclaimer threads that free pruned subtrees in the background. If there is no reclaimer, tree_simple_free_except frees them inline.
+void tree_simple_pool_start_reclaimers(TreePool *p, int num_reclaimer);
+
 // Free the children of node, except for the child specified by b2 and offset.
+// The discarded subtrees are only unlinked here and then handed to the reclaimers, so the call is cheap.
 void tree_simple_free_except(TreePool *p, TreeBlock *except);
 
 // Free the tree_pool
@@ -184,8 +299,9 @@ void tree_simple_pool_check(const TreePool *p);
 const char *tree_simple_get_status_str(unsigned char evaluated);
 
 // Print out the current visible tree into file.
-typedef void (* FuncSimpleTreeVisitor)(void *context, const TreeBlock *bl, int depth);
-void tree_simple_visitor_cnn(void *context, const TreeBlock *bl, int depth);
+// The parent and parent_offset is the edge that we come from (bl->parent might be different in transposition mode).
+typedef void (* FuncSimpleTreeVisitor)(void *context, const TreeBlock *parent, BlockOffset parent_offset, const TreeBlock *bl, int depth);
+void tree_simple_visitor_cnn(void *context, const TreeBlock *parent, BlockOffset parent_offset, const TreeBlock *bl, int depth);
 
 // Example usage:
 //   tree_print_out(filename, p, tree_child_picker_cnn, tree_visitor_cnn);
@@ -97,26 +97,40 @@ static int block_all_threads(TreeHandle *s, BOOL print_and_reset_all_stats) {
   int cnn_send_infunc = 0;
   int cnn_send_attempt = 0;
   int cnn_send_success = 0;
+  int cnn_cache_hit = 0;
+  int cnn_cache_waiting = 0;
+  int cnn_prefetch_sent = 0;
   int use_ucb = 0;
   int use_cnn = 0;
   int use_async = 0;
   int max_depth = 0;
   int leaf_expanded = 0;
+  int transposition_hit = 0;
+  int expand_collision = 0;
   int num_expand_failed = 0;
   int num_policy_failed = 0;
   int preempt_playout_count = 0;
+  int sim_parked = 0;
+  int sim_stalled = 0;
   for (int i = 0; i < s->params.num_tree_thread; ++i) {
     ThreadInfo *info = &s->infos[i];
     leaf_expanded += info->leaf_expanded;
+    transposition_hit += info->transposition_hit;
+    expand_collision += info->expand_collision;
     num_expand_failed += info->num_expand_failed;
     num_policy_failed += info->num_policy_failed;
     cnn_send_infunc += info->cnn_send_infunc;
     cnn_send_attempt += info->cnn_send_attempt;
     cnn_send_success += info->cnn_send_success;
+    cnn_cache_hit += info->cnn_cache_hit;
+    cnn_cache_waiting += info->cnn_cache_waiting;
+    cnn_prefetch_sent += info->cnn_prefetch_sent;
     use_ucb += info->use_ucb;
     use_cnn += info->use_cnn;
     use_async += info->use_async;
     preempt_playout_count += info->preempt_playout_count;
+    sim_parked += info->sim_parked;
+    sim_stalled += info->sim_stalled;
     if (max_depth < info->max_depth) max_depth = info->max_depth;
     /*
        PRINT_INFO("Thread [%d]: #expanded = %d, #policy_failed = %d, #expand_failed = %d, infunc = %d, attempt = %d, success = %d, #ucb = %d, #cnn = %d, max_depth = %d\n",
@@ -126,24 +140,32 @@ static int block_all_threads(TreeHandle *s, BOOL print_and_reset_all_stats) {
        */
 
     info->leaf_expanded = 0;
+    info->transposition_hit = 0;
+    info->expand_collision = 0;
     info->num_expand_failed = 0;
     info->num_policy_failed = 0;
     info->cnn_send_infunc = 0;
     info->cnn_send_attempt = 0;
     info->cnn_send_success = 0;
+    info->cnn_cache_hit = 0;
+    info->cnn_cache_waiting = 0;
+    info->cnn_prefetch_sent = 0;
     info->use_ucb = 0;
     info->use_cnn = 0;
     info->use_async = 0;
     info->max_depth = 0;
     info->counter = 0;
     info->preempt_playout_count = 0;
+    info->sim_parked = 0;
+    info->sim_stalled = 0;
   }
 
-  PRINT_INFO("Stats: leaf_expanded = %d, #policy_failed = %d, #expand_failed = %d, #preempt_playout_count = %d\n",
-      leaf_expanded, num_policy_failed, num_expand_failed, preempt_playout_count);
-  PRINT_INFO("Stats [Send] infunc = %d, attempt = %d, success = %d\n", cnn_send_infunc, cnn_send_attempt, cnn_send_success);
+  PRINT_INFO("Stats: leaf_expanded = %d, transposition_hit = %d, expand_collision = %d, #policy_failed = %d, #expand_failed = %d, #preempt_playout_count = %d, sim_parked = %d, sim_stalled = %d\n",
+      leaf_expanded, transposition_hit, expand_collision, num_policy_failed, num_expand_failed, preempt_playout_count, sim_parked, sim_stalled);
+  PRINT_INFO("Stats [Send] infunc = %d, attempt = %d, success = %d, cache_hit = %d, cache_waiting = %d, prefetch_sent = %d\n",
+      cnn_send_infunc, cnn_send_attempt, cnn_send_success, cnn_cache_hit, cnn_cache_waiting, cnn_prefetch_sent);
   PRINT_INFO("Stats [Policy] use_ucb = %d, use_cnn = %d, use_async = %d\n", use_ucb, use_cnn, use_async);
-  fprintf(stderr,"p->root->data.stats[0].total: %d, #rollout: %d, #cnn: %d, max_depth: %d\n", s->p.root->data.stats[0].total, s->rollout_count, s->dcnn_count, max_depth);
+  fprintf(stderr,"p->root total: %d, #rollout: %d, #cnn: %d, max_depth: %d\n", stat_total(s->p.root->data.stats.packed[0]), s->rollout_count, s->dcnn_count, max_depth);
 
   // Clear up the model.
   if (s->params.use_online_model) {
@@ -173,6 +195,19 @@ static int block_all_threads(TreeHandle *s, BOOL print_and_reset_all_stats) {
   return res;
 }
 
+// Tell the evaluators that the boards of older sequence numbers are useless, so that they are dropped before evaluation.
+static void publish_seq(TreeHandle *s) {
+  if (s->common_params->cpu_only || s->callbacks.callback_set_min_seq == NULL) return;
+  s->callbacks.callback_set_min_seq(s->callbacks.context, s->seq);
+}
+
+// Move to a new (larger) sequence number. Replies to the previous one are discarded.
+static void next_seq(TreeHandle *s) {
+  unsigned long new_seq = time(NULL);
+  s->seq = (new_seq > s->seq ? new_seq : s->seq + 1);
+  publish_seq(s);
+}
+
 static int resume_all_threads(TreeHandle *s) {
   // If all threads have been resumed, then no need to resume.
   int blocking_number = __atomic_load_n(&s->all_threads_blocking_count, __ATOMIC_ACQUIRE);
@@ -281,186 +316,234 @@ static void prepare_search_complete(TreeHandle *s) {
   s->flag_search_complete = SC_NOT_YET;
 }
 
-static void *threaded_move_receiver(void *ctx) {
-  ReceiverParams *rp = (ReceiverParams *)ctx;
-  TreeHandle *s = rp->s;
-
-  PRINT_DEBUG("In move receiver, id = %d\n", rp->receiver_id);
-  // receive move.
-  MMove mmove;
+// Fill the block with the moves returned from CNN, and open BIT_CNN_RECEIVED.
+void fill_block_with_cnn_move(const TreeHandle *s, TreeBlock *bl, const MMove *mmove, unsigned long *seed) {
+  // Register the moves to the tree.
+  float accumulated = 0.0;
   short indices_map[BOUND_COORD];
-  unsigned long seed = rp->receiver_id + 26712;
-  // Simple buffer for moves.
-  while (1) {
-    memset(&mmove, 0, sizeof(mmove));
-    if (s->receiver_done) {
-      // Clean up all messages in the queue, once done, quit.
-      rp->cnn_move_discarded += s->callbacks.callback_receiver_discard_move(s->callbacks.context, rp->receiver_id);
-      break;
+  memset(indices_map, 0xff, sizeof(short) * BOUND_COORD);
+
+  // Get the parameters atomically.
+  const float rcv_acc_prob_thres = __atomic_load_n(&s->params.rcv_acc_percent_thres, __ATOMIC_ACQUIRE) / 100.0;
+  const int rcv_min_num_move = __atomic_load_n(&s->params.rcv_min_num_move, __ATOMIC_ACQUIRE);
+  const int rcv_max_num_move = __atomic_load_n(&s->params.rcv_max_num_move, __ATOMIC_ACQUIRE);
+
+  // First add existing moves if there is any.
+  int n = bl->n;
+  for (int i = 0; i < n; ++i) {
+    indices_map[bl->data.moves[i]] = i;
+  }
+
+  int count = 0;
+  for (int i = 0; i < NUM_FIRST_MOVES; ++i) {
+    if (accumulated >= rcv_acc_prob_thres && i >= rcv_min_num_move) break;
+    if (count >= rcv_max_num_move) break;
+    // We only pick first BLOCK_SIZE moves.
+    if (n >= BLOCK_SIZE) break;
+    // note the coordinates in mmove are 1-based due to lua convension.
+    Coord m = GetCoord(mmove->xs[i] - 1, mmove->ys[i] - 1);
+    if (m != M_PASS) {
+      // set the corresponding bit to be one. note that there is no race condition since before the
+      // final .evaluated bit is set, other thread will not use it.
+      // fprintf(stderr,"%s ", get_move_str(m, mmove->player));
+
+      // bl->data.moves[bl->n] = m;
+      // bl->cnn_data.confidences[bl->n] = mmove->probs[i];
+      int idx = indices_map[m];
+      if (idx < 0) {
+        // newly added.
+        idx = n;
+        bl->data.moves[n] = m;
+        indices_map[m] = n ++;
+      }
+
+      // Initialize the node.
+      bl->cnn_data.confidences[idx] = mmove->probs[i];
+      if (bl->cnn_data.ps != NULL) {
+        bl->cnn_data.types[idx] = mmove->types[i];
+        bl->cnn_data.ps[idx].b = 10;
+        bl->cnn_data.ps[idx].w = 10;
+      }
+      // Without any online prediction, we just assume the prior is 0.5
+      if (bl->data.opp_preds != NULL) bl->data.opp_preds[idx] = 0.5;
+
+      // Random n.
+      bl->data.stats.packed[i] = STAT_PACK(s->params.num_virtual_games, fast_random(seed, s->params.num_virtual_games));
+
+      // A small fix: it seems that if CNN could play ko, it will play it with 0.9x confidence, which does not make sense.
+      // So if the move is KO, we will just skip the accumulation so that other moves can also be considered.
+      //if (mmove->types[i] != MOVE_SIMPLE_KO) accumulated += mmove->probs[i];
+      //*disable the ko check by Yan, 12/24/2015
+      accumulated += mmove->probs[i];
+      count ++;
     }
+  }
 
-    // Receive move.
-    if (! s->callbacks.callback_receive_move(s->callbacks.context, rp->receiver_id, &mmove)) continue;
-
-    rp->cnn_move_received ++;
-    // Invalid sequence.
-    if (mmove.seq == 0) continue;
-
-    // This is a pointer that we could use. Therefore, any node that has not be evaluated will never be deleted by tree_simple_free_except.
-    // Since MCTS will simply not pick node with bl->n = 0. In conclusion, we don't need a lock here.
-    TreeBlock *bl = (TreeBlock *)mmove.b;
-
-    // Statistics.
-    // Since parameter might change at any time, we need to read them atomatically.
-    const int verbose = __atomic_load_n(&s->params.verbose, __ATOMIC_ACQUIRE);
-    if (verbose >= V_DEBUG || bl == TP_NULL) {
-      double t_received_board = mmove.t_received - mmove.t_sent;
-      double t_replied = mmove.t_replied - mmove.t_received;
-      double t_received_move = wallclock() - mmove.t_replied;
-      fprintf(stderr,"Received move: b = %lx, hostname = %s, board[send2rcv] = %lf, rcv2reply = %lf, move[send2rcv] = %lf\n", mmove.b, mmove.hostname, t_received_board, t_replied, t_received_move);
+  // We don't need the lock here.
+  // __atomic_store_n(&bl->cnn_data.seq, mmove->seq, __ATOMIC_RELAXED);
+  bl->cnn_data.seq = mmove->seq;
+  // bl->player = mmove->player;
+  //
+  // If we want to use extra information, copy them to the tree block.
+  // [FIXME]: Do we need atomic operation?
+  if (s->params.use_online_model) {
+    bl->extra = (char *)malloc(MAX_CUSTOM_DATA);
+    // It will be freed when the tree node is freed.
+    memcpy(bl->extra, mmove->extra, MAX_CUSTOM_DATA);
+  }
+
+  bl->has_score = mmove->has_score;
+  bl->score = mmove->score;
+  // finally open the bit.
+  //set_bit(bl->cnn_data.evaluated, bit_cnn_received);
+  __atomic_store_n(&bl->n, n, __ATOMIC_RELAXED);
+  cnn_data_set_evaluated_bit(&bl->cnn_data, BIT_CNN_RECEIVED);
+}
+
+// Save the reply to the cache, and deliver it to all blocks waiting on the same position.
+static void store_and_deliver(TreeHandle *s, const MMove *mmove, unsigned long *seed) {
+  if (s->eval_cache == NULL || mmove->board_hash == 0) return;
+  void *waiters[EC_MAX_WAITERS];
+  int num_waiters = EvalCacheStore(s->eval_cache, mmove->board_hash, mmove, waiters);
+  for (int i = 0; i < num_waiters; ++i) {
+    TreeBlock *w = (TreeBlock *)waiters[i];
+    unsigned char w_evaluated = cnn_data_load_evaluated(&w->cnn_data);
+    if (w->cnn_data.seq != mmove->seq || ! TEST_BIT(w_evaluated, BIT_CNN_SENT) || TEST_BIT(w_evaluated, BIT_CNN_RECEIVED)) continue;
+    fill_block_with_cnn_move(s, w, mmove, seed);
+    __sync_fetch_and_add(&s->dcnn_count, 1);
+  }
+}
+
+// Register one move from the exchanger to the tree.
+static void receive_one_move(ReceiverParams *rp, const MMove *mmove, unsigned long *seed) {
+  TreeHandle *s = rp->s;
+  // Invalid sequence.
+  if (mmove->seq == 0) return;
+
+  // This is a pointer that we could use. Therefore, any node that has not be evaluated will never be deleted by tree_simple_free_except.
+  // Since MCTS will simply not pick node with bl->n = 0. In conclusion, we don't need a lock here.
+  TreeBlock *bl = (TreeBlock *)mmove->b;
+
+  // Statistics.
+  // Since parameter might change at any time, we need to read them atomatically.
+  const int verbose = __atomic_load_n(&s->params.verbose, __ATOMIC_ACQUIRE);
+  if (verbose >= V_DEBUG || bl == TP_NULL) {
+    double t_received_board = mmove->t_received - mmove->t_sent;
+    double t_replied = mmove->t_replied - mmove->t_received;
+    double t_received_move = wallclock() - mmove->t_replied;
+    fprintf(stderr,"Received move: b = %lx, hostname = %s, board[send2rcv] = %lf, rcv2reply = %lf, move[send2rcv] = %lf\n", mmove->b, mmove->hostname, t_received_board, t_replied, t_received_move);
+    fflush(stdout);
+  }
+
+  // fprintf(stderr,"Package received. b = %d, seq = %ld\n", mmove->b, mmove->seq);
+  // Check if the move is valid.
+  if (bl == NULL) {
+    if (verbose >= V_INFO) {
+      fprintf(stderr,"Should never receive move instructions from b = NULL!\n");
       fflush(stdout);
     }
+    return;
+  }
 
-    // fprintf(stderr,"Package received. b = %d, seq = %ld\n", mmove.b, mmove.seq);
-    // Check if the move is valid.
-    if (bl == NULL) {
-      if (verbose >= V_INFO) {
-        fprintf(stderr,"Should never receive move instructions from b = NULL!\n");
-        fflush(stdout);
-      }
-      continue;
-    }
+  // Lock if the main threads want it to stop here.
+  if (s->params.use_async)
+    pthread_mutex_lock(&rp->lock);
 
-    // Lock if the main threads want it to stop here.
+  // If seq does not match, we skip this move.
+  if (mmove->seq != s->seq) {
+    rp->cnn_move_seq_mismatched ++;
     if (s->params.use_async)
-      pthread_mutex_lock(&rp->lock);
+      pthread_mutex_unlock(&rp->lock);
+    return;
+  }
 
-    // If seq does not match, we skip this move.
-    if (mmove.seq != s->seq) {
-      rp->cnn_move_seq_mismatched ++;
-      if (s->params.use_async)
-        pthread_mutex_unlock(&rp->lock);
-      continue;
+  // The server could not evaluate the board (e.g., the shm exchanger lost the parent of a delta). Give up the request,
+  // so that the block and the blocks waiting on it in the cache send their boards again.
+  if (mmove->error) {
+    rp->cnn_move_error ++;
+    if (s->eval_cache != NULL && mmove->board_hash != 0) {
+      void *waiters[EC_MAX_WAITERS];
+      int num_waiters = EvalCacheCancel(s->eval_cache, mmove->board_hash, (void *)mmove->b, waiters);
+      for (int i = 0; i < num_waiters; ++i) cnn_data_cancel_sent(&((TreeBlock *)waiters[i])->cnn_data);
     }
+    if (mmove->b != PREFETCH_ID(s) && ! cnn_data_get_evaluated_bit(&bl->cnn_data, BIT_CNN_RECEIVED)) cnn_data_cancel_sent(&bl->cnn_data);
+    if (s->params.use_async)
+      pthread_mutex_unlock(&rp->lock);
+    return;
+  }
 
-    /*
-    if (bl->board_hash != mmove.board_hash) {
-      rp->cnn_move_board_hash_mismatched ++;
+  // Reply to a speculative request (see prefetch_children). There is no block behind it, so it only goes to the cache.
+  if (mmove->b == PREFETCH_ID(s)) {
+    rp->cnn_move_valid ++;
+    store_and_deliver(s, mmove, seed);
+    if (s->params.use_async)
       pthread_mutex_unlock(&rp->lock);
-      continue;
-    }
-    */
+    return;
+  }
 
-    // We receive a move, then we should register it to the tree.
-    float accumulated = 0.0;
-    memset(indices_map, 0xff, sizeof(short) * BOUND_COORD);
+  /*
+  if (bl->board_hash != mmove->board_hash) {
+    rp->cnn_move_board_hash_mismatched ++;
+    pthread_mutex_unlock(&rp->lock);
+    return;
+  }
+  */
 
-    unsigned char cnn_evaluated = __sync_fetch_and_add(&bl->cnn_data.evaluated, 0);
-    if (! TEST_BIT(cnn_evaluated, BIT_CNN_SENT)) {
-      error("For a block that receives CNN prediction, its SENT bit must be set. block = %u, status = %d", mmove.b, cnn_evaluated);
-    }
-    if (TEST_BIT(cnn_evaluated, BIT_CNN_RECEIVED)) {
-      // In synced version, each node should be evaluated precisely once.
-      error("The block should not receive CNN information twice! block = %u, status = %d", mmove.b, cnn_evaluated);
-    }
+  // We receive a move, then we should register it to the tree.
+  unsigned char cnn_evaluated = __sync_fetch_and_add(&bl->cnn_data.evaluated, 0);
+  if (! TEST_BIT(cnn_evaluated, BIT_CNN_SENT)) {
+    error("For a block that receives CNN prediction, its SENT bit must be set. block = %u, status = %d", mmove->b, cnn_evaluated);
+  }
+  if (TEST_BIT(cnn_evaluated, BIT_CNN_RECEIVED)) {
+    // In synced version, each node should be evaluated precisely once.
+    error("The block should not receive CNN information twice! block = %u, status = %d", mmove->b, cnn_evaluated);
+  }
 
-    rp->cnn_move_valid ++;
-    // Get the parameters atomically.
-    const float rcv_acc_prob_thres = __atomic_load_n(&s->params.rcv_acc_percent_thres, __ATOMIC_ACQUIRE) / 100.0;
-    const int rcv_min_num_move = __atomic_load_n(&s->params.rcv_min_num_move, __ATOMIC_ACQUIRE);
-    const int rcv_max_num_move = __atomic_load_n(&s->params.rcv_max_num_move, __ATOMIC_ACQUIRE);
+  rp->cnn_move_valid ++;
+  fill_block_with_cnn_move(s, bl, mmove, seed);
+  store_and_deliver(s, mmove, seed);
 
-    // First add existing moves if there is any.
-    int n = bl->n;
-    for (int i = 0; i < n; ++i) {
-      indices_map[bl->data.moves[i]] = i;
-    }
+  if (s->params.use_async)
+    pthread_mutex_unlock(&rp->lock);
 
-    int count = 0;
-    for (int i = 0; i < NUM_FIRST_MOVES; ++i) {
-      if (accumulated >= rcv_acc_prob_thres && i >= rcv_min_num_move) break;
-      if (count >= rcv_max_num_move) break;
-      // We only pick first BLOCK_SIZE moves.
-      if (n >= BLOCK_SIZE) break;
-      // note the coordinates in mmove are 1-based due to lua convension.
-      Coord m = GetCoord(mmove.xs[i] - 1, mmove.ys[i] - 1);
-      if (m != M_PASS) {
-        // set the corresponding bit to be one. note that there is no race condition since before the
-        // final .evaluated bit is set, other thread will not use it.
-        // fprintf(stderr,"%s ", get_move_str(m, mmove.player));
-
-        // bl->data.moves[bl->n] = m;
-        // bl->cnn_data.confidences[bl->n] = mmove.probs[i];
-        int idx = indices_map[m];
-        if (idx < 0) {
-          // newly added.
-          idx = n;
-          bl->data.moves[n] = m;
-          indices_map[m] = n ++;
-        }
+  __sync_fetch_and_add(&s->dcnn_count, 1);
+}
 
-        // Initialize the node.
-        bl->cnn_data.confidences[idx] = mmove.probs[i];
-        bl->cnn_data.types[idx] = mmove.types[i];
-        bl->cnn_data.ps[idx].b = 10;
-        bl->cnn_data.ps[idx].w = 10;
-        // Without any online prediction, we just assume the prior is 0.5
-        bl->data.opp_preds[idx] = 0.5;
-
-        // Random n.
-        bl->data.stats[i].total = s->params.num_virtual_games;
-        bl->data.stats[i].black_win = fast_random(&seed, s->params.num_virtual_games);
-
-        // A small fix: it seems that if CNN could play ko, it will play it with 0.9x confidence, which does not make sense.
-        // So if the move is KO, we will just skip the accumulation so that other moves can also be considered.
-        //if (mmove.types[i] != MOVE_SIMPLE_KO) accumulated += mmove.probs[i];
-        //*disable the ko check by Yan, 12/24/2015
-        accumulated += mmove.probs[i];
-        count ++;
-      }
-    }
+// How long an idle receiver sleeps before checking receiver_done again.
+#define RECEIVER_WAIT_MS 10
+// Max #moves taken from the exchanger at a time.
+#define RECEIVER_BATCH 32
 
-    // We don't need the lock here.
-    // __atomic_store_n(&bl->cnn_data.seq, mmove.seq, __ATOMIC_RELAXED);
-    bl->cnn_data.seq = mmove.seq;
-    // bl->player = mmove.player;
-    //
-    // If we want to use extra information, copy them to the tree block.
-    // [FIXME]: Do we need atomic operation?
-    if (s->params.use_online_model) {
-      bl->extra = (char *)malloc(MAX_CUSTOM_DATA);
-      // It will be freed when the tree node is freed.
-      memcpy(bl->extra, mmove.extra, MAX_CUSTOM_DATA);
-    }
+static void *threaded_move_receiver(void *ctx) {
+  ReceiverParams *rp = (ReceiverParams *)ctx;
+  TreeHandle *s = rp->s;
 
-    bl->has_score = mmove.has_score;
-    bl->score = mmove.score;
-    // finally open the bit.
-    //set_bit(bl->cnn_data.evaluated, bit_cnn_received);
-    __atomic_store_n(&bl->n, n, __ATOMIC_RELAXED);
-    cnn_data_set_evaluated_bit(&bl->cnn_data, BIT_CNN_RECEIVED);
+  PRINT_DEBUG("In move receiver, id = %d\n", rp->receiver_id);
+  // receive move.
+  MMove mmoves[RECEIVER_BATCH];
+  unsigned long seed = rp->receiver_id + 26712;
+  while (1) {
+    if (s->receiver_done) {
+      // Clean up all messages in the queue, once done, quit.
+      rp->cnn_move_discarded += s->callbacks.callback_receiver_discard_move(s->callbacks.context, rp->receiver_id);
+      break;
+    }
 
-    if (s->params.use_async)
-      pthread_mutex_unlock(&rp->lock);
+    // Receive all moves that are ready. If there is nothing, sleep until the exchanger has something (or time out to check receiver_done).
+    int n = s->callbacks.callback_receive_moves(s->callbacks.context, rp->receiver_id, mmoves, RECEIVER_BATCH);
+    if (n == 0) {
+      if (s->callbacks.callback_wait_move != NULL) s->callbacks.callback_wait_move(s->callbacks.context, rp->receiver_id, RECEIVER_WAIT_MS);
+      continue;
+    }
 
-    __sync_fetch_and_add(&s->dcnn_count, 1);
-    /*
-    if (bl->n == 0) {
-      float accumulated = 0.0;
-      char notation = '*';
-      for (int i = 0; i < NUM_FIRST_MOVES; ++i) {
-        if (accumulated >= rcv_acc_prob_thres) notation = ' ';
-        fprintf(stderr,"[%d]: x:  %d, y: %d, conf = %f [%c]\n", i, mmove.xs[i], mmove.ys[i], mmove.probs[i], notation);
-        accumulated += mmove.probs[i];
-      }
-      PRINT_CRITICAL("cnn returned for b = %lx, seq = %ld, id = %u, %d moves are ready.\n", (uint64_t)bl, mmove.seq, ID(bl), bl->n);
+    rp->cnn_move_received += n;
+    for (int i = 0; i < n; ++i) {
+      receive_one_move(rp, &mmoves[i], &seed);
     }
-    */
   }
   return NULL;
 }
 
-
 // ====================== Main function ======================
 void tree_search_init_params(TreeParams *params) {
   memset(params, 0, sizeof(TreeParams));
@@ -484,6 +567,8 @@ void tree_search_init_params(TreeParams *params) {
   params->min_rollout_peekable = 20000;
 
   params->expand_n_thres = 0;
+  params->prefetch_n_thres = 0;
+  params->prefetch_topk = 2;
 
   params->rcv_acc_percent_thres = 80;
   params->rcv_max_num_move = 5;
@@ -512,6 +597,13 @@ void tree_search_init_params(TreeParams *params) {
   params->percent_playout_in_expansion = 0;
   params->num_playout_per_rollout = 1;
   params->use_old_uct = FALSE;
+  params->eval_cache_size = 16384;
+  params->num_reclaimer = 1;
+  params->transposition_table_size = 0;
+  params->virtual_loss = 0.0;
+  params->bp_coalesce_depth = 0;
+  params->bp_flush_interval = 16;
+  params->num_sim_per_thread = 1;
 }
 
 void tree_search_print_params(void *ctx) {
@@ -540,6 +632,7 @@ void tree_search_print_params(void *ctx) {
   fprintf(stderr,"rcv_max_num_move: %d\n", params->rcv_max_num_move);
   fprintf(stderr,"rcv_min_num_move: %d\n", params->rcv_min_num_move);
   fprintf(stderr,"expand_n_thres: %d\n", params->expand_n_thres);
+  fprintf(stderr,"prefetch_n_thres: %d, prefetch_topk: %d\n", params->prefetch_n_thres, params->prefetch_topk);
   fprintf(stderr,"decision_mixture_ratio: %.1f\n", params->decision_mixture_ratio);
   fprintf(stderr,"Use pondering: %s\n", STR_BOOL(params->use_pondering));
   fprintf(stderr,"Time limit: %ld\n", params->time_limit);
@@ -550,6 +643,12 @@ void tree_search_print_params(void *ctx) {
     fprintf(stderr,"Final score = final_mixture_ratio * win_rate_prediction + (1.0 - final_mixture_ratio) * playout_result.\n");
   }
   fprintf(stderr,"single_move_return: %s\n", STR_BOOL(params->single_move_return));
+  fprintf(stderr,"eval_cache_size: %d\n", params->eval_cache_size);
+  fprintf(stderr,"#Reclaimers: %d\n", params->num_reclaimer);
+  fprintf(stderr,"transposition_table_size: %d\n", params->transposition_table_size);
+  fprintf(stderr,"virtual_loss: %.2f\n", params->virtual_loss);
+  fprintf(stderr,"bp_coalesce_depth: %d, bp_flush_interval: %d\n", params->bp_coalesce_depth, params->bp_flush_interval);
+  fprintf(stderr,"num_sim_per_thread: %d\n", params->num_sim_per_thread);
   fprintf(stderr,"default_policy: %s [%d, T: %.3lf]\n", def_policy_str(params->default_policy_choice), params->default_policy_sample_topn, params->default_policy_temperature);
   if (params->life_and_death_mode) {
     fprintf(stderr,"Life and death mode. Use tsumego_dcnn: %s, Region: [%d, %d, %d, %d]\n",
@@ -560,6 +659,17 @@ void tree_search_print_params(void *ctx) {
   }
 }
 
+// Side arrays of tree blocks that the current mode needs.
+static int get_side_mask(const TreeParams *params) {
+  int mask = 0;
+  if (params->use_rave) mask |= BIT(TP_SIDE_RAVE);
+  if (params->use_online_model) mask |= BIT(TP_SIDE_ONLINE);
+  if (params->use_async) mask |= BIT(TP_SIDE_FAST);
+  if (params->life_and_death_mode) mask |= BIT(TP_SIDE_LD);
+  if (params->virtual_loss > 0) mask |= BIT(TP_SIDE_VLOSS);
+  return mask;
+}
+
 // Set all parameters.
 // =========================== Set Callbacks ===========================
 static void internal_set_params(TreeHandle *s, const TreeParams *new_params) {
@@ -609,13 +719,25 @@ void thread_callback_blocks_init(TreePool *p, TreeBlock *b, void *context, void
   s->callback_expand(info, board, b);
 }
 
+// Init callback of a leaf that is linked later, see tree_simple_g_alloc_deferred.
+static void thread_callback_blocks_send(TreePool *p, TreeBlock *b, void *context, void *context2) {
+  dcnn_leaf_send((ThreadInfo *)context, (const Board *)context2, b);
+}
+
 #define EXPAND_SUCCESS            0
 #define EXPAND_FAILED             1
 #define EXPAND_OTHER_FIRST        2
 #define EXPAND_OTHER_EXPANDING    3
+// The leaf is created and sent to CNN, but not linked yet. The simulation has to be parked.
+#define EXPAND_PENDING            4
+
+static inline uint64_t leaf_board_hash(const Board *board) {
+  // Ply is mixed in so that the graph has no cycle.
+  return GetBoardHash(board) ^ ((uint64_t)board->_ply * 0x9e3779b97f4a7c15ULL);
+}
 
 // Expand the leaf
-int expand_leaf(ThreadInfo* info, TreeBlock *parent, BlockOffset parent_offset, const Board* board, BOOL wait_until_expansion_finished, TreeBlock **c) {
+int expand_leaf(ThreadInfo* info, TreeBlock *parent, BlockOffset parent_offset, const Board* board, BOOL wait_until_expansion_finished, BOOL defer_link, TreeBlock **c) {
   // expand the current tree.
   TreeHandle *s = info->s;
   TreePool *p = &s->p;
@@ -623,6 +745,7 @@ int expand_leaf(ThreadInfo* info, TreeBlock *parent, BlockOffset parent_offset,
   PRINT_DEBUG("New node. Parent id = %u, parent_offset = %u, expansion = %u, cnn.evaluated = %u\n",
       ID(parent), parent_offset, (unsigned int)parent->expansion, (unsigned int)parent->cnn_data.evaluated);
 
+  BOOL pending = FALSE;
   int res = wait_until_expansion_finished ? tree_simple_begin_expand(parent, parent_offset, c) : tree_simple_begin_expand_nowait(parent, parent_offset, c);
   switch (res) {
     case EXPAND_STATUS_FIRST:
@@ -631,14 +754,29 @@ int expand_leaf(ThreadInfo* info, TreeBlock *parent, BlockOffset parent_offset,
           ID(parent), parent_offset, (unsigned int)parent->expansion, (unsigned int)parent->cnn_data.evaluated);
 
       // fprintf(stderr,"info = %lx, board = %lx, p = %lx, parent = %lx, parent_offset = %d\n", (uint64_t)info, (uint64_t)board, (uint64_t)p, (uint64_t)parent, parent_offset);
-      *c = tree_simple_g_alloc(p, (void *)info, (void *)board, thread_callback_blocks_init, parent, parent_offset);
+      if (defer_link) {
+        BOOL shared;
+        *c = tree_simple_g_alloc_deferred(p, USE_TRANSPOSITION(s) ? leaf_board_hash(board) : 0, (void *)info, (void *)board, thread_callback_blocks_send,
+            parent, parent_offset, &shared);
+        if (shared) info->transposition_hit ++;
+        // The reply might be already there (e.g., from the evaluation cache).
+        else if (cnn_data_get_evaluated_bit(&(*c)->cnn_data, BIT_CNN_RECEIVED)) tree_simple_g_link(p, *c);
+        else pending = TRUE;
+      } else if (USE_TRANSPOSITION(s)) {
+        uint64_t board_hash = leaf_board_hash(board);
+        BOOL shared;
+        *c = tree_simple_g_alloc_shared(p, board_hash, (void *)info, (void *)board, thread_callback_blocks_init, parent, parent_offset, &shared);
+        if (shared) info->transposition_hit ++;
+      } else {
+        *c = tree_simple_g_alloc(p, (void *)info, (void *)board, thread_callback_blocks_init, parent, parent_offset);
+      }
       if (*c == TP_NULL) {
         fprintf(stderr,"allocation error, output TP_NULL!\n");
         error("");
       }
       info->leaf_expanded ++;
       PRINT_DEBUG("New leaf created!, leaf_expanded = %d\n", info->leaf_expanded);
-      return EXPAND_SUCCESS;
+      return pending ? EXPAND_PENDING : EXPAND_SUCCESS;
 
     case EXPAND_STATUS_EXPANDING:
       PRINT_DEBUG("Other threads is creating the leaf. b2 = %u, b2_offset = %u, expansion = %u, cnn.evaluated = %u\n",
@@ -651,6 +789,119 @@ int expand_leaf(ThreadInfo* info, TreeBlock *parent, BlockOffset parent_offset,
   return EXPAND_FAILED;
 }
 
+// Play a move on the thread's board during the descent, journaled so that the board goes back to the root afterwards.
+static void descent_play(ThreadInfo *info, Board *board, const GroupId4 *ids, int depth) {
+  if (depth >= info->num_undos) {
+    int n = (info->num_undos == 0 ? 64 : info->num_undos * 2);
+    info->undos = (BoardUndo *)realloc(info->undos, n * sizeof(BoardUndo));
+    if (info->undos == NULL) error("Cannot allocate %d undo entries!", n);
+    info->num_undos = n;
+  }
+  PlayWithUndo(board, ids, &info->undos[depth]);
+}
+
+static void descent_undo(ThreadInfo *info, Board *board, int depth) {
+  while (depth > 0) Undo(board, &info->undos[-- depth]);
+}
+
+static void threaded_alloc_simulations(ThreadInfo *info) {
+  int n = info->s->params.num_sim_per_thread;
+  if (n <= info->num_sims) return;
+  info->sims = (Simulation *)realloc(info->sims, n * sizeof(Simulation));
+  if (info->sims == NULL) error("Cannot allocate %d simulation slots!", n);
+  for (int i = info->num_sims; i < n; ++i) info->sims[i].leaf = NULL;
+  info->num_sims = n;
+}
+
+// Park the current simulation, whose playout is done, until the CNN reply of its new leaf arrives.
+static void park_simulation(ThreadInfo *info, TreeBlock *leaf, float black_moku, Stone end_player, int end_ply) {
+  Simulation *sim = NULL;
+  for (int i = 0; i < info->num_sims; ++i) {
+    if (info->sims[i].leaf == NULL) {
+      sim = &info->sims[i];
+      break;
+    }
+  }
+  if (sim == NULL) error("No free simulation slot! #parked = %d", info->num_parked);
+
+  sim->leaf = leaf;
+  sim->black_moku = black_moku;
+  sim->end_player = end_player;
+  sim->end_ply = end_ply;
+  sim->stamp = info->sim_stamp ++;
+  sim->path_len = info->path_len;
+  memcpy(sim->path, info->path, info->path_len * sizeof(TreeBlock *));
+  memcpy(sim->path_offsets, info->path_offsets, info->path_len * sizeof(BlockOffset));
+  // The virtual loss stays on the path while the simulation is parked.
+  sim->vloss_len = info->vloss_len;
+  memcpy(sim->vloss_path, info->vloss_path, info->vloss_len * sizeof(TreeBlock *));
+  memcpy(sim->vloss_offsets, info->vloss_offsets, info->vloss_len * sizeof(BlockOffset));
+  info->vloss_len = 0;
+
+  info->num_parked ++;
+  info->sim_parked ++;
+}
+
+static void finish_simulation(ThreadInfo *info, Simulation *sim) {
+  TreeHandle *s = info->s;
+  // Backprop runs as if the simulation has just ended.
+  info->path_len = sim->path_len;
+  memcpy(info->path, sim->path, sim->path_len * sizeof(TreeBlock *));
+  memcpy(info->path_offsets, sim->path_offsets, sim->path_len * sizeof(BlockOffset));
+  info->vloss_len = sim->vloss_len;
+  memcpy(info->vloss_path, sim->vloss_path, sim->vloss_len * sizeof(TreeBlock *));
+  memcpy(info->vloss_offsets, sim->vloss_offsets, sim->vloss_len * sizeof(BlockOffset));
+
+  tree_simple_g_link(&s->p, sim->leaf);
+  s->callback_backprop(info, sim->black_moku, sim->end_player, sim->end_ply, FALSE, 0, sim->leaf);
+  __sync_fetch_and_add(&s->rollout_count, 1);
+
+  sim->leaf = NULL;
+  info->num_parked --;
+}
+
+// The request of a parked leaf was given up (see receive_one_move and prefetch_children), send it again.
+// The board of the leaf is rebuilt from the path, whose first edge (from p->root) carries no move.
+static void resend_parked_leaf(ThreadInfo *info, Simulation *sim) {
+  TreeHandle *s = info->s;
+  Board board;
+  GroupId4 ids;
+  char buf[30];
+
+  CopyBoard(&board, &s->board);
+  for (int i = 1; i < sim->path_len; ++i) {
+    Coord m = sim->path[i]->data.moves[sim->path_offsets[i]];
+    if (! TryPlay2(&board, m, &ids)) error("The play %s on the path of a parked leaf should never fail!", get_move_str(m, board._next_player, buf));
+    Play(&board, &ids);
+  }
+  dcnn_leaf_send(info, &board, sim->leaf);
+}
+
+// Finish the parked simulations whose leaf has been evaluated, and resend the leaves whose request was given up.
+// If more than max_parked are left, wait for the oldest ones.
+static void resume_simulations(ThreadInfo *info, int max_parked) {
+  if (info->num_parked == 0) return;
+  for (int i = 0; i < info->num_sims; ++i) {
+    Simulation *sim = &info->sims[i];
+    if (sim->leaf == NULL) continue;
+    unsigned char evaluated = cnn_data_load_evaluated(&sim->leaf->cnn_data);
+    if (TEST_BIT(evaluated, BIT_CNN_RECEIVED)) finish_simulation(info, sim);
+    else if (! TEST_BIT(evaluated, BIT_CNN_SENT)) resend_parked_leaf(info, sim);
+  }
+  while (info->num_parked > max_parked) {
+    Simulation *oldest = NULL;
+    for (int i = 0; i < info->num_sims; ++i) {
+      Simulation *sim = &info->sims[i];
+      if (sim->leaf != NULL && (oldest == NULL || (int)(sim->stamp - oldest->stamp) < 0)) oldest = sim;
+    }
+    info->sim_stalled ++;
+    while (! TEST_BIT(cnn_data_wait_until_received_or_cancelled(&oldest->leaf->cnn_data), BIT_CNN_RECEIVED)) {
+      resend_parked_leaf(info, oldest);
+    }
+    finish_simulation(info, oldest);
+  }
+}
+
 #define THRES_PLY_DCNN_NOT_EVAL       400
 #define MAX_ALLOWABLE_NODCNN_EVAL     5
 
@@ -662,6 +913,12 @@ static inline BOOL threaded_block_if_needed(void *ctx) {
 
   // If all_threads_blocking is true, block here until the tree is updated.
   int blocking_number = __atomic_load_n(&s->all_threads_blocking_count, __ATOMIC_ACQUIRE);
+  // The tree has to be up-to-date before anyone reads it.
+  // Parked simulations hold unlinked leaves, and their replies would be discarded once the seq changes, so finish them too.
+  if (blocking_number > 0 || s->search_done) {
+    resume_simulations(info, 0);
+    flush_bp_deltas(info);
+  }
   if (blocking_number > 0) {
     int count = __sync_add_and_fetch(&s->threads_count, 1);
     if (count == 1) {
@@ -672,6 +929,7 @@ static inline BOOL threaded_block_if_needed(void *ctx) {
       sem_post(&s->sem_all_threads_blocked);
     }
     sem_wait(&s->sem_all_threads_unblocked);
+    info->board_synced = FALSE;
   }
   if (s->search_done) return TRUE;
   return FALSE;
@@ -778,7 +1036,7 @@ static inline void threaded_if_search_complete(void *ctx) {
   }
 
   // Check if the condition is met and we send the message that search is complete.
-  int num_branch = p->root->data.stats[0].total;
+  int num_branch = stat_total(p->root->data.stats.packed[0]);
   if (num_branch >= s->params.num_rollout) {
     BOOL rollout_count_passed = __sync_fetch_and_add(&s->rollout_count, 0) >= s->params.num_rollout_per_move;
     BOOL dcnn_count_passed = s->common_params->cpu_only || __sync_fetch_and_add(&s->dcnn_count, 0) >= s->params.num_dcnn_per_move;
@@ -811,7 +1069,7 @@ static inline TreeBlock *threaded_expand_root_if_needed(void *ctx) {
   if (b == TP_NULL) {
     PRINT_DEBUG("p->root->children[0] is TP_NULL! Need to reallocate.\n");
     TreeBlock *c;
-    int res = expand_leaf(info, p->root, 0, board_init, TRUE, &c);
+    int res = expand_leaf(info, p->root, 0, board_init, TRUE, FALSE, &c);
     b = c;
 
     if (res == EXPAND_SUCCESS) PRINT_DEBUG("Finish creating leaf...\n");
@@ -830,11 +1088,13 @@ static void *threaded_expansion(void *ctx) {
   TreeHandle *s = info->s;
   TreePool *p = &s->p;
 
-  // Copy a new board. No pointer in board.
+  // The thread's own copy of the internal board. Each rollout plays down the tree with PlayWithUndo and undoes back to the root,
+  // so it is only copied again after the internal board has changed.
   Board board, board2;
   GroupId4 ids;
   char buf[30];
   PRINT_DEBUG("Start expansion\n");
+  info->board_synced = FALSE;
 
   for (;;) {
     if (threaded_block_if_needed(ctx)) break;
@@ -842,13 +1102,29 @@ static void *threaded_expansion(void *ctx) {
     TreeBlock *b = threaded_expand_root_if_needed(ctx);
     info->counter ++;
 
+    // Make room for this simulation: finish the parked ones that are ready, and wait for the oldest one if all slots are taken.
+    BOOL park = USE_PARKED_SIMS(s);
+    if (park) {
+      threaded_alloc_simulations(info);
+      resume_simulations(info, s->params.num_sim_per_thread - 1);
+    }
+
     BlockOffset child_offset;
+    info->path_len = 0;
+    PATH_PUSH(info, p->root, 0);
 
-    CopyBoard(&board, &s->board);
+    if (! info->board_synced) {
+      CopyBoard(&board, &s->board);
+      info->board_synced = TRUE;
+    }
+    // #moves played on board in this rollout.
+    int num_played = 0;
     // Random traverse down the tree and expand a node
     BOOL leaf_expanded = FALSE;
     // Whether the board is pointing towards the child node.
     BOOL board_on_child = FALSE;
+    // Whether the new leaf is waiting for the CNN reply.
+    BOOL leaf_pending = FALSE;
     // PRINT_DEBUG("---Start playout %d/%d ---\n", i, info->s->num_rollout_per_thread);
     // fprintf(stderr,"---Start playout %d/%d ---\n", i, info->s->num_rollout_per_thread);
     int depth = 0;
@@ -874,6 +1150,7 @@ static void *threaded_expansion(void *ctx) {
         info->num_policy_failed ++;
         break;
       }
+      if (USE_VIRTUAL_LOSS(s)) add_virtual_loss(info, b, child_offset);
 
       // Get the move.
       Coord m = b->data.moves[child_offset];
@@ -891,7 +1168,7 @@ static void *threaded_expansion(void *ctx) {
 
       // ShowBoard(&board, SHOW_LAST_MOVE);
       // fprintf(stderr,"Current move: %s\n", get_move_str(m, curr_player, buf));
-      Play(&board, &ids);
+      descent_play(info, &board, &ids, num_played ++);
 
       if (leaf_expanded) {
         board_on_child = TRUE;
@@ -901,34 +1178,44 @@ static void *threaded_expansion(void *ctx) {
       // Expand it or go downward
       // fprintf(stderr,"[Explore %d]: pick idx = %d/%d, block_parent = %d, child b = %d\n", b, child_idx, total_children, b2, c);
       if (c != TP_NULL) {
+        PATH_PUSH(info, b, child_offset);
         b = c;
       } else {
-        if (b->data.stats[child_offset].total < s->params.expand_n_thres) {
+        if (stat_total(b->data.stats.packed[child_offset]) < s->params.expand_n_thres) {
           // Insufficient statistics, stop the expansion.
           board_on_child = TRUE;
           break;
         }
 
-        BOOL wait_until_cnn_return = (thread_rand(info, 100) >= s->params.percent_playout_in_expansion ? TRUE : FALSE);
-        if (! wait_until_cnn_return) info->preempt_playout_count ++;
+        // A parked simulation never waits for the leaf of another thread, otherwise two threads could wait on each other's parked leaves.
+        BOOL wait_until_cnn_return = FALSE;
+        if (! park) {
+          wait_until_cnn_return = (thread_rand(info, 100) >= s->params.percent_playout_in_expansion ? TRUE : FALSE);
+          if (! wait_until_cnn_return) info->preempt_playout_count ++;
+        }
 
-        int ret = expand_leaf(info, b, child_offset, &board, wait_until_cnn_return, &c);
+        int ret = expand_leaf(info, b, child_offset, &board, wait_until_cnn_return, park, &c);
         BOOL time_to_break = FALSE;
         switch (ret) {
           case EXPAND_FAILED:
             info->num_expand_failed ++;
             error("Node expansion failed!");
             // break;
+          case EXPAND_PENDING:
           case EXPAND_SUCCESS:
             // Now node.
+            PATH_PUSH(info, b, child_offset);
             b = c;
             leaf_expanded = TRUE;
+            leaf_pending = (ret == EXPAND_PENDING);
           case EXPAND_OTHER_EXPANDING:
             // For this, don't waste time waiting. We just break and run the playout.
+            if (ret == EXPAND_OTHER_EXPANDING) info->expand_collision ++;
             time_to_break = TRUE;
             break;
           case EXPAND_OTHER_FIRST:
             // For EXPAND_OTHER_FIRST, we didn't do anything, just let it go.
+            PATH_PUSH(info, b, child_offset);
             b = c;
             break;
         }
@@ -943,18 +1230,27 @@ static void *threaded_expansion(void *ctx) {
     // Step 2, playout from current board and curr_player.
     PRINT_DEBUG("Default policy...\n");
     int end_ply = board._ply;
+    Stone end_player = board._next_player;
     float aver_black_moku = 0.0;
     if (s->callback_def_policy != NULL && ! s->params.life_and_death_mode) {
       for (int i = 0; i < s->params.num_playout_per_rollout; ++i) {
+        // The default policy does not journal its moves, so it runs on a copy.
         CopyBoard(&board2, &board);
         s->callback_def_policy(s->def_policy, info, thread_rand, &board2, NULL, s->params.max_depth_default_policy, FALSE);
         aver_black_moku += s->callback_compute_score(info, &board2);
       }
       aver_black_moku /= s->params.num_playout_per_rollout;
     }
+    descent_undo(info, &board, num_played);
+
+    if (leaf_pending) {
+      // Link the leaf and backprop once the CNN reply arrives.
+      park_simulation(info, b, aver_black_moku, end_player, end_ply);
+      continue;
+    }
 
     PRINT_DEBUG("Back propagation ...\n");
-    s->callback_backprop(info, aver_black_moku, board._next_player, end_ply, board_on_child, child_offset, b);
+    s->callback_backprop(info, aver_black_moku, end_player, end_ply, board_on_child, child_offset, b);
 
     // Add the total rollout_count count.
     __sync_fetch_and_add(&s->rollout_count, 1);
@@ -975,10 +1271,16 @@ BOOL tree_search_set_params(void *ctx, const TreeParams *new_params) {
 
   fprintf(stderr,"Change params!\n");
   internal_set_params(s, new_params);
+  tree_simple_pool_enable_sides(&s->p, get_side_mask(&s->params));
+  // Same as in tree_search_init, the tree cannot stay a DAG in these modes.
+  if (USE_TRANSPOSITION(s) && (s->params.life_and_death_mode || s->params.use_online_model)) {
+    PRINT_INFO("Transposition is not supported in life and death mode or with online model, disabled.\n");
+    tree_simple_free_except(&s->p, TP_NULL);
+    tree_simple_pool_disable_transposition(&s->p);
+  }
 
   // Reset the seq number
-  unsigned long new_seq = time(NULL);
-  s->seq = (new_seq > s->seq ? new_seq : s->seq + 1);
+  next_seq(s);
 
   fprintf(stderr,"Set_params! And resume all threads!\n");
   resume_all_threads(s);
@@ -1004,13 +1306,26 @@ void *tree_search_init(const SearchParamsV2 *common_params, const SearchVariants
   if (s->params.num_receiver == 0) error("#Num of receivers cannot be zero!");
 
   tree_simple_pool_init(&s->p);
+  tree_simple_pool_enable_sides(&s->p, get_side_mask(&s->params));
+  tree_simple_pool_start_reclaimers(&s->p, s->params.num_reclaimer);
+  if (s->params.transposition_table_size > 0) {
+    // Life and death mode and the online model walk up through the parent pointers, which is not supported in a DAG.
+    if (s->params.life_and_death_mode || s->params.use_online_model) {
+      PRINT_INFO("Transposition is not supported in life and death mode or with online model, ignored.\n");
+    } else {
+      tree_simple_pool_enable_transposition(&s->p, s->params.transposition_table_size);
+    }
+  }
   s->search_done = FALSE;
   s->receiver_done = FALSE;
 
   PRINT_INFO("Initialize the sender/receiver. #gpu = %d.\n", s->params.num_receiver);
   // Threads that receives referenced moves from CNN player (another process, communication via message queue).
   // These threads are always there until the search system is destoryed.
+  s->eval_cache = NULL;
   if (! s->common_params->cpu_only) {
+    if (s->params.eval_cache_size > 0) s->eval_cache = EvalCacheInit(s->params.eval_cache_size);
+
     // For global server, we need to set num_receiver to 1.
     s->move_receivers = (pthread_t *)malloc(sizeof(pthread_t) * s->params.num_receiver);
     s->move_params = (ReceiverParams *)malloc(sizeof(ReceiverParams) * s->params.num_receiver);
@@ -1102,6 +1417,7 @@ void tree_search_free(void *ctx) {
     int cnn_move_discarded = 0;
     int cnn_move_board_hash_mismatched = 0;
     int cnn_move_seq_mismatched = 0;
+    int cnn_move_error = 0;
 
     PRINT_INFO("Stopping all receivers...\n");
 
@@ -1114,17 +1430,23 @@ void tree_search_free(void *ctx) {
       cnn_move_discarded += rp->cnn_move_discarded;
       cnn_move_board_hash_mismatched += rp->cnn_move_board_hash_mismatched;
       cnn_move_seq_mismatched += rp->cnn_move_seq_mismatched;
+      cnn_move_error += rp->cnn_move_error;
 
-      PRINT_INFO("Stats [Receive][%d]: received = %d, valid = %d, discarded = %d, board_hash_mismatched = %d, seq_mismatched = %d\n", i,
-          rp->cnn_move_received, rp->cnn_move_valid, rp->cnn_move_discarded, rp->cnn_move_board_hash_mismatched, rp->cnn_move_seq_mismatched);
+      PRINT_INFO("Stats [Receive][%d]: received = %d, valid = %d, discarded = %d, board_hash_mismatched = %d, seq_mismatched = %d, error = %d\n", i,
+          rp->cnn_move_received, rp->cnn_move_valid, rp->cnn_move_discarded, rp->cnn_move_board_hash_mismatched, rp->cnn_move_seq_mismatched, rp->cnn_move_error);
       pthread_mutex_destroy(&rp->lock);
     }
-    PRINT_INFO("Stats [Receive]: received = %d, valid = %d, discarded = %d, board_hash_mismatched = %d, seq_mismatched = %d\n",
-        cnn_move_received, cnn_move_valid, cnn_move_discarded, cnn_move_board_hash_mismatched, cnn_move_seq_mismatched);
+    PRINT_INFO("Stats [Receive]: received = %d, valid = %d, discarded = %d, board_hash_mismatched = %d, seq_mismatched = %d, error = %d\n",
+        cnn_move_received, cnn_move_valid, cnn_move_discarded, cnn_move_board_hash_mismatched, cnn_move_seq_mismatched, cnn_move_error);
     free(s->move_receivers);
     free(s->move_params);
   }
 
+  if (s->eval_cache != NULL) {
+    EvalCachePrintStats(s->eval_cache);
+    EvalCacheFree(s->eval_cache);
+  }
+
   // Release default policies.
   switch (s->params.default_policy_choice) {
     case DP_SIMPLE:
@@ -1142,9 +1464,15 @@ void tree_search_free(void *ctx) {
 
   // Free threads and related stuff.
   free(s->explorers);
+  for (int i = 0; i < s->params.num_tree_thread; ++i) {
+    free(s->infos[i].sims);
+    free(s->infos[i].undos);
+  }
   free(s->infos);
 
   // Finally free s itself.
+  PRINT_INFO("Tree arena: #chunks = %d, block = %lu bytes, side mask = %x, reserved = %.1f MB, allocated = %d, freed = %d, ever_allocated = %ld\n",
+      s->p.num_chunks, sizeof(TreeBlock), s->p.side_mask, tree_simple_pool_bytes(&s->p) / 1048576.0, s->p.allocated, s->p.freed, s->p.ever_allocated);
   tree_simple_pool_free(&s->p);
   free(s);
 }
@@ -1175,6 +1503,8 @@ void tree_search_start(void *ctx) {
   // Set sequence.
   s->seq = time(NULL);
   PRINT_INFO("Current sequence = %ld\n", s->seq);
+  // The evaluators might still have a larger one from a previous run.
+  publish_seq(s);
 
   // Start all search threads.
   for (int i = 0; i < s->params.num_tree_thread; ++i) {
@@ -1184,13 +1514,20 @@ void tree_search_start(void *ctx) {
     info->num_policy_failed = 0;
     info->num_expand_failed = 0;
     info->leaf_expanded = 0;
+    info->transposition_hit = 0;
+    info->expand_collision = 0;
     info->cnn_send_infunc = 0;
     info->cnn_send_attempt = 0;
     info->cnn_send_success = 0;
+    info->cnn_cache_hit = 0;
+    info->cnn_cache_waiting = 0;
+    info->cnn_prefetch_sent = 0;
     info->use_ucb = 0;
     info->use_cnn = 0;
     info->use_async = 0;
     info->preempt_playout_count = 0;
+    info->sim_parked = 0;
+    info->sim_stalled = 0;
     info->max_depth = 0;
 
     // fprintf(stderr,"Starting thread = %d, #rollout = %d\n", i, infos[i].num_rollout_per_thread);
@@ -1266,8 +1603,7 @@ BOOL tree_search_reset_tree(void *ctx) {
 
   s->is_pondering = FALSE;
   // Reset the seq number
-  unsigned long new_seq = time(NULL);
-  s->seq = (new_seq > s->seq ? new_seq : s->seq + 1);
+  next_seq(s);
 
   // Free the tree.
   tree_simple_free_except(&s->p, TP_NULL);
@@ -1290,8 +1626,7 @@ BOOL tree_search_set_board(void *ctx, const Board *new_board) {
 
   s->is_pondering = FALSE;
   // Reset the seq number
-  unsigned long new_seq = time(NULL);
-  s->seq = (new_seq > s->seq ? new_seq : s->seq + 1);
+  next_seq(s);
 
   // Free the tree.
   tree_simple_free_except(&s->p, TP_NULL);
@@ -1316,9 +1651,9 @@ Coord pick_best(const TreeHandle *s, const TreeBlock *b, Stone player, float *hi
     // UPDATE: we trust the decision made by MCTS/CNN. Sometime a self atari is a good move.
     // if (IsSelfAtari(&s->board, &ids, m, player)) continue;
 
-    int this_n = b->data.stats[i].total + 1;
-    float win = b->data.stats[i].black_win;
-    unsigned int n_parent = b->parent->data.stats[b->parent_offset].total;
+    int this_n = stat_total(b->data.stats.packed[i]) + 1;
+    float win = stat_black_win(b->data.stats.packed[i]);
+    unsigned int n_parent = stat_total(b->parent->data.stats.packed[b->parent_offset]);
     if (player == S_WHITE) win = this_n - win;
 
     if (this_n == 0) error("This_n cannot be zero!");
@@ -1356,9 +1691,9 @@ BOOL pick_best_n(const TreeHandle *s, const TreeBlock *b, Stone player, Moves *m
   for (int i = 0; i < b->n; ++i) {
     Coord m = b->data.moves[i];
 
-    int this_n = b->data.stats[i].total + 1;
-    float win = b->data.stats[i].black_win;
-    unsigned int n_parent = b->parent->data.stats[b->parent_offset].total;
+    int this_n = stat_total(b->data.stats.packed[i]) + 1;
+    float win = stat_black_win(b->data.stats.packed[i]);
+    unsigned int n_parent = stat_total(b->parent->data.stats.packed[b->parent_offset]);
     if (player == S_WHITE) win = this_n - win;
 
     if (this_n == 0) error("This_n cannot be zero!");
@@ -1406,12 +1741,12 @@ static void show_picked_move_cnn_impl(const TreeHandle *s, TreeBlock *b, Stone p
   for (int i = 0; i < b->n; ++i) {
     Coord m = b->data.moves[i];
     float cnn_conf = b->cnn_data.confidences[i];
-    float fast_conf = b->cnn_data.fast_confidences[i];
+    float fast_conf = b->cnn_data.fast_confidences ? b->cnn_data.fast_confidences[i] : 0.0;
     // Make it redicted win rate from our perspective.
-    float online_pred = 1.0 - b->data.opp_preds[i];
-    int this_n = b->data.stats[i].total;
+    float online_pred = b->data.opp_preds ? 1.0 - b->data.opp_preds[i] : 0.5;
+    int this_n = stat_total(b->data.stats.packed[i]);
 
-    float win = b->data.stats[i].black_win;
+    float win = stat_black_win(b->data.stats.packed[i]);
     if (player == S_WHITE) win = this_n - win;
 
     float winning_rate = win / (this_n + 1e-8);
@@ -1426,8 +1761,8 @@ static void show_picked_move_cnn_impl(const TreeHandle *s, TreeBlock *b, Stone p
     }
 
     char picked = chosen == m ? '*' : ' ';
-    char the_type = b->cnn_data.types[i];
-    const char *type_str = NULL;
+    char the_type = b->cnn_data.types ? b->cnn_data.types[i] : -1;
+    const char *type_str = "--";
     switch(the_type) {
       case MOVE_SIMPLE_KO:
         type_str = "KO"; break;
@@ -1676,6 +2011,10 @@ void tree_search_prune_opponent(void *ctx, Coord m) {
 
   block_all_threads(s, TRUE);
 
+  // Update the sequence number before any block is handed to the reclaimers. In sync mode the receivers are not blocked,
+  // and a reply of the old sequence number must not be written into a freed (and maybe reused) block.
+  next_seq(s);
+
   // If the child to be expand is TP_NULL, we first need to expand it and then pick the move we want.
   // This happens if the opponent picks the unexpected move which we didn't expand.
   PRINT_DEBUG("play_multithread:prune_tree starts\n");
@@ -1712,10 +2051,6 @@ void tree_search_prune_opponent(void *ctx, Coord m) {
   // After opponent prune, it is not considered as pondering.
   s->is_pondering = FALSE;
 
-  // Update the sequence number.
-  unsigned long new_seq = time(NULL);
-  s->seq = (new_seq > s->seq ? new_seq : s->seq + 1);
-
   resume_all_threads(s);
   return;
 }
@@ -1739,7 +2074,8 @@ BOOL tree_search_undo_pass(void *ctx, const Board *before_board) {
     s->board._last_move4 = before_board->_last_move4;
   }
 
-  // We also need to clear the tree.
+  // We also need to clear the tree. Update the sequence number so that replies to the freed nodes are discarded.
+  next_seq(s);
   tree_simple_free_except(&s->p, TP_NULL);
 
   resume_all_threads(s);
@@ -1772,7 +2108,7 @@ BOOL tree_search_peek(void *ctx, Moves *moves, const Board *verify_board) {
   // If we just start simulation, we should just wait..
   int total_simulation;
   do {
-    total_simulation = __atomic_load_n(&p->root->data.stats[0].total, __ATOMIC_ACQUIRE);
+    total_simulation = stat_total(__atomic_load_n(&p->root->data.stats.packed[0], __ATOMIC_ACQUIRE));
   } while (total_simulation < s->params.min_rollout_peekable);
 
   // Then we block all threads and read the results.
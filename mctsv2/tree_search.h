@@ -19,18 +19,30 @@ extern "C" {
 
 // Send/Receive callback.
 typedef BOOL (* func_send_board)(void *context, int, MBoard *b);
-// Receive the move from exchanger.
-typedef BOOL (* func_receive_move)(void *context, int, MMove *mmove);
+// Send the board, which is the move m played on the board of an earlier request parent_b. NULL if the exchanger has no delta encoding.
+typedef BOOL (* func_send_board_delta)(void *context, int, MBoard *b, uint64_t parent_b, Coord m);
+// Receive up to max_n moves that are ready on the exchanger (not blocked). Return #moves received.
+typedef int (* func_receive_moves)(void *context, int, MMove *mmoves, int max_n);
+// Block until a move might be ready on the exchanger, at most timeout_ms. NULL if the exchanger cannot wait.
+typedef BOOL (* func_wait_move)(void *context, int, int timeout_ms);
+// After a failed send, block until a board might be sent again (e.g., a credit comes back), at most timeout_ms. NULL if the exchanger cannot wait.
+typedef void (* func_wait_send)(void *context, int, int timeout_ms);
 typedef int (* func_receiver_discard_move)(void *context, int);
 typedef void (* func_receiver_restart)(void *context);
+// Cancel the pending evaluations with sequence number < min_seq. NULL if the exchanger cannot cancel.
+typedef void (* func_set_min_seq)(void *context, long min_seq);
 
 typedef struct {
   void *context;
   // Callbacks.
   func_send_board callback_send_board;
-  func_receive_move callback_receive_move;
+  func_send_board_delta callback_send_board_delta;
+  func_receive_moves callback_receive_moves;
+  func_wait_move callback_wait_move;
+  func_wait_send callback_wait_send;
   func_receiver_discard_move callback_receiver_discard_move;
   func_receiver_restart callback_receiver_restart;
+  func_set_min_seq callback_set_min_seq;
 } ExCallbacks;
 
 // ================================================
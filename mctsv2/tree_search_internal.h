@@ -16,6 +16,7 @@
 #include "tree_search.h"
 #include "tree.h"
 #include "../board/default_policy_common.h"
+#include "eval_cache.h"
 
 // ========================== Data Structure =============================
 struct __TreeHandle;
@@ -31,9 +32,39 @@ typedef struct {
   int cnn_move_received;
   int cnn_move_discarded;
   int cnn_move_seq_mismatched;
+  // Error replies (the server could not evaluate the board).
+  int cnn_move_error;
   int cnn_move_board_hash_mismatched;
 } ReceiverParams;
 
+#define MAX_PATH_LEN 1024
+#define MAX_BP_DELTAS 64
+
+// Pending update to one packed stat word, see TreeParams.bp_coalesce_depth.
+typedef struct {
+  uint64_t *loc;
+  uint64_t delta;
+} StatDelta;
+
+// A simulation parked until the CNN reply of its new leaf arrives, see TreeParams.num_sim_per_thread.
+// Its playout is done, what is left is to link the leaf and backprop.
+typedef struct {
+  TreeBlock *leaf;
+  float black_moku;
+  Stone end_player;
+  int end_ply;
+  // Order of parking, the oldest one is waited first.
+  unsigned int stamp;
+
+  // Saved from ThreadInfo.
+  TreeBlock *path[MAX_PATH_LEN];
+  BlockOffset path_offsets[MAX_PATH_LEN];
+  int path_len;
+  TreeBlock *vloss_path[MAX_PATH_LEN + 1];
+  BlockOffset vloss_offsets[MAX_PATH_LEN + 1];
+  int vloss_len;
+} Simulation;
+
 // This is one for each thread.
 typedef struct {
   // A pointer to search info common.
@@ -51,15 +82,64 @@ typedef struct {
   int num_policy_failed;
   int num_expand_failed;
   int leaf_expanded;
+  int transposition_hit;
+  // #times the leaf is being expanded by another thread.
+  int expand_collision;
   int cnn_send_infunc;
   int cnn_send_attempt;
   int cnn_send_success;
+  int cnn_cache_hit;
+  int cnn_cache_waiting;
+  // #speculative requests sent for the children of hot nodes.
+  int cnn_prefetch_sent;
   int use_ucb, use_cnn, use_async;
   int max_depth;
   // Count for preempt-expanding
   int preempt_playout_count;
+  // #simulations parked, and #times all slots were waiting and the thread had to block.
+  int sim_parked;
+  int sim_stalled;
+
+  // Edges (block, offset) from the root to the current block in this rollout. path[path_len - 1] leads to the current block.
+  // Used for backprop in transposition mode, where a block might have several parents.
+  TreeBlock *path[MAX_PATH_LEN];
+  BlockOffset path_offsets[MAX_PATH_LEN];
+  int path_len;
+
+  // Edges that carry the virtual loss of this rollout, reverted in backprop.
+  TreeBlock *vloss_path[MAX_PATH_LEN + 1];
+  BlockOffset vloss_offsets[MAX_PATH_LEN + 1];
+  int vloss_len;
+
+  // Coalesced backprop updates, and #rollouts since they were last flushed.
+  StatDelta bp_deltas[MAX_BP_DELTAS];
+  int num_bp_deltas;
+  int num_bp_pending;
+
+  // Slots of parked simulations (leaf == NULL if free).
+  Simulation *sims;
+  int num_sims;
+  int num_parked;
+  unsigned int sim_stamp;
+
+  // Journal of the moves played on the thread's board during the descent, one entry per ply.
+  BoardUndo *undos;
+  int num_undos;
+  // Cleared whenever the thread is blocked, since the internal board might change in the meantime.
+  BOOL board_synced;
 } ThreadInfo;
 
+#define PATH_PUSH(info, bl, offset) do { \
+  if ((info)->path_len >= MAX_PATH_LEN) error("Tree path is too long! len = %d", (info)->path_len); \
+  (info)->path[(info)->path_len] = (bl); \
+  (info)->path_offsets[(info)->path_len] = (offset); \
+  (info)->path_len ++; \
+} while(0)
+
+#define USE_TRANSPOSITION(s) ((s)->p.trans_table != NULL)
+#define USE_VIRTUAL_LOSS(s) ((s)->params.virtual_loss > 0 && ! (s)->params.life_and_death_mode)
+#define USE_PARKED_SIMS(s) ((s)->params.num_sim_per_thread > 1 && ! (s)->params.use_async && ! (s)->params.life_and_death_mode)
+
 // Some callback functions.
 typedef DefPolicyMove (* func_def_policy)(void *def_policy, void *context, RandFunc rand_func, Board* board, const Region *r, int max_depth, BOOL verbose);
 typedef float (* func_compute_score)(ThreadInfo *info, const Board *board);
@@ -82,6 +162,8 @@ typedef BOOL (* func_expand)(ThreadInfo *info, const Board *board, TreeBlock *b)
 #define SC_TIME_HEURISTIC_STAGE3  10
 #define SC_TIME_HEURISTIC_STAGE4  11
 
+#define PREFETCH_ID(s) ((uint64_t)&(s)->prefetch_id)
+
 typedef struct __TreeHandle {
   TreeParams params;
   ExCallbacks callbacks;
@@ -148,6 +230,11 @@ typedef struct __TreeHandle {
   pthread_t *move_receivers;
   ReceiverParams *move_params;
 
+  // Cache of CNN evaluations keyed by board hash. NULL if disabled.
+  void *eval_cache;
+  // Its address is the block id of speculative requests (see prefetch_children), whose replies only go to eval_cache.
+  char prefetch_id;
+
   // Whether the bot is pondering. (Think when the opponent is thinking)
   BOOL is_pondering;
 
@@ -167,6 +254,9 @@ typedef struct __TreeHandle {
   int move_scores_white[BOUND_COORD];
 } TreeHandle;
 
+// Fill the block with the moves returned from CNN, and open BIT_CNN_RECEIVED.
+void fill_block_with_cnn_move(const TreeHandle *s, TreeBlock *bl, const MMove *mmove, unsigned long *seed);
+
 // Some utilities.
 // ============================== Utility =====================================
 extern inline unsigned int thread_rand(void *context, unsigned int max_value) {
@@ -16,19 +16,16 @@ Coord get_nlibs_of_group(const Board *b, group_t id, int k, Coord *libs) {
   Coord last = M_PASS;
   int lib_count = b->_groups[id].liberties;
   if (lib_count < k) error("The liberty count is %d and cannot get %d liberty points!\n", lib_count, k);
+  // Liberties already collected, as a bitset over coords.
+  uint64_t seen[LIB_WORDS] = { 0 };
   TRAVERSE(b, id, c) {
     FOR4(c, _, cc) {
       if (b->_infos[cc].color == S_EMPTY) {
         last = cc;
         if (libs != NULL) {
-          BOOL dup = FALSE;
-          for (int j = 0; j < count; ++j) {
-            if (libs[j] == cc) {
-              dup = TRUE;
-              break;
-            }
-          }
-          if (!dup) {
+          uint64_t mask = 1ULL << (cc & 63);
+          if (! (seen[cc >> 6] & mask)) {
+            seen[cc >> 6] |= mask;
             libs[count++] = cc;
           }
         } else {
@@ -26,8 +26,14 @@ local pl = require 'pl.import_into'()
 local argcheck = require 'argcheck'
 local tnt = require 'torchnet'
 
+local ffi = require 'ffi'
+
 local fm_go = { }
 
+-- Input buffers for native feature extraction.
+local feature_board = ffi.new("const Board*[1]")
+local feature_player = ffi.new("Stone[1]")
+
 local FMGo, ForwardModel = torch.class('fm_go.FMGo', 'rl.ForwardModel', fm_go)
 
 local function protected_play(b, game)
@@ -50,11 +56,21 @@ function FMGo:get_sa(b, game)
         if rank == nil then rank = '9d' end
     end
     -- require 'fb.debugger'.enter()
-    local feature = goutils.extract_feature(self.b, player, self.opt, rank, game.dataset_info)
+    local feature
     local style = 0
     if self.data_augmentation then
         style = torch.random(0, 7)
-        feature = goutils.rotateTransform(feature, style)
+    end
+    if goutils.is_feature_batch_supported(self.opt, game.dataset_info) then
+        -- Native path, the transform is applied during extraction.
+        feature_board[0] = self.b
+        feature_player[0] = player
+        feature = goutils.extract_feature_batch(feature_board, feature_player, 1, self.opt, { rank }, game.dataset_info, style)[1]
+    else
+        feature = goutils.extract_feature(self.b, player, self.opt, rank, game.dataset_info)
+        if style ~= 0 then
+            feature = goutils.rotateTransform(feature, style)
+        end
     end
 
     -- Check if we see any NaN.
@@ -281,7 +281,7 @@ local features_list = {
     },
 }
 
-function goutils.addGrade(feature, grade)
+function goutils.get_rank_channel(grade)
     local channel
     if grade == nil or grade=='None' or grade=='none' or string.sub(grade,-1,-1)=='k' then
         channel = 1
@@ -301,6 +301,11 @@ function goutils.addGrade(feature, grade)
             channel = 1
         end
     end
+    return channel
+end
+
+function goutils.addGrade(feature, grade)
+    local channel = goutils.get_rank_channel(grade)
     local goban_size = feature:size(2)
     local rank = torch.FloatTensor(9, goban_size, goban_size):zero()
     rank[channel]:fill(1)
@@ -334,6 +339,37 @@ function goutils.extract_feature(b, player, opt, rank, dataset_info)
     end
 end
 
+-- Batched version of extract_feature, computed in C. Only for non-legacy feature types.
+-- bs: a cdata array of board pointers, players: nil or a cdata array of players, n: number of boards.
+-- ranks: nil or a table of n ranks (only used if opt.userank is true).
+-- dataset_info: nil/non-tsumego string (attention on the entire board) or an attention table {x1, y1, x2, y2}.
+-- style: dihedral transform (0-7), same as rotateTransform.
+-- output: optional contiguous FloatTensor which will be resized to n x dim x 19 x 19.
+function goutils.extract_feature_batch(bs, players, n, opt, ranks, dataset_info, style, output)
+    if opt.feature_type == 'extended_with_attention' and opt.attention then
+        dataset_info = opt.attention
+    end
+    assert(goutils.is_feature_batch_supported(opt, dataset_info), "extract_feature_batch: unsupported feature type " .. opt.feature_type)
+    local rank_channels
+    if opt.userank then
+        rank_channels = { }
+        for i = 1, n do
+            rank_channels[i] = goutils.get_rank_channel(ranks and ranks[i])
+        end
+    end
+    local attention = type(dataset_info) == 'table' and dataset_info or nil
+    return board.get_features_batch(bs, players, n, opt.feature_type, rank_channels, attention, style, output)
+end
+
+function goutils.is_feature_batch_supported(opt, dataset_info)
+    if opt.feature_type == 'extended_with_attention' then
+        -- Tsumego attention is computed in Lua.
+        local info = opt.attention or dataset_info
+        return info ~= 'tsumego'
+    end
+    return opt.feature_type == 'complete' or opt.feature_type == 'extended'
+end
+
 function goutils.extract_feature_dim(opt)
     local feature_dim
     if opt.feature_type == "old" then